@@ -14,37 +14,222 @@
 /* 
 *   IH1412116
 *   IMPORTANT: The FPU type (ARM toolsets) should be set to Hard EABI
+*
+*   The runtime scaling is fixed point now (Q12, see Function Group : Fixed point); 
+*   no float math is left, so the FPU type no longer matters.
 */
 
 /* Includes ------------------------------------------------------------------*/
 #include "circle_api.h"
 #include <string.h>
+#ifndef STIM32_HOST
+#include "stm32f4xx.h"
+#else
+#include <stdio.h>
+#include <time.h>
+#endif
 
 /* DEBUG Setting defines -----------------------------------------------------------*/
 //#define DEBUG_NOHW
 
+/* STIM32_HOST is defined by the host (PC) build only; it replaces the
+   hardware timer by a virtual one */
+//#define STIM32_HOST
+
 /* Private defines -----------------------------------------------------------*/
 #define STIM32_VERSION          "150219a"
 
 #define  STIMULATOR_HANDLER_ID  UNUSED5_SCHHDL_ID
-#define  GUIUPDATE_DIVIDER      1       // GUI is called every 100 SysTicks
-#define  STATECHANGE_CNT_LIMIT  10
+#define  GUIUPDATE_DIVIDER      1       // GUI is called every frame (EVENT_FRAME_SYSTICKS)
+#define  EVENT_FRAME_SYSTICKS   100     // readouts and GUI: every 100 SysTicks (30Hz)
+#define  INTRO_SCREEN_MS        2000    // at most; the button skips the rest
 
 #define  FIFO_SIZE              128
 
 #define  VBAT_MV_LOW                    4000
-#define  BATTERY_STATUS_STRING_LENGHT   8
+#define  BATTERY_STATUS_STRING_LENGHT   12      // "Battery LOW"
 #define  SETTINGS_STRING_LENGHT         32
 #define  TOTALTIME_STRING_LENGHT        8
 #define  NETTIME_STRING_LENGHT          8
+#define  PROFILER_STRING_LENGHT         32
 
-#define  BKP_FREQUENCY          BKP_USER1
+/* settings of older versions; migrated once by the settings store, then cleared */
+#define  BKP_FREQUENCY          BKP_USER1       // sequence rate in Hz
 #define  BKP_PULSESEQ           BKP_USER2
 #define  BKP_PULSEPEAKVOLTAGE   BKP_USER3
+#define  BKP_CURRENTTARGET      BKP_USER4       // constant current target (CAE), 0: voltage mode
+
+/* settings store: kept in the backup SRAM, with a copy in the session log flash
+   (see Function Group : Settings store) */
+#define  SETTINGS_VERSION               2       // of Settings_Record_struct; fields are only appended
+#define  SETTINGS_HEADER_SIZE           8       // crc, version, length, sequence
+#define  SETTINGS_SLOT_SIZE             32      // bytes per copy, <= LOG_RECORD_MAX_BODY
+#define  SETTINGS_NB_SLOTS              2       // written alternately; a torn write leaves the other
+#define  SETTINGS_BKPSRAM_ADDRESS       0x40024FC0      // last 64 bytes of the 4K backup SRAM
+#define  SETTINGS_FLASH_DELAY_SECONDS   2       // the flash copy waits for the settings to settle
+#define  SETTINGS_READOUT_MAX           4095    // limits and ADC offset
+#define  SETTINGS_CAE_SCALE_MAX         64
+
+/* contact detection: RUN/IDLE from a sliding window of CAE readouts
+   (see Function Group : Contact detection) */
+#define  CONTACT_WINDOW_MAX             31      // samples; odd, so the median is a sample
+#define  CONTACT_HOLD_MAX               32      // samples
+
+#define  FREQUENCY_MIN_HZ               5
+#define  FREQUENCY_MAX_HZ               50000   // above any sequence; the actual limit is maxFrequency_Hz of the pulse configuration
+#define  FREQUENCY_DEFAULT_HZ           1000
+#define  FREQUENCY_LEGACY_CODE_MAX      3       // BKP_FREQUENCY 1..3 are the 1/2/3 kHz codes of older versions
+#define  FREQUENCY_STRING_LENGHT        10
 
 #define NOMINAL_BATTERY_VOLTAGE_MV     4020
 /* lower voltage limit; under this voltage, the 8V pulse voltage option is disabled */ 
 #define LIMIT_FOR8V_BATTERY_VOLTAGE_MV 3900
+/* ... and enabled again above LIMIT_FOR8V_BATTERY_VOLTAGE_MV + this */
+#define BATTERY_8V_HYSTERESIS_MV       50
+
+#define  BATTERY_FILTER_SHIFT           3       // low-pass of the battery samples, time constant 2^3 s
+#define  BATTERY_FILTER_FRACTION_BITS   8
+
+/* fixed point numbers with 12 fraction bits */
+#define  Q12_SHIFT                      12
+#define  Q12_ONE                        (1<<Q12_SHIFT)
+#define  Q12_RATIO(num, den)            ((((num)<<Q12_SHIFT) + (den)/2) / (den))    // constant fraction, rounded
+
+#define  READOUT_Y_SCALE                Q12_RATIO(15, 100)      // strip chart pixels per CAE unit
+
+#define  CURRENT_KP                     2       // PI gains of the constant current mode:
+#define  CURRENT_KI                     1       // voltage factor (Q12) per CAE unit, per sequence
+#define  CURRENT_MAX_SLEW               64      // voltage factor change per sequence (one wiper code)
+#define  CURRENT_MIN_FACTOR             Q12_RATIO(1, 8)         // 1V of 8V
+
+/* session log: a ring of flash sectors in bank 2, so the programming does not stall the
+   code running from bank 1 (see Function Group : Session log), and below 0x081CE000 where
+   CircleOS keeps its non debuggable code; the application owns them, reserved as LOGFLASH
+   in Circle_App_OP4.ld: keep in line */
+#define  LOG_FLASH_BASE                 0x08180000      // sector 20
+#define  LOG_FLASH_FIRST_SECTOR         20
+#define  LOG_FLASH_NB_SECTORS           2
+#define  LOG_FLASH_SECTOR_SIZE          0x20000         // 128K
+#define  LOG_FLASH_KEY1                 0x45670123
+#define  LOG_FLASH_KEY2                 0xCDEF89AB
+#define  LOG_FLASH_ERRORS               (FLASH_SR_WRPERR | FLASH_SR_PGAERR | FLASH_SR_PGPERR | FLASH_SR_PGSERR)
+#define  LOG_HEADER_SIZE                4       // sector sequence number (u16) and its complement
+#define  LOG_RECORD_HEADER_SIZE         2       // tag, body length
+#define  LOG_RECORD_MAX_BODY            32      // SETTINGS_SLOT_SIZE
+#define  LOG_BUFFER_SIZE                256     // power of 2; records waiting for the flash, ~25s of stimulation
+#define  LOG_ERASED                     0xFF
+
+/* telemetry: every readout, in COBS framed packets with a CRC, sent by DMA on the USART
+   of the CX connector (see Function Group : Telemetry) */
+#define  TELEMETRY_USART                USART1          // CX_USART
+#define  TELEMETRY_DMA                  DMA2_Stream7    // USART1_TX request, channel 4
+#define  TELEMETRY_DMA_FLAGS            (0x3D << 22)    // all HIFCR flags of stream 7
+#define  DMA_CHANNEL_4                  (4 << 25)
+#define  TELEMETRY_BAUD_RATE            921600          // ~3.4 bytes per readout: 3kHz readouts take 1/9 of it
+#define  TELEMETRY_PACKET_TYPE_READOUTS 1
+#define  TELEMETRY_PACKET_TYPE_REPLY    2       // type, sequence, ASCII text of a command reply
+#define  TELEMETRY_HEADER_SIZE          9       // type, sequence, timestamp (4), dropped (2), nbRecords
+#define  TELEMETRY_RECORD_SIZE          3       // SysTicks since the previous record, CAE1 | state | overload
+#define  TELEMETRY_MAX_RECORDS          32
+#define  TELEMETRY_PACKET_SIZE          (TELEMETRY_HEADER_SIZE + TELEMETRY_MAX_RECORDS*TELEMETRY_RECORD_SIZE + 2)  // + CRC
+#define  TELEMETRY_FRAME_SIZE           (TELEMETRY_PACKET_SIZE + 2)    // COBS code byte (packets < 254 bytes), 0 delimiter
+#define  TELEMETRY_TX_BUFFER_SIZE       512     // two of them: one is filled while the DMA sends the other
+
+/* serial commands: text lines on the RX line of the same USART, parsed in its idle line
+   interrupt (see Function Group : Serial commands) */
+#define  COMMAND_DMA                    DMA2_Stream2    // USART1_RX request, channel 4
+#define  COMMAND_USART_IRQn             USART1_IRQn
+#define  COMMAND_USART_IRQ_OFFSET       ((16+USART1_IRQn)*4)   // offset of the vector in the vector table
+#define  COMMAND_DMA_FLAGS              (0x3D << 16)    // all LIFCR flags of stream 2
+#define  COMMAND_RX_BUFFER_SIZE         128     // power of 2; circular, ~31 bytes arrive per SysTick at 921600 baud
+#define  COMMAND_MAX_VALUE              100000  // larger numbers are an error, no overflow
+#define  COMMAND_REPLY_QUEUE_SIZE       4       // power of 2
+#define  COMMAND_REPLY_STRING_LENGHT    32      // "OK F50000 S5 V8 I180"
+
+/* pulse timer: TIM8 (APB2), prescaled to 1 tick per microsecond
+   One timer period per edge: CC1 drives the MAX5439 NSS line (PWM mode 1, NSS rises
+   at the update event = the edge), CC2 triggers the DMA write of the wiper byte to SPI,
+   CC3/CC4 interrupts start/stop the CAE sampling and the update event triggers a DMA burst
+   preloading ARR/CCRx of the following period. */
+#define  PULSE_TIMER                    TIM8
+#define  PULSE_TIMER_CC_IRQn            TIM8_CC_IRQn
+#define  PULSE_TIMER_CC_IRQ_OFFSET      ((16+TIM8_CC_IRQn)*4)  // offset of the vector in the vector table
+#define  PULSE_TIMER_FREQUENCY_HZ       1000000
+#define  PULSE_TIMER_BURST_LENGTH       6       // ARR, RCR, CCR1, CCR2, CCR3, CCR4
+#define  PULSE_TIMER_NEVER              0xFFFF  // compare value beyond any period
+#define  PULSE_TIMER_IDLE_TICKS         100     // period before the first sequence (NSS stays high)
+#define  PULSE_TIMER_MAX_PERIOD_TICKS   0x10000 // ARR is 16 bits
+#define  PULSE_TIMER_MAX_REPETITIONS    256     // RCR is 8 bits
+
+/* The pulse engine drives the MAX5439 itself: the wiper bytes go to WIPER_SPI by DMA and
+   NSS is TIM8_CH1. Both are checked against the CircleOS CX pin map by WIPER_CheckWiring;
+   a board where CX PIN8 is not PC6 must be rewired (PIN8 to PC6), the pulses are not
+   started on it. */
+#define  WIPER_SPI                      SPI2            // SPI of the CX connector (CX_SPI)
+#define  WIPER_NSS_GPIO                 GPIOC           // CX PIN8 must be wired to TIM8_CH1 (PC6)
+#define  WIPER_NSS_PIN                  6
+#define  WIPER_NSS_AF                   3               // AF3 = TIM8
+#define  WIPER_NSS_LEAD_TICKS           4               // NSS goes low this long before the edge, the byte is shifted meanwhile
+#define  WIPER_PRIME_TICKS              (WIPER_NSS_LEAD_TICKS+2)  // from the sequence start to the first edge
+#define  WIPER_MIN_PERIOD_TICKS         (WIPER_NSS_LEAD_TICKS+2)
+#define  CAE_SAMPLE_DELAY_TICKS         1               // CAE sampling starts this long after the positive edge
+
+#define  WIPER_BYTE_DMA                 DMA2_Stream3    // TIM8_CH2 request, channel 7
+#define  WIPER_BYTE_DMA_FLAGS           (0x3D << 22)    // all LIFCR flags of stream 3
+#define  WIPER_BURST_DMA                DMA2_Stream1    // TIM8_UP request, channel 7
+#define  WIPER_BURST_DMA_IRQn           DMA2_Stream1_IRQn
+#define  WIPER_BURST_DMA_IRQ_OFFSET     ((16+DMA2_Stream1_IRQn)*4)
+#define  WIPER_BURST_DMA_FLAGS          (0x3D << 6)     // all LIFCR flags of stream 1
+#define  WIPER_BURST_DMA_TCIF           (0x20 << 6)     // LISR transfer complete of stream 1
+#define  PULSE_SWAP_MIN_TICKS           30              // wait in which the DMA streams are pointed at a new configuration
+#define  DMA_CHANNEL_7                  (7 << 25)
+#define  DMA_CHANNEL_0                  (0 << 25)
+
+/* CAE acquisition: ADC1 (CX_ADC1) converts continuously into CaeWindow.samples
+   during the positive phase; the samples are decimated to one CAE per sequence, at most one per SysTick */
+#define  CAE_ADC                        ADC1
+#define  CAE_ADC_SAMPLE_TIME            4               // SMPR code 4: 84 cycles
+#define  CAE_ADC_DMA                    DMA2_Stream0    // ADC1 request, channel 0
+#define  CAE_ADC_DMA_FLAGS              (0x3D << 0)     // all LIFCR flags of stream 0
+#define  CAE_MAX_SAMPLES                64
+#define  CAE_AD_VALUE_MAX               4095
+#define  HOST_CAE_SAMPLE_PERIOD_TICKS   5               // host build: one conversion each 5 us
+
+/* readout queue from STIMULATOR_Handler to Application_Handler (single producer, single consumer) */
+#define  READOUT_QUEUE_SIZE             256             // power of 2; 3kHz readouts for ~85ms
+#define  READOUT_BATCH_SIZE             32
+
+#ifdef STIM32_HOST
+#define  MEMORY_BARRIER()               __sync_synchronize()
+#else
+#define  MEMORY_BARRIER()               __DMB()
+#endif
+
+#define  PROFILER_HISTOGRAM_BUCKETS     12      // <1us, <2us, <4us ... <1024us, longer
+#define  PROFILER_SYSTICK_BUDGET_US     333     // one SysTick at 3kHz
+#define  PROFILER_DISPLAY_DIVIDER       10      // diagnostics screen redrawn every 10th call
+
+#define  TIMERCAL_FIRST_PERIOD_SECONDS  1       // first measurement, during the intro screen
+#define  TIMERCAL_PERIOD_SECONDS        10      // RTC seconds per measurement afterwards
+#define  TIMERCAL_MAX_PPM               20000   // larger deviations are rejected (2%)
+#define  TIMERCAL_APPLY_PPM             200     // edge tables are recompiled beyond this change
+
+#define  GOVERNOR_FULL_SPEED            SPEED_VERY_HIGH
+#define  GOVERNOR_LOW_SPEED             SPEED_MEDIUM
+#define  GOVERNOR_IDLE_SECONDS          5       // without contact this long, the clock is lowered
+#define  GOVERNOR_LOW_SPEED_MAX_HZ      1000    // faster sequence rates keep the full speed (interrupt load)
+#define  GOVERNOR_UA_PER_MHZ            500     // estimated supply current of the MCU, 0.5mA/MHz (F429 datasheet, typ.)
+
+#define  PULSE_MAX_PHASES               5       // max. number of phases of one sequence description
+#define  PULSE_EDGE_TABLE_SIZE          (PULSE_MAX_PHASES+1)        // max. number of edges of one sequence
+
+#define  GUI_TEXT_FIELD_LENGHT          24
+#define  GUI_STRIPCHART_COLUMN_WIDTH    8       // pixels, one column per readout shown
+#define  GUI_STRIPCHART_NB_COLUMNS      (SCREEN_WIDTH/GUI_STRIPCHART_COLUMN_WIDTH)
+#define  GUI_STRIPCHART_CLEAN           0xFF    // column height: nothing drawn since the panel was cleared
+
+/* MAX5439 wiper code for 0V output (the middle of the 128 taps) */
+#define  MAX5439_ZERO_VOLTAGE_CODE      63
 
 
 /* Typedefs ------------------------------------------------------------------*/
@@ -53,6 +238,8 @@ typedef enum {
     GUI_NORMAL_UPDATE,    
     GUI_CLEAR,
     GUI_INTRO_SCREEN,
+    GUI_DIAGNOSTICS_INITIALIZE,
+    GUI_DIAGNOSTICS_SCREEN,
     } GUIaction_code;
 
 typedef enum {
@@ -60,6 +247,7 @@ typedef enum {
 
     PENDING_REQUEST_REDRAW,    
     PENDING_REQUEST_SHOWING_INTRO_SCREEN,
+    PENDING_REQUEST_SHOWING_DIAGNOSTICS,
     } PendingRequest_code;
 
 typedef enum {
@@ -76,8 +264,41 @@ typedef enum {
     UPPERPANELSTATE_OVERLOAD,
     UPPERPANELSTATE_WAITING,
     UPPERPANELSTATE_DISPLAY_READOUT,
+    UPPERPANELSTATE_REWIRE,             // WIPER_CheckWiring failed, no pulses
     } UpperPanelState_code;
 
+typedef enum {
+    GUI_FIELD_READOUT,                  // readout figure or message, upper panel
+    GUI_FIELD_NETTIME,
+    GUI_FIELD_TOTALTIME,
+    GUI_FIELD_SETTINGS,
+    GUI_NB_TEXT_FIELDS,
+    } GUITextField_code;
+
+typedef struct
+    {
+        coord_t         x;                  // as for DRAW_DisplayStringWithMode (RIGHT: from the right edge)
+        coord_t         y;
+        enum ALIGNMENT  align;
+        u16             textColor;
+        u16             bgndColor;
+        
+        // what is on the screen
+        bool            isValid;            // FALSE: never drawn, the whole text is drawn
+        coord_t         drawnX;             // left edge
+        u8              drawnLength;        // 0: nothing on the screen, the layers below show
+        u8              drawnMagnification;
+        char            text[GUI_TEXT_FIELD_LENGHT];
+    }
+    GUI_Text_Field_struct;
+
+typedef struct
+    {
+        u8              nextColumn;         // the oldest column, overwritten by the next readout
+        u8              height[GUI_STRIPCHART_NB_COLUMNS];     // bar heights on the screen, <= STIM_MIDDLEPANEL_HEIGHT
+    }
+    GUI_Strip_Chart_struct;
+
 typedef enum {
     POSITIVE_VOLTAGE_MAX,
     POSITIVE_VOLTAGE_HALF,
@@ -93,65 +314,113 @@ typedef enum {
     } PulsePeakVoltage_code;
 
 typedef enum {
-    FREQUENCY_1KHZ=1,
-    FREQUENCY_2KHZ=2,
-    FREQUENCY_3KHZ=3,
-    } Frequency_code;
+    PROFILER_PHASE_SYSTICK_HANDLER,     // STIMULATOR_Handler, entry to exit
+    PROFILER_PHASE_SYSTICK_PERIOD,      // STIMULATOR_Handler, entry to entry (jitter)
+    PROFILER_PHASE_DECIMATION,
+    PROFILER_PHASE_SEQUENCE_START,
+    PROFILER_PHASE_PULSE_IRQ,           // CAE sampling start/stop, wiper DMA end
+    PROFILER_PHASE_READOUTS,            // ProcessReadouts
+    PROFILER_PHASE_GUI,                 // GUI normal update
+    PROFILER_NB_PHASES,
+    } ProfilerPhase_code;
 
-typedef enum {
-    PULSESEQUENCE_1=1,
-    PULSESEQUENCE_2=2,
-    PULSESEQUENCE_3=3,
-    PULSESEQUENCE_4=4,
-    } PulseSequence_code;
+typedef struct 
+    {
+        u16     duration_ticks;     // time to the next edge (pulse timer ticks)
+        u8      wiperCode;          // MAX5439 control byte set at this edge
+        u8      readCAE;            // read the CAE right after this edge
+        u8      level;              // OutputVoltage_code, for BATTERY_RefreshWiperCodes
+    }
+    Pulse_Edge_struct;
 
-typedef enum {
-    SEQUENCEMULTIPLICITY_SINGLE,
-    SEQUENCEMULTIPLICITY_DOUBLE,
-    } SequenceMultiplicity_code;
+typedef struct
+    {
+        OutputVoltage_code  level;
+        u16                 duration_microseconds;  // 0: the phase is omitted
+        u8                  readCAE;                // read the CAE during this phase
+    }
+    Pulse_Phase_struct;
 
-typedef struct 
+typedef struct
     {
-        Frequency_code frequency;
-        PulseSequence_code pulseSeq;
-        PulsePeakVoltage_code peakVoltage;
-        u16 frequency_divider;
-        SequenceMultiplicity_code sequence_multiplicity;
-        float voltage_multiplication_factor;
-    
-        u16 delay_between_sequences_microseconds;
-        u16 delay_between_sequences_loop_counts;
-    
-        u16 delay0_microseconds;     
-        u16 delay0_loop_counts;     
-        s16 edge1;
-    
-        u16 delay1_microseconds;     
-        u16 delay1_loop_counts;             
-        s16 edge2;
-        
-        u16 delay2_microseconds;     
-        u16 delay2_loop_counts;         
-        s16 edge3;
-            
-        u16 delay3_microseconds;     
-        u16 delay3_loop_counts;         
-        s16 edge4;
+        const char*         name;                   // settings string (4 characters)
+        const char*         menuText;
+        u8                  nbPhases;
+        Pulse_Phase_struct  phase[PULSE_MAX_PHASES];
+    }
+    Pulse_Sequence_Description_struct;
 
-/*
-                  d3
-        d1     --------   
-      ------   |      |
-      |    |   |      |
-d0    |    | d2|      |
-------|    -----      ------
-     e1   e2   e3     e4
+typedef struct
+    {
+        u32                 frequency_Hz;
+        const char*         menuText;
+    }
+    Frequency_Preset_struct;
 
-*/
-    
+/* a compiled pulse configuration, published as a whole by STIMULATOR_Handler and not
+   written afterwards, but for the wait (PULSESCHEDULER_NextSequence) and the wiper
+   codes refreshed by the pulse engine between two sequences */
+typedef struct
+    {
+        // the settings it was compiled from
+        u32 frequency_Hz;
+        u8  pulseSeq;
+        u16 voltageFactor;
+        s32 appliedPpm;                 // timer calibration
+        
+        // edge table compiled from the sequence description by CompilePulseEdgeTable()
+        Pulse_Edge_struct edgeTable[PULSE_EDGE_TABLE_SIZE];
+        u8 nbEdges;
+        
+        // DMA sources played back by the pulse timer (see CompileWiperBurst)
+        u8  wiperBytes[PULSE_EDGE_TABLE_SIZE];
+        u32 timerBurst[PULSE_EDGE_TABLE_SIZE+1][PULSE_TIMER_BURST_LENGTH];
+        
+        // sequence rate (see PULSESCHEDULER_NextSequence)
+        u32 periodTicks;                // pulse timer ticks per sequence, integer part
+        u32 phaseIncrement;             // fraction of a tick per sequence, in 1/phaseModulus
+        u32 phaseModulus;               // the sequence rate
+        u32 sequenceTicks;              // first edge to the wait period, plus the prime period
+        u32 maxFrequency_Hz;            // limit for the sequence
+    }
+    Pulse_Config_struct;
+
+typedef struct
+    {
+        u32 frequency_Hz;               // sequence rate
+        u8 pulseSeq;                    // 1..NB_PULSE_SEQUENCES, entry of PulseSequenceTable
+        PulsePeakVoltage_code peakVoltage;
+        u16 voltageFactor;              // peak voltage and battery compensation, Q12
+        volatile bool isCompilePending; // the settings above are compiled into a new configuration
+        volatile bool isPublishing;     // STIMULATOR_Handler is in PULSEENGINE_Publish: not the RX interrupt
+        volatile bool isWiperRefreshPending;    // refreshedWiperBytes replace the wiperBytes of refreshConfig after the running sequence
+        bool isWiringWrong;             // CX PIN8 or CX_SPI not where the pulse engine drives them: no pulses
+        u8  refreshedWiperBytes[PULSE_EDGE_TABLE_SIZE];
+        u16 refreshedVoltageFactor;
+        Pulse_Config_struct *refreshConfig;
+        
+        // double buffer: the configuration played by the pulse engine and the one compiled next
+        Pulse_Config_struct configs[2];
+        Pulse_Config_struct * volatile config;      // swapped by the pulse engine only; 0 before the first one
+        Pulse_Config_struct * volatile nextConfig;  // published by STIMULATOR_Handler or the RX interrupt, 0 once taken
     } 
     Pulse_Sequence_struct;
 
+typedef struct
+    {
+        u32             phase;              // phase accumulator (fraction of a tick carried over)
+        s32             carryTicks;         // whole ticks carried over (wait shortened by RCR)
+        u32             waitTicks;          // of the sequence after the running one
+        u32             runningWaitTicks;   // the wait started at waitStart, 0 before the first one
+        u32             waitStart;          // TIMERCAL_ClockNow at the last PULSEENGINE_SequenceDone
+        u32             lastPhase;          // phase and carryTicks before the last PULSESCHEDULER_NextSequence,
+        s32             lastCarryTicks;     // for a configuration taken in the wait (PULSEENGINE_TakeInWait)
+        volatile bool   isStopRequested;
+        u32             nbSwaps;            // configurations taken while running
+        u32             nbDelayedSwaps;     // ... after a wait lengthened to PULSE_SWAP_MIN_TICKS
+    }
+    Pulse_Scheduler_struct;
+
 typedef struct 
     {
         u32     CAE1;           // current after edge1
@@ -159,6 +428,384 @@ typedef struct
     }
     Readout_struct;
 
+typedef struct 
+    {
+        u16     ad_value_offset;            // ADC values under this are presented as 0
+        u16     ad_value_reciproq_scale;    // values are DIVIDED by this factor
+    }
+    CAE_Calibration_struct;
+
+typedef struct 
+    {
+        u32     timestamp;      // SysTick count
+        u16     CAE1;
+        u8      isOverloaded;
+        u8      stimState;
+    }
+    Readout_Record_struct;
+
+typedef struct 
+    {
+        Readout_Record_struct   record[READOUT_QUEUE_SIZE];
+        volatile u32            head;           // written by the producer only
+        volatile u32            tail;           // written by the consumer only
+        volatile u32            nbDropped;      // records lost because the queue was full
+    }
+    Readout_Queue_struct;
+
+typedef enum {
+    EVENT_FRAME,                        // STIMULATOR_Handler, every EVENT_FRAME_SYSTICKS: readouts, GUI
+    EVENT_SECOND,                       // TIMERCAL_Poll, at each RTC second: battery
+    EVENT_CALIBRATION,                  // TIMERCAL_Poll, new pulse timer measurement
+    EVENT_INTRO_DONE,                   // TimerHandler1, the intro screen time is over
+    EVENT_COMMAND,                      // STIMULATOR_Handler, a command line was parsed: reply
+    EVENT_NB,
+    } Event_code;
+
+typedef struct
+    {
+        volatile u32    nbPosted[EVENT_NB];     // each written by the one producer of the event
+        u32             nbTaken[EVENT_NB];      // main context
+        
+        // idle time
+        u32             nbCalls;                // Application_Handler calls
+        u32             nbIdleCalls;            // ... without any event posted
+        u32             idleTicks;              // profiler clock ticks in WFI (target)
+    }
+    Event_Queue_struct;
+
+typedef struct 
+    {
+        u32     nbReadouts;
+        u32     nbOverloads;
+        u16     minCAE1;
+        u16     maxCAE1;
+    }
+    Readout_Statistics_struct;
+
+typedef struct 
+    {
+        u16             samples[CAE_MAX_SAMPLES];
+        volatile u8     nbSamples;
+        volatile bool   isComplete;         // set at the end of the sampling window, cleared once decimated
+        volatile bool   isSampling;
+    }
+    CAE_Window_struct;
+
+typedef struct 
+    {
+        u32     count;
+        u32     min;                // profiler ticks
+        u32     max;
+        u32     histogram[PROFILER_HISTOGRAM_BUCKETS];
+    }
+    Profiler_Phase_struct;
+
+typedef struct 
+    {
+        Profiler_Phase_struct   phase[PROFILER_NB_PHASES];
+        u32                     ticksPerMicrosecond;
+        u32                     budgetTicks;        // SysTick period
+        u32                     lastSysTickTime;
+        volatile u32            nbOverruns;         // STIMULATOR_Handler took longer than the SysTick period
+        volatile u32            nbLateSequences;    // sequence started late, the rate is above the limit
+    }
+    Profiler_struct;
+
+typedef struct 
+    {
+        u32             nominalHz;          // rate of the measured clock as configured
+        u32             startTime;
+        u8              lastSecond;
+        u8              nbSeconds;          // RTC seconds since startTime
+        u8              periodSeconds;
+        s32             measuredPpm;        // pulse timer rate error against the RTC (LSE)
+        s32             driftPpm;           // change since the previous measurement
+        s32             appliedPpm;         // compiled into the pulse configurations
+        u32             nbMeasurements;
+        u32             nbRejected;
+    }
+    Timer_Calibration_struct;
+
+typedef struct 
+    {
+        enum eSpeed     speed;
+        volatile bool   isSwitchPending;    // the pulse engine is not restarted until the clock is switched
+        bool            isLowSpeedRejected; // the pulse timing cannot be kept at GOVERNOR_LOW_SPEED
+        u8              idleSeconds;
+        u32             nbCommandLines;     // Command.nbLines at the last update: a new line is not idle
+        u32             fullSpeedHz;        // HCLK at GOVERNOR_FULL_SPEED
+        u32             hclkHz;
+        u32             nbSwitches;
+        u32             nbSeconds;
+        u32             nbSecondsLow;
+        u32             savedEnergy_mJ;     // estimate, see GOVERNOR_UA_PER_MHZ
+    }
+    Governor_struct;
+
+typedef struct 
+    {
+        u32             filtered_mV;        // low-pass state, BATTERY_FILTER_FRACTION_BITS below the mV
+        u16             mV;                 // model voltage
+        bool            is8VAvailable;      // LIMIT_FOR8V_BATTERY_VOLTAGE_MV with hysteresis
+        u32             nbRefreshes;        // voltage factor changes applied while running
+        u32             nb8VChanges;
+    }
+    Battery_Model_struct;
+
+typedef struct 
+    {
+        u16             target;             // CAE; 0: voltage mode (open loop)
+        s32             integrator;         // voltage factor, Q12
+        u32             nbUpdates;
+        u32             nbLimited;          // outputs limited by the amplitude or the slew rate
+        u32             sumAbsError;        // CAE
+    }
+    Current_Control_struct;
+
+typedef enum {
+    LOG_RECORD_SESSION = 1,             // RTC time of day, battery, settings, boot time
+    LOG_RECORD_SETTINGS,                // settings changed
+    LOG_RECORD_SECOND,                  // one second with contact or a state transition
+    LOG_RECORD_IDLE,                    // a run of seconds in STIMSTATE_IDLE
+    LOG_RECORD_BASE,                    // delta bases, starts each sector but the first
+    LOG_RECORD_STORE,                   // flash copy of the settings record (Settings store)
+    } LogRecord_code;
+
+typedef enum {
+    LOG_FLASH_READY,
+    LOG_FLASH_ERASING,                  // the next sector of the ring
+    LOG_FLASH_HEADER,                   // its header is programmed byte by byte
+    LOG_FLASH_FAILED,                   // programming error, the log is stopped
+    } LogFlash_code;
+
+typedef struct 
+    {
+        // aggregate of the current second, ProcessReadouts()
+        u32             sumCAE1;
+        u32             nbReadouts;
+        u16             minCAE1;
+        u16             maxCAE1;
+        u16             nbOverloads;
+        u8              nbTransitions;
+        u8              stimState;          // of the last readout
+        u32             nbIdleSeconds;      // run not yet written
+        
+        // delta bases, set by the session record
+        u16             lastCAE1;           // mean of the last second record
+        u16             lastBatterymV;
+        u32             frequency_Hz;       // settings of the last session or settings record
+        u8              pulseSeq;
+        u8              peakVoltage;
+        u16             currentTarget;
+        
+        // records waiting for the flash
+        u8              buffer[LOG_BUFFER_SIZE];
+        u32             head;
+        u32             tail;
+        u32             recordLeft;         // bytes of the record being programmed
+        u32             putOffset;          // where the next record will be in the flash
+        
+        // flash ring
+        LogFlash_code   flashState;
+        u8              sector;             // active sector, 0..LOG_FLASH_NB_SECTORS-1
+        u16             sequence;           // its header
+        u32             offset;             // next free byte in it
+        
+        u32             nbRecords;
+        u32             nbDropped;          // buffer full
+        u32             nbErases;
+    }
+    Log_struct;
+
+/* the backup SRAM and the flash hold it as raw bytes (little endian); a record is
+   valid if its CRC over the bytes after it, up to length, matches */
+typedef struct
+    {
+        u16             crc;
+        u8              version;            // SETTINGS_VERSION of the firmware that wrote it
+        u8              length;             // bytes of the record; missing fields take their defaults
+        u32             sequence;           // write count, the newest valid copy is restored
+        
+        // version 1
+        u32             frequency_Hz;
+        u8              pulseSeq;
+        u8              peakVoltage;
+        u16             currentTarget;
+        u16             readoutLimitRun;    // CAE thresholds of the state machine
+        u16             readoutLimitIdle;
+        u16             caeOffset;          // CAE calibration
+        u16             caeScale;
+        s32             timerPpm;           // pulse timer calibration in use
+
+        // version 2: the readout limits are a hysteresis band, Idle < Run
+        u8              contactStatistic;   // ContactStatistic_code
+        u8              contactWindow;
+        u8              contactHold;
+        u8              reserved;           // 0
+    }
+    Settings_Record_struct;
+
+typedef enum {
+    SETTINGS_SOURCE_DEFAULTS,
+    SETTINGS_SOURCE_BACKUP_SRAM,
+    SETTINGS_SOURCE_FLASH,              // the backup domain was lost
+    SETTINGS_SOURCE_LEGACY,             // BKP_USER registers of older versions
+    } SettingsSource_code;
+
+typedef struct
+    {
+        Settings_Record_struct  record;     // as last written
+        u8              slot;               // of the backup SRAM holding it
+        SettingsSource_code source;         // restored from
+        u8              nbRejectedFields;   // out of range at the restore, set to their defaults
+        volatile bool   isChangePending;    // set by UpdatePulseSequence, also in the SysTick
+        u8              flashDelay;         // seconds until the flash copy, 0: none pending
+        u32             nbWrites;
+        u32             nbFlashCopies;
+    }
+    Settings_struct;
+
+typedef struct 
+    {
+        u8              packet[TELEMETRY_PACKET_SIZE];      // being filled, main context
+        u32             length;
+        u8              nbPacketRecords;
+        u8              sequence;           // of the packets sent
+        u32             lastTimestamp;
+        
+        u8              txBuffer[2][TELEMETRY_TX_BUFFER_SIZE];     // COBS frames
+        u32             txLength[2];
+        u8              fill;               // buffer filled; the other one is sent
+        bool            isClockChanged;     // the baud rate is set again when the USART is idle
+        
+        u32             nbPackets;
+        u32             nbRecords;
+        u32             nbBytes;
+        u32             nbDropped;          // records lost because the TX buffer was full
+    }
+    Telemetry_struct;
+
+typedef enum {
+    COMMAND_SET_FREQUENCY   = 0x01,
+    COMMAND_SET_PULSESEQ    = 0x02,
+    COMMAND_SET_PEAKVOLTAGE = 0x04,
+    COMMAND_SET_CURRENT     = 0x08,
+    } CommandSet_code;
+
+typedef struct 
+    {
+        u8              column;             // of the error; 0: OK, the settings follow
+    }
+    Command_Reply_struct;
+
+typedef struct 
+    {
+        u8              rxBuffer[COMMAND_RX_BUFFER_SIZE];       // circular, written by the DMA
+        u32             rxTail;             // next byte to parse
+        
+        // the line being parsed: one command letter and its number at a time
+        u8              column;
+        u8              letter;             // 0: between the commands
+        u8              letterColumn;
+        u32             value;
+        bool            hasValue;
+        u8              errorColumn;        // first error of the line; the line is not applied
+        
+        // ... its settings, applied together at the end of the line
+        u8              setMask;            // CommandSet_code
+        u32             frequency_Hz;
+        u8              pulseSeq;
+        u8              peakVoltage;
+        u16             currentTarget;
+        
+        // replies, to the main context
+        Command_Reply_struct reply[COMMAND_REPLY_QUEUE_SIZE];
+        volatile u32    replyHead;          // RX interrupt
+        volatile u32    replyTail;          // main context
+        
+        // latency from the end of the line to the first edge with its settings
+        bool            isStartPending;     // until its configuration is published
+        const Pulse_Config_struct * volatile config;    // ... then until the pulse engine takes it
+        u32             lineTime;           // TIMERCAL_ClockNow
+        u32             nbLatencies;
+        u32             minLatency_us;
+        u32             maxLatency_us;
+        u32             sumLatency_us;
+        
+        u32             nbLines;
+        u32             nbErrors;
+        u32             nbRepliesLost;
+        u32             nbOverruns;         // bytes overwritten before they were parsed
+    }
+    Command_struct;
+
+/* staged boot: Application_Ini does only what the first pulse needs, the stages are
+   done by Application_Handler while the intro screen is shown, one per call */
+typedef enum {
+    BOOT_STAGE_INTRO,                   // the intro screen is drawn, its timer started
+    BOOT_STAGE_LOG,                     // session log, then the RTC and the timer calibration
+    BOOT_STAGE_MENUS,                   // frequency and pulse sequence menus
+    BOOT_STAGE_DONE,                    // the main screen follows when the intro is over or skipped
+    } BootStage_code;
+
+typedef struct
+    {
+        BootStage_code  stage;
+        bool            isIntroOver;        // EVENT_INTRO_DONE taken
+        bool            isIntroSkipped;     // button pushed while the intro screen is shown
+        u32             startClock;         // TIMERCAL_ClockNow at Application_Ini
+        u32             startTime;          // PROFILER_Now at Application_Ini
+        u32             iniTime;            // profiler ticks of Application_Ini
+        volatile u32    firstPulse_us;      // from Application_Ini to the first edge, 0 until then
+        u32             readySysTicks;      // SysTicks from Application_Ini to the last stage done
+        u32             mainScreenSysTicks; // ... to the main screen
+#ifdef STIM32_HOST
+        u32             lcdPixels;          // at Application_Ini, then written to the LCD before the first pulse
+#endif
+    }
+    Boot_struct;
+
+typedef enum {
+    CONTACT_STATISTIC_LAST,             // the newest sample alone
+    CONTACT_STATISTIC_MEAN,
+    CONTACT_STATISTIC_MEDIAN,
+    NB_CONTACT_STATISTICS,
+    } ContactStatistic_code;
+
+typedef struct
+    {
+        // configuration, CONTACT_Init
+        ContactStatistic_code statistic;
+        u8              window;             // samples, odd
+        u8              hold;               // consecutive samples beyond a limit for a transition
+        u16             runLimit;           // RUN is entered at a statistic >= runLimit ...
+        u16             idleLimit;          // ... and left at <= idleLimit, below it: the hysteresis
+
+        // sliding window
+        u16             samples[CONTACT_WINDOW_MAX];
+        u8              head;               // the next sample replaces this one
+        u8              nbSamples;          // up to window
+        u16             last;
+        u32             sum;
+        u8              nbAtRun;            // samples >= runLimit
+        u8              nbAtIdle;           // samples <= idleLimit
+
+        StimState_code  state;
+        u8              holdCnt;
+    }
+    Contact_Detector_struct;
+
+/* a statistic of the window, compared with the limits in O(1) */
+typedef struct
+    {
+        const char*     name;
+        bool            (*isAtRun)(const Contact_Detector_struct *contact);
+        bool            (*isAtIdle)(const Contact_Detector_struct *contact);
+        u8              (*settleSamples)(u8 window);    // after a step, until the statistic is beyond the limit
+    }
+    Contact_Statistic_struct;
+
 /* Forward declarations ------------------------------------------------------*/
 enum MENU_code Application_Handler(void);
 
@@ -170,85 +817,248 @@ enum MENU_code  RestoreApp( void );
 enum MENU_code  MenuSetup_Freq();
 enum MENU_code  MenuSetup_PSeq();
 enum MENU_code  MenuSetup_PVolt();
+enum MENU_code  MenuSetup_OMode(void);
+enum MENU_code  ShowDiagnostics(void);
 
-enum MENU_code  SetFrequency_1();
-enum MENU_code  SetFrequency_2();
-enum MENU_code  SetFrequency_3();
+enum MENU_code  SetFrequency(void);
 
-enum MENU_code  SetPulseSequence_1();
-enum MENU_code  SetPulseSequence_2();
-enum MENU_code  SetPulseSequence_3();
-enum MENU_code  SetPulseSequence_4();
+enum MENU_code  SetPulseSequence(void);
 
 enum MENU_code  SetPulsePeakVoltage_1(void);
 enum MENU_code  SetPulsePeakVoltage_2(void);
 enum MENU_code  SetPulsePeakVoltage_3(void);
 
+enum MENU_code  SetOutputMode(void);
+
 void TimerHandler1(void);
 
+static void BOOT_NextStage(void);
+static void BOOT_FirstPulse(u32 firstEdgeTicks);
+
 static void GUI(GUIaction_code, u16 );
+static void GUI_InitTextField(GUITextField_code id, coord_t x, coord_t y, enum ALIGNMENT align, u16 textColor, u16 bgndColor);
+static void GUI_DrawTextField(GUITextField_code id, const char *text, u8 magnification);
+static void GUI_HideTextField(GUITextField_code id);
+static void GUI_ClearStripChart(void);
+static void GUI_AddStripChartColumn(u16 barHeight);
+static void GUI_ComposeFill(coord_t x, coord_t y, coord_t width, coord_t height, u16 color);
+static void GUI_RestoreLayers(coord_t x, coord_t y, coord_t width, coord_t height);
 static void LongDelay(u8 delayInSeconds);
 static enum MENU_code MsgVersion(void);
 static void UpdatePulseSequence(void);
+static void BuildPulseSequenceMenu(void);
+static void BuildFrequencyMenu(void);
 static void SetAutorun(void);
-static void BackUpParameters(void);
-static void RestoreParameters(void);
 static char* GetBatteryStatusString(void);
 static char* GetSettingsString(void);
+static char* GetFrequencyString(void);
 static char* GetTotalTimeString(void);
 static char* GetNetTimeString(void);
 static void StartNetTimeTimer(void);
 
-static void SetOutputVoltage(OutputVoltage_code, float multiplication_factor);
-static void GeneratePulseSequenceAndReadCAE(void);        
+static u8   GetWiperCode(OutputVoltage_code, u16 voltageFactor);
+static void SetWiper(u8 wiperCode);
+static bool WIPER_CheckWiring(void);
+static void CAE_Init(void);
+static void CAE_StartSampling(void);
+static void CAE_StopSampling(void);
+static void CAE_Decimate(void);
+
+static bool READOUTQUEUE_Push(const Readout_Record_struct *record);
+static u32  READOUTQUEUE_Pop(Readout_Record_struct *records, u32 maxNbRecords);
+static void ProcessReadouts(void);
+static void EVENT_Post(Event_code event);
+static bool EVENT_Take(Event_code event);
+static bool EVENT_IsPending(void);
+static void EVENT_Sleep(void);
+static void CompilePulseEdgeTable(Pulse_Config_struct *config);
+static void PULSEENGINE_Publish(void);
+static void PULSEENGINE_TakeWiperRefresh(void);
+static bool PULSEENGINE_RefreshWiperCodes(u16 voltageFactor);
+static void CompileWiperBurst(Pulse_Config_struct *config);
+
+static void PULSEENGINE_Init(void);
+static bool PULSEENGINE_SetClock(void);
+static void PULSEENGINE_Start(void);
+static void PULSEENGINE_Stop(void);
+static bool PULSEENGINE_IsBusy(void);
+static void PULSEENGINE_SetSource(const Pulse_Config_struct *config);
+static void PULSEENGINE_TakeConfig(Pulse_Config_struct *config, u32 firstEdgeTicks);
+static void PULSEENGINE_SequenceDone(void);
+static void PULSEENGINE_TakeInWait(void);
+static void PULSEENGINE_RequestTake(void);
+static void PULSEENGINE_StopAtUpdate(void);
+static void PULSEENGINE_EndWaitIn(u32 ticks);
+static void PULSESCHEDULER_NextSequence(void);
+static u32  PULSESCHEDULER_WaitLeft(const Pulse_Config_struct *config, u32 elapsedTicks);
+
+static void PROFILER_Init(void);
+static void PROFILER_SetClock(void);
+static u32  PROFILER_Now(void);
+static void PROFILER_Record(ProfilerPhase_code phase, u32 startTime);
+static char* GetProfilerPhaseString(ProfilerPhase_code phase);
+
+static void TIMERCAL_Init(void);
+static void TIMERCAL_Restart(void);
+static u32  TIMERCAL_ClockNow(void);
+static u32  TIMERCAL_GetNominalHz(void);
+static void TIMERCAL_Poll(void);
+static void TIMERCAL_Apply(void);
+static char* GetTimerCalibrationString(void);
+
+static u32  Q12_Mul(u32 a, u32 b);
+static s32  Q12_Scale(s32 x, u32 factor);
+static u32  Q12_Div(u32 num, u32 den);
+static u32  Q12_Limit(u32 x, u32 max);
+
+static void BATTERY_Init(u16 sample_mV);
+static void BATTERY_Update(u16 sample_mV);
+static u16  BATTERY_GetVoltageFactor(void);
+static void BATTERY_RefreshWiperCodes(void);
+
+static void CURRENT_Control(void);
+
+static void CONTACT_Init(Contact_Detector_struct *contact, u8 statistic, u8 window, u8 hold, u16 runLimit, u16 idleLimit);
+static StimState_code CONTACT_Update(Contact_Detector_struct *contact, u16 sample);
+static u8   CONTACT_GetLatencyBound(const Contact_Detector_struct *contact);
+static bool CONTACT_LastAtRun(const Contact_Detector_struct *contact);
+static bool CONTACT_LastAtIdle(const Contact_Detector_struct *contact);
+static bool CONTACT_MeanAtRun(const Contact_Detector_struct *contact);
+static bool CONTACT_MeanAtIdle(const Contact_Detector_struct *contact);
+static bool CONTACT_MedianAtRun(const Contact_Detector_struct *contact);
+static bool CONTACT_MedianAtIdle(const Contact_Detector_struct *contact);
+static u8   CONTACT_SettleOne(u8 window);
+static u8   CONTACT_SettleWindow(u8 window);
+static u8   CONTACT_SettleHalf(u8 window);
+
+static void LOG_Init(void);
+static void LOG_AddReadout(const Readout_Record_struct *record);
+static void LOG_Second(void);
+static void LOG_Service(void);
+static void LOG_Flush(void);
+
+static void SETTINGS_Restore(void);
+static void SETTINGS_Service(bool isNewSecond);
+static void SETTINGS_Flush(void);
+static void SETTINGS_PutFlashCopy(void);
+static bool SETTINGS_Decode(const u8 *data, u32 size, Settings_Record_struct *record);
+
+static u16  CRC16_Compute(const u8 *data, u32 length, u16 crc);
+static void TELEMETRY_Init(void);
+static void TELEMETRY_SetClock(void);
+static void TELEMETRY_AddReadout(const Readout_Record_struct *record);
+static void TELEMETRY_Flush(void);
+static void TELEMETRY_Service(void);
+static bool TELEMETRY_SendReply(const char *text);
+
+static void COMMAND_Init(void);
+static void COMMAND_Poll(void);
+static void COMMAND_Parse(void);
+static void COMMAND_IRQHandler(void);
+static void COMMAND_Published(const Pulse_Config_struct *config);
+static void COMMAND_Started(const Pulse_Config_struct *config, u32 firstEdgeTicks);
+static void COMMAND_Reply(void);
+
+static void GOVERNOR_Init(void);
+static void GOVERNOR_Update(bool isNewSecond);
+static u32  GOVERNOR_GetHclkHz(void);
+static char* GetGovernorString(void);
+#ifdef STIM32_HOST
+static u32  HOST_PulseTimerNow(void);
+static void HOST_CheckPulseConfig(const Pulse_Config_struct *config);
+static void HOST_RefusePublish(void);
+static void HOST_PreemptPublish(void);
+u32         HOST_GetHclkHz(void);                   // circle_host.c
+u32         HOST_GetLcdPixelsWritten(void);         // circle_host.c
+#else
+static u32  RCC_GetHclkHz(void);
+#endif
     
 
 /* Constants -----------------------------------------------------------------*/
 const char Application_Name[8+1] = {"STiM32"};      // Max 8 characters
 
+static const char* const ProfilerPhaseName[PROFILER_NB_PHASES] = 
+    { "SysTick ", "Period  ", "Decimate", "SeqStart", "PulseIRQ", "Readouts", "GUI     " };   // 8 characters each
+
 tMenu MenuMainSTiM32 =
 {
     1,
     "STiM32 Main Menu",
-    6, 0, 0, 0, 0, 0,
+    8, 0, 0, 0, 0, 0,
     0,
     {
         { "Set Frequency",           MenuSetup_Freq,    Application_Handler,    0 },
         { "Set Pulse Sequence",      MenuSetup_PSeq,    Application_Handler ,   0 },
         { "Set Pulse Voltage",       MenuSetup_PVolt,   Application_Handler ,   0 },
+        { "Set Output Mode",         MenuSetup_OMode,   Application_Handler ,   0 },
+        { "Diagnostics",             ShowDiagnostics,   Application_Handler ,   0 },
         { "Cancel",                  Cancel,            RestoreApp ,            0 },
         { "Shutdown",                ShutDown,          0,                      1 },
         { "Quit to OS",              Quit,              0,                      1 },            
     }
 };
 
-tMenu MenuSetFrequency =
+/*
+   Sequence rates offered by the Set Frequency menu; the pulse scheduler takes
+   any rate from FREQUENCY_MIN_HZ up to the limit of the selected sequence, the
+   others are set by the F command of the serial link.
+   With Cancel, at most MENU_MAXITEM (8) items.
+*/
+static const Frequency_Preset_struct FrequencyPresetTable[] =
+{
+    {   10, " 10 Hz " },
+    {   50, " 50 Hz " },
+    {  100, "100 Hz " },
+    {  500, "500 Hz " },
+    { 1000, " 1 kHz " },
+    { 2000, " 2 kHz " },
+    { 3000, " 3 kHz " },
+};
+
+#define NB_FREQUENCY_PRESETS    (sizeof(FrequencyPresetTable)/sizeof(FrequencyPresetTable[0]))     // + Cancel <= MENU_MAXITEM
+
+tMenu MenuSetFrequency =                    // items set by BuildFrequencyMenu()
 {
     1,
     "Set Frequency",
-    4, 0, 0, 0, 0, 0,
+    0, 0, 0, 0, 0, 0,
     0,
-    {
-        { " 1 kHz ",     SetFrequency_1,    Application_Handler,    0 },
-        { " 2 kHz ",     SetFrequency_2,    Application_Handler ,   0 },
-        { " 3 kHz ",     SetFrequency_3,    Application_Handler ,   0 },        
-        { "Cancel",      Cancel,            Application_Handler,    0 },
-    }
 };
 
-tMenu MenuSetPulseSequence =
+/*
+   Pulse sequences
+   Each phase is an edge to its level, held for its duration; the ZERO_VOLTAGE edge
+   ending the sequence is appended by CompilePulseEdgeTable. A new waveform is a new
+   entry here; the Set Pulse Sequence menu is built from this table.
+   The index+1 of an entry is stored in BKP_PULSESEQ, so entries are only appended.
+*/
+static const Pulse_Sequence_Description_struct PulseSequenceTable[] =
+{
+    { "Seq1", "+200us",             2, { { POSITIVE_VOLTAGE_MAX,  200, TRUE  },
+                                         { ZERO_VOLTAGE,           50, FALSE } } },
+    { "Seq2", "-50us",              2, { { ZERO_VOLTAGE,           50, FALSE },
+                                         { NEGATIVE_VOLTAGE_MAX,   50, FALSE } } },
+    { "Seq3", "+50us/o50us/+50us",  3, { { POSITIVE_VOLTAGE_MAX,   50, TRUE  },
+                                         { ZERO_VOLTAGE,           50, FALSE },
+                                         { NEGATIVE_VOLTAGE_MAX,   50, FALSE } } },
+    { "Seq4", "+400us",             1, { { POSITIVE_VOLTAGE_MAX,  400, TRUE  } } },
+    { "Seq5", "+100us/-100us half", 2, { { POSITIVE_VOLTAGE_HALF, 100, TRUE  },
+                                         { NEGATIVE_VOLTAGE_HALF, 100, FALSE } } },
+};
+
+#define NB_PULSE_SEQUENCES      (sizeof(PulseSequenceTable)/sizeof(PulseSequenceTable[0]))     // + Cancel <= MENU_MAXITEM
+
+// the menus built from the tables must fit in tMenu.Items: a negative array size stops the build
+typedef char FrequencyMenuFitsCheck[(NB_FREQUENCY_PRESETS + 1 <= MENU_MAXITEM) ? 1 : -1];
+typedef char PulseSequenceMenuFitsCheck[(NB_PULSE_SEQUENCES + 1 <= MENU_MAXITEM) ? 1 : -1];
+
+tMenu MenuSetPulseSequence =                // items set by BuildPulseSequenceMenu()
 {
     1,
     "Set Pulse Sequence",
-    5, 0, 0, 0, 0, 0,
+    0, 0, 0, 0, 0, 0,
     0,
-    {
-        { "+200us",             SetPulseSequence_1,    Application_Handler,    0 },
-        { "-50us",              SetPulseSequence_2,    Application_Handler ,   0 },
-        { "+50us/o50us/+50us",  SetPulseSequence_3,    Application_Handler ,   0 },
-        { "+400us",             SetPulseSequence_4,    Application_Handler ,   0 },
-        { "Cancel",             Cancel,                Application_Handler,    0 },
-    }
 };
 
 tMenu MenuSetPulsePeakVoltage =
@@ -278,14 +1088,78 @@ tMenu MenuSetPulsePeakVoltage_No8VOption =
     }
 };
 
+/*
+   Output modes: the peak voltage (open loop), or a constant current (CAE) up to
+   the peak voltage. The targets are above ReadoutLimit_CAE1_for_Idle, otherwise 
+   the regulated current would end the RUN state.
+*/
+static const u16 CurrentTargetTable[] = { 0, 120, 150, 180 };
+
+#define NB_CURRENT_TARGETS      (sizeof(CurrentTargetTable)/sizeof(CurrentTargetTable[0]))
+
+/* restored if nothing was stored, and field by field for values out of range */
+static const Settings_Record_struct SettingsDefaults =
+{
+    0, SETTINGS_VERSION, sizeof(Settings_Record_struct), 0,
+    FREQUENCY_DEFAULT_HZ, 1, PULSEPEAKVOLTAGE_8V, 0,
+    100, 60,                                // readout limits, Run and Idle: tuned at 8V (TODO IH150216)
+    1500, 3,                                // CAE offset and reciprocal scale
+    0,
+    CONTACT_STATISTIC_MEDIAN, 9, 2, 0,      // contact detection: 6 readouts from a step to the transition
+};
+
+/* the statistics of the contact detection, selected by contactStatistic */
+static const Contact_Statistic_struct ContactStatisticTable[NB_CONTACT_STATISTICS] =
+{
+    { "Last",   CONTACT_LastAtRun,   CONTACT_LastAtIdle,   CONTACT_SettleOne    },
+    { "Mean",   CONTACT_MeanAtRun,   CONTACT_MeanAtIdle,   CONTACT_SettleWindow },
+    { "Median", CONTACT_MedianAtRun, CONTACT_MedianAtIdle, CONTACT_SettleHalf   },
+};
+
+tMenu MenuSetOutputMode =                   // items follow CurrentTargetTable
+{
+    1,
+    "Set Output Mode",
+    5, 0, 0, 0, 0, 0,
+    0,
+    {
+        { "Voltage",        SetOutputMode,      Application_Handler,    0 },
+        { "Current 120",    SetOutputMode,      Application_Handler,    0 },
+        { "Current 150",    SetOutputMode,      Application_Handler,    0 },
+        { "Current 180",    SetOutputMode,      Application_Handler,    0 },
+        { "Cancel",         Cancel,             Application_Handler,    0 },
+    }
+};
+
 
 /* Global variables ----------------------------------------------------------*/
 static PendingRequest_code ActualPendingRequest;
 static Pulse_Sequence_struct PulseSeq;
-static Readout_struct Readout;
+static Readout_struct Readout;                  // latest readout, STIMULATOR_Handler only
+static Readout_struct DisplayReadout;           // readout shown by the GUI, main context only
+static Readout_Queue_struct ReadoutQueue;
+static Event_Queue_struct Events;
+static Readout_Statistics_struct ReadoutStatistics;
+static volatile u32 SysTickCnt;
+static CAE_Calibration_struct CaeCalibration;
+static CAE_Window_struct CaeWindow;
+static Profiler_struct Profiler;
+static Timer_Calibration_struct TimerCalibration;
+static Governor_struct Governor;
+static Battery_Model_struct Battery;
+static Current_Control_struct CurrentControl;
+static Log_struct Log;
+static Settings_struct Settings;
+static Telemetry_struct Telemetry;
+static Command_struct Command;
+static Boot_struct Boot;
+static Pulse_Scheduler_struct PulseScheduler;
+static GUI_Text_Field_struct GuiTextField[GUI_NB_TEXT_FIELDS];
+static GUI_Strip_Chart_struct GuiStripChart;
 static StimState_code StimState;
 static u16 ReadoutLimit_CAE1_for_Run;
 static u16 ReadoutLimit_CAE1_for_Idle;
+static Contact_Detector_struct Contact;        // STIMULATOR_Handler only
 static u16 ActualBatteryVoltagemV;
 
 static u8 MyFifoRxBuffer[FIFO_SIZE];       
@@ -295,141 +1169,148 @@ static char BatteryStatusString[BATTERY_STATUS_STRING_LENGHT];
 static char SettingsStatusString[SETTINGS_STRING_LENGHT];
 static char TotalTimeString[TOTALTIME_STRING_LENGHT];
 static char NetTimeString[NETTIME_STRING_LENGHT];
+static char ProfilerPhaseString[PROFILER_STRING_LENGHT];
+static char TimerCalibrationString[PROFILER_STRING_LENGHT];
+static char GovernorString[PROFILER_STRING_LENGHT];
+static char FrequencyString[FREQUENCY_STRING_LENGHT];
 
 static u16 NetTimer_StartTime;
 
 /*******************************************************************************
 * Function Name  : STIMULATOR_Handler
-* Description    : Generates single pulse sequence and reads the feedback signal
+* Description    : Evaluates the feedback signal of the pulse sequences
+*                  The sequences are played back by the pulse timer and DMA at the
+*                  rate set by the pulse scheduler (see PULSESCHEDULER_NextSequence),
+*                  so no time is spent here waiting.
 * Input          : None
 * Return         : Readout 
 *******************************************************************************/
 void STIMULATOR_Handler( void ) 
 {
-static u32 state_change_cnt = 0;
-static u32 frequency_cnt = 0;
+bool isNewReadout = FALSE;
+u32 entryTime = PROFILER_Now();
+u32 phaseTime;
+
+SysTickCnt++;
+if(SysTickCnt % EVENT_FRAME_SYSTICKS == 0)
+    {
+    EVENT_Post(EVENT_FRAME);
+    }
+
+PROFILER_Record(PROFILER_PHASE_SYSTICK_PERIOD, Profiler.lastSysTickTime);
+Profiler.lastSysTickTime = entryTime;
+
+TIMERCAL_Poll();                    // every SysTick, the RTC second is caught within 333us
+COMMAND_Poll();                     // ... and the serial command bytes left by the RX interrupt
 
-if((frequency_cnt++) % PulseSeq.frequency_divider)
-            {
-            return;
-            }
-        
-#define WHILE_DELAY_LOOP(loopCounts)      {i=(loopCounts);while(i--);}
-        
 #ifdef DEBUG_NOHW
 
-    // Code for debugging (no hardware connected)
+    // Code for debugging (no hardware connected): a ramp across the limits of the contact detector
 
     static u16 TickCnt=0;    
     
     if(TickCnt<1000)
         {        
-            Readout.CAE1 = ReadoutLimit_CAE1_for_Run-1;                           
+            Readout.CAE1 = Contact.idleLimit-1;
         }
     else if(TickCnt<3000)
         {
-            Readout.CAE1 = ReadoutLimit_CAE1_for_Run + ((float)TickCnt-1000.0)/2000.0*100;        
+            Readout.CAE1 = Contact.runLimit + (TickCnt-1000)*100/2000;        
         }
     else if(TickCnt<4000)
         {
-            Readout.CAE1 = ReadoutLimit_CAE1_for_Run + 100;                    
+            Readout.CAE1 = Contact.runLimit + 100;                    
         }        
     if(TickCnt++==4000)
         {
         TickCnt=0;                
         }    
-
-    {u32 i;
-    CX_Write( CX_GPIO_PIN4, CX_GPIO_LOW, 0 );
-    WHILE_DELAY_LOOP(PulseSeq.delay0_loop_counts)
-    
-    CX_Write( CX_GPIO_PIN4, CX_GPIO_HIGH, 0 );
-    WHILE_DELAY_LOOP(PulseSeq.delay1_loop_counts)
-    
-    CX_Write( CX_GPIO_PIN4, CX_GPIO_LOW, 0 );
-    WHILE_DELAY_LOOP(PulseSeq.delay2_loop_counts)
+    isNewReadout = TRUE;
     
-    CX_Write( CX_GPIO_PIN4, CX_GPIO_HIGH, 0 );
-    WHILE_DELAY_LOOP(PulseSeq.delay3_loop_counts)
-    
-    CX_Write( CX_GPIO_PIN4, CX_GPIO_LOW, 0 );
-    }
+#else
+
+    // the samples of the last positive phase are decimated here, not in the pulse interrupts
+    if(CaeWindow.isComplete)
+        {
+        phaseTime = PROFILER_Now();
+        CAE_Decimate();
+        PROFILER_Record(PROFILER_PHASE_DECIMATION, phaseTime);
+        isNewReadout = TRUE;
+        }
     
-#else        
+#endif
 
-    // Real code using connected hardware
-                    
-    switch(PulseSeq.sequence_multiplicity)
-    {        
-        case SEQUENCEMULTIPLICITY_SINGLE:
-            GeneratePulseSequenceAndReadCAE();        
-            break;
-        
-        case SEQUENCEMULTIPLICITY_DOUBLE:
-            GeneratePulseSequenceAndReadCAE();        
-            {u32 i; WHILE_DELAY_LOOP(PulseSeq.delay_between_sequences_loop_counts)}
-            GeneratePulseSequenceAndReadCAE();        
-            break;
-    }   
-                    
+    // new settings are compiled into the configuration not played and published; the
+    // running pulse engine takes it between two sequences, without stopping. The RX
+    // interrupt preempts this: isPublishing is set before the test, so it publishes
+    // before the test sees nextConfig, or leaves the publish to this
+    PulseSeq.isPublishing = TRUE;
+    MEMORY_BARRIER();                                       // the flag before the test
+    if(PulseSeq.isCompilePending && PulseSeq.nextConfig == 0)
+        {
+        phaseTime = PROFILER_Now();
+#ifdef STIM32_HOST
+        HOST_PreemptPublish();                              // the stress harness comes in here
 #endif
+        PULSEENGINE_Publish();
+        PROFILER_Record(PROFILER_PHASE_SEQUENCE_START, phaseTime);
+        }
+    PulseSeq.isPublishing = FALSE;
+    
+    // the pulse engine runs on its own; it is (re)started here only, 
+    // at the beginning and once it has stopped for a clock switch
+    if(!PULSEENGINE_IsBusy() && !Governor.isSwitchPending && !PulseSeq.isWiringWrong)
+        {
+        phaseTime = PROFILER_Now();
+        PULSEENGINE_Start();
+        PROFILER_Record(PROFILER_PHASE_SEQUENCE_START, phaseTime);
+        }
         
+    // contact detection, one sample per readout
+    if(isNewReadout)
+        {
+        if(CONTACT_Update(&Contact, Readout.CAE1) == STIMSTATE_RUN && StimState != STIMSTATE_RUN)
+            {
+            StartNetTimeTimer();
+            }
+        StimState = Contact.state;
+        }
+
     switch(StimState)
     {
         case STIMSTATE_IDLE:  
-        
                 LED_Set( LED_RED, LED_ON);                
                 LED_Set( LED_GREEN, LED_OFF);           
-                            
-        
-                // check if still idle    
-                if(Readout.CAE1 >= ReadoutLimit_CAE1_for_Run)
-                    {
-                    StimState = STIMSTATE_WAITING_FOR_RUN;
-                    state_change_cnt = 0;
-                    }
                 break;
         
         case STIMSTATE_RUN:  
-            
                 LED_Set( LED_RED, LED_OFF);                
                 LED_Set( LED_GREEN, LED_ON);                
-                                                              
-        
-                // check if still running
-                if(Readout.CAE1 <= ReadoutLimit_CAE1_for_Idle)
-                    {
-                    StimState = STIMSTATE_WAITING_FOR_IDLE;
-                    state_change_cnt = 0;
-                    }                
                 break;
                 
-        case STIMSTATE_WAITING_FOR_IDLE:  
-                if(Readout.CAE1 > ReadoutLimit_CAE1_for_Idle)
-                    {
-                    StimState = STIMSTATE_RUN;                    
-                    }
-                else                    
-                    if(++state_change_cnt == STATECHANGE_CNT_LIMIT)
-                        {
-                        StimState = STIMSTATE_IDLE;
-                        }                                          
-                break;
-                    
-        case STIMSTATE_WAITING_FOR_RUN:  
-                if(Readout.CAE1 < ReadoutLimit_CAE1_for_Run)
-                    {
-                    StimState = STIMSTATE_IDLE;
-                    }
-                else                    
-                    if(++state_change_cnt == STATECHANGE_CNT_LIMIT)
-                        {
-                        StimState = STIMSTATE_RUN;
-                        StartNetTimeTimer();
-                        }                                          
+        default:                                    // the samples are held, the LEDs stay
                 break;
     }
 
+    // constant current mode: one controller update per readout, i.e. per sequence
+    if(isNewReadout && CurrentControl.target)
+        {
+        CURRENT_Control();
+        }
+    
+    // every readout goes to the main loop
+    if(isNewReadout)
+        {
+        Readout_Record_struct record;
+        
+        record.timestamp = SysTickCnt;
+        record.CAE1 = Readout.CAE1;
+        record.isOverloaded = Readout.isOverloaded;
+        record.stimState = StimState;
+        READOUTQUEUE_Push(&record);
+        }
+    
+    PROFILER_Record(PROFILER_PHASE_SYSTICK_HANDLER, entryTime);
 }
 
 /*******************************************************************************
@@ -445,42 +1326,43 @@ enum MENU_code Application_Ini(void)
     LCD_SetOffset(OFFSET_OFF);
     
     UTIL_SetDividerHandler(MENU_SCHHDL_ID, 10);             //  10 is default
-    MENU_SetAppliDivider( 10 );                             // This application will be called every 10*10 =100 SysTicks
-    UTIL_SetSchHandler(STIMULATOR_HANDLER_ID, STIMULATOR_Handler );
-    UTIL_SetDividerHandler(STIMULATOR_HANDLER_ID, 1);       // This handler will be called every single SysTick
+    MENU_SetAppliDivider( 1 );                              // This application will be called every 10 SysTicks,
+                                                            // it only works when an event is posted (Event Queue)
     
-    UTIL_SetPll(SPEED_VERY_HIGH);                           // CPU frequency is 120MHz; Systick frequency is 3kHZ
+    UTIL_SetPll(GOVERNOR_FULL_SPEED);                       // CPU frequency is 120MHz; Systick frequency is 3kHZ
                                                             // see EvoPrimer Manual for STM32F429ZI
+    PROFILER_Init();                                        // after the clock is set
+    GOVERNOR_Init();                                        // lowers it when idle
+    
+    Boot.startClock = TIMERCAL_ClockNow();                  // the DWT runs from PROFILER_Init on
+    Boot.startTime = PROFILER_Now();
+#ifdef STIM32_HOST
+    Boot.lcdPixels = HOST_GetLcdPixelsWritten();
+#endif
     
     LCD_SetRotateScreen( 1 );
     SetAutorun();
     
     //-------------------------------------
-    // Initialize ...
+    // Initialize what the first pulse needs; the intro screen, the session log
+    // and the menus are done by Application_Handler (BOOT_NextStage)
               
-    // ... set frequency and pulse sequence   
-    RestoreParameters();  
-    UpdatePulseSequence();    
+    // ... battery model, for the compensation of the pulse voltage
+    ActualBatteryVoltagemV = UTIL_GetBat();
+    BATTERY_Init(ActualBatteryVoltagemV);
     
-    // ... GUI    
-    GUI(GUI_INITIALIZE,0);
+    // ... set frequency and pulse sequence
+    SETTINGS_Restore();                                     // also the readout limits and the CAE scaling
+    UpdatePulseSequence();    
     
     // ... request mechanism
-    ActualPendingRequest = PENDING_REQUEST_NONE;
+    ActualPendingRequest = PENDING_REQUEST_SHOWING_INTRO_SCREEN;
     
     // ... state machine
     StimState = STIMSTATE_IDLE; 
-    
-    // ... readout limits
-    ReadoutLimit_CAE1_for_Run =   60;
-    ReadoutLimit_CAE1_for_Idle = 100;
 
     // ... miscellaneous    
 
-    ActualBatteryVoltagemV = UTIL_GetBat();
-    
-    RTC_SetTime(0,0,0);  //IH150126 this clears any preset RTC ... but we do not care in our app
-
     BUZZER_SetMode(BUZZER_SHORTBEEP);
     
     // ... CX Extension
@@ -489,8 +1371,7 @@ enum MENU_code Application_Ini(void)
 
     // test settings
     
-    CX_Configure( CX_GPIO_PIN4, CX_GPIO_Mode_OUT_PP, 0 );  //Push-pull mode
-    CX_Write( CX_GPIO_PIN4, CX_GPIO_LOW, 0 );
+    // no SPI device; the edge timing can be watched on the NSS line (TIM8_CH1)
     
 #else        
 
@@ -520,20 +1401,36 @@ enum MENU_code Application_Ini(void)
     // NSS (aka CS(neg)) pin setup                        
     CX_Configure( CX_GPIO_PIN8, CX_GPIO_Mode_OUT_PP, 0 );  //Push-pull mode    
     CX_Write( CX_GPIO_PIN8, CX_GPIO_HIGH, 0 );             // initial NSS state is HIGH
+    PulseSeq.isWiringWrong = !WIPER_CheckWiring();
     
     // ADC Setup
    
     CX_Configure( CX_ADC1,  0 , 0 );
+    CAE_Init();                                             // continuous conversions with DMA on top of it
+    
+    SetWiper(MAX5439_ZERO_VOLTAGE_CODE);                   // before the pulse timer takes over the NSS pin
     
  #endif   
  
+    // ... pulse timer and DMA
+    
+    PULSEENGINE_Init();
+    
+    // ... telemetry of the readouts
+    
+    TELEMETRY_Init();
+    
+    // ... and the commands on its RX line (polled by STIMULATOR_Handler)
+    
+    COMMAND_Init();
+ 
     //-------------------------------------
     
-    //--- at start, show intro screen for 2 seconds
-        
-    ActualPendingRequest = PENDING_REQUEST_SHOWING_INTRO_SCREEN;
-    GUI(GUI_INTRO_SCREEN,0);                                                     
-    UTIL_SetTimer(2000,TimerHandler1);
+    // last: the first SysTick publishes the configuration and starts the pulse engine
+    UTIL_SetSchHandler(STIMULATOR_HANDLER_ID, STIMULATOR_Handler );
+    UTIL_SetDividerHandler(STIMULATOR_HANDLER_ID, 1);       // This handler will be called every single SysTick
+    
+    Boot.iniTime = PROFILER_Now() - Boot.startTime;
         
     return MENU_CONTINUE_COMMAND;
     }
@@ -552,7 +1449,55 @@ enum MENU_code Application_Handler(void)
     // return MENU_LEAVE
     
     static int GUIUpdate_cnt = 0;    
-        
+    u32 phaseTime;
+    bool isFrame, isNewSecond;
+    
+    Events.nbCalls++;
+    if(!EVENT_IsPending())
+        {
+        Events.nbIdleCalls++;
+        }
+    
+    // staged boot, the pulses run meanwhile; the events wait for the stages done
+    if(Boot.stage != BOOT_STAGE_DONE)
+        {
+        BOOT_NextStage();
+        return MENU_CONTINUE;
+        }
+    
+    // pulse timer calibration, also while the intro screen is shown
+    if(EVENT_Take(EVENT_CALIBRATION))
+        {
+        TIMERCAL_Apply();
+        }
+    if(EVENT_Take(EVENT_INTRO_DONE))
+        {
+        Boot.isIntroOver = TRUE;                        // also taken after a skipped intro
+        }
+    isNewSecond = EVENT_Take(EVENT_SECOND);
+    if(isNewSecond)
+        {
+        ActualBatteryVoltagemV = UTIL_GetBat();        //IH150202 check actual battery status (every second)
+        BATTERY_Update(ActualBatteryVoltagemV);
+        LOG_Second();
+        }
+    GOVERNOR_Update(isNewSecond);
+    SETTINGS_Service(isNewSecond);                      // before the log, which takes its flash copy
+    LOG_Service();                                      // one byte to the flash per call
+    if(EVENT_Take(EVENT_COMMAND))
+        {
+        COMMAND_Reply();                                // before the TX buffer is handed over
+        }
+    TELEMETRY_Service();                                // next TX buffer to the DMA
+    
+    // the readout queue is drained every frame
+    isFrame = EVENT_Take(EVENT_FRAME);
+    if(isFrame)
+        {
+        phaseTime = PROFILER_Now();
+        ProcessReadouts();
+        PROFILER_Record(PROFILER_PHASE_READOUTS, phaseTime);
+        }
   
     // process special requests first    
     switch(ActualPendingRequest)
@@ -566,21 +1511,54 @@ enum MENU_code Application_Handler(void)
             ActualPendingRequest = PENDING_REQUEST_NONE;                       
             GUI(GUI_CLEAR,0);                                                     
             GUI(GUI_NORMAL_UPDATE,0);   
+            isFrame = FALSE;                            // just drawn
             break;       
         
         case PENDING_REQUEST_SHOWING_INTRO_SCREEN:            
+            if ( BUTTON_GetState() == BUTTON_PUSHED )
+                {
+                BUTTON_WaitForRelease();
+                Boot.isIntroSkipped = TRUE;
+                }
+            if(Boot.isIntroOver || Boot.isIntroSkipped)
+                {
+                ActualPendingRequest = PENDING_REQUEST_NONE;
+                GUI(GUI_INITIALIZE,0);
+                Boot.mainScreenSysTicks = SysTickCnt;
+                }
+            EVENT_Sleep();
+            return MENU_CONTINUE;
+            
+        case PENDING_REQUEST_SHOWING_DIAGNOSTICS:
+            
+            if (isFrame && !(GUIUpdate_cnt++ % PROFILER_DISPLAY_DIVIDER))
+                {
+                GUI(GUI_DIAGNOSTICS_SCREEN,0);
+                }
+            if ( BUTTON_GetState() == BUTTON_PUSHED )
+                {
+                BUTTON_WaitForRelease();
+                ActualPendingRequest = PENDING_REQUEST_REDRAW;  // back to the normal screen
+                return MENU_CONTINUE;
+                }
+            EVENT_Sleep();
             return MENU_CONTINUE;
     }
   
     // normal processing    
-    if (!(GUIUpdate_cnt % GUIUPDATE_DIVIDER))
+    if (isFrame && !(GUIUpdate_cnt % GUIUPDATE_DIVIDER))
         {
+        phaseTime = PROFILER_Now();
         GUI(GUI_NORMAL_UPDATE,0);     
-        ActualBatteryVoltagemV = UTIL_GetBat();        //IH150202 check actual battery status every 100 ticks
+        PROFILER_Record(PROFILER_PHASE_GUI, phaseTime);
         }   
-    GUIUpdate_cnt++;
+    if (isFrame)
+        {
+        GUIUpdate_cnt++;
+        }
   
     // check button state to invoke main menu
+    // (CircleOS debounces the button in its own handler, this reads the result)
     if ( BUTTON_GetState() == BUTTON_PUSHED )
     {
         BUTTON_WaitForRelease();
@@ -588,6 +1566,7 @@ enum MENU_code Application_Handler(void)
         return MENU_CHANGE;
     }
 
+    EVENT_Sleep();
     return MENU_CONTINUE;  
     }
 
@@ -596,10 +1575,69 @@ enum MENU_code Application_Handler(void)
 *******************************************************************************/
 void TimerHandler1(void)
     {    
-    ActualPendingRequest = PENDING_REQUEST_NONE;
-    GUI(GUI_INITIALIZE,0);
+    EVENT_Post(EVENT_INTRO_DONE);               // the screen is drawn by Application_Handler, not here
+    }
+
+/*******************************************************************************
+* Function Group : Staged boot
+* Description    : Power-on to the first pulse takes Application_Ini and a SysTick:
+                   the settings, the pulse table and the CX devices only. The rest
+                   is done here while the intro screen is shown, one stage per 
+                   Application_Handler call; the session log, which scans its flash
+                   sectors, is ready some 10ms later. The intro screen is shown for
+                   INTRO_SCREEN_MS, or until the button is pushed.
+                   The figures are taken on the clock of TIMERCAL_ClockNow: DWT cycles
+                   on the target, the virtual pulse timer in the host build (which 
+                   does not see the time of Application_Ini, reported apart).
+*******************************************************************************/
+static void BOOT_NextStage(void)
+    {
+    switch(Boot.stage)
+        {
+        case BOOT_STAGE_INTRO:
+            GUI(GUI_INTRO_SCREEN,0);
+            UTIL_SetTimer(INTRO_SCREEN_MS,TimerHandler1);
+            break;
+        case BOOT_STAGE_LOG:
+            LOG_Init();                                 // before the RTC is cleared: its time of day is the session start
+            RTC_SetTime(0,0,0);  //IH150126 this clears any preset RTC ... but we do not care in our app
+            TIMERCAL_Init();                            // pulse timer measured against the RTC from now on
+            break;
+        case BOOT_STAGE_MENUS:
+            BuildFrequencyMenu();
+            BuildPulseSequenceMenu();
+            Boot.readySysTicks = SysTickCnt;
+            break;
+        default:
+            break;
+        }
+    Boot.stage++;
+    }
+
+/* the pulse engine takes its first configuration, firstEdgeTicks before its first edge */
+static void BOOT_FirstPulse(u32 firstEdgeTicks)
+    {
+    Boot.firstPulse_us = (TIMERCAL_ClockNow() - Boot.startClock) / (TIMERCAL_GetNominalHz() / 1000000) + firstEdgeTicks;
+#ifdef STIM32_HOST
+    Boot.lcdPixels = HOST_GetLcdPixelsWritten() - Boot.lcdPixels;
+#endif
+    }
+
+#ifdef STIM32_HOST
+
+/* boot figures, for the host harness; the times are 0 until reached */
+void HOST_GetBootCounters(u32 *firstPulse_us, u32 *iniTime_us, u32 *lcdPixels, u32 *readySysTicks, u32 *mainScreenSysTicks, bool *isIntroSkipped)
+    {
+    *firstPulse_us = Boot.firstPulse_us;
+    *iniTime_us = Boot.iniTime / Profiler.ticksPerMicrosecond;
+    *lcdPixels = Boot.firstPulse_us ? Boot.lcdPixels : 0;
+    *readySysTicks = Boot.readySysTicks;
+    *mainScreenSysTicks = Boot.mainScreenSysTicks;
+    *isIntroSkipped = Boot.isIntroSkipped;
     }
 
+#endif // STIM32_HOST
+
 /*******************************************************************************
 * Function Group: Setup Menu Handlers
 *******************************************************************************/
@@ -615,9 +1653,17 @@ enum MENU_code  MenuSetup_PSeq(void)
     return MENU_CHANGE;
     }
 
+enum MENU_code  ShowDiagnostics(void)
+    {
+    BUTTON_SetMode( BUTTON_ONOFF ) ;            
+    GUI(GUI_DIAGNOSTICS_INITIALIZE,0);
+    ActualPendingRequest = PENDING_REQUEST_SHOWING_DIAGNOSTICS;
+    return MENU_CONTINUE_COMMAND;
+    }
+
 enum MENU_code  MenuSetup_PVolt(void)
     {    
-    if(ActualBatteryVoltagemV >= LIMIT_FOR8V_BATTERY_VOLTAGE_MV)
+    if(Battery.is8VAvailable)
     {
         MENU_Set( ( tMenu* ) &MenuSetPulsePeakVoltage );
     }
@@ -628,67 +1674,28 @@ enum MENU_code  MenuSetup_PVolt(void)
     return MENU_CHANGE;
     }
 
-
-enum MENU_code  SetFrequency_1(void)
-    {
-    PulseSeq.frequency = FREQUENCY_1KHZ;     
-    UpdatePulseSequence();
-    
-    ActualPendingRequest = PENDING_REQUEST_REDRAW;    
-    return MENU_CONTINUE_COMMAND;
+enum MENU_code  MenuSetup_OMode(void)
+    {    
+    MENU_Set( ( tMenu* ) &MenuSetOutputMode );             
+    return MENU_CHANGE;
     }
 
-enum MENU_code  SetFrequency_2(void)
-    {
-    PulseSeq.frequency = FREQUENCY_2KHZ;        
-    UpdatePulseSequence();
-    
-    ActualPendingRequest = PENDING_REQUEST_REDRAW;    
-    return MENU_CONTINUE_COMMAND;
-    }
 
-enum MENU_code  SetFrequency_3(void)
+enum MENU_code  SetFrequency(void)
     {
-    PulseSeq.frequency = FREQUENCY_3KHZ;    
-    UpdatePulseSequence();
-    
-    ActualPendingRequest = PENDING_REQUEST_REDRAW;    
-    return MENU_CONTINUE_COMMAND;
-    }
-
-enum MENU_code  SetPulseSequence_1(void)
-    {       
-    PulseSeq.pulseSeq = PULSESEQUENCE_1;    
+    PulseSeq.frequency_Hz = FrequencyPresetTable[MenuSetFrequency.SelectedItem].frequency_Hz;     // menu items follow FrequencyPresetTable
     UpdatePulseSequence();
     
     ActualPendingRequest = PENDING_REQUEST_REDRAW;    
     return MENU_CONTINUE_COMMAND;
     }
 
-enum MENU_code  SetPulseSequence_2(void)
+enum MENU_code  SetPulseSequence(void)
     {
-    PulseSeq.pulseSeq = PULSESEQUENCE_2;    
+    PulseSeq.pulseSeq = MenuSetPulseSequence.SelectedItem + 1;     // menu items follow PulseSequenceTable
     UpdatePulseSequence();
-    
-    ActualPendingRequest = PENDING_REQUEST_REDRAW;    
-    return MENU_CONTINUE_COMMAND;
-    }
-
-enum MENU_code  SetPulseSequence_3(void)
-    {
-    PulseSeq.pulseSeq = PULSESEQUENCE_3;    
-    UpdatePulseSequence();    
-    
-    ActualPendingRequest = PENDING_REQUEST_REDRAW;    
-    return MENU_CONTINUE_COMMAND;
-    }
 
-enum MENU_code  SetPulseSequence_4(void)
-    {
-    PulseSeq.pulseSeq = PULSESEQUENCE_4;    
-    UpdatePulseSequence();    
-    
-    ActualPendingRequest = PENDING_REQUEST_REDRAW;    
+    ActualPendingRequest = PENDING_REQUEST_REDRAW;
     return MENU_CONTINUE_COMMAND;
     }
 
@@ -719,11 +1726,21 @@ enum MENU_code  SetPulsePeakVoltage_3(void)
     return MENU_CONTINUE_COMMAND;
     }
 
+enum MENU_code  SetOutputMode(void)
+    {
+    CurrentControl.target = CurrentTargetTable[MenuSetOutputMode.SelectedItem];
+    UpdatePulseSequence();
+    
+    ActualPendingRequest = PENDING_REQUEST_REDRAW;    
+    return MENU_CONTINUE_COMMAND;
+    }
+
 
 enum MENU_code ShutDown( void )
 {
         //IH150126 immediate shutdown
-        BackUpParameters();
+        SETTINGS_Flush();
+        LOG_Flush();
         SHUTDOWN_Action();
 }
 
@@ -749,7 +1766,8 @@ enum MENU_code Quit( void )
         LED_Set( LED_GREEN, LED_OFF );
         LED_Set( LED_RED, LED_OFF );
         
-        BackUpParameters();
+        SETTINGS_Flush();
+        LOG_Flush();
         return MENU_Quit();
 }
 
@@ -789,199 +1807,4599 @@ static void LongDelay(u8 delayInSeconds)
     }
 
 /*******************************************************************************
-* MACRO Name     : MICROSECONDS_TO_LOOP_COUNTS
-* Description    : computes the number of delay loops counts for this simple loop
-*                                   
-*                   {i=(loopCounts);while(i--);}
-*
-*                   assuming CPU speed 120MHz
-*
-* Input          : u32 microseconds
-* Return         : u32 loopCounts
+* MACRO Name     : MICROSECONDS_TO_TIMER_TICKS
+* Description    : converts microseconds to the pulse timer ticks, corrected by
+                   the measured rate of the timer clock (see TIMERCAL_Apply)
+* Input          : u32 microseconds, s32 ppm (TimerCalibration.appliedPpm when compiled)
+* Return         : u32 ticks
 *******************************************************************************/
-#define MICROSECONDS_TO_LOOP_COUNTS(us)   ((float)(us)*15.0)  //IH150107 corrected (was 7.78 before)
+#define MICROSECONDS_TO_TIMER_TICKS(us, ppm)   ((u32)(us)*(PULSE_TIMER_FREQUENCY_HZ/1000000) \
+                                                + (s32)(us)*(ppm)/1000000)
 
 static void UpdatePulseSequence()
     {
-        switch(PulseSeq.pulseSeq)
+       // compensated for the battery voltage; kept up to date by BATTERY_Update,
+       // or by CURRENT_Control up to this limit
+       u16 voltageFactor = BATTERY_GetVoltageFactor();
+       
+       if(CurrentControl.target == 0 || PulseSeq.voltageFactor > voltageFactor)
+       {
+            PulseSeq.voltageFactor = voltageFactor;
+       }
+       
+       // the tables are played back by DMA; a new configuration is compiled in
+       // STIMULATOR_Handler and taken by the pulse engine between two sequences
+       PulseSeq.isCompilePending = TRUE;
+       Settings.isChangePending = TRUE;         // saved by SETTINGS_Service
+    }
+
+
+/*******************************************************************************
+* Function Name  : BuildFrequencyMenu
+* Description    : One item of the Set Frequency menu per FrequencyPresetTable entry
+* Input          : None
+* Return         : None
+*******************************************************************************/
+static void BuildFrequencyMenu(void)
+    {
+    u8 i;
+
+    for(i=0; i<NB_FREQUENCY_PRESETS; i++)
         {
-            case PULSESEQUENCE_1:    
-                PulseSeq.delay1_microseconds = 200;        
-                PulseSeq.delay2_microseconds = 50;        
-                PulseSeq.delay3_microseconds = 0;             
-                PulseSeq.delay_between_sequences_microseconds = 200;    
-                break;
-            
-            case PULSESEQUENCE_2:    
-                PulseSeq.delay1_microseconds = 0;        
-                PulseSeq.delay2_microseconds = 50;        
-                PulseSeq.delay3_microseconds = 50;          
-                PulseSeq.delay_between_sequences_microseconds = 400;        
-                break;
-            
-            case PULSESEQUENCE_3:    
-                PulseSeq.delay1_microseconds = 50;        
-                PulseSeq.delay2_microseconds = 50;        
-                PulseSeq.delay3_microseconds = 50;      
-                PulseSeq.delay_between_sequences_microseconds = 400;        
-                break;
-            
-            case PULSESEQUENCE_4:    
-                PulseSeq.delay1_microseconds = 400;        
-                PulseSeq.delay2_microseconds = 0;        
-                PulseSeq.delay3_microseconds = 0;
-                PulseSeq.delay_between_sequences_microseconds = 100;        
-                break;
+        MenuSetFrequency.Items[i].Text = FrequencyPresetTable[i].menuText;
+        MenuSetFrequency.Items[i].Fct_Init = SetFrequency;
+        MenuSetFrequency.Items[i].Fct_Manage = Application_Handler;
+        MenuSetFrequency.Items[i].fRemoveMenu = 0;
         }
-    
-        PulseSeq.delay0_loop_counts = MICROSECONDS_TO_LOOP_COUNTS(PulseSeq.delay0_microseconds);
-        PulseSeq.delay1_loop_counts = MICROSECONDS_TO_LOOP_COUNTS(PulseSeq.delay1_microseconds);
-        PulseSeq.delay2_loop_counts = MICROSECONDS_TO_LOOP_COUNTS(PulseSeq.delay2_microseconds);
-        PulseSeq.delay3_loop_counts = MICROSECONDS_TO_LOOP_COUNTS(PulseSeq.delay3_microseconds);     
-        PulseSeq.delay_between_sequences_loop_counts
-                                    = MICROSECONDS_TO_LOOP_COUNTS(PulseSeq.delay_between_sequences_microseconds);     
-    
-        switch(PulseSeq.frequency)
+    MenuSetFrequency.Items[i].Text = "Cancel";
+    MenuSetFrequency.Items[i].Fct_Init = Cancel;
+    MenuSetFrequency.Items[i].Fct_Manage = Application_Handler;
+    MenuSetFrequency.Items[i].fRemoveMenu = 0;
+    MenuSetFrequency.NbItems = i+1;
+    }
+
+/*******************************************************************************
+* Function Name  : BuildPulseSequenceMenu
+* Description    : One item of the Set Pulse Sequence menu per PulseSequenceTable entry
+* Input          : None
+* Return         : None
+*******************************************************************************/
+static void BuildPulseSequenceMenu(void)
+    {
+    u8 i;
+
+    for(i=0; i<NB_PULSE_SEQUENCES; i++)
         {
-            case FREQUENCY_1KHZ:    
-                    PulseSeq.frequency_divider = 3;     
-                    PulseSeq.sequence_multiplicity = SEQUENCEMULTIPLICITY_SINGLE;
-                    break; 
-            case FREQUENCY_2KHZ:    
-                    PulseSeq.frequency_divider = 3;     
-                    PulseSeq.sequence_multiplicity = SEQUENCEMULTIPLICITY_DOUBLE;
-                    break;
-            case FREQUENCY_3KHZ:    
-                    PulseSeq.frequency_divider = 1;     
-                    PulseSeq.sequence_multiplicity = SEQUENCEMULTIPLICITY_SINGLE;
-                    break;
+        MenuSetPulseSequence.Items[i].Text = PulseSequenceTable[i].menuText;
+        MenuSetPulseSequence.Items[i].Fct_Init = SetPulseSequence;
+        MenuSetPulseSequence.Items[i].Fct_Manage = Application_Handler;
+        MenuSetPulseSequence.Items[i].fRemoveMenu = 0;
         }
-    
-        switch(PulseSeq.peakVoltage)
-        {
-            case PULSEPEAKVOLTAGE_8V:    
-                    PulseSeq.voltage_multiplication_factor =  8.0/8.0;
-                    break;
-            case PULSEPEAKVOLTAGE_6V:    
-                    PulseSeq.voltage_multiplication_factor =  6.0/8.0;
-                    break;
-            case PULSEPEAKVOLTAGE_4V:    
-                    PulseSeq.voltage_multiplication_factor =  4.0/8.0;
-                    break;
-        }    
-    
-       PulseSeq.voltage_multiplication_factor *= ((float)NOMINAL_BATTERY_VOLTAGE_MV)/((float)ActualBatteryVoltagemV);  
-       if(PulseSeq.voltage_multiplication_factor >1.0)
-       {
-            PulseSeq.voltage_multiplication_factor = 1.0;
-       }       
-                    
+    MenuSetPulseSequence.Items[i].Text = "Cancel";
+    MenuSetPulseSequence.Items[i].Fct_Init = Cancel;
+    MenuSetPulseSequence.Items[i].Fct_Manage = Application_Handler;
+    MenuSetPulseSequence.Items[i].fRemoveMenu = 0;
+    MenuSetPulseSequence.NbItems = i+1;
     }
 
-
 /*******************************************************************************
-* Function Name  : GeneratePulseSequenceAndReadCAE
-* Description    : Generates a single output pulse sequence according to PulseSeq data
-                   and reads CAE (only if  PulseSeq.delay1_loop_counts>0)
+* Function Name  : CompilePulseEdgeTable
+* Description    : Compiles the pulse sequence description into the edge table played back by 
+                   the pulse engine
                     
-                    IH141230
-                    In the current implementation, the values of edgeN are ignored
-                    and the pulse pattern is like follows:
-                    If d1>0, the first pulse is POSITIVE_VOLTAGE_MAX, otherwise the first pulse is omitted
-                    If d3>0, the second pulse is NEGATIVE_VOLTAGE_MAX, otherwise the second pulse is omitted    
+                    Every phase of the selected PulseSequenceTable entry becomes an edge;
+                    the wiper codes and durations are computed here once, so the run time
+                    cost per edge does not depend on the sequence.
 
-* Input          : None
+                    Zero-length phases do not produce an edge.
+                    The last edge (ZERO_VOLTAGE) ends the sequence; the time to the
+                    next sequence is set by the pulse scheduler.
+
+                    Only the settings recorded in the configuration are used, so it
+                    is compiled the same way whatever the other contexts change meanwhile.
+                    Called for a configuration the pulse engine does not play.
+
+* Input          : Pulse_Config_struct *config
 * Return         : None
 *******************************************************************************/
-static void GeneratePulseSequenceAndReadCAE()
-    {u32 i;    
-     u32 ad_value_0_to_4095;
-    
-     u32 ad_value_offset  =  1500;          // ADC values under this are presented as 0
-     u32 ad_value_reciproq_scale   =  3;    // values are DIVIDED by this factor
+static void CompilePulseEdgeTable(Pulse_Config_struct *config)
+    {
+    const Pulse_Sequence_Description_struct *sequence = &PulseSequenceTable[config->pulseSeq-1];
+    u8 n = 0;
+    u8 i;
     
-    SetOutputVoltage(ZERO_VOLTAGE,PulseSeq.voltage_multiplication_factor);
-    WHILE_DELAY_LOOP(PulseSeq.delay0_loop_counts)
+#define ADD_EDGE(lvl, us, rd)   { config->edgeTable[n].wiperCode = GetWiperCode((lvl), config->voltageFactor); \
+                                  config->edgeTable[n].level = (lvl);                                    \
+                                  config->edgeTable[n].duration_ticks = MICROSECONDS_TO_TIMER_TICKS(us, config->appliedPpm); \
+                                  config->edgeTable[n].readCAE = (rd);                                   \
+                                  n++; }
 
-    if(PulseSeq.delay1_loop_counts>0)
-    {    
-        SetOutputVoltage(POSITIVE_VOLTAGE_MAX,PulseSeq.voltage_multiplication_factor);
-    
-        CX_Read(CX_ADC1, &ad_value_0_to_4095, 0);    
-        if(ad_value_0_to_4095 < ad_value_offset)
-        {
-            Readout.CAE1 = 0;
-            Readout.isOverloaded = 0;
-        }
-        else if (ad_value_0_to_4095 == 4095)
+    for(i=0; i<sequence->nbPhases; i++)
+    {
+        const Pulse_Phase_struct *phase = &sequence->phase[i];
+
+        if(phase->duration_microseconds>0)
         {
-            Readout.CAE1 = 0;
-            Readout.isOverloaded = 1;
-        }
-        else    
-        {        
-            Readout.CAE1 = (ad_value_0_to_4095 - ad_value_offset)/ad_value_reciproq_scale;    
-            Readout.isOverloaded = 0;
+            ADD_EDGE(phase->level, phase->duration_microseconds, phase->readCAE)
         }
-    
-        WHILE_DELAY_LOOP(PulseSeq.delay1_loop_counts)        
     }
-        
-    SetOutputVoltage(ZERO_VOLTAGE,PulseSeq.voltage_multiplication_factor);
+    ADD_EDGE(ZERO_VOLTAGE, 0, FALSE)
     
-    WHILE_DELAY_LOOP(PulseSeq.delay2_loop_counts)    
-   
-    if(PulseSeq.delay3_loop_counts>0)
-    {    
-        SetOutputVoltage(NEGATIVE_VOLTAGE_MAX,PulseSeq.voltage_multiplication_factor);
-        WHILE_DELAY_LOOP(PulseSeq.delay3_loop_counts)    
-    }
+#undef ADD_EDGE
+
+    config->nbEdges = n;    
     
-    SetOutputVoltage(ZERO_VOLTAGE,PulseSeq.voltage_multiplication_factor);                  
+    CompileWiperBurst(config);
     }   
 
 /*******************************************************************************
-* Function Name  : SetOutputVoltage
-* Description    : controls the MAX5439 digital potentiometer connected like this
-                    L ... negative voltage input (typ -10V)
-                    H ... positive voltage input (typ +10V)
-                    W ... output voltage (the wiper between L and H)
-                   MAX5439 has 128 taps so the control word has 7 bits.
+* Function Name  : CompileWiperBurst
+* Description    : Compiles the edge table into the DMA sources of the pulse timer
+                   
+                   Edge i ends timer period i. Period 0 (WIPER_PRIME_TICKS) is set up
+                   by PULSEENGINE_Start; period i+1 lasts the duration of edge i
+                   and is preloaded by the DMA burst at the update event ending period i-1,
+                   hence timerBurst[i] holds period i+1. The period after the last edge
+                   is the wait for the next sequence (set by PULSESCHEDULER_NextSequence,
+                   repeated by RCR for long waits); it keeps NSS high and writes no byte.
+                   timerBurst[nbEdges] is the prime period again, the DMA streams are
+                   circular, so the sequences follow each other without the CPU.
+                   The prime period is the same in all configurations: a new one is
+                   taken during the wait, from its period 1 on.
+                   
+                   In each period, NSS goes low WIPER_NSS_LEAD_TICKS before the end, the
+                   byte is written to SPI one tick later and NSS rises (= the wiper is set)
+                   at the update event. 
 
-* Input          : OutputVoltage_code oVcode
-*                  multiplication_factor : float from 0 to 1
+* Input          : Pulse_Config_struct *config
 * Return         : None
 *******************************************************************************/
-static void SetOutputVoltage(OutputVoltage_code oVcode,float multiplication_factor)
+static void CompileWiperBurst(Pulse_Config_struct *config)
     {
-  
-        static u8 controlByteForMAX5439=0;
-
-        volatile u32 nb_byteSent = 1;
+    u8 i;
+    u32 *burst;
+    u32 periodTicks;
+    u32 timerFrequency_Hz = PULSE_TIMER_FREQUENCY_HZ + config->appliedPpm;   // 1 ppm of 1MHz is 1Hz
+    
+    config->sequenceTicks = WIPER_PRIME_TICKS;
+    for(i=0; i<config->nbEdges; i++)
+    {
+        config->wiperBytes[i] = config->edgeTable[i].wiperCode;
         
-        switch(oVcode)
+        burst = config->timerBurst[i];
+        if(i+1 < config->nbEdges)
         {
-            case POSITIVE_VOLTAGE_MAX:      controlByteForMAX5439= 63 + 64*multiplication_factor;  break;
-            case POSITIVE_VOLTAGE_HALF:     controlByteForMAX5439= 63 + 32*multiplication_factor;  break; 
-            case ZERO_VOLTAGE:              controlByteForMAX5439= 63 ; break;
-            case NEGATIVE_VOLTAGE_HALF:     controlByteForMAX5439= 63 - 32*multiplication_factor;  break;  
-            case NEGATIVE_VOLTAGE_MAX:      controlByteForMAX5439= 63 - 63*multiplication_factor;  break;  
-                                                                        //IH150203 not absolutely exact, but OK
+            periodTicks = config->edgeTable[i].duration_ticks;
+            if(periodTicks < WIPER_MIN_PERIOD_TICKS)
+            {
+                periodTicks = WIPER_MIN_PERIOD_TICKS;
+            }
+            config->sequenceTicks += periodTicks;
+            burst[0] = periodTicks - 1;                                 // ARR
+            burst[1] = 0;                                               // RCR
+            burst[2] = periodTicks - WIPER_NSS_LEAD_TICKS;              // CCR1: NSS low
+            burst[3] = periodTicks - WIPER_NSS_LEAD_TICKS + 1;          // CCR2: byte to SPI
+            if(config->edgeTable[i].readCAE)
+            {
+                burst[4] = CAE_SAMPLE_DELAY_TICKS;                      // CCR3: start CAE sampling
+                burst[5] = periodTicks - WIPER_NSS_LEAD_TICKS;          // CCR4: stop it before the next edge
+            }
+            else
+            {
+                burst[4] = PULSE_TIMER_NEVER;
+                burst[5] = PULSE_TIMER_NEVER;
+            }
         }
+        else
+        {
+            burst[0] = WIPER_MIN_PERIOD_TICKS - 1;                      // ARR, RCR: PULSESCHEDULER_NextSequence
+            burst[1] = 0;
+            burst[2] = PULSE_TIMER_NEVER;
+            burst[3] = PULSE_TIMER_NEVER;
+            burst[4] = PULSE_TIMER_NEVER;
+            burst[5] = PULSE_TIMER_NEVER;
+        }
+    }
     
-        CX_Write(CX_GPIO_PIN8,CX_GPIO_LOW,0);     
-
-        CX_Write(CX_SPI,&controlByteForMAX5439,&nb_byteSent);
-        CX_Write(CX_GPIO_PIN8,CX_GPIO_HIGH,0);  //IH141230 this rising edge of the NSS signal actually sets the wiper 
-                                                // (see MAX5439 datasheet)
-    
-        //IH140912 we do not wait for end of the transmission here, neither do we check the success
+    burst = config->timerBurst[config->nbEdges];
+    burst[0] = WIPER_PRIME_TICKS - 1;
+    burst[1] = 0;
+    burst[2] = WIPER_PRIME_TICKS - WIPER_NSS_LEAD_TICKS;
+    burst[3] = WIPER_PRIME_TICKS - WIPER_NSS_LEAD_TICKS + 1;
+    burst[4] = PULSE_TIMER_NEVER;
+    burst[5] = PULSE_TIMER_NEVER;
     
+    // the sequences must not overlap: above this rate they are started late
+    config->maxFrequency_Hz = timerFrequency_Hz / (config->sequenceTicks + WIPER_MIN_PERIOD_TICKS);
+    config->phaseModulus = (config->frequency_Hz < config->maxFrequency_Hz) ? config->frequency_Hz : config->maxFrequency_Hz;
+    config->periodTicks = timerFrequency_Hz / config->phaseModulus;
+    config->phaseIncrement = timerFrequency_Hz % config->phaseModulus;
     }
 
 /*******************************************************************************
-* Function Name  : GUI
-* Description    : GUI management
+* Function Name  : PULSEENGINE_Publish
+* Description    : Compiles the settings into the configuration the pulse engine does
+                   not play and publishes it (PulseSeq.nextConfig); the pulse engine 
+                   takes it in the wait between two sequences (PULSEENGINE_SequenceDone,
+                   PULSEENGINE_TakeInWait) or at its start. Each setting is read once, so the menu handlers and the
+                   serial commands may change them meanwhile: the configuration is
+                   then compiled again. STIMULATOR_Handler, or the RX interrupt of
+                   the serial commands when it does not preempt it (isPublishing).
+                   It returns at once while the previous configuration is not taken
+                   (nextConfig), as it would compile over that one; the settings
+                   stay pending (isCompilePending).
+* Input          : None
+* Return         : None
+*******************************************************************************/
+static void PULSEENGINE_Publish(void)
+    {
+    Pulse_Config_struct *config = (PulseSeq.config == &PulseSeq.configs[0]) ? &PulseSeq.configs[1] : &PulseSeq.configs[0];
+    
+    if(PulseSeq.nextConfig)                                 // not taken yet: the other one is not free
+        {
+#ifdef STIM32_HOST
+        HOST_RefusePublish();
+#endif
+        return;                                             // still pending, for the next call
+        }
+    
+    PulseSeq.isCompilePending = FALSE;
+    config->frequency_Hz = PulseSeq.frequency_Hz;
+    config->pulseSeq = PulseSeq.pulseSeq;
+    config->voltageFactor = PulseSeq.voltageFactor;
+    config->appliedPpm = TimerCalibration.appliedPpm;
+    CompilePulseEdgeTable(config);
+    COMMAND_Published(config);
+    
+    MEMORY_BARRIER();                                       // the tables before the pointer
+    PulseSeq.nextConfig = config;
+    PULSEENGINE_RequestTake();                              // during a wait, taken right away
+    }
+
+/*******************************************************************************
+* Function Name  : PULSEENGINE_TakeWiperRefresh
+* Description    : Copies the wiper codes refreshed by BATTERY_RefreshWiperCodes into
+                   the DMA source. Called from the wiper DMA interrupt, between the
+                   last edge of a sequence and the first byte of the next one, so
+                   a sequence is played with either the old or the new codes, never a mix.
+                   Codes refreshed for a configuration replaced meanwhile are dropped,
+                   the settings are compiled again with the new voltage factor.
+* Input          : None
+* Return         : None
+*******************************************************************************/
+static void PULSEENGINE_TakeWiperRefresh(void)
+    {
+    Pulse_Config_struct *config = PulseSeq.config;
+    
+    if(!PulseSeq.isWiperRefreshPending) return;
+    
+    if(PulseSeq.refreshConfig == config)
+        {
+        memcpy(config->wiperBytes, PulseSeq.refreshedWiperBytes, config->nbEdges);
+        config->voltageFactor = PulseSeq.refreshedVoltageFactor;
+        }
+    else
+        {
+        PulseSeq.isCompilePending = TRUE;
+        }
+    PulseSeq.isWiperRefreshPending = FALSE;
+    }
+
+/*******************************************************************************
+* Function Name  : PULSEENGINE_RefreshWiperCodes
+* Description    : Recomputes the wiper codes of the played configuration for a new 
+                   voltage factor and hands them to the running pulse engine 
+                   (PULSEENGINE_TakeWiperRefresh); the configuration itself is only
+                   read here. Called by one context at a time: the main loop in
+                   voltage mode, STIMULATOR_Handler in constant current mode.
+* Input          : u16 voltageFactor (Q12)
+* Return         : FALSE if a new configuration or the previous refresh is still pending
+*******************************************************************************/
+static bool PULSEENGINE_RefreshWiperCodes(u16 voltageFactor)
+    {
+    Pulse_Config_struct *config = PulseSeq.config;
+    bool isChanged = FALSE;
+    u8 i;
+    
+    if(PulseSeq.isCompilePending || PulseSeq.nextConfig || PulseSeq.isWiperRefreshPending || config == 0) return FALSE;
+    
+    PulseSeq.voltageFactor = voltageFactor;
+    for(i=0; i<config->nbEdges; i++)
+        {
+        u8 wiperCode = GetWiperCode(config->edgeTable[i].level, voltageFactor);
+        
+        if(wiperCode != config->wiperBytes[i]) isChanged = TRUE;
+        PulseSeq.refreshedWiperBytes[i] = wiperCode;
+        }
+    if(isChanged)
+        {
+        PulseSeq.refreshedVoltageFactor = voltageFactor;
+        PulseSeq.refreshConfig = config;
+        MEMORY_BARRIER();                                   // the bytes before the flag
+        PulseSeq.isWiperRefreshPending = TRUE;
+        }
+    return TRUE;
+    }
+
+/*******************************************************************************
+* Function Name  : PULSESCHEDULER_NextSequence
+* Description    : Sets the wait after the last edge so that the sequences start at the
+                   exact rate: a sequence period is timerFrequency/frequency ticks, the
+                   integer part (periodTicks) plus a fraction accumulated in phase.
+                   When the phase accumulator overflows (DDS, modulo the frequency), the
+                   period gets one tick more. The starts are spaced evenly to one tick
+                   and, for an integer rate in Hz, the average rate is exact.
+                   A wait longer than the 16 bit timer is repeated by RCR; the ticks
+                   it misses (less than the number of repetitions) are carried over
+                   to the next wait.
+                   
+                   Called once per sequence from the wiper DMA interrupt, one sequence
+                   ahead: the wait of the running sequence is already loaded.
+                   While a new configuration is pending, the wait is made long enough
+                   to take it (PULSE_SWAP_MIN_TICKS); the sequences after it are
+                   delayed by as much.
+* Input          : None
+* Return         : None
+*******************************************************************************/
+static void PULSESCHEDULER_NextSequence(void)
+    {
+    Pulse_Config_struct *config = PulseSeq.config;
+    u32 *burst = config->timerBurst[config->nbEdges-1];
+    s32 waitTicks = config->periodTicks - config->sequenceTicks + PulseScheduler.carryTicks;
+    u32 nbRepetitions;
+    
+    PulseScheduler.lastPhase = PulseScheduler.phase;
+    PulseScheduler.lastCarryTicks = PulseScheduler.carryTicks;
+    PulseScheduler.phase += config->phaseIncrement;
+    if(PulseScheduler.phase >= config->phaseModulus)
+        {
+        PulseScheduler.phase -= config->phaseModulus;
+        waitTicks++;
+        }
+    
+    if(waitTicks < WIPER_MIN_PERIOD_TICKS)
+        {
+        // rate above the limit (the sequence was compiled for another timer calibration)
+        waitTicks = WIPER_MIN_PERIOD_TICKS;
+        Profiler.nbLateSequences++;
+        }
+    if(PulseSeq.nextConfig && waitTicks < PULSE_SWAP_MIN_TICKS)
+        {
+        waitTicks = PULSE_SWAP_MIN_TICKS;
+        PulseScheduler.nbDelayedSwaps++;
+        }
+    PulseScheduler.waitTicks = waitTicks;
+    nbRepetitions = (waitTicks + PULSE_TIMER_MAX_PERIOD_TICKS - 1) / PULSE_TIMER_MAX_PERIOD_TICKS;
+    if(nbRepetitions > PULSE_TIMER_MAX_REPETITIONS) nbRepetitions = PULSE_TIMER_MAX_REPETITIONS;
+    
+    burst[0] = waitTicks / nbRepetitions - 1;                   // ARR
+    burst[1] = nbRepetitions - 1;                               // RCR
+    PulseScheduler.carryTicks = waitTicks - (burst[0] + 1) * nbRepetitions;
+    }
+
+/*******************************************************************************
+* Function Name  : PULSESCHEDULER_WaitLeft
+* Description    : The wait before the first sequence of a configuration about to be
+                   taken, elapsedTicks into the running wait. A faster rate applies
+                   from the last sequence start: the wait is ended one period of the
+                   new configuration after it, if that comes first, but leaves the
+                   time to point the streams at it (PULSE_SWAP_MIN_TICKS). A wait
+                   repeated by RCR runs to its end.
+                   Called from the wiper DMA interrupt, before the configuration is taken.
+* Input          : Pulse_Config_struct *config, u32 elapsedTicks
+* Return         : pulse timer ticks to the end of the wait
+*******************************************************************************/
+static u32 PULSESCHEDULER_WaitLeft(const Pulse_Config_struct *config, u32 elapsedTicks)
+    {
+    const Pulse_Config_struct *previous = PulseSeq.config;
+    u32 waitLeftTicks = PulseScheduler.runningWaitTicks - elapsedTicks;
+    s32 periodLeftTicks = (s32)config->periodTicks - (s32)previous->sequenceTicks - (s32)elapsedTicks;
+    
+    if(config->periodTicks >= previous->periodTicks || PulseScheduler.runningWaitTicks > PULSE_TIMER_MAX_PERIOD_TICKS)
+        {
+        return waitLeftTicks;
+        }
+    if(periodLeftTicks < PULSE_SWAP_MIN_TICKS) periodLeftTicks = PULSE_SWAP_MIN_TICKS;
+    if((u32)periodLeftTicks >= waitLeftTicks) return waitLeftTicks;
+    
+    PULSEENGINE_EndWaitIn(periodLeftTicks);
+    PulseScheduler.runningWaitTicks = elapsedTicks + periodLeftTicks;
+    return periodLeftTicks;
+    }
+
+/*******************************************************************************
+* Function Group : CAE acquisition
+* Description    : During the positive phase (CC3 to CC4 of the pulse timer) ADC1
+                   converts continuously into CaeWindow.samples by DMA. The interrupts
+                   only start and stop the conversions; CAE_Decimate runs from
+                   STIMULATOR_Handler and filters the window to one CAE value:
+                   the mean without the lowest and the highest sample.
+                   The readout is overloaded if at least half of the samples saturate.
+                   
+                   In the host build, the samples come from HOST_SetAdcSource() (or
+                   CX_Read if none is set), one each HOST_CAE_SAMPLE_PERIOD_TICKS.
+*******************************************************************************/
+static void CAE_Decimate(void)
+    {
+    u32 i;
+    u32 nbSamples = CaeWindow.nbSamples;
+    u32 sum = 0, nbSaturated = 0;
+    u16 min = CAE_AD_VALUE_MAX, max = 0;
+    u32 ad_value_0_to_4095;
+    
+    if(nbSamples == 0)
+    {
+        CaeWindow.isComplete = FALSE;
+        return;
+    }
+    
+    for(i=0; i<nbSamples; i++)
+    {
+        u16 sample = CaeWindow.samples[i];
+        
+        sum += sample;
+        if(sample < min) min = sample;
+        if(sample > max) max = sample;
+        if(sample >= CAE_AD_VALUE_MAX) nbSaturated++;
+    }
+    if(nbSamples > 2)
+    {
+        sum -= (u32)min + max;
+        ad_value_0_to_4095 = sum / (nbSamples - 2);
+    }
+    else
+    {
+        ad_value_0_to_4095 = sum / nbSamples;
+    }
+    
+        if(2*nbSaturated >= nbSamples)
+        {
+            Readout.CAE1 = 0;
+            Readout.isOverloaded = 1;
+        }
+        else if(ad_value_0_to_4095 < CaeCalibration.ad_value_offset)
+        {
+            Readout.CAE1 = 0;
+            Readout.isOverloaded = 0;
+        }
+        else    
+        {        
+            Readout.CAE1 = (ad_value_0_to_4095 - CaeCalibration.ad_value_offset)/CaeCalibration.ad_value_reciproq_scale;    
+            Readout.isOverloaded = 0;
+        }
+    
+    CaeWindow.isComplete = FALSE;           // the samples may be overwritten from now on
+    }   
+
+#ifndef STIM32_HOST
+
+static void CAE_Init(void)
+    {
+    u32 channel = CAE_ADC->SQR3 & 0x1F;        // the channel selected by CX_Configure(CX_ADC1)
+    
+    if(channel < 10)
+        {
+        CAE_ADC->SMPR2 = (CAE_ADC->SMPR2 & ~(7 << (channel*3))) | (CAE_ADC_SAMPLE_TIME << (channel*3));
+        }
+    else
+        {
+        CAE_ADC->SMPR1 = (CAE_ADC->SMPR1 & ~(7 << ((channel-10)*3))) | (CAE_ADC_SAMPLE_TIME << ((channel-10)*3));
+        }
+    
+    CAE_ADC_DMA->CR = 0;
+    CAE_ADC_DMA->PAR = (u32)&CAE_ADC->DR;
+    CAE_ADC_DMA->M0AR = (u32)CaeWindow.samples;
+    CAE_ADC_DMA->CR = DMA_CHANNEL_0 | DMA_SxCR_MINC | DMA_SxCR_MSIZE_0 | DMA_SxCR_PSIZE_0;
+    }
+
+static void CAE_StartSampling(void)
+    {
+    if(CaeWindow.isComplete) return;        // the last window is not decimated yet (more sequences than SysTicks)
+    CaeWindow.isSampling = TRUE;
+    
+    DMA2->LIFCR = CAE_ADC_DMA_FLAGS;
+    CAE_ADC_DMA->NDTR = CAE_MAX_SAMPLES;
+    CAE_ADC_DMA->CR |= DMA_SxCR_EN;
+    
+    CAE_ADC->SR = 0;
+    CAE_ADC->CR2 |= ADC_CR2_CONT | ADC_CR2_DMA;
+    CAE_ADC->CR2 |= ADC_CR2_SWSTART;
+    }
+
+static void CAE_StopSampling(void)
+    {
+    if(!CaeWindow.isSampling) return;
+    CaeWindow.isSampling = FALSE;
+    
+    CAE_ADC->CR2 &= ~(ADC_CR2_CONT | ADC_CR2_DMA);
+    CAE_ADC_DMA->CR &= ~DMA_SxCR_EN;
+    
+    CaeWindow.nbSamples = CAE_MAX_SAMPLES - CAE_ADC_DMA->NDTR;
+    CaeWindow.isComplete = TRUE;
+    }
+
+#else // STIM32_HOST
+
+static u16 (*HOST_AdcSource)(u32 time);
+static u32 HOST_SamplingStartTime;
+
+void HOST_SetAdcSource(u16 (*source)(u32 time))
+    {
+    HOST_AdcSource = source;
+    }
+
+static void CAE_Init(void)
+    {
+    }
+
+static void CAE_StartSampling(void)
+    {
+    if(CaeWindow.isComplete) return;
+    CaeWindow.isSampling = TRUE;
+    HOST_SamplingStartTime = HOST_PulseTimerNow();
+    }
+
+static void CAE_StopSampling(void)
+    {
+    u32 time = HOST_SamplingStartTime;
+    u32 n = 0;
+    u32 ad_value_0_to_4095;
+    
+    if(!CaeWindow.isSampling) return;
+    CaeWindow.isSampling = FALSE;
+    
+    while(n < CAE_MAX_SAMPLES && (s32)(HOST_PulseTimerNow() - time) >= HOST_CAE_SAMPLE_PERIOD_TICKS)
+        {
+        time += HOST_CAE_SAMPLE_PERIOD_TICKS;                   // conversion complete
+        if(HOST_AdcSource)
+            {
+            ad_value_0_to_4095 = HOST_AdcSource(time);
+            }
+        else
+            {
+            CX_Read(CX_ADC1, &ad_value_0_to_4095, 0);
+            }
+        CaeWindow.samples[n++] = ad_value_0_to_4095;
+        }
+    CaeWindow.nbSamples = n;
+    CaeWindow.isComplete = TRUE;
+    }
+
+#endif // STIM32_HOST
+
+/*******************************************************************************
+* Function Name  : GetWiperCode
+* Description    : computes the control byte of the MAX5439 digital potentiometer
+                   connected like this
+                    L ... negative voltage input (typ -10V)
+                    H ... positive voltage input (typ +10V)
+                    W ... output voltage (the wiper between L and H)
+                   MAX5439 has 128 taps so the control word has 7 bits.
+                   
+                   Called at configuration time (CompilePulseEdgeTable) and once a 
+                   second at most by BATTERY_RefreshWiperCodes; the edges just send 
+                   the precomputed byte.
+
+* Input          : OutputVoltage_code oVcode
+*                  voltageFactor : Q12, 0 to Q12_ONE
+* Return         : u8 control byte
+*******************************************************************************/
+static u8 GetWiperCode(OutputVoltage_code oVcode,u16 voltageFactor)
+    {
+        u8 controlByteForMAX5439 = MAX5439_ZERO_VOLTAGE_CODE;
+        
+        switch(oVcode)
+        {
+            case POSITIVE_VOLTAGE_MAX:      controlByteForMAX5439= 63 + Q12_Scale(64, voltageFactor);  break;
+            case POSITIVE_VOLTAGE_HALF:     controlByteForMAX5439= 63 + Q12_Scale(32, voltageFactor);  break; 
+            case ZERO_VOLTAGE:              controlByteForMAX5439= 63 ; break;
+            case NEGATIVE_VOLTAGE_HALF:     controlByteForMAX5439= 63 - Q12_Scale(32, voltageFactor);  break;  
+            case NEGATIVE_VOLTAGE_MAX:      controlByteForMAX5439= 63 - Q12_Scale(63, voltageFactor);  break;  
+                                                                        //IH150203 not absolutely exact, but OK
+        }
+        return controlByteForMAX5439;
+    }
+
+/*******************************************************************************
+* Function Name  : WIPER_CheckWiring
+* Description    : Checks the CX pin map of CircleOS against the wiring the pulse
+                   engine assumes: CX PIN8 (the NSS of the MAX5439) must be PC6, which
+                   the pulse engine hands over to TIM8_CH1, and CX_SPI must be
+                   WIPER_SPI, the SPI the wiper byte DMA writes to.
+                   PIN8 is driven low and high through CircleOS and read back from
+                   the PC6 output register; the SPI must be configured as master.
+                   Called after CX_Configure of both, before PULSEENGINE_Init.
+* Input          : None
+* Return         : FALSE if the board needs rewiring (see WIPER_SPI)
+*******************************************************************************/
+#ifndef STIM32_HOST
+
+static bool WIPER_CheckWiring(void)
+    {
+    bool isNssOnTimer;
+
+    CX_Write(CX_GPIO_PIN8, CX_GPIO_LOW, 0);
+    isNssOnTimer = (WIPER_NSS_GPIO->ODR & (1 << WIPER_NSS_PIN)) == 0;
+    CX_Write(CX_GPIO_PIN8, CX_GPIO_HIGH, 0);
+    isNssOnTimer = isNssOnTimer && (WIPER_NSS_GPIO->ODR & (1 << WIPER_NSS_PIN)) != 0;
+
+    return isNssOnTimer && (WIPER_SPI->CR1 & SPI_CR1_MSTR);
+    }
+
+#else // STIM32_HOST
+
+/* the simulated CX connector is wired as the pulse engine assumes */
+static bool WIPER_CheckWiring(void)
+    {
+    return TRUE;
+    }
+
+#endif // STIM32_HOST
+
+/*******************************************************************************
+* Function Name  : SetWiper
+* Description    : sends the control byte to the MAX5439
+* Input          : u8 wiperCode
+* Return         : None
+*******************************************************************************/
+static void SetWiper(u8 wiperCode)
+    {
+        static u8 controlByteForMAX5439;
+
+        volatile u32 nb_byteSent = 1;
+        
+        controlByteForMAX5439 = wiperCode;
+    
+        CX_Write(CX_GPIO_PIN8,CX_GPIO_LOW,0);     
+
+        CX_Write(CX_SPI,&controlByteForMAX5439,&nb_byteSent);
+        CX_Write(CX_GPIO_PIN8,CX_GPIO_HIGH,0);  //IH141230 this rising edge of the NSS signal actually sets the wiper 
+                                                // (see MAX5439 datasheet)
+    
+        //IH140912 we do not wait for end of the transmission here, neither do we check the success
+    
+    }
+
+/*******************************************************************************
+* Function Group : Fixed point
+* Description    : Q12 numbers (12 fraction bits) for all the runtime scaling, so no
+                   float math runs on the target. Products and quotients are computed
+                   in 32 bits; instead of wrapping, they saturate at the largest value.
+                   The results are truncated, as the float to integer conversions 
+                   they replace.
+*******************************************************************************/
+
+/* a * b, both Q12: a is split into its integer and fraction parts, b into its 
+   integer and fraction parts for the fraction of a, so no partial product wraps */
+static u32 Q12_Mul(u32 a, u32 b)
+    {
+    u32 aInteger = a >> Q12_SHIFT;
+    u32 aFraction = a & (Q12_ONE-1);
+    u32 low = aFraction * (b >> Q12_SHIFT) + ((aFraction * (b & (Q12_ONE-1))) >> Q12_SHIFT);
+    
+    if(aInteger != 0 && b > 0xFFFFFFFF / aInteger)      return 0xFFFFFFFF;
+    if(aInteger * b > 0xFFFFFFFF - low)                 return 0xFFFFFFFF;
+    return aInteger * b + low;
+    }
+
+/* integer x times a Q12 factor, toward zero */
+static s32 Q12_Scale(s32 x, u32 factor)
+    {
+    u32 magnitude = Q12_Mul((x < 0) ? -(u32)x : (u32)x, factor);
+    
+    if(magnitude > 0x7FFFFFFF) magnitude = 0x7FFFFFFF;
+    return (x < 0) ? -(s32)magnitude : (s32)magnitude;
+    }
+
+/* num / den as Q12, both integers: the fraction bits by long division of the remainder */
+static u32 Q12_Div(u32 num, u32 den)
+    {
+    u32 quotient, remainder;
+    u8 i;
+    
+    if(den == 0 || num / den > 0xFFFFFFFF >> Q12_SHIFT)
+        {
+        return 0xFFFFFFFF;
+        }
+    quotient = num / den;
+    remainder = num % den;
+    for(i=0; i<Q12_SHIFT; i++)
+        {
+        bool isCarry = remainder >> 31;
+        
+        remainder <<= 1;
+        quotient <<= 1;
+        if(isCarry || remainder >= den)
+            {
+            remainder -= den;
+            quotient |= 1;
+            }
+        }
+    return quotient;
+    }
+
+static u32 Q12_Limit(u32 x, u32 max)
+    {
+    return (x > max) ? max : x;
+    }
+
+#ifdef STIM32_HOST
+
+/*******************************************************************************
+* Function Name  : HOST_CheckFixedPoint
+* Description    : The fixed point scaling against its float reference, for the host 
+                   harness: wiper codes, battery compensation and strip chart heights
+                   over their whole input ranges, and the saturation
+* Input          : None
+* Return         : u32 number of cases out of tolerance; the counts and the largest
+                   deviations (in LSB of the result) through the pointers
+*******************************************************************************/
+u32 HOST_CheckFixedPoint(u32 *nbCases, u32 *maxWiperError, u32 *maxFactorError, u32 *maxBarError)
+    {
+    static const OutputVoltage_code levels[] = 
+        { POSITIVE_VOLTAGE_MAX, POSITIVE_VOLTAGE_HALF, ZERO_VOLTAGE, NEGATIVE_VOLTAGE_HALF, NEGATIVE_VOLTAGE_MAX };
+    static const double levelSpan[] = { 64, 32, 0, -32, -63 };
+    static const double peakFraction[] = { 0, 8.0/8.0, 6.0/8.0, 4.0/8.0 };      // PulsePeakVoltage_code
+    Battery_Model_struct battery = Battery;
+    PulsePeakVoltage_code peakVoltage = PulseSeq.peakVoltage;
+    u32 nbFailures = 0;
+    u32 factor, mV, cae, i;
+    
+#define CHECK_DEVIATION(result, reference, tolerance, maxError) \
+    { double deviation = (double)(result) - (reference); u32 e; \
+      if(deviation < 0) deviation = -deviation; \
+      e = (u32)(deviation + 0.999); \
+      if(e > *(maxError)) *(maxError) = e; \
+      if(deviation > (tolerance)) nbFailures++; \
+      (*nbCases)++; }
+    
+    *nbCases = *maxWiperError = *maxFactorError = *maxBarError = 0;
+    
+    // wiper codes: exact, as the float code truncated
+    for(factor=0; factor<=Q12_ONE; factor++)
+        {
+        for(i=0; i<sizeof(levels)/sizeof(levels[0]); i++)
+            {
+            double reference = 63 + (s32)(levelSpan[i] * factor / Q12_ONE);
+            CHECK_DEVIATION(GetWiperCode(levels[i], factor), reference, 0, maxWiperError)
+            }
+        }
+    
+    // battery compensation over the battery range: within 2 LSB of Q12
+    for(PulseSeq.peakVoltage=PULSEPEAKVOLTAGE_8V; PulseSeq.peakVoltage<=PULSEPEAKVOLTAGE_4V; PulseSeq.peakVoltage++)
+        {
+        for(mV=3000; mV<=4500; mV++)
+            {
+            double reference = peakFraction[PulseSeq.peakVoltage] * NOMINAL_BATTERY_VOLTAGE_MV / mV;
+            
+            Battery.mV = mV;
+            CHECK_DEVIATION(BATTERY_GetVoltageFactor(), (reference > 1.0 ? 1.0 : reference) * Q12_ONE, 2, maxFactorError)
+            }
+        }
+    
+    // strip chart: within a pixel of the float 0.15 scaling
+    for(cae=0; cae<=4095; cae++)
+        {
+        CHECK_DEVIATION(Q12_Scale(cae, READOUT_Y_SCALE), (u32)(cae * 0.15), 1, maxBarError)
+        }
+    
+    // saturation instead of wrapping
+    if(Q12_Mul(0xFFFFFFFF, 2*Q12_ONE) != 0xFFFFFFFF)         nbFailures++;
+    if(Q12_Mul(0x10000000, 0x10000000) != 0xFFFFFFFF)        nbFailures++;
+    if(Q12_Mul(0x80000000, Q12_ONE/2) != 0x40000000)         nbFailures++;
+    if(Q12_Scale(-1000, Q12_RATIO(1, 2)) != -500)            nbFailures++;
+    if(Q12_Scale(0x7FFFFFFF, 2*Q12_ONE) != 0x7FFFFFFF)       nbFailures++;
+    if(Q12_Div(1, 0) != 0xFFFFFFFF)                          nbFailures++;
+    if(Q12_Div(0x00100000, 1) != 0xFFFFFFFF)                 nbFailures++;
+    if(Q12_Div(4020, 4100) != (u32)(4020.0 / 4100 * Q12_ONE)) nbFailures++;
+    *nbCases += 8;
+    
+#undef CHECK_DEVIATION
+    
+    Battery = battery;
+    PulseSeq.peakVoltage = peakVoltage;
+    return nbFailures;
+    }
+
+#endif // STIM32_HOST
+
+/*******************************************************************************
+* Function Group : Battery model
+* Description    : The pulse voltage is compensated for the battery voltage. The
+                   battery is sampled every second and low-pass filtered (first order,
+                   integer), so the load steps of the stimulation and the ADC noise do
+                   not move the wiper codes. When the filtered voltage changes the codes,
+                   they are refreshed in the running pulse engine at the next sequence
+                   boundary (PULSEENGINE_TakeWiperRefresh).
+*******************************************************************************/
+#ifdef STIM32_HOST
+
+/* battery model figures, for the host harness */
+void HOST_GetBatteryModel(u16 *mV, u16 *voltageFactor, u32 *nbRefreshes, u32 *nb8VChanges)
+    {
+    *mV = Battery.mV;
+    *voltageFactor = PulseSeq.voltageFactor;
+    *nbRefreshes = Battery.nbRefreshes;
+    *nb8VChanges = Battery.nb8VChanges;
+    }
+
+#endif // STIM32_HOST
+
+static void BATTERY_Init(u16 sample_mV)
+    {
+    memset(&Battery, 0, sizeof(Battery));
+    Battery.filtered_mV = (u32)sample_mV << BATTERY_FILTER_FRACTION_BITS;
+    Battery.mV = sample_mV;
+    Battery.is8VAvailable = (sample_mV >= LIMIT_FOR8V_BATTERY_VOLTAGE_MV);
+    }
+
+/*******************************************************************************
+* Function Name  : BATTERY_Update
+* Description    : Called every second with a new sample of the battery voltage
+* Input          : u16 sample_mV
+* Return         : None
+*******************************************************************************/
+static void BATTERY_Update(u16 sample_mV)
+    {
+    s32 error = ((s32)sample_mV << BATTERY_FILTER_FRACTION_BITS) - (s32)Battery.filtered_mV;
+    bool is8VAvailable = Battery.is8VAvailable;
+    
+    Battery.filtered_mV += error >> BATTERY_FILTER_SHIFT;
+    Battery.mV = (Battery.filtered_mV + (1 << (BATTERY_FILTER_FRACTION_BITS-1))) >> BATTERY_FILTER_FRACTION_BITS;
+    
+    if(is8VAvailable && Battery.mV < LIMIT_FOR8V_BATTERY_VOLTAGE_MV)
+        {
+        is8VAvailable = FALSE;
+        }
+    else if(!is8VAvailable && Battery.mV >= LIMIT_FOR8V_BATTERY_VOLTAGE_MV + BATTERY_8V_HYSTERESIS_MV)
+        {
+        is8VAvailable = TRUE;
+        }
+    if(is8VAvailable != Battery.is8VAvailable)
+        {
+        Battery.is8VAvailable = is8VAvailable;
+        Battery.nb8VChanges++;
+        }
+    
+    BATTERY_RefreshWiperCodes();
+    }
+
+/*******************************************************************************
+* Function Name  : BATTERY_GetVoltageFactor
+* Description    : Peak voltage setting (of 8V) compensated for the model battery 
+                   voltage; the wiper cannot go beyond its ends, so the factor is 
+                   limited to 1
+* Input          : None
+* Return         : u16 voltage factor, Q12
+*******************************************************************************/
+static u16 BATTERY_GetVoltageFactor(void)
+    {
+    u32 peak = Q12_ONE;
+    
+    switch(PulseSeq.peakVoltage)
+    {
+        case PULSEPEAKVOLTAGE_8V:   peak = Q12_RATIO(8, 8);     break;
+        case PULSEPEAKVOLTAGE_6V:   peak = Q12_RATIO(6, 8);     break;
+        case PULSEPEAKVOLTAGE_4V:   peak = Q12_RATIO(4, 8);     break;
+    }
+    return Q12_Limit(Q12_Mul(peak, Q12_Div(NOMINAL_BATTERY_VOLTAGE_MV, Battery.mV)), Q12_ONE);
+    }
+
+/*******************************************************************************
+* Function Name  : BATTERY_RefreshWiperCodes
+* Description    : Voltage mode: the wiper codes follow the model battery voltage.
+                   If the refresh cannot be taken now, it is tried again at the next second.
+* Input          : None
+* Return         : None
+*******************************************************************************/
+static void BATTERY_RefreshWiperCodes(void)
+    {
+    u16 voltageFactor = BATTERY_GetVoltageFactor();
+    
+    if(CurrentControl.target) return;                       // the current loop follows the battery
+    if(voltageFactor == PulseSeq.voltageFactor) return;
+    
+    if(PULSEENGINE_RefreshWiperCodes(voltageFactor))
+        {
+        Battery.nbRefreshes++;
+        }
+    }
+
+/*******************************************************************************
+* Function Group : Constant current
+* Description    : In constant current mode, a PI controller sets the voltage factor
+                   so the CAE readout tracks CurrentControl.target while the skin 
+                   impedance changes. It runs in STIMULATOR_Handler once per readout
+                   (integer math, a few dozen cycles); the new wiper codes are taken
+                   by the pulse engine at the next sequence boundary.
+                   The output stays between CURRENT_MIN_FACTOR and the peak voltage 
+                   setting and changes by CURRENT_MAX_SLEW per sequence at most.
+                   Without contact, the output goes back to the peak voltage, which
+                   the contact detection relies on.
+*******************************************************************************/
+#ifdef STIM32_HOST
+
+/* controller figures, for the host harness */
+void HOST_GetCurrentControl(u16 *target, u32 *nbUpdates, u32 *nbLimited, u32 *sumAbsError)
+    {
+    *target = CurrentControl.target;
+    *nbUpdates = CurrentControl.nbUpdates;
+    *nbLimited = CurrentControl.nbLimited;
+    *sumAbsError = CurrentControl.sumAbsError;
+    }
+
+#endif // STIM32_HOST
+
+static void CURRENT_Control(void)
+    {
+    s32 limit = BATTERY_GetVoltageFactor();
+    s32 output = PulseSeq.voltageFactor;
+    s32 desired, error = 0;
+    bool isControlled = FALSE;
+    
+    if(StimState != STIMSTATE_RUN && StimState != STIMSTATE_WAITING_FOR_IDLE)
+        {
+        desired = limit;                                    // open loop until the contact is there
+        CurrentControl.integrator = output;                 // bumpless start from the present output
+        }
+    else if(Readout.isOverloaded)
+        {
+        desired = output - CURRENT_MAX_SLEW;
+        }
+    else
+        {
+        error = (s32)CurrentControl.target - (s32)Readout.CAE1;
+        CurrentControl.integrator += CURRENT_KI * error;
+        if(CurrentControl.integrator > limit)               CurrentControl.integrator = limit;
+        if(CurrentControl.integrator < CURRENT_MIN_FACTOR)  CurrentControl.integrator = CURRENT_MIN_FACTOR;
+        desired = CurrentControl.integrator + CURRENT_KP * error;
+        
+        isControlled = TRUE;
+        CurrentControl.nbUpdates++;
+        CurrentControl.sumAbsError += (error < 0) ? -error : error;
+        }
+    
+    if(desired > limit || desired < CURRENT_MIN_FACTOR
+       || desired > output + CURRENT_MAX_SLEW || desired < output - CURRENT_MAX_SLEW)
+        {
+        if(desired > limit)                         desired = limit;
+        if(desired < CURRENT_MIN_FACTOR)            desired = CURRENT_MIN_FACTOR;
+        if(desired > output + CURRENT_MAX_SLEW)     desired = output + CURRENT_MAX_SLEW;
+        if(desired < output - CURRENT_MAX_SLEW)     desired = output - CURRENT_MAX_SLEW;
+        if(isControlled)
+            {
+            CurrentControl.integrator = desired - CURRENT_KP * error;       // anti-windup: back-calculation
+            CurrentControl.nbLimited++;
+            }
+        }
+    
+    if(desired != output)
+        {
+        PULSEENGINE_RefreshWiperCodes(desired);             // else at the next sequence
+        }
+    }
+
+/*******************************************************************************
+* Function Group : Contact detection
+* Description    : The RUN/IDLE state follows a statistic of a sliding window of
+                   CAE readouts, one sample per readout, with a hysteresis: RUN is
+                   entered when the statistic has been >= the Run limit for hold
+                   consecutive samples, and left when it has been <= the Idle limit,
+                   below the Run limit, as long. The WAITING states are the samples
+                   held; a sample back inside the band ends them.
+
+                   The statistics are plugged in by ContactStatisticTable. Each sample
+                   costs O(1) whatever the window: the window keeps its sum and how
+                   many of its samples are at or beyond each limit, so the median is
+                   compared with a limit without being computed (it is >= the limit
+                   when most samples are). A lone outlier is one vote of the window:
+                   it moves the median by one sample at most.
+
+                   Latency: after a step of the readouts across both limits, the
+                   transition comes at the settle + hold - 1th sample at most, settle
+                   being 1 sample for Last, the window for Mean (a step to well beyond
+                   the limit settles sooner) and (window+1)/2 for Median; each outlier
+                   in the window may add a sample. There is one readout per sequence,
+                   one per SysTick at most: 6 samples of Median 9/2 are 6ms at 1kHz,
+                   120ms at 50Hz. CONTACT_GetLatencyBound is checked by the host build.
+*******************************************************************************/
+static void CONTACT_Init(Contact_Detector_struct *contact, u8 statistic, u8 window, u8 hold, u16 runLimit, u16 idleLimit)
+    {
+    memset(contact, 0, sizeof(*contact));
+    contact->statistic = statistic;
+    contact->window = window;
+    contact->hold = hold;
+    contact->runLimit = runLimit;
+    contact->idleLimit = idleLimit;
+    contact->state = STIMSTATE_IDLE;
+    }
+
+static void CONTACT_AddSample(Contact_Detector_struct *contact, u16 sample)
+    {
+    if(contact->nbSamples == contact->window)
+        {
+        u16 oldest = contact->samples[contact->head];
+
+        contact->sum -= oldest;
+        if(oldest >= contact->runLimit)     contact->nbAtRun--;
+        if(oldest <= contact->idleLimit)    contact->nbAtIdle--;
+        }
+    else
+        {
+        contact->nbSamples++;
+        }
+    contact->samples[contact->head] = sample;
+    if(++contact->head == contact->window) contact->head = 0;
+    contact->last = sample;
+    contact->sum += sample;
+    if(sample >= contact->runLimit)         contact->nbAtRun++;
+    if(sample <= contact->idleLimit)        contact->nbAtIdle++;
+    }
+
+/*******************************************************************************
+* Function Name  : CONTACT_Update
+* Description    : Adds a readout to the window and advances the state
+* Input          : Contact_Detector_struct *contact, u16 sample: CAE1 of the readout
+* Return         : the new state
+*******************************************************************************/
+static StimState_code CONTACT_Update(Contact_Detector_struct *contact, u16 sample)
+    {
+    const Contact_Statistic_struct *statistic = &ContactStatisticTable[contact->statistic];
+    bool isIdle = (contact->state == STIMSTATE_IDLE || contact->state == STIMSTATE_WAITING_FOR_RUN);
+    bool isBeyond;
+
+    CONTACT_AddSample(contact, sample);
+    isBeyond = isIdle ? statistic->isAtRun(contact) : statistic->isAtIdle(contact);
+
+    if(!isBeyond)
+        {
+        contact->holdCnt = 0;
+        contact->state = isIdle ? STIMSTATE_IDLE : STIMSTATE_RUN;
+        }
+    else if(++contact->holdCnt >= contact->hold)
+        {
+        contact->holdCnt = 0;
+        contact->state = isIdle ? STIMSTATE_RUN : STIMSTATE_IDLE;
+        }
+    else
+        {
+        contact->state = isIdle ? STIMSTATE_WAITING_FOR_RUN : STIMSTATE_WAITING_FOR_IDLE;
+        }
+    return contact->state;
+    }
+
+/* samples from a clean step to the transition */
+static u8 CONTACT_GetLatencyBound(const Contact_Detector_struct *contact)
+    {
+    return ContactStatisticTable[contact->statistic].settleSamples(contact->window) + contact->hold - 1;
+    }
+
+static bool CONTACT_LastAtRun(const Contact_Detector_struct *contact)
+    {
+    return contact->last >= contact->runLimit;
+    }
+
+static bool CONTACT_LastAtIdle(const Contact_Detector_struct *contact)
+    {
+    return contact->last <= contact->idleLimit;
+    }
+
+static bool CONTACT_MeanAtRun(const Contact_Detector_struct *contact)
+    {
+    return contact->sum >= (u32)contact->runLimit * contact->nbSamples;
+    }
+
+static bool CONTACT_MeanAtIdle(const Contact_Detector_struct *contact)
+    {
+    return contact->sum <= (u32)contact->idleLimit * contact->nbSamples;
+    }
+
+/* while the window fills, most of the samples so far */
+static bool CONTACT_MedianAtRun(const Contact_Detector_struct *contact)
+    {
+    return 2 * contact->nbAtRun > contact->nbSamples;
+    }
+
+static bool CONTACT_MedianAtIdle(const Contact_Detector_struct *contact)
+    {
+    return 2 * contact->nbAtIdle > contact->nbSamples;
+    }
+
+static u8 CONTACT_SettleOne(u8 window)
+    {
+    return 1;
+    }
+
+static u8 CONTACT_SettleWindow(u8 window)
+    {
+    return window;
+    }
+
+static u8 CONTACT_SettleHalf(u8 window)
+    {
+    return (window + 1) / 2;
+    }
+
+#ifdef STIM32_HOST
+
+static Contact_Detector_struct HOST_Contact;
+
+/* the detector in use, for the host harness */
+void HOST_GetContactDetector(u32 *statistic, u32 *window, u32 *hold, u16 *runLimit, u16 *idleLimit)
+    {
+    *statistic = Contact.statistic;
+    *window = Contact.window;
+    *hold = Contact.hold;
+    *runLimit = Contact.runLimit;
+    *idleLimit = Contact.idleLimit;
+    }
+
+/* a detector of its own with the limits in use, fed by HOST_ContactUpdate; returns its latency bound */
+u32 HOST_ContactInit(u32 statistic, u32 window, u32 hold, const char **name)
+    {
+    CONTACT_Init(&HOST_Contact, statistic, window, hold, Contact.runLimit, Contact.idleLimit);
+    *name = ContactStatisticTable[statistic].name;
+    return CONTACT_GetLatencyBound(&HOST_Contact);
+    }
+
+u8 HOST_ContactUpdate(u16 sample)
+    {
+    return CONTACT_Update(&HOST_Contact, sample);
+    }
+
+#endif // STIM32_HOST
+
+/*******************************************************************************
+* Function Group : Session log
+* Description    : Per-second aggregates of a session are appended to a ring of
+                   flash sectors, so they survive the power-off. A record is
+                   [tag][body length][body]; the numbers in the body are varints (7 bits
+                   per byte, LSB first), signed ones zigzag coded, and most are deltas
+                   to the previous record of the session:
+                   
+                   SESSION  time of day (s), battery mV, frequency Hz, sequence, peak, target,
+                            power-on to the first pulse (us; not in older records)
+                   SETTINGS frequency Hz, sequence, peak, target
+                   SECOND   state, transitions, battery delta [, CAE mean delta,
+                            mean - min, max - mean, overloads]  (no CAE without readouts)
+                   IDLE     seconds, battery delta
+                   BASE     battery mV, CAE mean, frequency Hz, sequence, peak, target
+                   STORE    the settings record of the Settings store, as raw bytes
+                   
+                   A second of stimulation takes ~9 bytes, a run of idle seconds ~4. 
+                   A 128K sector thus holds ~4 hours of stimulation, and the ring
+                   keeps the last 4 to 8 hours of it (the sector being filled and
+                   the full one before it); idle time costs next to nothing, older
+                   sessions are overwritten.
+                   Each sector starts with a sequence number; at the start, the one
+                   with the highest number is continued after its last record. When
+                   it is full, the next sector of the ring is erased, so all sectors
+                   wear alike. Records do not straddle sectors: a sector that would be 
+                   full after the next record is ended with a BASE record, which starts
+                   the next sector, so each sector decodes on its own when the older
+                   ones are erased; a STORE record follows it, so the newest sector
+                   always holds the settings. The body length lets a reader step over a record
+                   torn by a power loss.
+                   The records are buffered in RAM and programmed one byte per
+                   Application_Handler call while the flash is not busy, so neither
+                   a record (a few us) nor an erase holds up the application;
+                   LOG_Flush() empties the buffer at Quit and ShutDown.
+                   In the host build, the flash is a RAM array, backed by a file if
+                   HOST_SetLogFile() is called before the application starts.
+*******************************************************************************/
+#ifdef STIM32_HOST
+
+static u8 HOST_LogFlash[LOG_FLASH_NB_SECTORS][LOG_FLASH_SECTOR_SIZE];
+static FILE *HOST_LogFile;
+
+/* the log flash is loaded from this file and written through to it; a new file is erased flash */
+bool HOST_SetLogFile(const char *path)
+    {
+    memset(HOST_LogFlash, LOG_ERASED, sizeof(HOST_LogFlash));
+    HOST_LogFile = fopen(path, "r+b");
+    if(HOST_LogFile)
+        {
+        if(fread(HOST_LogFlash, 1, sizeof(HOST_LogFlash), HOST_LogFile) == sizeof(HOST_LogFlash)) return TRUE;
+        fclose(HOST_LogFile);
+        memset(HOST_LogFlash, LOG_ERASED, sizeof(HOST_LogFlash));
+        }
+    HOST_LogFile = fopen(path, "w+b");
+    if(!HOST_LogFile) return FALSE;
+    fwrite(HOST_LogFlash, 1, sizeof(HOST_LogFlash), HOST_LogFile);
+    fflush(HOST_LogFile);
+    return TRUE;
+    }
+
+static void LOG_FlashInit(void)
+    {
+    if(!HOST_LogFile) memset(HOST_LogFlash, LOG_ERASED, sizeof(HOST_LogFlash));
+    }
+
+static const u8* LOG_FlashSector(u8 sector)
+    {
+    return HOST_LogFlash[sector];
+    }
+
+static bool LOG_FlashIsBusy(void)
+    {
+    return FALSE;
+    }
+
+static bool LOG_FlashCheck(void)
+    {
+    return TRUE;
+    }
+
+static void LOG_FlashLock(void)
+    {
+    if(HOST_LogFile) fflush(HOST_LogFile);
+    }
+
+static void LOG_FlashErase(u8 sector)
+    {
+    memset(HOST_LogFlash[sector], LOG_ERASED, LOG_FLASH_SECTOR_SIZE);
+    if(HOST_LogFile)
+        {
+        fseek(HOST_LogFile, (long)sector * LOG_FLASH_SECTOR_SIZE, SEEK_SET);
+        fwrite(HOST_LogFlash[sector], 1, LOG_FLASH_SECTOR_SIZE, HOST_LogFile);
+        }
+    }
+
+static void LOG_FlashProgram(u8 sector, u32 offset, u8 value)
+    {
+    HOST_LogFlash[sector][offset] &= value;             // programming only clears bits
+    if(HOST_LogFile)
+        {
+        fseek(HOST_LogFile, (long)sector * LOG_FLASH_SECTOR_SIZE + offset, SEEK_SET);
+        fputc(HOST_LogFlash[sector][offset], HOST_LogFile);
+        }
+    }
+
+#else
+
+static void LOG_FlashInit(void)
+    {
+    FLASH->SR = LOG_FLASH_ERRORS;                       // left over from others
+    }
+
+static const u8* LOG_FlashSector(u8 sector)
+    {
+    return (const u8*)(LOG_FLASH_BASE + (u32)sector * LOG_FLASH_SECTOR_SIZE);
+    }
+
+static bool LOG_FlashIsBusy(void)
+    {
+    return (FLASH->SR & FLASH_SR_BSY) != 0;
+    }
+
+static bool LOG_FlashCheck(void)
+    {
+    if(FLASH->SR & LOG_FLASH_ERRORS)
+        {
+        FLASH->SR = LOG_FLASH_ERRORS;
+        return FALSE;
+        }
+    return TRUE;
+    }
+
+static void LOG_FlashUnlock(void)
+    {
+    if(FLASH->CR & FLASH_CR_LOCK)
+        {
+        FLASH->KEYR = LOG_FLASH_KEY1;
+        FLASH->KEYR = LOG_FLASH_KEY2;
+        }
+    }
+
+static void LOG_FlashLock(void)
+    {
+    FLASH->CR = FLASH_CR_LOCK;
+    }
+
+/* starts the erase, LOG_FlashIsBusy() until it is done (1..2s) */
+static void LOG_FlashErase(u8 sector)
+    {
+    LOG_FlashUnlock();
+    FLASH->CR = FLASH_CR_SER | ((LOG_FLASH_FIRST_SECTOR + sector + 4) << 3);    // SNB of bank 2 sectors: sector + 4
+    FLASH->CR |= FLASH_CR_STRT;
+    }
+
+/* starts a byte program (PSIZE x8), LOG_FlashIsBusy() until it is done (~16us) */
+static void LOG_FlashProgram(u8 sector, u32 offset, u8 value)
+    {
+    LOG_FlashUnlock();
+    FLASH->CR = FLASH_CR_PG;
+    *(volatile u8*)(LOG_FLASH_BASE + (u32)sector * LOG_FLASH_SECTOR_SIZE + offset) = value;
+    }
+
+#endif // STIM32_HOST
+
+static u8 LOG_PutVarint(u8 *p, u32 value)
+    {
+    u8 n = 0;
+    
+    while(value >= 0x80)
+        {
+        p[n++] = (value & 0x7F) | 0x80;
+        value >>= 7;
+        }
+    p[n++] = value;
+    return n;
+    }
+
+static u8 LOG_PutSigned(u8 *p, s32 value)
+    {
+    return LOG_PutVarint(p, ((u32)value << 1) ^ (u32)(value >> 31));   // zigzag: 0, -1, 1, -2 ...
+    }
+
+/* valid header: sequence number and its complement; a torn one is not */
+static bool LOG_ReadHeader(u8 sector, u16 *sequence)
+    {
+    const u8 *header = LOG_FlashSector(sector);
+    u16 value = header[0] | (header[1] << 8);
+    u16 complement = header[2] | (header[3] << 8);
+    
+    *sequence = value;
+    return (u16)~value == complement;
+    }
+
+static void LOG_PutBase(void);
+
+/*******************************************************************************
+* Function Name  : LOG_PutRecord
+* Description    : Appends a record to the RAM buffer; it is dropped if the buffer
+                   is full. If the sector would be too full for a BASE record after
+                   it, a BASE record goes first and starts the next sector.
+* Input          : LogRecord_code tag, body, length
+* Return         : TRUE if the record was buffered
+*******************************************************************************/
+static bool LOG_PutRecord(LogRecord_code tag, const u8 *body, u8 length)
+    {
+    u8 i;
+    
+    if(tag != LOG_RECORD_BASE && Log.putOffset + (LOG_RECORD_HEADER_SIZE + length)
+                                 + (LOG_RECORD_HEADER_SIZE + LOG_RECORD_MAX_BODY) > LOG_FLASH_SECTOR_SIZE)
+        {
+        LOG_PutBase();
+        }
+    if(LOG_BUFFER_SIZE - (Log.head - Log.tail) < (u32)length + LOG_RECORD_HEADER_SIZE)
+        {
+        Log.nbDropped++;
+        return FALSE;
+        }
+    Log.buffer[Log.head++ % LOG_BUFFER_SIZE] = tag;
+    Log.buffer[Log.head++ % LOG_BUFFER_SIZE] = length;
+    for(i=0; i<length; i++)
+        {
+        Log.buffer[Log.head++ % LOG_BUFFER_SIZE] = body[i];
+        }
+    Log.putOffset += LOG_RECORD_HEADER_SIZE + length;
+    Log.nbRecords++;
+    return TRUE;
+    }
+
+/* encodes the settings and takes them as the logged ones */
+static u8 LOG_PutSettings(u8 *p)
+    {
+    u8 n = 0;
+    
+    Log.frequency_Hz = PulseSeq.frequency_Hz;
+    Log.pulseSeq = PulseSeq.pulseSeq;
+    Log.peakVoltage = PulseSeq.peakVoltage;
+    Log.currentTarget = CurrentControl.target;
+    
+    n += LOG_PutVarint(p+n, Log.frequency_Hz);
+    p[n++] = Log.pulseSeq;
+    p[n++] = Log.peakVoltage;
+    n += LOG_PutVarint(p+n, Log.currentTarget);
+    return n;
+    }
+
+/* the bases the following deltas are taken from, at the start of the next sector */
+static void LOG_PutBase(void)
+    {
+    u8 body[LOG_RECORD_MAX_BODY];
+    u8 n = 0;
+    
+    n += LOG_PutVarint(body+n, Log.lastBatterymV);
+    n += LOG_PutVarint(body+n, Log.lastCAE1);
+    n += LOG_PutVarint(body+n, Log.frequency_Hz);
+    body[n++] = Log.pulseSeq;
+    body[n++] = Log.peakVoltage;
+    n += LOG_PutVarint(body+n, Log.currentTarget);
+    if(LOG_PutRecord(LOG_RECORD_BASE, body, n))
+        {
+        Log.putOffset = LOG_HEADER_SIZE + LOG_RECORD_HEADER_SIZE + n;
+        SETTINGS_PutFlashCopy();
+        }
+    }
+
+static void LOG_PutIdleRun(void)
+    {
+    u8 body[LOG_RECORD_MAX_BODY];
+    u8 n = 0;
+    
+    if(Log.nbIdleSeconds == 0) return;
+    
+    n += LOG_PutVarint(body+n, Log.nbIdleSeconds);
+    n += LOG_PutSigned(body+n, (s32)Battery.mV - Log.lastBatterymV);
+    LOG_PutRecord(LOG_RECORD_IDLE, body, n);                // the bases are updated after it
+    
+    Log.lastBatterymV = Battery.mV;
+    Log.nbIdleSeconds = 0;
+    }
+
+static void LOG_ClearSecond(void)
+    {
+    Log.sumCAE1 = 0;
+    Log.nbReadouts = 0;
+    Log.minCAE1 = 0;
+    Log.maxCAE1 = 0;
+    Log.nbOverloads = 0;
+    Log.nbTransitions = 0;
+    }
+
+/* the active sector is full: the next one of the ring is erased */
+static void LOG_NextSector(void)
+    {
+    Log.sector = (Log.sector + 1) % LOG_FLASH_NB_SECTORS;
+    Log.sequence++;
+    Log.offset = 0;
+    Log.flashState = LOG_FLASH_ERASING;
+    Log.nbErases++;
+    LOG_FlashErase(Log.sector);
+    }
+
+/*******************************************************************************
+* Function Name  : LOG_Init
+* Description    : Finds the end of the log in the flash ring and writes the
+                   session record
+* Input          : None
+* Return         : None
+*******************************************************************************/
+static void LOG_Init(void)
+    {
+    const u8 *sector;
+    u16 sequence;
+    bool isFound = FALSE;
+    u8 i;
+    u8 body[LOG_RECORD_MAX_BODY];
+    u8 n = 0;
+    u8 THH, TMM, TSS;
+    
+    memset(&Log, 0, sizeof(Log));
+    Log.stimState = STIMSTATE_IDLE;
+    LOG_FlashInit();
+    
+    for(i=0; i<LOG_FLASH_NB_SECTORS; i++)
+        {
+        if(LOG_ReadHeader(i, &sequence) && (!isFound || (s16)(sequence - Log.sequence) > 0))
+            {
+            Log.sector = i;
+            Log.sequence = sequence;
+            isFound = TRUE;
+            }
+        }
+    
+    if(isFound)
+        {
+        sector = LOG_FlashSector(Log.sector);
+        Log.offset = LOG_HEADER_SIZE;
+        while(Log.offset + LOG_RECORD_HEADER_SIZE <= LOG_FLASH_SECTOR_SIZE && sector[Log.offset] != LOG_ERASED)
+            {
+            Log.offset += LOG_RECORD_HEADER_SIZE + sector[Log.offset+1];
+            }
+        if(Log.offset > LOG_FLASH_SECTOR_SIZE) Log.offset = LOG_FLASH_SECTOR_SIZE;    // torn at the end
+        Log.putOffset = Log.offset;
+        }
+    else
+        {
+        Log.sector = LOG_FLASH_NB_SECTORS - 1;              // a new log starts in sector 0
+        Log.sequence = 0;
+        LOG_NextSector();
+        Log.putOffset = LOG_HEADER_SIZE;
+        }
+    
+    RTC_GetTime(&THH, &TMM, &TSS);
+    n += LOG_PutVarint(body+n, THH*3600 + TMM*60 + TSS);
+    n += LOG_PutVarint(body+n, Battery.mV);
+    n += LOG_PutSettings(body+n);
+    n += LOG_PutVarint(body+n, Boot.firstPulse_us);         // 0 if not yet pulsing
+    LOG_PutRecord(LOG_RECORD_SESSION, body, n);
+    Log.lastBatterymV = Battery.mV;
+    }
+
+static void LOG_AddReadout(const Readout_Record_struct *record)
+    {
+    if(Log.nbReadouts++ == 0 || record->CAE1 < Log.minCAE1)
+        {
+        Log.minCAE1 = record->CAE1;
+        }
+    if(record->CAE1 > Log.maxCAE1)
+        {
+        Log.maxCAE1 = record->CAE1;
+        }
+    Log.sumCAE1 += record->CAE1;
+    if(record->isOverloaded)
+        {
+        Log.nbOverloads++;
+        }
+    if(record->stimState != Log.stimState)
+        {
+        if(Log.nbTransitions < 0xFF) Log.nbTransitions++;
+        Log.stimState = record->stimState;
+        }
+    }
+
+/*******************************************************************************
+* Function Name  : LOG_Second
+* Description    : Writes the record of the second past, at each RTC second. The
+                   idle seconds are counted and written as one record when the
+                   run ends.
+* Input          : None
+* Return         : None
+*******************************************************************************/
+static void LOG_Second(void)
+    {
+    u8 body[LOG_RECORD_MAX_BODY];
+    u8 n = 0;
+    u16 meanCAE1;
+    
+    if(PulseSeq.frequency_Hz != Log.frequency_Hz || PulseSeq.pulseSeq != Log.pulseSeq
+       || PulseSeq.peakVoltage != Log.peakVoltage || CurrentControl.target != Log.currentTarget)
+        {
+        LOG_PutIdleRun();
+        LOG_PutRecord(LOG_RECORD_SETTINGS, body, LOG_PutSettings(body));
+        }
+    
+    if(Log.stimState == STIMSTATE_IDLE && Log.nbTransitions == 0 && Log.nbOverloads == 0)
+        {
+        Log.nbIdleSeconds++;
+        LOG_ClearSecond();
+        return;
+        }
+    LOG_PutIdleRun();
+    
+    body[n++] = Log.stimState;
+    n += LOG_PutVarint(body+n, Log.nbTransitions);
+    n += LOG_PutSigned(body+n, (s32)Battery.mV - Log.lastBatterymV);
+    meanCAE1 = Log.lastCAE1;
+    if(Log.nbReadouts > 0)
+        {
+        meanCAE1 = Log.sumCAE1 / Log.nbReadouts;
+        n += LOG_PutSigned(body+n, (s32)meanCAE1 - Log.lastCAE1);
+        n += LOG_PutVarint(body+n, meanCAE1 - Log.minCAE1);
+        n += LOG_PutVarint(body+n, Log.maxCAE1 - meanCAE1);
+        n += LOG_PutVarint(body+n, Log.nbOverloads);
+        }
+    LOG_PutRecord(LOG_RECORD_SECOND, body, n);              // the bases are updated after it
+    
+    Log.lastBatterymV = Battery.mV;
+    Log.lastCAE1 = meanCAE1;
+    LOG_ClearSecond();
+    }
+
+/*******************************************************************************
+* Function Name  : LOG_Service
+* Description    : Advances the flash: erase, sector header or one byte of the 
+                   buffered records. Returns at once while the flash is busy.
+* Input          : None
+* Return         : None
+*******************************************************************************/
+static void LOG_Service(void)
+    {
+    u32 length;
+    
+    if(Log.flashState == LOG_FLASH_FAILED || LOG_FlashIsBusy()) return;
+    if(!LOG_FlashCheck())
+        {
+        LOG_FlashLock();
+        Log.flashState = LOG_FLASH_FAILED;
+        return;
+        }
+    
+    switch(Log.flashState)
+        {
+        case LOG_FLASH_ERASING:
+            Log.flashState = LOG_FLASH_HEADER;
+            // no break
+        case LOG_FLASH_HEADER:
+            length = (Log.offset < 2) ? Log.sequence : (u16)~Log.sequence;
+            LOG_FlashProgram(Log.sector, Log.offset, (Log.offset & 1) ? length >> 8 : length);
+            if(++Log.offset == LOG_HEADER_SIZE) Log.flashState = LOG_FLASH_READY;
+            break;
+        case LOG_FLASH_READY:
+            if(Log.head == Log.tail)
+                {
+                LOG_FlashLock();
+                break;
+                }
+            if(Log.recordLeft == 0)
+                {
+                length = LOG_RECORD_HEADER_SIZE + Log.buffer[(Log.tail+1) % LOG_BUFFER_SIZE];
+                if((Log.buffer[Log.tail % LOG_BUFFER_SIZE] == LOG_RECORD_BASE && Log.offset > LOG_HEADER_SIZE)
+                   || Log.offset + length > LOG_FLASH_SECTOR_SIZE)
+                    {
+                    LOG_NextSector();
+                    break;
+                    }
+                Log.recordLeft = length;
+                }
+            LOG_FlashProgram(Log.sector, Log.offset++, Log.buffer[Log.tail++ % LOG_BUFFER_SIZE]);
+            Log.recordLeft--;
+            break;
+        default:
+            break;
+        }
+    }
+
+/* programs all buffered records, waiting for the flash */
+static void LOG_Flush(void)
+    {
+    LOG_PutIdleRun();
+    while(Log.flashState != LOG_FLASH_FAILED && (Log.head != Log.tail || Log.flashState != LOG_FLASH_READY))
+        {
+        LOG_Service();
+        }
+    while(LOG_FlashIsBusy())
+        ;
+    LOG_FlashLock();
+    }
+
+#ifdef STIM32_HOST
+
+static u32 LOG_GetVarint(const u8 **p)
+    {
+    u32 value = 0;
+    u8 shift = 0;
+    
+    do
+        {
+        value |= (u32)(**p & 0x7F) << shift;
+        shift += 7;
+        }
+    while(*(*p)++ & 0x80);
+    return value;
+    }
+
+static s32 LOG_GetSigned(const u8 **p)
+    {
+    u32 value = LOG_GetVarint(p);
+    
+    return (s32)(value >> 1) ^ -(s32)(value & 1);
+    }
+
+/* log counters, for the host harness */
+void HOST_GetLogCounters(u32 *nbRecords, u32 *nbDropped, u32 *nbErases)
+    {
+    *nbRecords = Log.nbRecords;
+    *nbDropped = Log.nbDropped;
+    *nbErases = Log.nbErases;
+    }
+
+/* as at Quit or ShutDown */
+void HOST_FlushLog(void)
+    {
+    SETTINGS_Flush();
+    LOG_Flush();
+    }
+
+/*******************************************************************************
+* Function Name  : HOST_ReadLog
+* Description    : Decodes the flash ring, oldest sector first, like a reader of
+                   the log would
+* Input          : FILE *out: one line per record, NULL for the counts only
+* Return         : bytes in use; number of sessions, seconds with and without contact
+*******************************************************************************/
+u32 HOST_ReadLog(FILE *out, u32 *nbSessions, u32 *nbActiveSeconds, u32 *nbIdleSeconds)
+    {
+    static const char* const StateName[] = { "IDLE", "RUN", "WAITING_FOR_RUN", "WAITING_FOR_IDLE" };
+    u8 order[LOG_FLASH_NB_SECTORS];
+    u16 sequence[LOG_FLASH_NB_SECTORS];
+    u8 nbSectors = 0, i, j, k;
+    u32 nbBytes = 0, offset;
+    u16 CAE1 = 0, batterymV = 0;
+    
+    *nbSessions = *nbActiveSeconds = *nbIdleSeconds = 0;
+    for(i=0; i<LOG_FLASH_NB_SECTORS; i++)
+        {
+        u16 s;
+        
+        if(!LOG_ReadHeader(i, &s)) continue;
+        for(j=nbSectors; j>0 && (s16)(s - sequence[j-1]) < 0; j--)
+            {
+            order[j] = order[j-1];
+            sequence[j] = sequence[j-1];
+            }
+        order[j] = i;
+        sequence[j] = s;
+        nbSectors++;
+        }
+    
+    for(k=0; k<nbSectors; k++)
+        {
+        const u8 *sector = LOG_FlashSector(order[k]);
+        
+        offset = LOG_HEADER_SIZE;
+        while(offset + LOG_RECORD_HEADER_SIZE <= LOG_FLASH_SECTOR_SIZE && sector[offset] != LOG_ERASED)
+            {
+            u8 tag = sector[offset], length = sector[offset+1];
+            const u8 *p = &sector[offset + LOG_RECORD_HEADER_SIZE];
+            const u8 *end = p + length;
+            
+            if(offset + LOG_RECORD_HEADER_SIZE + length > LOG_FLASH_SECTOR_SIZE) break;
+            offset += LOG_RECORD_HEADER_SIZE + length;
+            
+            switch(tag)
+                {
+                case LOG_RECORD_SESSION:
+                    {
+                    u32 time = LOG_GetVarint(&p);
+                    
+                    batterymV = LOG_GetVarint(&p);
+                    CAE1 = 0;
+                    (*nbSessions)++;
+                    if(out) fprintf(out, "session %u  %02u:%02u:%02u  battery %u mV", *nbSessions, time/3600, time/60%60, time%60, batterymV);
+                    }
+                    // no break, the settings follow
+                case LOG_RECORD_SETTINGS:
+                    {
+                    u32 frequency_Hz = LOG_GetVarint(&p);
+                    u8 pulseSeq = *p++;
+                    u8 peakVoltage = *p++;
+                    u32 target = LOG_GetVarint(&p);
+                    
+                    if(out)
+                        {
+                        fprintf(out, "%s%u Hz  sequence %u  peak %u  %s", tag == LOG_RECORD_SETTINGS ? "settings  " : "  ",
+                                frequency_Hz, pulseSeq, peakVoltage, target ? "current " : "voltage");
+                        if(target) fprintf(out, "%u", target);
+                        if(tag == LOG_RECORD_SESSION && p < end) fprintf(out, "  first pulse %u us", LOG_GetVarint(&p));
+                        fprintf(out, "\n");
+                        }
+                    }
+                    break;
+                case LOG_RECORD_SECOND:
+                    {
+                    u8 state = *p++;
+                    u32 nbTransitions = LOG_GetVarint(&p);
+                    
+                    batterymV += LOG_GetSigned(&p);
+                    (*nbActiveSeconds)++;
+                    if(out) fprintf(out, "second  %-16s transitions %u  battery %u mV", state < 4 ? StateName[state] : "?", nbTransitions, batterymV);
+                    if(p < end)
+                        {
+                        u32 low, high, nbOverloads;
+                        
+                        CAE1 += LOG_GetSigned(&p);
+                        low = LOG_GetVarint(&p);
+                        high = LOG_GetVarint(&p);
+                        nbOverloads = LOG_GetVarint(&p);
+                        if(out) fprintf(out, "  CAE %u (%u..%u)  overloads %u", CAE1, CAE1 - low, CAE1 + high, nbOverloads);
+                        }
+                    if(out) fprintf(out, "\n");
+                    }
+                    break;
+                case LOG_RECORD_BASE:
+                    {
+                    u32 frequency_Hz, target;
+                    u8 pulseSeq, peakVoltage;
+                    
+                    batterymV = LOG_GetVarint(&p);
+                    CAE1 = LOG_GetVarint(&p);
+                    frequency_Hz = LOG_GetVarint(&p);
+                    pulseSeq = *p++;
+                    peakVoltage = *p++;
+                    target = LOG_GetVarint(&p);
+                    if(out) fprintf(out, "base    battery %u mV  CAE %u  %u Hz  sequence %u  peak %u  target %u\n",
+                                    batterymV, CAE1, frequency_Hz, pulseSeq, peakVoltage, target);
+                    }
+                    break;
+                case LOG_RECORD_IDLE:
+                    {
+                    u32 nbSeconds = LOG_GetVarint(&p);
+                    
+                    batterymV += LOG_GetSigned(&p);
+                    *nbIdleSeconds += nbSeconds;
+                    if(out) fprintf(out, "idle    %u s  battery %u mV\n", nbSeconds, batterymV);
+                    }
+                    break;
+                case LOG_RECORD_STORE:
+                    {
+                    Settings_Record_struct record;
+                    
+                    if(!out) break;
+                    if(!SETTINGS_Decode(p, length, &record))
+                        {
+                        fprintf(out, "store   corrupt, %u bytes\n", length);
+                        break;
+                        }
+                    fprintf(out, "store   #%u v%u  %u Hz  sequence %u  peak %u  target %u  limits %u/%u  CAE %u/%u  timer %+d ppm"
+                            "  contact %u/%u/%u\n", record.sequence, record.version, record.frequency_Hz, record.pulseSeq,
+                            record.peakVoltage, record.currentTarget, record.readoutLimitRun, record.readoutLimitIdle,
+                            record.caeOffset, record.caeScale, record.timerPpm, record.contactStatistic, record.contactWindow,
+                            record.contactHold);
+                    }
+                    break;
+                default:
+                    if(out) fprintf(out, "unknown record %u, %u bytes\n", tag, length);
+                    break;
+                }
+            }
+        nbBytes += offset;
+        }
+    return nbBytes;
+    }
+
+#endif // STIM32_HOST
+
+/*******************************************************************************
+* Function Group : Settings store
+* Description    : The settings, the readout limits and the calibrations are one
+                   record with a version and a CRC (Settings_Record_struct). It is
+                   kept in the backup SRAM, which runs from VBAT like the RTC, in two
+                   slots written alternately, so a write cut short by a reset leaves
+                   the previous record. SETTINGS_Restore reads both slots in one go
+                   at the start and takes the newest valid one; if the backup domain
+                   was lost, it takes the newest STORE record of the session log
+                   flash, then the BKP_USER registers of older versions, then the
+                   defaults. Every field is checked against its range: one out of
+                   range takes its default, the others are kept.
+                   
+                   The record only grows: a new version appends its fields and raises
+                   SETTINGS_VERSION. A shorter record of an older version takes the
+                   defaults for the fields it lacks, a longer one of a newer version
+                   is read as far as its fields are known.
+                   
+                   A change (UpdatePulseSequence) is written to the backup SRAM at the
+                   next Application_Handler call, ~30 bytes; the flash copy follows
+                   when the settings have not changed for SETTINGS_FLASH_DELAY_SECONDS,
+                   and at Quit and ShutDown.
+                   In the host build, the backup SRAM is a RAM array, backed by a file
+                   if HOST_SetBackupFile() is called before the application starts.
+*******************************************************************************/
+#ifdef STIM32_HOST
+
+static u8 HOST_BackupSram[SETTINGS_NB_SLOTS * SETTINGS_SLOT_SIZE];
+static FILE *HOST_BackupFile;
+
+/* the backup SRAM is loaded from this file and written through to it; a new file is a lost backup domain */
+bool HOST_SetBackupFile(const char *path)
+    {
+    memset(HOST_BackupSram, 0, sizeof(HOST_BackupSram));
+    HOST_BackupFile = fopen(path, "r+b");
+    if(HOST_BackupFile)
+        {
+        if(fread(HOST_BackupSram, 1, sizeof(HOST_BackupSram), HOST_BackupFile) == sizeof(HOST_BackupSram)) return TRUE;
+        fclose(HOST_BackupFile);
+        memset(HOST_BackupSram, 0, sizeof(HOST_BackupSram));
+        }
+    HOST_BackupFile = fopen(path, "w+b");
+    if(!HOST_BackupFile) return FALSE;
+    fwrite(HOST_BackupSram, 1, sizeof(HOST_BackupSram), HOST_BackupFile);
+    fflush(HOST_BackupFile);
+    return TRUE;
+    }
+
+static void SETTINGS_BackupInit(void)
+    {
+    }
+
+static void SETTINGS_BackupRead(u8 *data)
+    {
+    memcpy(data, HOST_BackupSram, sizeof(HOST_BackupSram));
+    }
+
+static void SETTINGS_BackupWrite(u8 slot, const u8 *data, u8 length)
+    {
+    memcpy(&HOST_BackupSram[slot * SETTINGS_SLOT_SIZE], data, length);
+    if(HOST_BackupFile)
+        {
+        fseek(HOST_BackupFile, (long)slot * SETTINGS_SLOT_SIZE, SEEK_SET);
+        fwrite(&HOST_BackupSram[slot * SETTINGS_SLOT_SIZE], 1, length, HOST_BackupFile);
+        fflush(HOST_BackupFile);
+        }
+    }
+
+#else // STIM32_HOST
+
+static void SETTINGS_BackupInit(void)
+    {
+    RCC->APB1ENR |= RCC_APB1ENR_PWREN;
+    RCC->AHB1ENR |= RCC_AHB1ENR_BKPSRAMEN;
+    PWR->CR |= PWR_CR_DBP;                          // write access to the backup domain
+    PWR->CSR |= PWR_CSR_BRE;                        // the backup SRAM is kept on VBAT
+    }
+
+static void SETTINGS_BackupRead(u8 *data)
+    {
+    memcpy(data, (const void*)SETTINGS_BKPSRAM_ADDRESS, SETTINGS_NB_SLOTS * SETTINGS_SLOT_SIZE);
+    }
+
+static void SETTINGS_BackupWrite(u8 slot, const u8 *data, u8 length)
+    {
+    volatile u8 *sram = (volatile u8*)(SETTINGS_BKPSRAM_ADDRESS + (u32)slot * SETTINGS_SLOT_SIZE);
+    u8 i;
+    
+    for(i=0; i<length; i++)
+        {
+        sram[i] = data[i];
+        }
+    }
+
+#endif // STIM32_HOST
+
+/*******************************************************************************
+* Function Name  : SETTINGS_Decode
+* Description    : Checks a stored record and takes it to the current version
+* Input          : const u8 *data, u32 size: bytes available there
+* Return         : TRUE if valid; record: its fields, the defaults for the ones it lacks
+*******************************************************************************/
+static bool SETTINGS_Decode(const u8 *data, u32 size, Settings_Record_struct *record)
+    {
+    u8 length;
+    
+    if(size < SETTINGS_HEADER_SIZE) return FALSE;
+    length = data[3];
+    if(data[2] == 0 || length < SETTINGS_HEADER_SIZE || length > size) return FALSE;
+    if(CRC16_Compute(data + 2, length - 2, 0xFFFF) != (data[0] | (data[1] << 8))) return FALSE;
+    
+    *record = SettingsDefaults;
+    memcpy(record, data, length < sizeof(*record) ? length : sizeof(*record));
+    // a version changing the meaning of a field converts it here, by record->version
+    if(record->version < 2 && record->readoutLimitIdle > record->readoutLimitRun)
+        {
+        u16 limit = record->readoutLimitRun;                // the band of version 1 was inverted
+
+        record->readoutLimitRun = record->readoutLimitIdle;
+        record->readoutLimitIdle = limit;
+        }
+    return TRUE;
+    }
+
+/* out of range fields take their defaults; returns their number */
+static u8 SETTINGS_Validate(Settings_Record_struct *record)
+    {
+    u8 nbRejected = 0;
+    bool isTarget = FALSE;
+    u8 i;
+    
+    for(i=0; i<NB_CURRENT_TARGETS; i++)
+        {
+        if(record->currentTarget == CurrentTargetTable[i]) isTarget = TRUE;
+        }
+    
+#define CHECK_FIELD(field, isValid)     if(!(isValid)) { record->field = SettingsDefaults.field; nbRejected++; }
+    
+    CHECK_FIELD(frequency_Hz,       record->frequency_Hz >= FREQUENCY_MIN_HZ && record->frequency_Hz <= FREQUENCY_MAX_HZ)
+    CHECK_FIELD(pulseSeq,           record->pulseSeq >= 1 && record->pulseSeq <= NB_PULSE_SEQUENCES)
+    CHECK_FIELD(peakVoltage,        record->peakVoltage >= PULSEPEAKVOLTAGE_8V && record->peakVoltage <= PULSEPEAKVOLTAGE_4V)
+    CHECK_FIELD(currentTarget,      isTarget)
+    CHECK_FIELD(readoutLimitRun,    record->readoutLimitRun <= SETTINGS_READOUT_MAX)
+    CHECK_FIELD(readoutLimitIdle,   record->readoutLimitIdle < record->readoutLimitRun)
+    CHECK_FIELD(caeOffset,          record->caeOffset <= SETTINGS_READOUT_MAX)
+    CHECK_FIELD(caeScale,           record->caeScale >= 1 && record->caeScale <= SETTINGS_CAE_SCALE_MAX)
+    CHECK_FIELD(timerPpm,           record->timerPpm >= -TIMERCAL_MAX_PPM && record->timerPpm <= TIMERCAL_MAX_PPM)
+    CHECK_FIELD(contactStatistic,   record->contactStatistic < NB_CONTACT_STATISTICS)
+    CHECK_FIELD(contactWindow,      record->contactWindow >= 1 && record->contactWindow <= CONTACT_WINDOW_MAX && (record->contactWindow & 1))
+    CHECK_FIELD(contactHold,        record->contactHold >= 1 && record->contactHold <= CONTACT_HOLD_MAX)
+    
+#undef CHECK_FIELD
+    
+    return nbRejected;
+    }
+
+/* the BKP_USER registers of the versions before the settings store; 0 was never written */
+static bool SETTINGS_ReadLegacy(Settings_Record_struct *record)
+    {
+    u32 frequency = UTIL_ReadBackupRegister(BKP_FREQUENCY);
+    u32 pulseSeq = UTIL_ReadBackupRegister(BKP_PULSESEQ);
+    u32 peakVoltage = UTIL_ReadBackupRegister(BKP_PULSEPEAKVOLTAGE);
+    u32 currentTarget = UTIL_ReadBackupRegister(BKP_CURRENTTARGET);
+    
+    if(!frequency && !pulseSeq && !peakVoltage && !currentTarget) return FALSE;
+    
+    // values too large for the fields are made invalid, SETTINGS_Validate rejects them
+    *record = SettingsDefaults;
+    if(frequency)       record->frequency_Hz = (frequency <= FREQUENCY_LEGACY_CODE_MAX) ? frequency * 1000 : frequency;
+    if(pulseSeq)        record->pulseSeq = (pulseSeq <= 0xFF) ? pulseSeq : 0;
+    if(peakVoltage)     record->peakVoltage = (peakVoltage <= 0xFF) ? peakVoltage : 0;
+    if(currentTarget)   record->currentTarget = (currentTarget <= 0xFFFF) ? currentTarget : 1;
+    return TRUE;
+    }
+
+/*******************************************************************************
+* Function Name  : SETTINGS_ReadFlash
+* Description    : Finds the newest valid STORE record of the session log flash;
+                   the newest sector first, the older ones if it holds none
+* Input          : None
+* Return         : TRUE if found, in record
+*******************************************************************************/
+static bool SETTINGS_ReadFlash(Settings_Record_struct *record)
+    {
+    Settings_Record_struct candidate;
+    u16 sequence[LOG_FLASH_NB_SECTORS];
+    bool isValid[LOG_FLASH_NB_SECTORS];
+    u8 i, k, newest;
+    
+    for(i=0; i<LOG_FLASH_NB_SECTORS; i++)
+        {
+        isValid[i] = LOG_ReadHeader(i, &sequence[i]);
+        }
+    
+    for(k=0; k<LOG_FLASH_NB_SECTORS; k++)
+        {
+        const u8 *sector;
+        u32 offset = LOG_HEADER_SIZE;
+        bool isFound = FALSE;
+        
+        newest = LOG_FLASH_NB_SECTORS;
+        for(i=0; i<LOG_FLASH_NB_SECTORS; i++)
+            {
+            if(isValid[i] && (newest == LOG_FLASH_NB_SECTORS || (s16)(sequence[i] - sequence[newest]) > 0)) newest = i;
+            }
+        if(newest == LOG_FLASH_NB_SECTORS) break;
+        isValid[newest] = FALSE;
+        
+        // the last valid copy of the sector; a torn one is skipped
+        sector = LOG_FlashSector(newest);
+        while(offset + LOG_RECORD_HEADER_SIZE <= LOG_FLASH_SECTOR_SIZE && sector[offset] != LOG_ERASED)
+            {
+            u8 length = sector[offset+1];
+            
+            if(offset + LOG_RECORD_HEADER_SIZE + length > LOG_FLASH_SECTOR_SIZE) break;
+            if(sector[offset] == LOG_RECORD_STORE && SETTINGS_Decode(&sector[offset + LOG_RECORD_HEADER_SIZE], length, &candidate))
+                {
+                *record = candidate;
+                isFound = TRUE;
+                }
+            offset += LOG_RECORD_HEADER_SIZE + length;
+            }
+        if(isFound) return TRUE;
+        }
+    return FALSE;
+    }
+
+/*******************************************************************************
+* Function Name  : SETTINGS_Load
+* Description    : The newest valid record of the backup SRAM, the session log
+                   flash, the registers of older versions or the defaults, in this
+                   order; the backup SRAM is read once
+* Input          : None
+* Return         : where it came from; record, slot: the backup SRAM slot holding it
+*******************************************************************************/
+static SettingsSource_code SETTINGS_Load(Settings_Record_struct *record, u8 *slot)
+    {
+    u8 backup[SETTINGS_NB_SLOTS * SETTINGS_SLOT_SIZE];
+    Settings_Record_struct candidate;
+    bool isFound = FALSE;
+    u8 i;
+    
+    SETTINGS_BackupRead(backup);
+    *slot = SETTINGS_NB_SLOTS - 1;                  // the next write goes to slot 0
+    for(i=0; i<SETTINGS_NB_SLOTS; i++)
+        {
+        if(SETTINGS_Decode(&backup[i * SETTINGS_SLOT_SIZE], SETTINGS_SLOT_SIZE, &candidate)
+           && (!isFound || (s32)(candidate.sequence - record->sequence) > 0))
+            {
+            *record = candidate;
+            *slot = i;
+            isFound = TRUE;
+            }
+        }
+    
+    if(isFound)                         return SETTINGS_SOURCE_BACKUP_SRAM;
+    if(SETTINGS_ReadFlash(record))      return SETTINGS_SOURCE_FLASH;
+    if(SETTINGS_ReadLegacy(record))     return SETTINGS_SOURCE_LEGACY;
+    *record = SettingsDefaults;
+    return SETTINGS_SOURCE_DEFAULTS;
+    }
+
+/* the record to the backup SRAM slot not holding the newest one */
+static void SETTINGS_Write(void)
+    {
+    Settings_Record_struct *record = &Settings.record;
+    
+    record->version = SETTINGS_VERSION;
+    record->length = sizeof(Settings_Record_struct);
+    record->sequence++;
+    record->crc = CRC16_Compute((const u8*)record + 2, record->length - 2, 0xFFFF);
+    Settings.slot = (Settings.slot + 1) % SETTINGS_NB_SLOTS;
+    SETTINGS_BackupWrite(Settings.slot, (const u8*)record, record->length);
+    Settings.nbWrites++;
+    }
+
+/*******************************************************************************
+* Function Name  : SETTINGS_Restore
+* Description    : At the start: loads the record, checks its fields and sets them.
+                   A record from elsewhere than the backup SRAM is written to it, so
+                   the next start takes the short way; the registers of older
+                   versions are cleared once migrated.
+* Input          : None
+* Return         : None
+*******************************************************************************/
+static void SETTINGS_Restore(void)
+    {
+    Settings_Record_struct *record = &Settings.record;
+    
+    memset(&Settings, 0, sizeof(Settings));
+    SETTINGS_BackupInit();
+    Settings.source = SETTINGS_Load(record, &Settings.slot);
+    Settings.nbRejectedFields = SETTINGS_Validate(record);
+    
+    PulseSeq.frequency_Hz = record->frequency_Hz;
+    PulseSeq.pulseSeq = record->pulseSeq;
+    PulseSeq.peakVoltage = record->peakVoltage;
+    CurrentControl.target = record->currentTarget;
+    ReadoutLimit_CAE1_for_Run = record->readoutLimitRun;
+    ReadoutLimit_CAE1_for_Idle = record->readoutLimitIdle;
+    CaeCalibration.ad_value_offset = record->caeOffset;
+    CaeCalibration.ad_value_reciproq_scale = record->caeScale;
+    TimerCalibration.appliedPpm = record->timerPpm;             // kept by TIMERCAL_Init
+    CONTACT_Init(&Contact, record->contactStatistic, record->contactWindow, record->contactHold,
+                 record->readoutLimitRun, record->readoutLimitIdle);
+    
+    if(Settings.source != SETTINGS_SOURCE_BACKUP_SRAM || Settings.nbRejectedFields || record->version != SETTINGS_VERSION)
+        {
+        SETTINGS_Write();
+        }
+    if(Settings.source == SETTINGS_SOURCE_LEGACY)
+        {
+        UTIL_WriteBackupRegister(BKP_FREQUENCY, 0);
+        UTIL_WriteBackupRegister(BKP_PULSESEQ, 0);
+        UTIL_WriteBackupRegister(BKP_PULSEPEAKVOLTAGE, 0);
+        UTIL_WriteBackupRegister(BKP_CURRENTTARGET, 0);
+        }
+    if(Settings.source != SETTINGS_SOURCE_FLASH)
+        {
+        Settings.flashDelay = SETTINGS_FLASH_DELAY_SECONDS;    // the flash copy may be older
+        }
+    }
+
+/*******************************************************************************
+* Function Name  : SETTINGS_Service
+* Description    : Main context; writes changed settings to the backup SRAM, and
+                   their flash copy once they have settled
+* Input          : bool isNewSecond: at each RTC second
+* Return         : None
+*******************************************************************************/
+static void SETTINGS_Service(bool isNewSecond)
+    {
+    Settings_Record_struct record;
+    
+    if(Settings.isChangePending)
+        {
+        Settings.isChangePending = FALSE;           // before the settings are read; a later change sets it again
+        record = Settings.record;
+        record.frequency_Hz = PulseSeq.frequency_Hz;
+        record.pulseSeq = PulseSeq.pulseSeq;
+        record.peakVoltage = PulseSeq.peakVoltage;
+        record.currentTarget = CurrentControl.target;
+        record.readoutLimitRun = ReadoutLimit_CAE1_for_Run;
+        record.readoutLimitIdle = ReadoutLimit_CAE1_for_Idle;
+        record.caeOffset = CaeCalibration.ad_value_offset;
+        record.caeScale = CaeCalibration.ad_value_reciproq_scale;
+        record.timerPpm = TimerCalibration.appliedPpm;
+        record.contactStatistic = Contact.statistic;
+        record.contactWindow = Contact.window;
+        record.contactHold = Contact.hold;
+        
+        if(memcmp((const u8*)&record + SETTINGS_HEADER_SIZE, (const u8*)&Settings.record + SETTINGS_HEADER_SIZE,
+                  sizeof(record) - SETTINGS_HEADER_SIZE) != 0)
+            {
+            Settings.record = record;
+            SETTINGS_Write();
+            Settings.flashDelay = SETTINGS_FLASH_DELAY_SECONDS;
+            }
+        }
+    
+    if(isNewSecond && Settings.flashDelay && --Settings.flashDelay == 0)
+        {
+        SETTINGS_PutFlashCopy();
+        }
+    }
+
+/* the record to the session log; again at the next second if its buffer is full */
+static void SETTINGS_PutFlashCopy(void)
+    {
+    if(LOG_PutRecord(LOG_RECORD_STORE, (const u8*)&Settings.record, Settings.record.length))
+        {
+        Settings.nbFlashCopies++;
+        }
+    else
+        {
+        Settings.flashDelay = 1;
+        }
+    }
+
+/* at Quit and ShutDown, before LOG_Flush */
+static void SETTINGS_Flush(void)
+    {
+    SETTINGS_Service(FALSE);
+    if(Settings.flashDelay)
+        {
+        Settings.flashDelay = 0;
+        SETTINGS_PutFlashCopy();
+        }
+    }
+
+#ifdef STIM32_HOST
+
+/* settings store figures, for the host harness; returns where the settings were restored from */
+const char* HOST_GetSettingsCounters(u32 *sequence, u32 *frequency_Hz, u32 *nbRejectedFields, u32 *nbWrites, u32 *nbFlashCopies)
+    {
+    static const char* const SourceName[] = { "defaults", "backup SRAM", "flash", "legacy registers" };     // SettingsSource_code
+    
+    *sequence = Settings.record.sequence;
+    *frequency_Hz = Settings.record.frequency_Hz;
+    *nbRejectedFields = Settings.nbRejectedFields;
+    *nbWrites = Settings.nbWrites;
+    *nbFlashCopies = Settings.nbFlashCopies;
+    return SourceName[Settings.source];
+    }
+
+/* seals a record in data as SETTINGS_Write does, with any version and length */
+static void HOST_SealSettings(u8 *data, u8 version, u8 length)
+    {
+    u16 crc;
+    
+    data[2] = version;
+    data[3] = length;
+    crc = CRC16_Compute(data + 2, length - 2, 0xFFFF);
+    data[0] = crc;
+    data[1] = crc >> 8;
+    }
+
+static void HOST_PutBackupSlot(u8 slot, const Settings_Record_struct *record, u8 length)
+    {
+    u8 *data = &HOST_BackupSram[slot * SETTINGS_SLOT_SIZE];
+    
+    memset(data, 0, SETTINGS_SLOT_SIZE);
+    memcpy(data, record, length);
+    HOST_SealSettings(data, SETTINGS_VERSION, length);
+    }
+
+/* a STORE record at offset of a log sector with the given header; returns the offset after it */
+static u32 HOST_PutStoreRecord(u8 sector, u16 sequence, u32 offset, const Settings_Record_struct *record)
+    {
+    u8 *flash = HOST_LogFlash[sector];
+    
+    flash[0] = sequence;
+    flash[1] = sequence >> 8;
+    flash[2] = ~sequence;
+    flash[3] = (u16)~sequence >> 8;
+    flash[offset] = LOG_RECORD_STORE;
+    flash[offset+1] = sizeof(*record);
+    memcpy(&flash[offset + LOG_RECORD_HEADER_SIZE], record, sizeof(*record));
+    HOST_SealSettings(&flash[offset + LOG_RECORD_HEADER_SIZE], SETTINGS_VERSION, sizeof(*record));
+    return offset + LOG_RECORD_HEADER_SIZE + sizeof(*record);
+    }
+
+/* a lost backup domain and an erased flash */
+static void HOST_ClearSettings(void)
+    {
+    memset(HOST_BackupSram, 0, sizeof(HOST_BackupSram));
+    memset(HOST_LogFlash, LOG_ERASED, sizeof(HOST_LogFlash));
+    UTIL_WriteBackupRegister(BKP_FREQUENCY, 0);
+    UTIL_WriteBackupRegister(BKP_PULSESEQ, 0);
+    UTIL_WriteBackupRegister(BKP_PULSEPEAKVOLTAGE, 0);
+    UTIL_WriteBackupRegister(BKP_CURRENTTARGET, 0);
+    }
+
+static bool HOST_LoadSettings(Settings_Record_struct *record, SettingsSource_code source, u8 nbRejected)
+    {
+    u8 slot;
+    
+    if(SETTINGS_Load(record, &slot) != source) return FALSE;
+    return SETTINGS_Validate(record) == nbRejected;
+    }
+
+/*******************************************************************************
+* Function Name  : HOST_CheckSettings
+* Description    : Restores the settings from corrupt, torn, lost, older and newer
+                   records; the backup SRAM, the log flash and the registers are
+                   put back afterwards
+* Input          : None
+* Return         : number of cases failed; nbCases
+*******************************************************************************/
+u32 HOST_CheckSettings(u32 *nbCases)
+    {
+    static u8 savedFlash[LOG_FLASH_NB_SECTORS][LOG_FLASH_SECTOR_SIZE];
+    u8 savedBackup[sizeof(HOST_BackupSram)];
+    u32 savedRegister[4];
+    Settings_struct savedSettings = Settings;
+    FILE *backupFile = HOST_BackupFile;
+    Settings_Record_struct r, base = SettingsDefaults;
+    u8 data[SETTINGS_SLOT_SIZE];
+    u32 nbFailures = 0, offset;
+    
+    memcpy(savedFlash, HOST_LogFlash, sizeof(HOST_LogFlash));
+    memcpy(savedBackup, HOST_BackupSram, sizeof(HOST_BackupSram));
+    savedRegister[0] = UTIL_ReadBackupRegister(BKP_FREQUENCY);
+    savedRegister[1] = UTIL_ReadBackupRegister(BKP_PULSESEQ);
+    savedRegister[2] = UTIL_ReadBackupRegister(BKP_PULSEPEAKVOLTAGE);
+    savedRegister[3] = UTIL_ReadBackupRegister(BKP_CURRENTTARGET);
+    HOST_BackupFile = 0;                            // not written through
+    *nbCases = 0;
+    
+#define EXPECT(isPassed)    { (*nbCases)++; if(!(isPassed)) nbFailures++; }
+    
+    // two valid copies: the newer one, also across the wrap of the sequence number
+    HOST_ClearSettings();
+    r = base; r.sequence = 0xFFFFFFFF; r.frequency_Hz = 2000; HOST_PutBackupSlot(0, &r, sizeof(r));
+    r = base; r.sequence = 0;          r.frequency_Hz = 3000; HOST_PutBackupSlot(1, &r, sizeof(r));
+    EXPECT(HOST_LoadSettings(&r, SETTINGS_SOURCE_BACKUP_SRAM, 0) && r.frequency_Hz == 3000)
+    
+    // the newer one corrupt: the older one
+    HOST_BackupSram[SETTINGS_SLOT_SIZE + 9] ^= 0x01;
+    EXPECT(HOST_LoadSettings(&r, SETTINGS_SOURCE_BACKUP_SRAM, 0) && r.frequency_Hz == 2000)
+    
+    // both corrupt: the last copy in the newest flash sector
+    HOST_BackupSram[9] ^= 0x01;
+    r = base; r.frequency_Hz = 900;
+    HOST_PutStoreRecord(1, 6, LOG_HEADER_SIZE, &r);
+    r = base; r.frequency_Hz = 500;
+    offset = HOST_PutStoreRecord(0, 7, LOG_HEADER_SIZE, &r);
+    r = base; r.frequency_Hz = 700;
+    HOST_PutStoreRecord(0, 7, offset, &r);
+    EXPECT(HOST_LoadSettings(&r, SETTINGS_SOURCE_FLASH, 0) && r.frequency_Hz == 700)
+    
+    // the last copy torn by a power loss: the one before
+    memset(&HOST_LogFlash[0][offset + LOG_RECORD_HEADER_SIZE + 10], LOG_ERASED, sizeof(r) - 10);
+    EXPECT(HOST_LoadSettings(&r, SETTINGS_SOURCE_FLASH, 0) && r.frequency_Hz == 500)
+    
+    // no copy in the newest sector yet: the older sector
+    memset(&HOST_LogFlash[0][LOG_HEADER_SIZE], LOG_ERASED, LOG_FLASH_SECTOR_SIZE - LOG_HEADER_SIZE);
+    EXPECT(HOST_LoadSettings(&r, SETTINGS_SOURCE_FLASH, 0) && r.frequency_Hz == 900)
+    
+    // upgrade from the registers of older versions, 2 is the code of 2 kHz
+    HOST_ClearSettings();
+    UTIL_WriteBackupRegister(BKP_FREQUENCY, 2);
+    UTIL_WriteBackupRegister(BKP_PULSESEQ, 3);
+    UTIL_WriteBackupRegister(BKP_PULSEPEAKVOLTAGE, PULSEPEAKVOLTAGE_6V);
+    UTIL_WriteBackupRegister(BKP_CURRENTTARGET, 150);
+    EXPECT(HOST_LoadSettings(&r, SETTINGS_SOURCE_LEGACY, 0) && r.frequency_Hz == 2000 && r.pulseSeq == 3
+           && r.peakVoltage == PULSEPEAKVOLTAGE_6V && r.currentTarget == 150 && r.caeScale == base.caeScale)
+    
+    // garbage in the registers, taken by older versions: rejected field by field
+    UTIL_WriteBackupRegister(BKP_FREQUENCY, 12345);
+    UTIL_WriteBackupRegister(BKP_PULSESEQ, 7);
+    UTIL_WriteBackupRegister(BKP_PULSEPEAKVOLTAGE, 0x103);
+    UTIL_WriteBackupRegister(BKP_CURRENTTARGET, 151);
+    EXPECT(HOST_LoadSettings(&r, SETTINGS_SOURCE_LEGACY, 3) && r.frequency_Hz == 12345 && r.pulseSeq == base.pulseSeq
+           && r.peakVoltage == base.peakVoltage && r.currentTarget == base.currentTarget)
+    
+    // nothing stored, or a backup SRAM of random content: the defaults
+    HOST_ClearSettings();
+    EXPECT(HOST_LoadSettings(&r, SETTINGS_SOURCE_DEFAULTS, 0) && memcmp(&r, &base, sizeof(r)) == 0)
+    memset(HOST_BackupSram, 0xA5, sizeof(HOST_BackupSram));
+    EXPECT(HOST_LoadSettings(&r, SETTINGS_SOURCE_DEFAULTS, 0))
+    
+    // a valid record with fields out of range: only these take their defaults
+    HOST_ClearSettings();
+    r = base; r.frequency_Hz = FREQUENCY_MIN_HZ - 1; r.pulseSeq = NB_PULSE_SEQUENCES + 1; r.caeScale = 0;
+    r.timerPpm = -TIMERCAL_MAX_PPM - 1; r.readoutLimitRun = 80;
+    HOST_PutBackupSlot(0, &r, sizeof(r));
+    EXPECT(HOST_LoadSettings(&r, SETTINGS_SOURCE_BACKUP_SRAM, 4) && r.frequency_Hz == base.frequency_Hz
+           && r.pulseSeq == base.pulseSeq && r.caeScale == base.caeScale && r.timerPpm == base.timerPpm && r.readoutLimitRun == 80)
+    
+    // a shorter record of an older version: the fields it lacks take their defaults
+    r = base; r.frequency_Hz = 2500; r.readoutLimitRun = 80;
+    HOST_PutBackupSlot(0, &r, (u8*)&r.readoutLimitRun - (u8*)&r);
+    EXPECT(HOST_LoadSettings(&r, SETTINGS_SOURCE_BACKUP_SRAM, 0) && r.frequency_Hz == 2500 && r.readoutLimitRun == base.readoutLimitRun)
+    
+    // a version 1 record: its inverted band of readout limits is turned around
+    HOST_ClearSettings();
+    r = base; r.readoutLimitRun = 60; r.readoutLimitIdle = 100;
+    memcpy(HOST_BackupSram, &r, (u8*)&r.contactStatistic - (u8*)&r);
+    HOST_SealSettings(HOST_BackupSram, 1, (u8*)&r.contactStatistic - (u8*)&r);
+    EXPECT(HOST_LoadSettings(&r, SETTINGS_SOURCE_BACKUP_SRAM, 0) && r.readoutLimitRun == 100 && r.readoutLimitIdle == 60
+           && r.contactStatistic == base.contactStatistic && r.contactWindow == base.contactWindow)
+
+    // an empty band, an even window, no hold, an unknown statistic: their defaults
+    r = base; r.readoutLimitRun = 80; r.readoutLimitIdle = 80; r.contactWindow = 8; r.contactHold = 0;
+    r.contactStatistic = NB_CONTACT_STATISTICS;
+    HOST_PutBackupSlot(0, &r, sizeof(r));
+    EXPECT(HOST_LoadSettings(&r, SETTINGS_SOURCE_BACKUP_SRAM, 4) && r.readoutLimitRun == 80 && r.readoutLimitIdle == base.readoutLimitIdle
+           && r.contactWindow == base.contactWindow && r.contactHold == base.contactHold && r.contactStatistic == base.contactStatistic)
+
+    // a record of a newer version: the fields known
+    memset(data, 0x5A, sizeof(data));
+    r = base; r.frequency_Hz = 4000;
+    memcpy(data, &r, sizeof(r));
+    HOST_SealSettings(data, SETTINGS_VERSION + 1, SETTINGS_SLOT_SIZE);
+    memcpy(HOST_BackupSram, data, SETTINGS_SLOT_SIZE);
+    EXPECT(HOST_LoadSettings(&r, SETTINGS_SOURCE_BACKUP_SRAM, 0) && r.frequency_Hz == 4000 && r.version == SETTINGS_VERSION + 1)
+    
+    // written alternately: a write cut short leaves the previous record
+    HOST_ClearSettings();
+    Settings.record = base;
+    Settings.slot = SETTINGS_NB_SLOTS - 1;
+    Settings.record.frequency_Hz = 1500; SETTINGS_Write();
+    Settings.record.frequency_Hz = 1600; SETTINGS_Write();
+    EXPECT(HOST_LoadSettings(&r, SETTINGS_SOURCE_BACKUP_SRAM, 0) && r.frequency_Hz == 1600 && r.sequence == 2)
+    Settings.record.frequency_Hz = 1700; SETTINGS_Write();
+    memset(&HOST_BackupSram[Settings.slot * SETTINGS_SLOT_SIZE + 12], 0, sizeof(r) - 12);
+    EXPECT(HOST_LoadSettings(&r, SETTINGS_SOURCE_BACKUP_SRAM, 0) && r.frequency_Hz == 1600)
+    
+#undef EXPECT
+    
+    Settings = savedSettings;
+    HOST_BackupFile = backupFile;
+    memcpy(HOST_LogFlash, savedFlash, sizeof(HOST_LogFlash));
+    memcpy(HOST_BackupSram, savedBackup, sizeof(HOST_BackupSram));
+    UTIL_WriteBackupRegister(BKP_FREQUENCY, savedRegister[0]);
+    UTIL_WriteBackupRegister(BKP_PULSESEQ, savedRegister[1]);
+    UTIL_WriteBackupRegister(BKP_PULSEPEAKVOLTAGE, savedRegister[2]);
+    UTIL_WriteBackupRegister(BKP_CURRENTTARGET, savedRegister[3]);
+    return nbFailures;
+    }
+
+#endif // STIM32_HOST
+
+/*******************************************************************************
+* Function Group : CRC
+* Description    : CRC-16/CCITT (polynomial 0x1021, MSB first), 4 bits at a time
+                   with a 16 entry table; start with 0xFFFF
+*******************************************************************************/
+static const u16 Crc16Table[16] = 
+    { 0x0000, 0x1021, 0x2042, 0x3063, 0x4084, 0x50A5, 0x60C6, 0x70E7,
+      0x8108, 0x9129, 0xA14A, 0xB16B, 0xC18C, 0xD1AD, 0xE1CE, 0xF1EF };
+
+static u16 CRC16_Compute(const u8 *data, u32 length, u16 crc)
+    {
+    while(length--)
+        {
+        crc = (crc << 4) ^ Crc16Table[(crc >> 12) ^ (*data >> 4)];
+        crc = (crc << 4) ^ Crc16Table[(crc >> 12) ^ (*data++ & 0x0F)];
+        }
+    return crc;
+    }
+
+/*******************************************************************************
+* Function Group : Telemetry
+* Description    : Every readout record goes out on the CX USART, for the tuning
+                   of the thresholds on a PC. The records come from STIMULATOR_Handler
+                   through the readout queue, so the SysTick does not see any of this;
+                   ProcessReadouts() packs them into packets (little endian):
+                   
+                   type (1), sequence, timestamp of the first record (SysTick count, u32),
+                   dropped records since the start (u16), nbRecords,
+                   nbRecords x { SysTicks since the previous record (u8), 
+                                 CAE1 | stimState << 13 | isOverloaded << 15 (u16) },
+                   CRC16 of all the above
+                   
+                   The replies to the serial commands are packets of their own (type 2,
+                   sequence, text, CRC16) in the same stream.
+                   
+                   A packet ends after TELEMETRY_MAX_RECORDS records, at a gap of more than
+                   255 SysTicks and at the end of each frame. It is COBS encoded (no 0
+                   inside) and ended with a 0, so a receiver synchronises on the 0. The
+                   frames are collected in one TX buffer while the DMA sends the other 
+                   one; a packet that does not fit is dropped and its records are 
+                   counted in the packet header. The CPU time is a few us per packet,
+                   in the main context.
+                   In the host build, the bytes go to HOST_SetSerialSink() and the USART
+                   is busy for their time at TELEMETRY_BAUD_RATE (pulse timer time).
+*******************************************************************************/
+#ifdef STIM32_HOST
+
+static void (*HOST_SerialSink)(const u8 *data, u32 length);
+static u32 HOST_SerialBusyUntil;
+
+void HOST_SetSerialSink(void (*sink)(const u8 *data, u32 length))
+    {
+    HOST_SerialSink = sink;
+    }
+
+/* telemetry counters, for the host harness */
+void HOST_GetTelemetryCounters(u32 *nbPackets, u32 *nbRecords, u32 *nbBytes, u32 *nbDropped)
+    {
+    *nbPackets = Telemetry.nbPackets;
+    *nbRecords = Telemetry.nbRecords;
+    *nbBytes = Telemetry.nbBytes;
+    *nbDropped = Telemetry.nbDropped;
+    }
+
+static void TELEMETRY_Init(void)
+    {
+    memset(&Telemetry, 0, sizeof(Telemetry));
+    HOST_SerialBusyUntil = HOST_PulseTimerNow();
+    }
+
+static void TELEMETRY_SetClock(void)
+    {
+    }
+
+static bool TELEMETRY_IsBusy(void)
+    {
+    return (s32)(HOST_PulseTimerNow() - HOST_SerialBusyUntil) < 0;
+    }
+
+static void TELEMETRY_StartTransfer(const u8 *data, u32 length)
+    {
+    if(HOST_SerialSink) HOST_SerialSink(data, length);
+    HOST_SerialBusyUntil = HOST_PulseTimerNow() + length * 10 * (PULSE_TIMER_FREQUENCY_HZ / 1000) / (TELEMETRY_BAUD_RATE / 1000);
+    }
+
+#else
+
+static void TELEMETRY_Init(void)
+    {
+    tCX_USART_Config s_UsartInit;
+    
+    memset(&Telemetry, 0, sizeof(Telemetry));
+    
+    // pins and baud rate by CircleOS; the DMA on top of it
+    s_UsartInit.Speed = TELEMETRY_BAUD_RATE;
+    s_UsartInit.WordLength = CX_USART_WordLength_8b;
+    s_UsartInit.StopBits = CX_USART_StopBits_1;
+    s_UsartInit.Parity = CX_USART_Parity_No;
+    s_UsartInit.HardwareFlowControl = CX_USART_HardwareFlowControl_None;
+    s_UsartInit.RxBuffer = 0;
+    s_UsartInit.RxBufferLen = 0;
+    s_UsartInit.TxBuffer = 0;                           // sent by the DMA
+    s_UsartInit.TxBufferLen = 0;
+    CX_Configure( CX_USART, &s_UsartInit, 0 );
+    
+    RCC->AHB1ENR |= RCC_AHB1ENR_DMA2EN;
+    TELEMETRY_DMA->CR = 0;
+    TELEMETRY_DMA->PAR = (u32)&TELEMETRY_USART->DR;
+    TELEMETRY_DMA->CR = DMA_CHANNEL_4 | DMA_SxCR_MINC | DMA_SxCR_DIR_0;      // bytes, memory to USART, low priority
+    TELEMETRY_USART->CR3 |= USART_CR3_DMAT;
+    TELEMETRY_SetClock();
+    }
+
+/* the APB2 clock follows the governor; the new divider is set when the USART is idle */
+static void TELEMETRY_SetClock(void)
+    {
+    Telemetry.isClockChanged = TRUE;
+    }
+
+static bool TELEMETRY_IsBusy(void)
+    {
+    static const u8 apbShift[8]  = { 0,0,0,0, 1,2,3,4 };
+    
+    if((TELEMETRY_DMA->CR & DMA_SxCR_EN) || !(TELEMETRY_USART->SR & USART_SR_TC))
+        {
+        return TRUE;
+        }
+    if(Telemetry.isClockChanged)
+        {
+        u32 pclk2Hz = RCC_GetHclkHz() >> apbShift[(RCC->CFGR & RCC_CFGR_PPRE2) >> 13];
+        
+        TELEMETRY_USART->BRR = (pclk2Hz + TELEMETRY_BAUD_RATE/2) / TELEMETRY_BAUD_RATE;    // OVER8=0: 16x oversampling
+        Telemetry.isClockChanged = FALSE;
+        }
+    return FALSE;
+    }
+
+static void TELEMETRY_StartTransfer(const u8 *data, u32 length)
+    {
+    DMA2->HIFCR = TELEMETRY_DMA_FLAGS;
+    TELEMETRY_DMA->M0AR = (u32)data;
+    TELEMETRY_DMA->NDTR = length;
+    TELEMETRY_DMA->CR |= DMA_SxCR_EN;
+    }
+
+#endif // STIM32_HOST
+
+/* COBS: each 0 is replaced by the distance to the next one; returns the frame length with its 0 delimiter */
+static u32 TELEMETRY_CobsEncode(const u8 *data, u32 length, u8 *frame)
+    {
+    u32 codeIndex = 0, n = 1;
+    u8 code = 1;
+    
+    while(length--)
+        {
+        if(*data == 0)
+            {
+            frame[codeIndex] = code;
+            code = 1;
+            codeIndex = n++;
+            data++;
+            }
+        else
+            {
+            frame[n++] = *data++;
+            if(++code == 0xFF)
+                {
+                frame[codeIndex] = code;
+                code = 1;
+                codeIndex = n++;
+                }
+            }
+        }
+    frame[codeIndex] = code;
+    frame[n++] = 0;
+    return n;
+    }
+
+static void TELEMETRY_Put16(u8 *p, u16 value)
+    {
+    p[0] = value;
+    p[1] = value >> 8;
+    }
+
+/* sequence number, CRC and COBS frame of the packet into the TX buffer; FALSE if it does not fit */
+static bool TELEMETRY_PutPacket(u32 length)
+    {
+    u8 *tx = Telemetry.txBuffer[Telemetry.fill];
+    u32 *txLength = &Telemetry.txLength[Telemetry.fill];
+    
+    if(*txLength + length + 4 > TELEMETRY_TX_BUFFER_SIZE)      // CRC, COBS code byte (< 254 bytes), 0 delimiter
+        {
+        return FALSE;
+        }
+    Telemetry.packet[1] = Telemetry.sequence++;
+    TELEMETRY_Put16(&Telemetry.packet[length], CRC16_Compute(Telemetry.packet, length, 0xFFFF));
+    *txLength += TELEMETRY_CobsEncode(Telemetry.packet, length + 2, tx + *txLength);
+    Telemetry.nbPackets++;
+    return TRUE;
+    }
+
+/*******************************************************************************
+* Function Name  : TELEMETRY_Flush
+* Description    : Ends the packet: CRC, COBS frame into the TX buffer
+* Input          : None
+* Return         : None
+*******************************************************************************/
+static void TELEMETRY_Flush(void)
+    {
+    if(Telemetry.nbPacketRecords == 0) return;
+    
+    Telemetry.packet[TELEMETRY_HEADER_SIZE-1] = Telemetry.nbPacketRecords;
+    if(TELEMETRY_PutPacket(Telemetry.length))
+        {
+        Telemetry.nbRecords += Telemetry.nbPacketRecords;
+        }
+    else
+        {
+        Telemetry.nbDropped += Telemetry.nbPacketRecords;
+        }
+    Telemetry.nbPacketRecords = 0;
+    }
+
+/* a reply packet (type, sequence, text) after the records so far; FALSE if it does not fit */
+static bool TELEMETRY_SendReply(const char *text)
+    {
+    u32 length = strlen(text);
+    
+    TELEMETRY_Flush();
+    Telemetry.packet[0] = TELEMETRY_PACKET_TYPE_REPLY;
+    memcpy(&Telemetry.packet[2], text, length);
+    return TELEMETRY_PutPacket(2 + length);
+    }
+
+static void TELEMETRY_AddReadout(const Readout_Record_struct *record)
+    {
+    u32 ticks = record->timestamp - Telemetry.lastTimestamp;
+    u8 *p;
+    
+    if(Telemetry.nbPacketRecords == TELEMETRY_MAX_RECORDS || ticks > 0xFF)
+        {
+        TELEMETRY_Flush();
+        }
+    if(Telemetry.nbPacketRecords == 0)
+        {
+        Telemetry.packet[0] = TELEMETRY_PACKET_TYPE_READOUTS;
+        Telemetry.packet[2] = record->timestamp;
+        Telemetry.packet[3] = record->timestamp >> 8;
+        Telemetry.packet[4] = record->timestamp >> 16;
+        Telemetry.packet[5] = record->timestamp >> 24;
+        TELEMETRY_Put16(&Telemetry.packet[6], ReadoutQueue.nbDropped + Telemetry.nbDropped);
+        Telemetry.length = TELEMETRY_HEADER_SIZE;
+        ticks = 0;
+        }
+    p = &Telemetry.packet[Telemetry.length];
+    p[0] = ticks;
+    TELEMETRY_Put16(p+1, record->CAE1 | (record->stimState << 13) | (record->isOverloaded ? 0x8000 : 0));
+    Telemetry.length += TELEMETRY_RECORD_SIZE;
+    Telemetry.nbPacketRecords++;
+    Telemetry.lastTimestamp = record->timestamp;
+    }
+
+/* hands the filled TX buffer to the DMA when the other one is sent */
+static void TELEMETRY_Service(void)
+    {
+    u8 fill = Telemetry.fill;
+    
+    if(Telemetry.txLength[fill] == 0 || TELEMETRY_IsBusy()) return;
+    
+    TELEMETRY_StartTransfer(Telemetry.txBuffer[fill], Telemetry.txLength[fill]);
+    Telemetry.nbBytes += Telemetry.txLength[fill];
+    Telemetry.fill = fill ^ 1;
+    Telemetry.txLength[fill ^ 1] = 0;
+    }
+
+/*******************************************************************************
+* Function Group : Serial commands
+* Description    : The settings can be set and queried by text lines on the RX line
+                   of the CX USART (921600 8N1), e.g. from a PC:
+                   
+                   F<Hz>        sequence rate, FREQUENCY_MIN_HZ..FREQUENCY_MAX_HZ
+                   S<n>         pulse sequence, 1..NB_PULSE_SEQUENCES
+                   V<8|6|4>     peak voltage (8 only if the battery allows it)
+                   I<CAE>       constant current target of CurrentTargetTable, 0: voltage mode
+                   ?            nothing; every line is answered with the settings
+                   
+                   Commands are separated by spaces (or ',' ';'), a line ends with CR or LF.
+                   The commands of a line are a batch: they are checked as they come in,
+                   and at the end of the line either all of them are applied together
+                   or none (reply "ERR <column>" of the first bad character). The reply
+                   "OK F1000 S1 V8 I0" gives the settings after the line.
+                   
+                   The DMA writes the received bytes into a circular buffer; the idle line
+                   interrupt of the USART (one character after the end of a line) parses
+                   them, one byte at a time, without a line buffer and without any
+                   allocation. A complete line is applied right there, the way the menu
+                   handlers do it (UpdatePulseSequence), and its settings are compiled
+                   together into the next pulse configuration and published, taken by the
+                   pulse engine in the wait after the running sequence, a faster rate
+                   from the last sequence start (PULSEENGINE_TakeInWait): no SysTick in
+                   between, within one sequence period at 1 kHz and more.
+                   Lines sent back to back do not idle the line; STIMULATOR_Handler pends
+                   the interrupt for the bytes it left (COMMAND_Poll). The interrupt is
+                   below the pulse interrupts, which preempt it as they preempt the
+                   SysTick, and above the SysTick. The replies are queued to the main
+                   context and sent in the telemetry stream.
+                   The time from the end of the line to the first edge played with its
+                   settings is measured (TIMERCAL clock). In the host build, the bytes come
+                   from HOST_SerialReceive(), which runs the interrupt, and the line ends
+                   at the time it was called.
+*******************************************************************************/
+#ifdef STIM32_HOST
+
+static u32 HOST_SerialRxHead;
+static u32 HOST_SerialRxTime;
+
+/* the RX line: bytes received between two SysTicks, at the current pulse timer time */
+void HOST_SerialReceive(const u8 *data, u32 length)
+    {
+    while(length--)
+        {
+        if(HOST_SerialRxHead - Command.rxTail == COMMAND_RX_BUFFER_SIZE)
+            {
+            Command.nbOverruns++;
+            Command.rxTail++;                   // the circular DMA overwrites the oldest byte
+            }
+        Command.rxBuffer[HOST_SerialRxHead++ % COMMAND_RX_BUFFER_SIZE] = *data++;
+        }
+    HOST_SerialRxTime = HOST_PulseTimerNow();
+    COMMAND_IRQHandler();                       // the line is idle after the bytes
+    }
+
+static void (*HOST_PublishPreemption)(void);
+
+/* called by STIMULATOR_Handler between its publish test and PULSEENGINE_Publish, where
+   the RX interrupt may come in on the target; the harness sends a line from there */
+void HOST_SetPublishPreemption(void (*preemption)(void))
+    {
+    HOST_PublishPreemption = preemption;
+    }
+
+static void HOST_PreemptPublish(void)
+    {
+    if(HOST_PublishPreemption) HOST_PublishPreemption();
+    }
+
+/* command counters and the latency to the first edge, for the host harness */
+void HOST_GetCommandCounters(u32 *nbLines, u32 *nbErrors, u32 *nbLatencies, u32 *minLatency_us, u32 *maxLatency_us, u32 *meanLatency_us)
+    {
+    *nbLines = Command.nbLines;
+    *nbErrors = Command.nbErrors;
+    *nbLatencies = Command.nbLatencies;
+    *minLatency_us = Command.minLatency_us;
+    *maxLatency_us = Command.maxLatency_us;
+    *meanLatency_us = Command.nbLatencies ? Command.sumLatency_us / Command.nbLatencies : 0;
+    }
+
+static void COMMAND_Init(void)
+    {
+    memset(&Command, 0, sizeof(Command));
+    HOST_SerialRxHead = 0;
+    }
+
+static u32 COMMAND_RxHead(void)
+    {
+    return HOST_SerialRxHead;
+    }
+
+static u32 COMMAND_LineTime(void)
+    {
+    return HOST_SerialRxTime;
+    }
+
+static void COMMAND_ClearIdle(void)
+    {
+    }
+
+/* each SysTick: the bytes the RX interrupt did not see (none, the bytes come with it) */
+static void COMMAND_Poll(void)
+    {
+    if(HOST_SerialRxHead != Command.rxTail) COMMAND_IRQHandler();
+    }
+
+#else
+
+/* after TELEMETRY_Init: the USART is set up by CircleOS */
+static void COMMAND_Init(void)
+    {
+    memset(&Command, 0, sizeof(Command));
+    
+    COMMAND_DMA->CR = 0;
+    while(COMMAND_DMA->CR & DMA_SxCR_EN);
+    DMA2->LIFCR = COMMAND_DMA_FLAGS;
+    COMMAND_DMA->PAR = (u32)&TELEMETRY_USART->DR;
+    COMMAND_DMA->M0AR = (u32)Command.rxBuffer;
+    COMMAND_DMA->NDTR = COMMAND_RX_BUFFER_SIZE;
+    COMMAND_DMA->CR = DMA_CHANNEL_4 | DMA_SxCR_MINC | DMA_SxCR_CIRC;     // bytes, USART to memory, low priority
+    COMMAND_DMA->CR |= DMA_SxCR_EN;
+    TELEMETRY_USART->CR3 |= USART_CR3_DMAR;
+    
+    UTIL_SetIrqHandler(COMMAND_USART_IRQ_OFFSET, COMMAND_IRQHandler);
+    NVIC_SetPriority(COMMAND_USART_IRQn, 1);        // below the pulse interrupts, above SysTick
+    TELEMETRY_USART->CR1 |= USART_CR1_IDLEIE;
+    NVIC_EnableIRQ(COMMAND_USART_IRQn);
+    }
+
+/* the running count of the bytes received; NDTR counts down and reloads at 0 */
+static u32 COMMAND_RxHead(void)
+    {
+    static u32 lastIndex = 0, nbWraps = 0;
+    u32 index = COMMAND_RX_BUFFER_SIZE - COMMAND_DMA->NDTR;
+    
+    if(index < lastIndex) nbWraps++;
+    lastIndex = index;
+    return nbWraps * COMMAND_RX_BUFFER_SIZE + index;
+    }
+
+/* the line end is seen one character after its arrival */
+static u32 COMMAND_LineTime(void)
+    {
+    return TIMERCAL_ClockNow();
+    }
+
+/* IDLE is cleared by reading SR, then DR (the DMA has taken the byte) */
+static void COMMAND_ClearIdle(void)
+    {
+    if(TELEMETRY_USART->SR & USART_SR_IDLE)
+        {
+        (void)TELEMETRY_USART->DR;
+        }
+    }
+
+/* each SysTick: bytes not parsed yet (lines back to back do not idle the line), to the RX interrupt */
+static void COMMAND_Poll(void)
+    {
+    if(COMMAND_RX_BUFFER_SIZE - COMMAND_DMA->NDTR != Command.rxTail % COMMAND_RX_BUFFER_SIZE)
+        {
+        NVIC_SetPendingIRQ(COMMAND_USART_IRQn);
+        }
+    }
+
+#endif // STIM32_HOST
+
+/* checks the command that ends here, into the settings of the line */
+static void COMMAND_EndCommand(void)
+    {
+    u32 value = Command.value;
+    u8 i;
+    
+    if(Command.letter == 0 || Command.errorColumn) return;
+    
+    if(!Command.hasValue)
+        {
+        Command.errorColumn = Command.letterColumn;
+        }
+    else switch(Command.letter)
+        {
+        case 'F':
+            if(value < FREQUENCY_MIN_HZ || value > FREQUENCY_MAX_HZ)   Command.errorColumn = Command.letterColumn;
+            Command.frequency_Hz = value;
+            Command.setMask |= COMMAND_SET_FREQUENCY;
+            break;
+        case 'S':
+            if(value < 1 || value > NB_PULSE_SEQUENCES)               Command.errorColumn = Command.letterColumn;
+            Command.pulseSeq = value;
+            Command.setMask |= COMMAND_SET_PULSESEQ;
+            break;
+        case 'V':
+            if(value == 8 && Battery.is8VAvailable)   Command.peakVoltage = PULSEPEAKVOLTAGE_8V;
+            else if(value == 6)                         Command.peakVoltage = PULSEPEAKVOLTAGE_6V;
+            else if(value == 4)                         Command.peakVoltage = PULSEPEAKVOLTAGE_4V;
+            else                                        Command.errorColumn = Command.letterColumn;
+            Command.setMask |= COMMAND_SET_PEAKVOLTAGE;
+            break;
+        case 'I':
+            Command.errorColumn = Command.letterColumn;
+            for(i=0; i<NB_CURRENT_TARGETS; i++)
+                {
+                if(value == CurrentTargetTable[i]) Command.errorColumn = 0;
+                }
+            Command.currentTarget = value;
+            Command.setMask |= COMMAND_SET_CURRENT;
+            break;
+        default:
+            Command.errorColumn = Command.letterColumn;
+            break;
+        }
+    Command.letter = 0;
+    }
+
+/* applies the settings of a good line together and queues the reply */
+static void COMMAND_EndLine(void)
+    {
+    u32 head = Command.replyHead;
+    
+    COMMAND_EndCommand();
+    Command.nbLines++;
+    if(Command.errorColumn)
+        {
+        Command.nbErrors++;
+        }
+    else if(Command.setMask)
+        {
+        if(Command.setMask & COMMAND_SET_FREQUENCY)     PulseSeq.frequency_Hz = Command.frequency_Hz;
+        if(Command.setMask & COMMAND_SET_PULSESEQ)      PulseSeq.pulseSeq = Command.pulseSeq;
+        if(Command.setMask & COMMAND_SET_PEAKVOLTAGE)   PulseSeq.peakVoltage = Command.peakVoltage;
+        if(Command.setMask & COMMAND_SET_CURRENT)       CurrentControl.target = Command.currentTarget;
+        UpdatePulseSequence();
+        Command.lineTime = COMMAND_LineTime();
+        Command.config = 0;                         // a configuration published before is not measured
+        Command.isStartPending = TRUE;
+        }
+    
+    if(head - Command.replyTail == COMMAND_REPLY_QUEUE_SIZE)
+        {
+        Command.nbRepliesLost++;
+        }
+    else
+        {
+        Command.reply[head % COMMAND_REPLY_QUEUE_SIZE].column = Command.errorColumn;
+        MEMORY_BARRIER();
+        Command.replyHead = head + 1;
+        EVENT_Post(EVENT_COMMAND);
+        }
+    
+    Command.column = 0;
+    Command.errorColumn = 0;
+    Command.setMask = 0;
+    }
+
+/*******************************************************************************
+* Function Name  : COMMAND_IRQHandler
+* Description    : Idle line interrupt of the CX USART, or pended by COMMAND_Poll:
+                   parses the bytes received; the settings of the lines are published
+                   to the pulse engine right away, unless the interrupted STIMULATOR_Handler
+                   is publishing or the previous configuration is not taken yet (then
+                   STIMULATOR_Handler publishes them at a next SysTick)
+* Input          : None
+* Return         : None
+*******************************************************************************/
+static void COMMAND_IRQHandler(void)
+    {
+    COMMAND_ClearIdle();
+    COMMAND_Parse();
+    if(PulseSeq.isCompilePending && PulseSeq.nextConfig == 0 && !PulseSeq.isPublishing)
+        {
+        PULSEENGINE_Publish();
+        }
+    }
+
+/*******************************************************************************
+* Function Name  : COMMAND_Parse
+* Description    : Parses the bytes received since the last call (RX interrupt)
+* Input          : None
+* Return         : None
+*******************************************************************************/
+static void COMMAND_Parse(void)
+    {
+    u32 head = COMMAND_RxHead();
+    
+    if(head - Command.rxTail > COMMAND_RX_BUFFER_SIZE)
+        {
+        Command.nbOverruns += head - Command.rxTail - COMMAND_RX_BUFFER_SIZE;
+        Command.rxTail = head - COMMAND_RX_BUFFER_SIZE;
+        }
+    while(Command.rxTail != head)
+        {
+        u8 c = Command.rxBuffer[Command.rxTail++ % COMMAND_RX_BUFFER_SIZE];
+        
+        if(c == '\r' || c == '\n')
+            {
+            if(Command.column) COMMAND_EndLine();      // empty lines (CR LF) are not answered
+            continue;
+            }
+        if(Command.column < 0xFF) Command.column++;
+        if(Command.errorColumn) continue;              // the rest of a bad line is skipped
+        
+        if(c >= '0' && c <= '9' && Command.letter)
+            {
+            Command.value = Command.value * 10 + (c - '0');
+            Command.hasValue = TRUE;
+            if(Command.value > COMMAND_MAX_VALUE) Command.errorColumn = Command.column;
+            }
+        else if(c == ' ' || c == ',' || c == ';' || c == '\t' || c == '?')
+            {
+            COMMAND_EndCommand();
+            }
+        else if((c >= 'A' && c <= 'Z') || (c >= 'a' && c <= 'z'))
+            {
+            COMMAND_EndCommand();
+            Command.letter = c & ~0x20;                 // upper case
+            Command.letterColumn = Command.column;
+            Command.value = 0;
+            Command.hasValue = FALSE;
+            }
+        else
+            {
+            Command.errorColumn = Command.column;
+            }
+        }
+    }
+
+/* a configuration is compiled with the settings of the last line applied */
+static void COMMAND_Published(const Pulse_Config_struct *config)
+    {
+    if(!Command.isStartPending) return;
+    
+    Command.isStartPending = FALSE;
+    Command.config = config;
+    }
+
+/* the pulse engine takes a configuration, its first edge is firstEdgeTicks away (wiper DMA 
+   interrupt or STIMULATOR_Handler): latency of the line applied with it */
+static void COMMAND_Started(const Pulse_Config_struct *config, u32 firstEdgeTicks)
+    {
+    u32 latency_us;
+    
+    if(config != Command.config) return;
+    
+    Command.config = 0;
+    latency_us = (TIMERCAL_ClockNow() - Command.lineTime) / (TIMERCAL_GetNominalHz() / 1000000) + firstEdgeTicks;
+    if(Command.nbLatencies == 0 || latency_us < Command.minLatency_us) Command.minLatency_us = latency_us;
+    if(latency_us > Command.maxLatency_us) Command.maxLatency_us = latency_us;
+    Command.sumLatency_us += latency_us;
+    Command.nbLatencies++;
+    }
+
+static char* COMMAND_PutNumber(char *p, u32 value)
+    {
+    char digits[10];
+    u8 n = 0;
+    
+    do
+        {
+        digits[n++] = '0' + value % 10;
+        value /= 10;
+        }
+    while(value);
+    while(n) *p++ = digits[--n];
+    return p;
+    }
+
+/*******************************************************************************
+* Function Name  : COMMAND_Reply
+* Description    : Sends the queued replies (main context, on EVENT_COMMAND)
+* Input          : None
+* Return         : None
+*******************************************************************************/
+static void COMMAND_Reply(void)
+    {
+    static const u8 peakVolts[] = { 0, 8, 6, 4 };       // PulsePeakVoltage_code
+    char text[COMMAND_REPLY_STRING_LENGHT];
+    char *p;
+    
+    while(Command.replyTail != Command.replyHead)
+        {
+        u8 column = Command.reply[Command.replyTail % COMMAND_REPLY_QUEUE_SIZE].column;
+        
+        MEMORY_BARRIER();
+        Command.replyTail++;
+        if(column)
+            {
+            strcpy(text, "ERR ");
+            p = COMMAND_PutNumber(text + 4, column);
+            }
+        else
+            {
+            strcpy(text, "OK F");
+            p = COMMAND_PutNumber(text + 4, PulseSeq.frequency_Hz);
+            *p++ = ' ';  *p++ = 'S';
+            p = COMMAND_PutNumber(p, PulseSeq.pulseSeq);
+            *p++ = ' ';  *p++ = 'V';
+            p = COMMAND_PutNumber(p, peakVolts[PulseSeq.peakVoltage]);
+            *p++ = ' ';  *p++ = 'I';
+            p = COMMAND_PutNumber(p, CurrentControl.target);
+            }
+        *p = 0;
+        if(!TELEMETRY_SendReply(text))
+            {
+            Command.nbRepliesLost++;
+            }
+        }
+    }
+
+/*******************************************************************************
+* Function Group : Readout Queue
+* Description    : Lock-free single producer (STIMULATOR_Handler) / single consumer
+                   (Application_Handler) ring of timestamped readout records.
+                   Each index is written by one side only; the barrier orders the
+                   record copy against the index update.
+*******************************************************************************/
+static bool READOUTQUEUE_Push(const Readout_Record_struct *record)
+    {
+    u32 head = ReadoutQueue.head;
+    
+    if(head - ReadoutQueue.tail >= READOUT_QUEUE_SIZE)
+        {
+        ReadoutQueue.nbDropped++;
+        return FALSE;
+        }
+    ReadoutQueue.record[head % READOUT_QUEUE_SIZE] = *record;
+    MEMORY_BARRIER();                   // record written before it is published
+    ReadoutQueue.head = head + 1;
+    return TRUE;
+    }
+
+static u32 READOUTQUEUE_Pop(Readout_Record_struct *records, u32 maxNbRecords)
+    {
+    u32 i;
+    u32 tail = ReadoutQueue.tail;
+    u32 nbRecords = ReadoutQueue.head - tail;
+    
+    MEMORY_BARRIER();                   // head read before the records
+    if(nbRecords > maxNbRecords)
+        {
+        nbRecords = maxNbRecords;
+        }
+    for(i=0; i<nbRecords; i++)
+        {
+        records[i] = ReadoutQueue.record[(tail + i) % READOUT_QUEUE_SIZE];
+        }
+    MEMORY_BARRIER();                   // records read before their slots are released
+    ReadoutQueue.tail = tail + nbRecords;
+    return nbRecords;
+    }
+
+/*******************************************************************************
+* Function Name  : ProcessReadouts
+* Description    : Drains the readout queue in batches. Every record feeds the 
+                   statistics; the GUI shows the mean of the records since the
+                   last call (overloaded if any of them was).
+* Input          : None
+* Return         : None
+*******************************************************************************/
+static void ProcessReadouts(void)
+    {
+    Readout_Record_struct batch[READOUT_BATCH_SIZE];
+    u32 i, nbRecords;
+    u32 sumCAE1 = 0, nbDisplayed = 0;
+    bool isOverloaded = FALSE;
+    
+    while((nbRecords = READOUTQUEUE_Pop(batch, READOUT_BATCH_SIZE)) > 0)
+    {
+        for(i=0; i<nbRecords; i++)
+        {
+            const Readout_Record_struct *record = &batch[i];
+            
+            if(ReadoutStatistics.nbReadouts++ == 0 || record->CAE1 < ReadoutStatistics.minCAE1)
+            {
+                ReadoutStatistics.minCAE1 = record->CAE1;
+            }
+            if(record->CAE1 > ReadoutStatistics.maxCAE1)
+            {
+                ReadoutStatistics.maxCAE1 = record->CAE1;
+            }
+            if(record->isOverloaded)
+            {
+                ReadoutStatistics.nbOverloads++;
+                isOverloaded = TRUE;
+            }
+            
+            sumCAE1 += record->CAE1;
+            nbDisplayed++;
+            
+            LOG_AddReadout(record);
+            TELEMETRY_AddReadout(record);
+        }
+    }
+    TELEMETRY_Flush();
+    
+    if(nbDisplayed > 0)
+    {
+        DisplayReadout.CAE1 = sumCAE1 / nbDisplayed;
+        DisplayReadout.isOverloaded = isOverloaded;
+    }
+    }
+
+#ifdef STIM32_HOST
+/* readout counters, for the host harness */
+void HOST_GetReadoutCounters(u32 *nbReadouts, u32 *nbOverloads, u32 *nbDropped)
+    {
+    *nbReadouts = ReadoutStatistics.nbReadouts;
+    *nbOverloads = ReadoutStatistics.nbOverloads;
+    *nbDropped = ReadoutQueue.nbDropped;
+    }
+
+/* the queue alone, for the producer/consumer thread test (queue_stress.c) */
+void HOST_ReadoutQueueReset(void)
+    {
+    memset(&ReadoutQueue, 0, sizeof(ReadoutQueue));
+    }
+
+bool HOST_ReadoutQueuePush(u32 timestamp, u16 CAE1, u8 isOverloaded, u8 stimState)
+    {
+    Readout_Record_struct record;
+    
+    record.timestamp = timestamp;
+    record.CAE1 = CAE1;
+    record.isOverloaded = isOverloaded;
+    record.stimState = stimState;
+    return READOUTQUEUE_Push(&record);
+    }
+
+/* at most READOUT_BATCH_SIZE records */
+u32 HOST_ReadoutQueuePop(u32 timestamp[], u16 CAE1[], u8 isOverloaded[], u8 stimState[], u32 maxNbRecords)
+    {
+    Readout_Record_struct batch[READOUT_BATCH_SIZE];
+    u32 i, nbRecords;
+    
+    nbRecords = READOUTQUEUE_Pop(batch, maxNbRecords < READOUT_BATCH_SIZE ? maxNbRecords : READOUT_BATCH_SIZE);
+    for(i=0; i<nbRecords; i++)
+        {
+        timestamp[i] = batch[i].timestamp;
+        CAE1[i] = batch[i].CAE1;
+        isOverloaded[i] = batch[i].isOverloaded;
+        stimState[i] = batch[i].stimState;
+        }
+    return nbRecords;
+    }
+
+u32 HOST_GetReadoutQueueDropped(void)
+    {
+    return ReadoutQueue.nbDropped;
+    }
+#endif
+
+/*******************************************************************************
+* Function Group : Event Queue
+* Description    : The interrupt handlers post events, Application_Handler takes
+                   them. Each event has one producer, which counts it up in
+                   nbPosted; the application compares with the count it has taken,
+                   so nothing is locked and repeated posts of one event coalesce.
+                   
+                   When no event is pending, the application puts the core to sleep
+                   until the next interrupt (the SysTick at the latest). An event
+                   posted between the check and the WFI waits for that interrupt,
+                   one SysTick at most.
+*******************************************************************************/
+static void EVENT_Post(Event_code event)
+    {
+    Events.nbPosted[event]++;
+    }
+
+static bool EVENT_Take(Event_code event)
+    {
+    u32 nbPosted = Events.nbPosted[event];
+    
+    if(nbPosted == Events.nbTaken[event])
+        {
+        return FALSE;
+        }
+    Events.nbTaken[event] = nbPosted;
+    return TRUE;
+    }
+
+static bool EVENT_IsPending(void)
+    {
+    u8 event;
+    
+    for(event=0; event<EVENT_NB; event++)
+        {
+        if(Events.nbPosted[event] != Events.nbTaken[event])
+            {
+            return TRUE;
+            }
+        }
+    return FALSE;
+    }
+
+static void EVENT_Sleep(void)
+    {
+    if(EVENT_IsPending()) return;
+    
+#ifndef STIM32_HOST
+    if(__get_IPSR() == 0)                   // thread mode: CircleOS calls the application from its main loop
+        {
+        u32 sleepTime = PROFILER_Now();
+        
+        __WFI();
+        Events.idleTicks += PROFILER_Now() - sleepTime;
+        }
+#endif
+    }
+
+#ifdef STIM32_HOST
+/* idle counters, for the host harness */
+void HOST_GetEventCounters(u32 *nbCalls, u32 *nbIdleCalls)
+    {
+    *nbCalls = Events.nbCalls;
+    *nbIdleCalls = Events.nbIdleCalls;
+    }
+#endif
+
+/*******************************************************************************
+* Function Name  : PULSEENGINE_Stop
+* Description    : Requests the pulse engine to stop at the end of the wait after the running
+                   sequence (the wiper is then at ZERO_VOLTAGE); PULSEENGINE_IsBusy tells when
+                   it has stopped. Needed for a clock switch only, new settings are taken
+                   while running (PULSEENGINE_SequenceDone).
+* Input          : None
+* Return         : None
+*******************************************************************************/
+static void PULSEENGINE_Stop(void)
+    {
+    PulseScheduler.isStopRequested = TRUE;
+    }
+
+/*******************************************************************************
+* Function Group : Pulse Engine
+* Description    : Plays back the wiper bytes and the timer burst compiled by
+                   CompileWiperBurst. The whole sequence is queued to DMA up front:
+                   the wiper updates land at the exact NSS rising edges produced by
+                   the timer, without any CPU involvement. The CPU only starts and stops
+                   the CAE sampling (CC3/CC4 interrupts) and, after the last timer burst
+                   of each sequence (DMA TC), takes a new configuration, sets the wait to
+                   the next sequence or stops the timer (PULSEENGINE_SequenceDone).
+                   The same interrupt, pended by the publisher, takes a configuration
+                   published during the wait (PULSEENGINE_TakeInWait).
+                   
+                   The configurations are double buffered (PulseSeq.configs): the one
+                   played is not written but by this interrupt, the next one is compiled
+                   aside and published with a pointer, which the interrupt takes while
+                   the DMA streams are idle. No sequence is played from two configurations
+                   and neither side masks the interrupts.
+                   
+                   In the host build, the timer and DMA are emulated (HOST_PulseTimerAdvance).
+*******************************************************************************/
+#ifndef STIM32_HOST
+
+static void PULSETIMER_CC_IRQHandler(void);
+static void WIPERDMA_IRQHandler(void);
+
+static u32 RCC_GetHclkHz(void)
+    {
+    u32 hclk;
+    u32 pllcfgr = RCC->PLLCFGR;
+    u32 pllInputHz = (pllcfgr & RCC_PLLCFGR_PLLSRC) ? HSE_VALUE : HSI_VALUE;
+    u32 pllm = pllcfgr & RCC_PLLCFGR_PLLM;
+    u32 plln = (pllcfgr & RCC_PLLCFGR_PLLN) >> 6;
+    u32 pllp = (((pllcfgr & RCC_PLLCFGR_PLLP) >> 16) + 1) * 2;
+    static const u8 ahbShift[16] = { 0,0,0,0,0,0,0,0, 1,2,3,4,6,7,8,9 };
+
+    switch(RCC->CFGR & RCC_CFGR_SWS)
+    {
+        case RCC_CFGR_SWS_PLL:  hclk = pllInputHz / pllm * plln / pllp;  break;
+        case RCC_CFGR_SWS_HSE:  hclk = HSE_VALUE;                       break;
+        default:                hclk = HSI_VALUE;                       break;
+    }
+    return hclk >> ahbShift[(RCC->CFGR & RCC_CFGR_HPRE) >> 4];
+    }
+
+static u32 PULSETIMER_GetInputClockHz(void)
+    {
+    // APB2 timer clock: twice the APB2 clock if APB2 is divided 
+    static const u8 apbShift[8]  = { 0,0,0,0, 1,2,3,4 };
+    u32 hclk = RCC_GetHclkHz();
+    u32 apb2Divider = apbShift[(RCC->CFGR & RCC_CFGR_PPRE2) >> 13];
+    
+    return apb2Divider ? (hclk >> apb2Divider) * 2 : hclk;
+    }
+
+static void PULSEENGINE_Init(void)
+    {
+    RCC->APB2ENR |= RCC_APB2ENR_TIM8EN;
+    RCC->AHB1ENR |= RCC_AHB1ENR_DMA2EN | RCC_AHB1ENR_GPIOCEN;
+    
+    // NSS pin handed over to TIM8_CH1
+    WIPER_NSS_GPIO->AFR[WIPER_NSS_PIN >> 3] = (WIPER_NSS_GPIO->AFR[WIPER_NSS_PIN >> 3] & ~(0xF << ((WIPER_NSS_PIN & 7)*4)))
+                                             | (WIPER_NSS_AF << ((WIPER_NSS_PIN & 7)*4));
+    WIPER_NSS_GPIO->MODER = (WIPER_NSS_GPIO->MODER & ~(3 << (WIPER_NSS_PIN*2))) | (2 << (WIPER_NSS_PIN*2));
+    
+    // timer
+    PULSE_TIMER->CR1 = TIM_CR1_ARPE;
+    PULSEENGINE_SetClock();
+    PULSE_TIMER->ARR = PULSE_TIMER_IDLE_TICKS - 1;
+    PULSE_TIMER->CCR1 = PULSE_TIMER_NEVER;                  // NSS high
+    PULSE_TIMER->CCR2 = PULSE_TIMER_NEVER;
+    PULSE_TIMER->CCR3 = PULSE_TIMER_NEVER;
+    PULSE_TIMER->CCR4 = PULSE_TIMER_NEVER;
+    PULSE_TIMER->CCMR1 = TIM_CCMR1_OC1M_2 | TIM_CCMR1_OC1M_1 | TIM_CCMR1_OC1PE     // CC1: PWM mode 1 (NSS)
+                       | TIM_CCMR1_OC2PE;                                          // CC2: DMA request only
+    PULSE_TIMER->CCMR2 = TIM_CCMR2_OC3PE | TIM_CCMR2_OC4PE;                        // CC3, CC4: interrupts only
+    PULSE_TIMER->CCER = TIM_CCER_CC1E;
+    PULSE_TIMER->BDTR = TIM_BDTR_MOE;
+    PULSE_TIMER->DCR = ((PULSE_TIMER_BURST_LENGTH-1) << 8)                         // burst from ARR
+                     | ((u32)(&PULSE_TIMER->ARR) - (u32)PULSE_TIMER)/4;
+    PULSE_TIMER->EGR = TIM_EGR_UG;
+    PULSE_TIMER->SR = 0;
+    PULSE_TIMER->DIER = TIM_DIER_UDE | TIM_DIER_CC2DE | TIM_DIER_CC3IE | TIM_DIER_CC4IE;
+    
+    // DMA: wiper bytes to SPI, one per CC2 request
+    WIPER_BYTE_DMA->CR = 0;
+    WIPER_BYTE_DMA->PAR = (u32)&WIPER_SPI->DR;
+    WIPER_BYTE_DMA->CR = DMA_CHANNEL_7 | DMA_SxCR_MINC | DMA_SxCR_CIRC | DMA_SxCR_DIR_0 | DMA_SxCR_PL;
+    
+    // DMA: timer bursts, PULSE_TIMER_BURST_LENGTH words per update request
+    WIPER_BURST_DMA->CR = 0;
+    WIPER_BURST_DMA->PAR = (u32)&PULSE_TIMER->DMAR;
+    WIPER_BURST_DMA->CR = DMA_CHANNEL_7 | DMA_SxCR_MINC | DMA_SxCR_CIRC | DMA_SxCR_DIR_0 
+                        | DMA_SxCR_MSIZE_1 | DMA_SxCR_PSIZE_1 | DMA_SxCR_TCIE | DMA_SxCR_PL;
+    
+    UTIL_SetIrqHandler(PULSE_TIMER_CC_IRQ_OFFSET, PULSETIMER_CC_IRQHandler);
+    UTIL_SetIrqHandler(WIPER_BURST_DMA_IRQ_OFFSET, WIPERDMA_IRQHandler);
+    NVIC_SetPriority(PULSE_TIMER_CC_IRQn, 0);       // CAE sampling window preempts SysTick and the GUI
+    NVIC_SetPriority(WIPER_BURST_DMA_IRQn, 0);
+    NVIC_EnableIRQ(PULSE_TIMER_CC_IRQn);
+    NVIC_EnableIRQ(WIPER_BURST_DMA_IRQn);
+    }
+
+/* points the circular DMA streams at the first byte and the first burst of the configuration;
+   they must be idle: the pulse engine is stopped, or waits after a sequence */
+static void PULSEENGINE_SetSource(const Pulse_Config_struct *config)
+    {
+    WIPER_BYTE_DMA->CR &= ~DMA_SxCR_EN;
+    WIPER_BURST_DMA->CR &= ~DMA_SxCR_EN;
+    while((WIPER_BYTE_DMA->CR | WIPER_BURST_DMA->CR) & DMA_SxCR_EN);
+    
+    DMA2->LIFCR = WIPER_BYTE_DMA_FLAGS | WIPER_BURST_DMA_FLAGS;
+    WIPER_BYTE_DMA->M0AR = (u32)config->wiperBytes;
+    WIPER_BYTE_DMA->NDTR = config->nbEdges;
+    WIPER_BYTE_DMA->CR |= DMA_SxCR_EN;
+    WIPER_BURST_DMA->M0AR = (u32)config->timerBurst;
+    WIPER_BURST_DMA->NDTR = (config->nbEdges + 1) * PULSE_TIMER_BURST_LENGTH;
+    WIPER_BURST_DMA->CR |= DMA_SxCR_EN;
+    }
+
+static void PULSEENGINE_Start(void)
+    {
+    if(PulseSeq.nextConfig)         PULSEENGINE_TakeConfig(PulseSeq.nextConfig, WIPER_PRIME_TICKS);
+    else if(PulseSeq.config)        PULSEENGINE_SetSource(PulseSeq.config);
+    else                            return;                 // nothing compiled yet
+    
+    PulseScheduler.isStopRequested = FALSE;
+    PulseScheduler.phase = 0;
+    PulseScheduler.carryTicks = 0;
+    PulseScheduler.runningWaitTicks = 0;                    // the first sequence plays first
+    PULSEENGINE_TakeWiperRefresh();
+    PULSESCHEDULER_NextSequence();                          // wait after the first sequence
+    
+    // period 0 ends with the first edge; UG loads it and requests the burst of period 1
+    PULSE_TIMER->CR1 = TIM_CR1_ARPE;
+    PULSE_TIMER->ARR = WIPER_PRIME_TICKS - 1;
+    PULSE_TIMER->CCR1 = WIPER_PRIME_TICKS - WIPER_NSS_LEAD_TICKS;
+    PULSE_TIMER->CCR2 = WIPER_PRIME_TICKS - WIPER_NSS_LEAD_TICKS + 1;
+    PULSE_TIMER->CCR3 = PULSE_TIMER_NEVER;
+    PULSE_TIMER->CCR4 = PULSE_TIMER_NEVER;
+    PULSE_TIMER->EGR = TIM_EGR_UG;
+    PULSE_TIMER->SR = 0;
+    PULSE_TIMER->CR1 = TIM_CR1_ARPE | TIM_CR1_CEN;
+    }
+
+/* after a stop request, the timer stops itself (one pulse mode) at the update event 
+   ending the wait after the running sequence */
+static bool PULSEENGINE_IsBusy(void)
+    {
+    return (PULSE_TIMER->CR1 & TIM_CR1_CEN) ? TRUE : FALSE;
+    }
+
+/*******************************************************************************
+* Function Name  : PULSEENGINE_SetClock
+* Description    : Sets the pulse timer prescaler for the current HCLK, so the timer
+                   keeps counting microseconds and the compiled edge tables stay valid.
+                   Checks that the wiper byte is still shifted out while NSS is low.
+                   The pulse engine must be stopped; the prescaler is loaded by the UG
+                   of PULSEENGINE_Start.
+* Input          : None
+* Return         : FALSE if the pulse timing cannot be kept at this clock
+*******************************************************************************/
+static bool PULSEENGINE_SetClock(void)
+    {
+    static const u8 apbShift[8]  = { 0,0,0,0, 1,2,3,4 };
+    u32 timerClockHz = PULSETIMER_GetInputClockHz();
+    u32 pclk1Hz = RCC_GetHclkHz() >> apbShift[(RCC->CFGR & RCC_CFGR_PPRE1) >> 10];
+    u32 spiClockHz = pclk1Hz >> (((WIPER_SPI->CR1 >> 3) & 7) + 1);     // CR1.BR: fPCLK/2..256
+    
+    if(timerClockHz % PULSE_TIMER_FREQUENCY_HZ != 0
+       || 8 * PULSE_TIMER_FREQUENCY_HZ / spiClockHz >= WIPER_NSS_LEAD_TICKS - 1)      // one tick of margin
+        {
+        return FALSE;
+        }
+    PULSE_TIMER->PSC = timerClockHz/PULSE_TIMER_FREQUENCY_HZ - 1;
+    return TRUE;
+    }
+
+static void PULSETIMER_CC_IRQHandler(void)
+    {
+    u32 entryTime = PROFILER_Now();
+    
+    if(PULSE_TIMER->SR & TIM_SR_CC3IF)
+        {
+        PULSE_TIMER->SR = ~TIM_SR_CC3IF;
+        CAE_StartSampling();
+        }
+    if(PULSE_TIMER->SR & TIM_SR_CC4IF)
+        {
+        PULSE_TIMER->SR = ~TIM_SR_CC4IF;
+        CAE_StopSampling();
+        }
+    PROFILER_Record(PROFILER_PHASE_PULSE_IRQ, entryTime);
+    }
+
+/* last timer burst of a sequence loaded, at the update event of its last edge;
+   or pended by PULSEENGINE_RequestTake */
+static void WIPERDMA_IRQHandler(void)
+    {
+    u32 entryTime = PROFILER_Now();
+    
+    if(DMA2->LISR & WIPER_BURST_DMA_TCIF)
+        {
+        DMA2->LIFCR = WIPER_BURST_DMA_FLAGS;
+        PULSEENGINE_SequenceDone();
+        }
+    else
+        {
+        PULSEENGINE_TakeInWait();
+        }
+    PROFILER_Record(PROFILER_PHASE_PULSE_IRQ, entryTime);
+    }
+
+/* a configuration published during the wait is taken by the wiper DMA interrupt,
+   which preempts the publisher */
+static void PULSEENGINE_RequestTake(void)
+    {
+    NVIC_SetPendingIRQ(WIPER_BURST_DMA_IRQn);
+    }
+
+static void PULSEENGINE_StopAtUpdate(void)
+    {
+    PULSE_TIMER->CR1 |= TIM_CR1_OPM;
+    }
+
+/* the running wait is one timer period (RCR 0) of PulseScheduler.runningWaitTicks:
+   moves the counter so it ends in ticks */
+static void PULSEENGINE_EndWaitIn(u32 ticks)
+    {
+    PULSE_TIMER->CNT = PulseScheduler.runningWaitTicks - ticks;
+    }
+
+#else // STIM32_HOST
+
+/* virtual TIM8 + DMA: preload registers, burst and byte DMA and the MAX5439 shift register */
+#define PULSE_TIMER_ARR     0
+#define PULSE_TIMER_RCR     1
+#define PULSE_TIMER_CCR1    2
+#define PULSE_TIMER_CCR2    3
+#define PULSE_TIMER_CCR3    4
+#define PULSE_TIMER_CCR4    5
+
+static struct
+    {
+        bool        isRunning;
+        bool        isOnePulse;
+        u32         now;
+        u32         periodStart;
+        u32         active[PULSE_TIMER_BURST_LENGTH];
+        u32         preload[PULSE_TIMER_BURST_LENGTH];
+        u8          eventsDone;                 // CC1..CC4 reached in this period (bit mask)
+        const Pulse_Config_struct *source;      // of the DMA streams
+        const u32   *burst;
+        u32         burstLeft;
+        const u8    *bytes;
+        u32         bytesLeft;
+        u8          shiftRegister;
+        u8          wiperCode;                  // latched at the NSS rising edge
+        const Pulse_Config_struct *played;      // source at the first edge of the sequence
+        u32         nominalEdgeTime;
+        u8          edgeIndex;
+    }
+    VirtualTimer;
+
+/* byte/NSS timeline of the wiper bus, for the host harness */
+#define HOST_WIPERBUS_TRACE_SIZE    256
+
+typedef enum {
+    HOST_WIPERBUS_NSS_LOW,
+    HOST_WIPERBUS_BYTE,
+    HOST_WIPERBUS_NSS_HIGH,             // the wiper is set; nominalTime is the requested edge time
+    } HostWiperBusEvent_code;
+
+static struct
+    {
+        u32 time;
+        u32 nominalTime;
+        u8  event;
+        u8  value;
+    }
+    HOST_WiperBusTrace[HOST_WIPERBUS_TRACE_SIZE];
+static u32 HOST_WiperBusTraceCount;
+
+/* first edges of the sequences since the last start of the pulse engine */
+static struct
+    {
+        u32 nbSequences;
+        u32 firstStart;
+        u32 lastStart;
+        u32 minPeriod;
+        u32 maxPeriod;
+    }
+    HOST_SequenceTiming;
+
+/* profiler ticks of the pulse interrupts over all the sequences played */
+static struct
+    {
+        double  pulseIrqTicks;
+        u32     nbPulseIrqs;
+        u32     nbSequences;
+        bool    isPerEdgeScaling;       // each edge scaled in an interrupt of its own
+        u8      scaledCode;
+    }
+    HOST_PulsePathCost;
+
+static void HOST_RecordWiperBus(HostWiperBusEvent_code event, u8 value, u32 nominalTime)
+    {
+    u32 i = HOST_WiperBusTraceCount++ % HOST_WIPERBUS_TRACE_SIZE;
+    
+    HOST_WiperBusTrace[i].time = VirtualTimer.now;
+    HOST_WiperBusTrace[i].nominalTime = nominalTime;
+    HOST_WiperBusTrace[i].event = event;
+    HOST_WiperBusTrace[i].value = value;
+    }
+
+/* returns the number of events so far; n counts from the oldest one kept */
+u32 HOST_GetWiperBusEvent(u32 n, u32 *time, u8 *event, u8 *value, u32 *nominalTime)
+    {
+    u32 first = (HOST_WiperBusTraceCount > HOST_WIPERBUS_TRACE_SIZE) ? HOST_WiperBusTraceCount - HOST_WIPERBUS_TRACE_SIZE : 0;
+    u32 i = (first + n) % HOST_WIPERBUS_TRACE_SIZE;
+    
+    if(first + n < HOST_WiperBusTraceCount)
+        {
+        *time = HOST_WiperBusTrace[i].time;
+        *nominalTime = HOST_WiperBusTrace[i].nominalTime;
+        *event = HOST_WiperBusTrace[i].event;
+        *value = HOST_WiperBusTrace[i].value;
+        }
+    return HOST_WiperBusTraceCount;
+    }
+
+/* sequence starts: count, first and last time, shortest and longest period (pulse timer ticks) */
+u32 HOST_GetSequenceTiming(u32 *firstStart, u32 *lastStart, u32 *minPeriod, u32 *maxPeriod)
+    {
+    *firstStart = HOST_SequenceTiming.firstStart;
+    *lastStart = HOST_SequenceTiming.lastStart;
+    *minPeriod = HOST_SequenceTiming.minPeriod;
+    *maxPeriod = HOST_SequenceTiming.maxPeriod;
+    return HOST_SequenceTiming.nbSequences;
+    }
+
+static void HOST_RecordSequenceStart(void)
+    {
+    u32 period = VirtualTimer.now - HOST_SequenceTiming.lastStart;
+    
+    if(HOST_SequenceTiming.nbSequences == 0)
+        {
+        HOST_SequenceTiming.firstStart = VirtualTimer.now;
+        HOST_SequenceTiming.minPeriod = 0xFFFFFFFF;
+        }
+    else
+        {
+        if(period < HOST_SequenceTiming.minPeriod) HOST_SequenceTiming.minPeriod = period;
+        if(period > HOST_SequenceTiming.maxPeriod) HOST_SequenceTiming.maxPeriod = period;
+        }
+    HOST_SequenceTiming.lastStart = VirtualTimer.now;
+    HOST_SequenceTiming.nbSequences++;
+    HOST_PulsePathCost.nbSequences++;
+    }
+
+/*******************************************************************************
+* Function Name  : HOST_ScaleEdge
+* Description    : The work of the engine at each edge before the edge table held
+                   the wiper codes: the float scaling of the level (the former
+                   SetOutputVoltage), for the benchmark of the pulse path
+* Input          : OutputVoltage_code level, voltageFactor (Q12)
+* Return         : u8 control byte
+*******************************************************************************/
+static u8 HOST_ScaleEdge(OutputVoltage_code level, u16 voltageFactor)
+    {
+    volatile float multiplication_factor = (float)voltageFactor / Q12_ONE;
+    u8 controlByteForMAX5439 = 63;
+    
+    switch(level)
+        {
+        case POSITIVE_VOLTAGE_MAX:      controlByteForMAX5439= 63 + 64*multiplication_factor;  break;
+        case POSITIVE_VOLTAGE_HALF:     controlByteForMAX5439= 63 + 32*multiplication_factor;  break;
+        case ZERO_VOLTAGE:              controlByteForMAX5439= 63 ; break;
+        case NEGATIVE_VOLTAGE_HALF:     controlByteForMAX5439= 63 - 32*multiplication_factor;  break;
+        case NEGATIVE_VOLTAGE_MAX:      controlByteForMAX5439= 63 - 63*multiplication_factor;  break;
+        }
+    return controlByteForMAX5439;
+    }
+
+void HOST_SetPerEdgeScaling(bool isPerEdgeScaling)
+    {
+    HOST_PulsePathCost.isPerEdgeScaling = isPerEdgeScaling;
+    }
+
+/* pulse interrupts and their profiler ticks (ns) per sequence; returns the number of sequences */
+u32 HOST_GetPulsePathCost(u32 *nbIrqsPerSequence_x100, u32 *nsPerSequence)
+    {
+    u32 n = HOST_PulsePathCost.nbSequences;
+    
+    *nbIrqsPerSequence_x100 = n ? (u32)(100.0 * HOST_PulsePathCost.nbPulseIrqs / n) : 0;
+    *nsPerSequence = n ? (u32)(HOST_PulsePathCost.pulseIrqTicks / n + 0.5) : 0;
+    return n;
+    }
+
+/* the pulse configurations: each one taken is compiled again from the settings it
+   records, the edges played are checked against the configuration of their sequence */
+static struct
+    {
+        Pulse_Config_struct scratch;
+        u32 nbChecked;
+        u32 nbInconsistent;             // configuration taken differs from its settings
+        u32 nbTornEdges;                // edge byte or time not from the configuration played
+        u32 nbRefusedPublishes;         // PULSEENGINE_Publish with a configuration not taken yet
+    }
+    HOST_PulseConfigCheck;
+
+static void HOST_RefusePublish(void)
+    {
+    HOST_PulseConfigCheck.nbRefusedPublishes++;
+    }
+
+static void HOST_CheckPulseConfig(const Pulse_Config_struct *config)
+    {
+    Pulse_Config_struct *scratch = &HOST_PulseConfigCheck.scratch;
+    bool isConsistent;
+    u8 i;
+    
+    scratch->frequency_Hz = config->frequency_Hz;
+    scratch->pulseSeq = config->pulseSeq;
+    scratch->voltageFactor = config->voltageFactor;
+    scratch->appliedPpm = config->appliedPpm;
+    CompilePulseEdgeTable(scratch);
+    
+    isConsistent = scratch->nbEdges == config->nbEdges
+                && memcmp(scratch->wiperBytes, config->wiperBytes, config->nbEdges) == 0
+                && scratch->periodTicks == config->periodTicks
+                && scratch->phaseIncrement == config->phaseIncrement
+                && scratch->phaseModulus == config->phaseModulus
+                && scratch->sequenceTicks == config->sequenceTicks
+                && scratch->maxFrequency_Hz == config->maxFrequency_Hz;
+    for(i=0; isConsistent && i<config->nbEdges; i++)
+        {
+        isConsistent = scratch->edgeTable[i].duration_ticks == config->edgeTable[i].duration_ticks
+                    && scratch->edgeTable[i].wiperCode == config->edgeTable[i].wiperCode
+                    && scratch->edgeTable[i].level == config->edgeTable[i].level
+                    && scratch->edgeTable[i].readCAE == config->edgeTable[i].readCAE;
+        }
+    for(i=0; isConsistent && i<=config->nbEdges; i++)
+        {
+        // but the wait, set by the pulse scheduler
+        isConsistent = (i == config->nbEdges-1)
+                    || memcmp(scratch->timerBurst[i], config->timerBurst[i], sizeof(config->timerBurst[i])) == 0;
+        }
+    if(!isConsistent) HOST_PulseConfigCheck.nbInconsistent++;
+    HOST_PulseConfigCheck.nbChecked++;
+    }
+
+/* configurations taken while running, and the checks; returns the frequency played */
+u32 HOST_GetPulseConfigCounters(u32 *nbSwaps, u32 *nbDelayedSwaps, u32 *nbChecked, u32 *nbInconsistent, u32 *nbTornEdges, u32 *nbRefusedPublishes)
+    {
+    *nbSwaps = PulseScheduler.nbSwaps;
+    *nbDelayedSwaps = PulseScheduler.nbDelayedSwaps;
+    *nbChecked = HOST_PulseConfigCheck.nbChecked;
+    *nbInconsistent = HOST_PulseConfigCheck.nbInconsistent;
+    *nbTornEdges = HOST_PulseConfigCheck.nbTornEdges;
+    *nbRefusedPublishes = HOST_PulseConfigCheck.nbRefusedPublishes;
+    return PulseSeq.config ? PulseSeq.config->frequency_Hz : 0;
+    }
+
+/* the burst DMA stream is circular; TRUE at its transfer complete (the last burst) */
+static bool VIRTUALTIMER_LoadBurst(void)
+    {
+    u8 i;
+    
+    if(VirtualTimer.burstLeft == 0)
+        {
+        VirtualTimer.burst = &VirtualTimer.source->timerBurst[0][0];
+        VirtualTimer.burstLeft = (VirtualTimer.source->nbEdges + 1) * PULSE_TIMER_BURST_LENGTH;
+        }
+    for(i=0; i<PULSE_TIMER_BURST_LENGTH; i++)
+        {
+        VirtualTimer.preload[i] = *VirtualTimer.burst++;
+        }
+    VirtualTimer.burstLeft -= PULSE_TIMER_BURST_LENGTH;
+    return (VirtualTimer.burstLeft == 0) ? TRUE : FALSE;
+    }
+
+static void PULSEENGINE_Init(void)
+    {
+    memset(&VirtualTimer, 0, sizeof(VirtualTimer));
+    }
+
+static void PULSEENGINE_SetSource(const Pulse_Config_struct *config)
+    {
+    VirtualTimer.source = config;
+    VirtualTimer.bytes = config->wiperBytes;
+    VirtualTimer.bytesLeft = config->nbEdges;
+    VirtualTimer.burst = &config->timerBurst[0][0];
+    VirtualTimer.burstLeft = (config->nbEdges + 1) * PULSE_TIMER_BURST_LENGTH;
+    }
+
+static void PULSEENGINE_StopAtUpdate(void)
+    {
+    VirtualTimer.isOnePulse = TRUE;
+    }
+
+static void PULSEENGINE_EndWaitIn(u32 ticks)
+    {
+    VirtualTimer.periodStart = VirtualTimer.now + ticks
+                             - (VirtualTimer.active[PULSE_TIMER_ARR] + 1) * (VirtualTimer.active[PULSE_TIMER_RCR] + 1);
+    }
+
+static void PULSEENGINE_RequestTake(void)
+    {
+    u32 entryTime = PROFILER_Now();                             // pended wiper DMA interrupt
+    
+    PULSEENGINE_TakeInWait();
+    PROFILER_Record(PROFILER_PHASE_PULSE_IRQ, entryTime);
+    }
+
+static void PULSEENGINE_Start(void)
+    {
+    if(PulseSeq.nextConfig)         PULSEENGINE_TakeConfig(PulseSeq.nextConfig, WIPER_PRIME_TICKS);
+    else if(PulseSeq.config)        PULSEENGINE_SetSource(PulseSeq.config);
+    else                            return;
+    
+    PulseScheduler.isStopRequested = FALSE;
+    PulseScheduler.phase = 0;
+    PulseScheduler.carryTicks = 0;
+    PulseScheduler.runningWaitTicks = 0;                    // the first sequence plays first
+    PULSEENGINE_TakeWiperRefresh();
+    PULSESCHEDULER_NextSequence();
+    memset(&HOST_SequenceTiming, 0, sizeof(HOST_SequenceTiming));
+    
+    VirtualTimer.active[PULSE_TIMER_ARR] = WIPER_PRIME_TICKS - 1;
+    VirtualTimer.active[PULSE_TIMER_RCR] = 0;
+    VirtualTimer.active[PULSE_TIMER_CCR1] = WIPER_PRIME_TICKS - WIPER_NSS_LEAD_TICKS;
+    VirtualTimer.active[PULSE_TIMER_CCR2] = WIPER_PRIME_TICKS - WIPER_NSS_LEAD_TICKS + 1;
+    VirtualTimer.active[PULSE_TIMER_CCR3] = PULSE_TIMER_NEVER;
+    VirtualTimer.active[PULSE_TIMER_CCR4] = PULSE_TIMER_NEVER;
+    VIRTUALTIMER_LoadBurst();                                   // UG
+    
+    VirtualTimer.periodStart = VirtualTimer.now;
+    VirtualTimer.eventsDone = 0;
+    VirtualTimer.isOnePulse = FALSE;
+    VirtualTimer.isRunning = TRUE;
+    VirtualTimer.edgeIndex = 0;
+    VirtualTimer.nominalEdgeTime = VirtualTimer.now + WIPER_PRIME_TICKS;
+    }
+
+static bool PULSEENGINE_IsBusy(void)
+    {
+    return VirtualTimer.isRunning;
+    }
+
+static bool PULSEENGINE_SetClock(void)
+    {
+    return TRUE;                                                // the virtual timer counts microseconds
+    }
+
+static u32 HOST_PulseTimerNow(void)
+    {
+    return VirtualTimer.now;
+    }
+
+/* the MAX5439 wiper, for an output load model */
+u8 HOST_GetWiperCode(void)
+    {
+    return VirtualTimer.wiperCode;
+    }
+
+/* advances the virtual timer, processing the compare and update events on the way */
+void HOST_PulseTimerAdvance(u32 ticks)
+    {
+    u32 end = VirtualTimer.now + ticks;
+    
+    while(VirtualTimer.isRunning)
+        {
+        u8  ch, event = 0xFF;
+        u32 eventTime = VirtualTimer.periodStart                                                 // update event
+                      + (VirtualTimer.active[PULSE_TIMER_ARR] + 1) * (VirtualTimer.active[PULSE_TIMER_RCR] + 1);
+        
+        for(ch=0; ch<4; ch++)
+            {
+            u32 ccr = VirtualTimer.active[PULSE_TIMER_CCR1 + ch];
+            if(!(VirtualTimer.eventsDone & (1 << ch)) && ccr <= VirtualTimer.active[PULSE_TIMER_ARR]
+               && VirtualTimer.periodStart + ccr < eventTime)
+                {
+                eventTime = VirtualTimer.periodStart + ccr;
+                event = ch;
+                }
+            }
+        if((s32)(end - eventTime) < 0) break;
+        
+        VirtualTimer.now = eventTime;
+        switch(event)
+            {
+            case 0:     // CC1: NSS low
+                HOST_RecordWiperBus(HOST_WIPERBUS_NSS_LOW, 0, 0);
+                break;
+            case 1:     // CC2: byte DMA
+                VirtualTimer.shiftRegister = *VirtualTimer.bytes++;
+                HOST_RecordWiperBus(HOST_WIPERBUS_BYTE, VirtualTimer.shiftRegister, 0);
+                if(--VirtualTimer.bytesLeft == 0)
+                    {
+                    VirtualTimer.bytes = VirtualTimer.source->wiperBytes;       // circular stream
+                    VirtualTimer.bytesLeft = VirtualTimer.source->nbEdges;
+                    }
+                break;
+            case 2:     // CC3: CAE sampling starts
+                {
+                u32 entryTime = PROFILER_Now();
+                CAE_StartSampling();
+                PROFILER_Record(PROFILER_PHASE_PULSE_IRQ, entryTime);
+                }
+                break;
+            case 3:     // CC4: CAE sampling stops
+                {
+                u32 entryTime = PROFILER_Now();
+                CAE_StopSampling();
+                PROFILER_Record(PROFILER_PHASE_PULSE_IRQ, entryTime);
+                }
+                break;
+            default:    // update: NSS rises (if it was low), next period
+                {
+                bool isBurstComplete;
+                
+                if(VirtualTimer.active[PULSE_TIMER_CCR1] <= VirtualTimer.active[PULSE_TIMER_ARR])
+                    {
+                    if(VirtualTimer.edgeIndex == 0)
+                        {
+                        // the sequence starts are checked by HOST_GetSequenceTiming
+                        HOST_RecordSequenceStart();
+                        VirtualTimer.nominalEdgeTime = eventTime;
+                        VirtualTimer.played = VirtualTimer.source;
+                        }
+                    HOST_RecordWiperBus(HOST_WIPERBUS_NSS_HIGH, VirtualTimer.shiftRegister, VirtualTimer.nominalEdgeTime);
+                    if(eventTime != VirtualTimer.nominalEdgeTime
+                       || VirtualTimer.shiftRegister != VirtualTimer.played->wiperBytes[VirtualTimer.edgeIndex])
+                        {
+                        HOST_PulseConfigCheck.nbTornEdges++;
+                        }
+                    VirtualTimer.wiperCode = VirtualTimer.shiftRegister;
+                    if(HOST_PulsePathCost.isPerEdgeScaling)
+                        {
+                        u32 entryTime = PROFILER_Now();
+                        HOST_PulsePathCost.scaledCode = HOST_ScaleEdge(VirtualTimer.played->edgeTable[VirtualTimer.edgeIndex].level, VirtualTimer.played->voltageFactor);
+                        PROFILER_Record(PROFILER_PHASE_PULSE_IRQ, entryTime);
+                        }
+                    VirtualTimer.nominalEdgeTime += VirtualTimer.played->edgeTable[VirtualTimer.edgeIndex++].duration_ticks;
+                    if(VirtualTimer.edgeIndex == VirtualTimer.played->nbEdges)
+                        {
+                        VirtualTimer.edgeIndex = 0;
+                        }
+                    }
+                memcpy(VirtualTimer.active, VirtualTimer.preload, sizeof(VirtualTimer.active));
+                isBurstComplete = VIRTUALTIMER_LoadBurst();
+                VirtualTimer.periodStart = eventTime;
+                if(VirtualTimer.isOnePulse)
+                    {
+                    VirtualTimer.isRunning = FALSE;
+                    }
+                else if(isBurstComplete)
+                    {
+                    u32 entryTime = PROFILER_Now();                 // burst DMA TC interrupt
+                    
+                    PULSEENGINE_SequenceDone();
+                    PROFILER_Record(PROFILER_PHASE_PULSE_IRQ, entryTime);
+                    }
+                }
+                break;
+            }
+        if(event <= 3)
+            {
+            VirtualTimer.eventsDone |= (1 << event);
+            }
+        else
+            {
+            VirtualTimer.eventsDone = 0;
+            }
+        }
+    VirtualTimer.now = end;
+    }
+
+#endif // STIM32_HOST
+
+/*******************************************************************************
+* Function Name  : PULSEENGINE_TakeConfig
+* Description    : Makes the configuration the one played from the next sequence on:
+                   the pointer swap of the double buffer. The DMA streams must be idle
+                   (pulse engine stopped, or waiting after a sequence).
+* Input          : Pulse_Config_struct *config, u32 firstEdgeTicks: pulse timer ticks 
+                   to its first edge
+* Return         : None
+*******************************************************************************/
+static void PULSEENGINE_TakeConfig(Pulse_Config_struct *config, u32 firstEdgeTicks)
+    {
+    Pulse_Config_struct *previous = PulseSeq.config;
+    
+    PULSEENGINE_SetSource(config);
+    if(previous == 0 || previous->phaseModulus != config->phaseModulus)
+        {
+        PulseScheduler.phase = 0;                           // a fraction of the previous modulus
+        }
+    PulseSeq.config = config;
+    PulseSeq.nextConfig = 0;
+    PulseScheduler.nbSwaps++;
+    COMMAND_Started(config, firstEdgeTicks);
+    if(Boot.firstPulse_us == 0)
+        {
+        BOOT_FirstPulse(firstEdgeTicks);
+        }
+#ifdef STIM32_HOST
+    HOST_CheckPulseConfig(config);
+#endif
+    }
+
+/*******************************************************************************
+* Function Name  : PULSEENGINE_SequenceDone
+* Description    : Called from the wiper DMA interrupt once the last timer burst of a
+                   sequence is loaded (update event of its last edge): the wait to the
+                   next sequence runs and both DMA streams are idle until its end.
+                   Stops the timer at the end of the wait, or takes the published
+                   configuration if the wait leaves the time to point the streams at it
+                   (else the next wait is lengthened, see PULSESCHEDULER_NextSequence),
+                   then sets the wait after the next sequence.
+* Input          : None
+* Return         : None
+*******************************************************************************/
+static void PULSEENGINE_SequenceDone(void)
+    {
+    Pulse_Config_struct *next = PulseSeq.nextConfig;
+    u32 waitTicks = PulseScheduler.waitTicks;               // running now
+    
+    if(PulseScheduler.isStopRequested)
+        {
+        PULSEENGINE_StopAtUpdate();
+        return;
+        }
+    PulseScheduler.waitStart = TIMERCAL_ClockNow();
+    PulseScheduler.runningWaitTicks = waitTicks;
+    if(next && waitTicks >= PULSE_SWAP_MIN_TICKS)
+        {
+        PULSEENGINE_TakeConfig(next, PULSESCHEDULER_WaitLeft(next, 0) + WIPER_PRIME_TICKS);
+        }
+    PULSEENGINE_TakeWiperRefresh();
+    PULSESCHEDULER_NextSequence();
+    }
+
+/*******************************************************************************
+* Function Name  : PULSEENGINE_TakeInWait
+* Description    : Called from the wiper DMA interrupt when pended by PULSEENGINE_Publish:
+                   a configuration published during the wait is taken at once, not
+                   after the next sequence. The wait left is measured on the clock of
+                   TIMERCAL_ClockNow since PULSEENGINE_SequenceDone; it must leave the
+                   time to point the streams at the configuration (PULSE_SWAP_MIN_TICKS),
+                   else it is taken after the next sequence. The wait after the next
+                   sequence is set again, for the new configuration, from the scheduler
+                   state it was set from.
+* Input          : None
+* Return         : None
+*******************************************************************************/
+static void PULSEENGINE_TakeInWait(void)
+    {
+    Pulse_Config_struct *next = PulseSeq.nextConfig;
+    u32 elapsedTicks, waitLeftTicks;
+    
+    if(next == 0 || PulseScheduler.isStopRequested || !PULSEENGINE_IsBusy()) return;
+    
+    elapsedTicks = (TIMERCAL_ClockNow() - PulseScheduler.waitStart) / (TIMERCAL_GetNominalHz() / PULSE_TIMER_FREQUENCY_HZ);
+    if(elapsedTicks + PULSE_SWAP_MIN_TICKS > PulseScheduler.runningWaitTicks) return;     // a sequence plays, or too late
+    
+    PulseScheduler.phase = PulseScheduler.lastPhase;
+    PulseScheduler.carryTicks = PulseScheduler.lastCarryTicks;
+    waitLeftTicks = PULSESCHEDULER_WaitLeft(next, elapsedTicks);
+    PULSEENGINE_TakeConfig(next, waitLeftTicks + WIPER_PRIME_TICKS);
+    PULSEENGINE_TakeWiperRefresh();
+    PULSESCHEDULER_NextSequence();
+    }
+
+/*******************************************************************************
+* Function Group : Profiler
+* Description    : Execution times of the phases of the pulse path, in profiler
+                   ticks: CPU cycles (DWT cycle counter) on the target, nanoseconds
+                   (monotonic clock) in the host build. Each phase is recorded
+                   from one interrupt level only; the diagnostics screen reads 
+                   the figures without locking.
+*******************************************************************************/
+#ifndef STIM32_HOST
+
+static void PROFILER_Init(void)
+    {
+    memset(&Profiler, 0, sizeof(Profiler));
+    
+    CoreDebug->DEMCR |= CoreDebug_DEMCR_TRCENA_Msk;
+    DWT->CYCCNT = 0;
+    DWT->CTRL |= DWT_CTRL_CYCCNTENA_Msk;
+    
+    Profiler.lastSysTickTime = PROFILER_Now();
+    PROFILER_SetClock();                                        // last: enables the recording
+    }
+
+/* the DWT counts CPU cycles: after each change of HCLK */
+static void PROFILER_SetClock(void)
+    {
+    Profiler.budgetTicks = RCC_GetHclkHz() / 1000000 * PROFILER_SYSTICK_BUDGET_US;
+    Profiler.ticksPerMicrosecond = RCC_GetHclkHz() / 1000000;
+    }
+
+static u32 PROFILER_Now(void)
+    {
+    return DWT->CYCCNT;
+    }
+
+#else // STIM32_HOST
+
+static void PROFILER_Init(void)
+    {
+    memset(&Profiler, 0, sizeof(Profiler));
+    Profiler.lastSysTickTime = PROFILER_Now();
+    PROFILER_SetClock();
+    }
+
+/* the host clock counts nanoseconds, whatever the speed */
+static void PROFILER_SetClock(void)
+    {
+    Profiler.budgetTicks = 1000 * PROFILER_SYSTICK_BUDGET_US;
+    Profiler.ticksPerMicrosecond = 1000;
+    }
+
+static u32 PROFILER_Now(void)
+    {
+    struct timespec ts;
+    
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (u32)ts.tv_sec * 1000000000u + (u32)ts.tv_nsec;
+    }
+
+/* phase figures in microseconds, for the host harness; returns the number of records */
+u32 HOST_GetProfilerPhase(u32 phase, const char **name, u32 *min_us, u32 *max_us, u32 histogram[PROFILER_HISTOGRAM_BUCKETS])
+    {
+    const Profiler_Phase_struct *p = &Profiler.phase[phase];
+    
+    *name = ProfilerPhaseName[phase];
+    *min_us = p->min / Profiler.ticksPerMicrosecond;
+    *max_us = p->max / Profiler.ticksPerMicrosecond;
+    memcpy(histogram, p->histogram, sizeof(p->histogram));
+    return p->count;
+    }
+
+void HOST_GetProfilerOverruns(u32 *nbOverruns, u32 *nbLateSequences)
+    {
+    *nbOverruns = Profiler.nbOverruns;
+    *nbLateSequences = Profiler.nbLateSequences;
+    }
+
+#endif // STIM32_HOST
+
+/*******************************************************************************
+* Function Name  : PROFILER_Record
+* Description    : Adds the time elapsed since startTime to the figures of a phase
+                   Histogram bucket n counts the durations under 2^n us.
+* Input          : ProfilerPhase_code phase
+                   u32 startTime (PROFILER_Now)
+* Return         : None
+*******************************************************************************/
+static void PROFILER_Record(ProfilerPhase_code phase, u32 startTime)
+    {
+    Profiler_Phase_struct *p = &Profiler.phase[phase];
+    u32 ticks = PROFILER_Now() - startTime;
+    u32 us, bucket = 0;
+    
+    if(Profiler.ticksPerMicrosecond == 0) return;          // not initialized yet
+    
+    if(p->count++ == 0 || ticks < p->min)
+        {
+        p->min = ticks;
+        }
+    if(ticks > p->max)
+        {
+        p->max = ticks;
+        }
+    
+    us = ticks / Profiler.ticksPerMicrosecond;
+    while(us && bucket < PROFILER_HISTOGRAM_BUCKETS-1)
+        {
+        us >>= 1;
+        bucket++;
+        }
+    p->histogram[bucket]++;
+#ifdef STIM32_HOST
+    if(phase == PROFILER_PHASE_PULSE_IRQ)
+        {
+        HOST_PulsePathCost.pulseIrqTicks += ticks;
+        HOST_PulsePathCost.nbPulseIrqs++;
+        }
+#endif
+    
+    if(phase == PROFILER_PHASE_SYSTICK_HANDLER && ticks > Profiler.budgetTicks)
+        {
+        Profiler.nbOverruns++;
+        }
+    }
+
+/*******************************************************************************
+* Function Name  : GetProfilerPhaseString
+* Description    : One line of the diagnostics screen: phase name, min and max in us
+* Input          : ProfilerPhase_code phase
+* Return         : string
+*******************************************************************************/
+static char* GetProfilerPhaseString(ProfilerPhase_code phase)
+{
+        const Profiler_Phase_struct *p = &Profiler.phase[phase];
+        char number_string[7];
+        
+        // max string lenght is PROFILER_STRING_LENGHT
+        strcpy(ProfilerPhaseString, ProfilerPhaseName[phase]);     // length = 8
+        UTIL_int2str( number_string, p->min / Profiler.ticksPerMicrosecond, 6, FALSE);
+        strcat(ProfilerPhaseString, number_string);         // length = 6
+        UTIL_int2str( number_string, p->max / Profiler.ticksPerMicrosecond, 6, FALSE);
+        strcat(ProfilerPhaseString, number_string);         // length = 6
+        
+        return ProfilerPhaseString;
+}
+
+/*******************************************************************************
+* Function Group : Timer Calibration
+* Description    : Measures the rate of the pulse timer clock against the RTC, which
+                   runs from the LSE crystal. The clock tree is computed from RCC by
+                   PULSEENGINE_Init, but a wrong HSE_VALUE, the HSI, a PLL changed by
+                   CircleOS or an inexact prescaler would silently change every pulse 
+                   width. The measured deviation feeds MICROSECONDS_TO_TIMER_TICKS.
+                   
+                   The RTC is polled every SysTick (TIMERCAL_Poll); the clock is
+                   the DWT cycle counter on the target (the pulse timer runs from the
+                   same HCLK) and the virtual pulse timer in the host build, where the
+                   simulator can inject a clock error.
+*******************************************************************************/
+#ifndef STIM32_HOST
+
+static u32 TIMERCAL_ClockNow(void)
+    {
+    return DWT->CYCCNT;                             // enabled by PROFILER_Init
+    }
+
+static u32 TIMERCAL_GetNominalHz(void)
+    {
+    return RCC_GetHclkHz();
+    }
+
+#else // STIM32_HOST
+
+static u32 TIMERCAL_ClockNow(void)
+    {
+    return HOST_PulseTimerNow();
+    }
+
+static u32 TIMERCAL_GetNominalHz(void)
+    {
+    return PULSE_TIMER_FREQUENCY_HZ;
+    }
+
+/* calibration figures, for the host harness */
+void HOST_GetTimerCalibration(s32 *measuredPpm, s32 *driftPpm, s32 *appliedPpm, u32 *nbMeasurements)
+    {
+    *measuredPpm = TimerCalibration.measuredPpm;
+    *driftPpm = TimerCalibration.driftPpm;
+    *appliedPpm = TimerCalibration.appliedPpm;
+    *nbMeasurements = TimerCalibration.nbMeasurements;
+    }
+
+#endif // STIM32_HOST
+
+static void TIMERCAL_Init(void)
+    {
+    u8 hh, mm;
+    s32 appliedPpm = TimerCalibration.appliedPpm;   // restored by SETTINGS_Restore
+    
+    memset(&TimerCalibration, 0, sizeof(TimerCalibration));
+    TimerCalibration.appliedPpm = appliedPpm;
+    RTC_GetTime( &hh, &mm, &TimerCalibration.lastSecond );
+    TimerCalibration.periodSeconds = TIMERCAL_FIRST_PERIOD_SECONDS;
+    TimerCalibration.nominalHz = TIMERCAL_GetNominalHz();          // last: enables the polling
+    }
+
+/*******************************************************************************
+* Function Name  : TIMERCAL_Restart
+* Description    : After a change of HCLK: the measurement in progress is discarded
+                   and a new one starts at the next RTC second, against the new nominal
+                   clock. The figures and the applied correction are kept.
+* Input          : None
+* Return         : None
+*******************************************************************************/
+static void TIMERCAL_Restart(void)
+    {
+    TimerCalibration.nominalHz = 0;                                // stops the polling
+    MEMORY_BARRIER();
+    TimerCalibration.nbSeconds = 0;
+    TimerCalibration.nominalHz = TIMERCAL_GetNominalHz();
+    }
+
+/*******************************************************************************
+* Function Name  : TIMERCAL_Poll
+* Description    : Called every SysTick; timestamps the RTC second boundaries and 
+                   computes the clock deviation every periodSeconds
+* Input          : None
+* Return         : None
+*******************************************************************************/
+static void TIMERCAL_Poll(void)
+    {
+    u8 hh, mm, ss;
+    u32 now, expected;
+    s32 ppm;
+    
+    if(TimerCalibration.nominalHz == 0) return;                    // not initialized yet
+    
+    RTC_GetTime( &hh, &mm, &ss );
+    if(ss == TimerCalibration.lastSecond) return;
+    
+    now = TIMERCAL_ClockNow();
+    TimerCalibration.lastSecond = ss;
+    EVENT_Post(EVENT_SECOND);
+    
+    if(TimerCalibration.nbSeconds++ == 0)                          // first boundary: start
+        {
+        TimerCalibration.startTime = now;
+        return;
+        }
+    if(TimerCalibration.nbSeconds <= TimerCalibration.periodSeconds) return;
+    
+    expected = TimerCalibration.nominalHz * TimerCalibration.periodSeconds;
+    ppm = (s32)(now - TimerCalibration.startTime - expected) / (s32)(expected / 1000000);
+    
+    if(ppm > TIMERCAL_MAX_PPM || ppm < -TIMERCAL_MAX_PPM)
+        {
+        TimerCalibration.nbRejected++;
+        }
+    else
+        {
+        if(TimerCalibration.nbMeasurements++ > 0)
+            {
+            TimerCalibration.driftPpm = ppm - TimerCalibration.measuredPpm;
+            }
+        TimerCalibration.measuredPpm = ppm;
+        EVENT_Post(EVENT_CALIBRATION);
+        }
+    
+    TimerCalibration.startTime = now;
+    TimerCalibration.nbSeconds = 1;
+    TimerCalibration.periodSeconds = TIMERCAL_PERIOD_SECONDS;
+    }
+
+/*******************************************************************************
+* Function Name  : TIMERCAL_Apply
+* Description    : Main context; recompiles the pulse sequence if the measured
+                   deviation moved away from the one in use
+* Input          : None
+* Return         : None
+*******************************************************************************/
+static void TIMERCAL_Apply(void)
+    {
+    s32 change = TimerCalibration.measuredPpm - TimerCalibration.appliedPpm;
+    
+    if(change > TIMERCAL_APPLY_PPM || change < -TIMERCAL_APPLY_PPM)
+        {
+        TimerCalibration.appliedPpm = TimerCalibration.measuredPpm;
+        UpdatePulseSequence();
+        }
+    }
+
+/*******************************************************************************
+* Function Name  : GetTimerCalibrationString
+* Description    : Line of the diagnostics screen: clock deviation and drift in ppm
+* Input          : None
+* Return         : string
+*******************************************************************************/
+static char* GetTimerCalibrationString(void)
+{
+        s32 values[2];
+        char number_string[7];
+        u8 i;
+        
+        values[0] = TimerCalibration.measuredPpm;
+        values[1] = TimerCalibration.driftPpm;
+        
+        // max string lenght is PROFILER_STRING_LENGHT
+        strcpy(TimerCalibrationString, "Clock ppm");             // length = 9
+        for(i=0; i<2; i++)
+        {
+            strcat(TimerCalibrationString, (values[i] < 0) ? " -" : " +");
+            UTIL_int2str( number_string, (values[i] < 0) ? -values[i] : values[i], 5, FALSE);
+            strcat(TimerCalibrationString, number_string);     // length = 2+5
+        }
+        if(TimerCalibration.nbMeasurements == 0)
+        {
+            strcat(TimerCalibrationString, " ?");
+        }
+        
+        return TimerCalibrationString;
+}
+
+/*******************************************************************************
+* Function Group : Clock governor
+* Description    : The CPU runs at GOVERNOR_FULL_SPEED while stimulating and at
+                   GOVERNOR_LOW_SPEED after GOVERNOR_IDLE_SECONDS without contact nor
+                   serial command: a switch stops the pulses for a few milliseconds,
+                   the lines must take effect within one sequence period.
+                   The clock is switched only while the pulse engine is stopped: the
+                   PLL relocks and CircleOS reprograms the SysTick and the bus dividers,
+                   which cannot be done between two bursts without disturbing the
+                   edges. The pulse timer prescaler follows the clock, so the edge
+                   tables (in microseconds) stay valid; the profiler and the timer
+                   calibration, which count CPU cycles, are rescaled.
+*******************************************************************************/
+#ifndef STIM32_HOST
+
+static u32 GOVERNOR_GetHclkHz(void)
+    {
+    return RCC_GetHclkHz();
+    }
+
+#else // STIM32_HOST
+
+static u32 GOVERNOR_GetHclkHz(void)
+    {
+    return HOST_GetHclkHz();
+    }
+
+/* governor figures, for the host harness */
+void HOST_GetGovernor(u32 *nbSwitches, u32 *nbSeconds, u32 *nbSecondsLow, u32 *savedEnergy_mJ)
+    {
+    *nbSwitches = Governor.nbSwitches;
+    *nbSeconds = Governor.nbSeconds;
+    *nbSecondsLow = Governor.nbSecondsLow;
+    *savedEnergy_mJ = Governor.savedEnergy_mJ;
+    }
+
+#endif // STIM32_HOST
+
+static void GOVERNOR_Init(void)
+    {
+    memset(&Governor, 0, sizeof(Governor));
+    Governor.speed = GOVERNOR_FULL_SPEED;                   // set by Application_Ini
+    Governor.fullSpeedHz = GOVERNOR_GetHclkHz();
+    Governor.hclkHz = Governor.fullSpeedHz;
+    }
+
+/*******************************************************************************
+* Function Name  : GOVERNOR_Switch
+* Description    : Sets the CPU clock and everything that depends on it. Falls back to
+                   the full speed for good if the pulse timing cannot be kept.
+                   The pulse engine must be stopped.
+* Input          : enum eSpeed speed
+* Return         : None
+*******************************************************************************/
+static void GOVERNOR_Switch(enum eSpeed speed)
+    {
+    UTIL_SetPll(speed);
+    if(!PULSEENGINE_SetClock())
+        {
+        speed = GOVERNOR_FULL_SPEED;
+        UTIL_SetPll(speed);
+        PULSEENGINE_SetClock();
+        Governor.isLowSpeedRejected = TRUE;
+        }
+    PROFILER_SetClock();
+    TELEMETRY_SetClock();
+    TIMERCAL_Restart();
+    
+    Governor.speed = speed;
+    Governor.hclkHz = GOVERNOR_GetHclkHz();
+    Governor.nbSwitches++;
+    }
+
+/*******************************************************************************
+* Function Name  : GOVERNOR_Update
+* Description    : Called by Application_Handler; chooses the clock speed and
+                   switches it once the pulse engine has stopped at the end of a sequence.
+                   Every second, the energy saved against the full speed is estimated.
+* Input          : bool isNewSecond
+* Return         : None
+*******************************************************************************/
+static void GOVERNOR_Update(bool isNewSecond)
+    {
+    enum eSpeed speed;
+    
+    if(StimState != STIMSTATE_IDLE || Command.nbLines != Governor.nbCommandLines)
+        {
+        Governor.idleSeconds = 0;                           // contact or command: full speed at once
+        Governor.nbCommandLines = Command.nbLines;
+        }
+    else if(isNewSecond && Governor.idleSeconds < GOVERNOR_IDLE_SECONDS)
+        {
+        Governor.idleSeconds++;
+        }
+    
+    if(isNewSecond)
+        {
+        Governor.nbSeconds++;
+        if(Governor.hclkHz < Governor.fullSpeedHz)
+            {
+            // uA * mV = nW, over one second nJ
+            u32 saved_uA = (Governor.fullSpeedHz - Governor.hclkHz) / 1000000 * GOVERNOR_UA_PER_MHZ;
+            
+            Governor.nbSecondsLow++;
+            Governor.savedEnergy_mJ += saved_uA * ActualBatteryVoltagemV / 1000000;
+            }
+        }
+    
+    speed = (Governor.idleSeconds >= GOVERNOR_IDLE_SECONDS
+             && PulseSeq.frequency_Hz <= GOVERNOR_LOW_SPEED_MAX_HZ
+             && !Governor.isLowSpeedRejected) ? GOVERNOR_LOW_SPEED : GOVERNOR_FULL_SPEED;
+    
+    if(speed != Governor.speed && !Governor.isSwitchPending)
+        {
+        Governor.isSwitchPending = TRUE;                    // first: STIMULATOR_Handler does not restart
+        PULSEENGINE_Stop();                                 // stops at the end of the sequence
+        }
+    if(Governor.isSwitchPending && !PULSEENGINE_IsBusy())
+        {
+        if(speed != Governor.speed)
+            {
+            GOVERNOR_Switch(speed);
+            }
+        MEMORY_BARRIER();
+        Governor.isSwitchPending = FALSE;                   // STIMULATOR_Handler restarts the pulse engine
+        }
+    }
+
+/*******************************************************************************
+* Function Name  : GetGovernorString
+* Description    : Line of the diagnostics screen: clock, time at low speed, energy saved
+* Input          : None
+* Return         : string
+*******************************************************************************/
+static char* GetGovernorString(void)
+{
+        char number_string[6];
+        
+        // max string lenght is PROFILER_STRING_LENGHT
+        strcpy(GovernorString, "Clock");                                    // length = 5
+        UTIL_int2str( number_string, Governor.hclkHz / 1000000, 4, FALSE);
+        strcat(GovernorString, number_string);
+        strcat(GovernorString, "MHz  low");                                 // length = 4+8
+        UTIL_int2str( number_string, Governor.nbSecondsLow * 100 / (Governor.nbSeconds + 1), 4, FALSE);
+        strcat(GovernorString, number_string);
+        strcat(GovernorString, "%");                                        // length = 4+1
+        UTIL_int2str( number_string, Governor.savedEnergy_mJ / 3600, 5, FALSE);
+        strcat(GovernorString, number_string);
+        strcat(GovernorString, "mWh");                                      // length = 5+3
+        
+        return GovernorString;
+}
+
+/*******************************************************************************
+* Function Name  : GUI
+* Description    : GUI management
+                   The normal screen is retained: the text fields keep what they show
+                   (GUI_DrawTextField), only changed characters are sent to the LCD,
+                   and a panel is cleared only when something was drawn on it.
+                   The fills under the text fields go through the compositor
+                   (GUI_ComposeFill), which leaves the text fields shown untouched.
 * Input          :  GUIaction
                     readout1
 * Return         : None
@@ -998,19 +6416,13 @@ static void GUI(GUIaction_code GUIaction, u16 readout1)
 #define STIM_MIDDLEPANEL_COLOR    RGB_MAKE(0x0F, 0x0F, 0x0F)
 #define STIM_BARBG_COLOR          RGB_WHITE
 #define STIM_BARFG_COLOR          RGB_RED
-       
-#define STIM_SINGLE_BAR_WIDTH     8
     
     static StimState_code lastStimState = STIMSTATE_RUN;
-    static u32 lastReadoutValue = 0;
-    static u32 roundedReadout; 
-    static u16 barPosX = 0;
-    u16 barWidth = STIM_SINGLE_BAR_WIDTH;
+    static bool isMiddlePanelClean = FALSE;
     
     static UpperPanelState_code thisUpperPanelState;
     static UpperPanelState_code lastUpperPanelState = UPPERPANELSTATE_UNDEFINED;  
         
-    float readoutYScalingFactor = 0.15;  
     
         switch(GUIaction)
         {
@@ -1021,7 +6433,13 @@ static void GUI(GUIaction_code GUIaction, u16 readout1)
             lastUpperPanelState = UPPERPANELSTATE_UNDEFINED;  
             
             lastStimState = STIMSTATE_RUN;
-            barPosX = 0;
+            isMiddlePanelClean = TRUE;
+            GUI_ClearStripChart();
+            
+            GUI_InitTextField(GUI_FIELD_READOUT,   0, 180, LEFT,  RGB_YELLOW, STIM_UPPERPANEL_COLOR);
+            GUI_InitTextField(GUI_FIELD_NETTIME,   8, 150, RIGHT, RGB_YELLOW, STIM_UPPERPANEL_COLOR);
+            GUI_InitTextField(GUI_FIELD_TOTALTIME, 8,  30, RIGHT, RGB_WHITE,  STIM_LOWERPANEL_COLOR);
+            GUI_InitTextField(GUI_FIELD_SETTINGS,  8,  10, RIGHT, RGB_WHITE,  STIM_LOWERPANEL_COLOR);
                             
             // graphics
             // These are default values
@@ -1052,9 +6470,13 @@ static void GUI(GUIaction_code GUIaction, u16 readout1)
                     
         case GUI_NORMAL_UPDATE:
                     
-            DRAW_DisplayStringWithMode( 8,30,GetTotalTimeString(), 0, NORMAL_TEXT, RIGHT);            
+            GUI_DrawTextField(GUI_FIELD_TOTALTIME, GetTotalTimeString(), 1);
         
-            if(Readout.isOverloaded)
+            if(PulseSeq.isWiringWrong)
+            {
+                thisUpperPanelState = UPPERPANELSTATE_REWIRE;
+            }
+            else if(DisplayReadout.isOverloaded)
             {
                 thisUpperPanelState = UPPERPANELSTATE_OVERLOAD;                
             }
@@ -1066,62 +6488,37 @@ static void GUI(GUIaction_code GUIaction, u16 readout1)
             {   
                 thisUpperPanelState = UPPERPANELSTATE_DISPLAY_READOUT;                
             }
-            if((thisUpperPanelState == lastUpperPanelState) && (thisUpperPanelState != UPPERPANELSTATE_DISPLAY_READOUT)) break;
-            lastUpperPanelState = thisUpperPanelState;    
-        
-            BUZZER_SetMode(BUZZER_OFF);  //switch out buzzer if it has been activated before
+            if(thisUpperPanelState != lastUpperPanelState)
+            {
+                // switch out buzzer if it has been activated before
+                BUZZER_SetMode((thisUpperPanelState == UPPERPANELSTATE_OVERLOAD) ? BUZZER_ON : BUZZER_OFF);
+                lastUpperPanelState = thisUpperPanelState;    
+            }
         
-            
-              
             {
             u8 str[30];        
-            if(thisUpperPanelState == UPPERPANELSTATE_OVERLOAD)
+            if(thisUpperPanelState == UPPERPANELSTATE_REWIRE)
             {
-                strcpy(str,"    OVERLOAD");
-                BUZZER_SetMode(BUZZER_ON);
-                DRAW_SetCharMagniCoeff(2);            
+                GUI_DrawTextField(GUI_FIELD_READOUT, " PIN8 not PC6", 2);
+            }
+            else if(thisUpperPanelState == UPPERPANELSTATE_OVERLOAD)
+            {
+                GUI_DrawTextField(GUI_FIELD_READOUT, "    OVERLOAD", 2);
             }
             else if(thisUpperPanelState == UPPERPANELSTATE_WAITING)
             {
-                strcpy(str,"    Waiting...");
-                DRAW_SetCharMagniCoeff(2);            
+                GUI_DrawTextField(GUI_FIELD_READOUT, "    Waiting...", 2);
             }
             else
             {
                 // display readout figure
                 // IH150219 value rounded to multiple of 50
                 u32 rounding=50;
-                roundedReadout = Readout.CAE1/rounding;
+                u32 roundedReadout = DisplayReadout.CAE1/rounding;
                 roundedReadout *= rounding;
                 UTIL_int2str( str, roundedReadout, 4, FALSE);                    
-                DRAW_SetCharMagniCoeff(4);            
-            }
-            
-            DRAW_SetTextColor(RGB_YELLOW);     
-            DRAW_SetBGndColor(STIM_UPPERPANEL_COLOR);   
-
-   
-            //IH150219 HACK: to reduce display flickering
-            if((lastReadoutValue!=roundedReadout) || (thisUpperPanelState != UPPERPANELSTATE_DISPLAY_READOUT))                 
-            {    
-                // clear upper panel            
-                LCD_FillRect(
-                    0, SCREEN_HEIGHT-STIM_UPPERPANEL_HEIGHT, 
-                    SCREEN_WIDTH, 
-                    STIM_UPPERPANEL_HEIGHT, 
-                    STIM_UPPERPANEL_COLOR );        
-                // display string in the upper panel
-                DRAW_DisplayStringWithMode( 0,180,str, 0, NORMAL_TEXT, LEFT);                        
-                if(thisUpperPanelState == UPPERPANELSTATE_DISPLAY_READOUT)
-                {
-                    lastReadoutValue=roundedReadout;
-                }                
+                GUI_DrawTextField(GUI_FIELD_READOUT, str, 4);
             }
-        
-            
-            DRAW_SetCharMagniCoeff(1);            
-            DRAW_SetTextColor(RGB_WHITE);     
-            DRAW_SetBGndColor(STIM_LOWERPANEL_COLOR);        
             }
         
             // display graphics
@@ -1129,71 +6526,52 @@ static void GUI(GUIaction_code GUIaction, u16 readout1)
             {
             case STIMSTATE_IDLE:  
             case STIMSTATE_WAITING_FOR_RUN:  
-                if(lastStimState!=STIMSTATE_IDLE)
+                if(lastStimState!=STIMSTATE_IDLE && !isMiddlePanelClean)
                     {
-                    //Clean middle panel
-                    LCD_FillRect(
+                    //Clean middle panel, no net time while idle
+                    GUI_HideTextField(GUI_FIELD_NETTIME);
+                    GUI_ComposeFill(
                         0, STIM_LOWERPANEL_HEIGHT, 
                         SCREEN_WIDTH, STIM_MIDDLEPANEL_HEIGHT,
                         STIM_MIDDLEPANEL_COLOR );                                                                           
+                    GUI_ClearStripChart();
+                    isMiddlePanelClean = TRUE;
                     }
                 lastStimState = STIMSTATE_IDLE;
                 break;
         
             case STIMSTATE_RUN:                 
             case STIMSTATE_WAITING_FOR_IDLE:  
-                if(lastStimState!=STIMSTATE_RUN)
+                if(lastStimState!=STIMSTATE_RUN && !isMiddlePanelClean)
                     {
                     //Clean middle panel
-                    LCD_FillRect(
+                    GUI_ComposeFill(
                         0, STIM_LOWERPANEL_HEIGHT, 
                         SCREEN_WIDTH, STIM_MIDDLEPANEL_HEIGHT,                        
                         STIM_MIDDLEPANEL_COLOR );
-                    
-                    barPosX=0;
+                    GUI_ClearStripChart();
                     }
-                else
+                
+                // strip chart: one column per update, the oldest one is overwritten
+                {
+                u32 barHeight = Q12_Scale(DisplayReadout.CAE1, READOUT_Y_SCALE);
+                if(barHeight>STIM_MIDDLEPANEL_HEIGHT)
                     {
-                    u16 barHeight = Readout.CAE1 * readoutYScalingFactor;
-                    if(barHeight>STIM_MIDDLEPANEL_HEIGHT)
-                        {
-                        barHeight>STIM_MIDDLEPANEL_HEIGHT;
-                        }
-                    LCD_FillRect(
-                        barPosX, STIM_LOWERPANEL_HEIGHT, 
-                        barWidth, STIM_MIDDLEPANEL_HEIGHT,                        
-                        STIM_BARBG_COLOR );                    
-                    LCD_FillRect(
-                        barPosX, STIM_LOWERPANEL_HEIGHT, 
-                        barWidth, barHeight,                        
-                        STIM_BARFG_COLOR );                    
-                    barPosX += barWidth;
-                    
-                    if(barPosX>SCREEN_WIDTH)
-                        {
-                        barPosX;
-                        }
+                    barHeight=STIM_MIDDLEPANEL_HEIGHT;
                     }
+                GUI_AddStripChartColumn(barHeight);
+                }
                 lastStimState = STIMSTATE_RUN;                
-                if(barPosX>SCREEN_WIDTH)
-                        {
-                        lastStimState = STIMSTATE_IDLE;  //begin new graphics screen                
-                        }
                 
                 // show net time
-                DRAW_SetTextColor(RGB_YELLOW);    
-                DRAW_SetCharMagniCoeff(2);                                
-                DRAW_SetBGndColor(STIM_UPPERPANEL_COLOR);        
-                DRAW_DisplayStringWithMode( 8,150,GetNetTimeString(), 0, NORMAL_TEXT, RIGHT);    
-                DRAW_SetCharMagniCoeff(1);            
-                DRAW_SetTextColor(RGB_WHITE);     
-                DRAW_SetBGndColor(STIM_LOWERPANEL_COLOR); 
+                GUI_DrawTextField(GUI_FIELD_NETTIME, GetNetTimeString(), 2);
+                isMiddlePanelClean = FALSE;
                        
                 break;
                                     
             }        
                                      
-            DRAW_DisplayStringWithMode( 8,10,GetSettingsString(), 0, NORMAL_TEXT, RIGHT);   
+            GUI_DrawTextField(GUI_FIELD_SETTINGS, GetSettingsString(), 1);
                                         
                    
             break;            
@@ -1215,81 +6593,368 @@ static void GUI(GUIaction_code GUIaction, u16 readout1)
             DRAW_SetCharMagniCoeff(1);
             DRAW_DisplayStringWithMode( 0,100,GetBatteryStatusString(), ALL_SCREEN, NORMAL_TEXT, CENTER);            
             break;                                                     
+        
+        case GUI_DIAGNOSTICS_INITIALIZE:
+        
+            DRAW_SetCharMagniCoeff(1);
+            DRAW_SetTextColor(RGB_WHITE);     
+            DRAW_SetBGndColor(STIM_MIDDLEPANEL_COLOR);        
+            
+            LCD_FillRect(
+            0, 0, 
+            SCREEN_WIDTH, SCREEN_HEIGHT,                 
+            STIM_MIDDLEPANEL_COLOR );
+            
+            DRAW_DisplayStringWithMode( 0,300,"Diagnostics    min[us] max[us]", ALL_SCREEN, NORMAL_TEXT, LEFT);
+            DRAW_DisplayStringWithMode( 0,104,"SysTick time, 1us..1ms (log2)", ALL_SCREEN, NORMAL_TEXT, LEFT);
+            DRAW_DisplayStringWithMode( 0,10,"Push button to return", ALL_SCREEN, NORMAL_TEXT, CENTER);
+            break;
+        
+        case GUI_DIAGNOSTICS_SCREEN:
+            
+#define STIM_HISTOGRAM_HEIGHT     64
+            
+            {
+            u8 i;
+            u32 maxCount = 1;
+            char str[PROFILER_STRING_LENGHT];
+            char number_string[11];
+            const Profiler_Phase_struct *p = &Profiler.phase[PROFILER_PHASE_SYSTICK_HANDLER];
+            
+            DRAW_SetCharMagniCoeff(1);
+            DRAW_SetTextColor(RGB_WHITE);     
+            DRAW_SetBGndColor(STIM_MIDDLEPANEL_COLOR);        
+            
+            // phase figures
+            for(i=0; i<PROFILER_NB_PHASES; i++)
+            {
+                DRAW_DisplayStringWithMode( 0,280-i*16,GetProfilerPhaseString(i), ALL_SCREEN, NORMAL_TEXT, LEFT);
+            }
+            
+            DRAW_SetTextColor(RGB_YELLOW);     
+            strcpy(str, "Overruns ");
+            UTIL_int2str( number_string, Profiler.nbOverruns, 10, FALSE);
+            strcat(str, number_string);
+            DRAW_DisplayStringWithMode( 0,168,str, ALL_SCREEN, NORMAL_TEXT, LEFT);
+            strcpy(str, "Late     ");
+            UTIL_int2str( number_string, Profiler.nbLateSequences, 10, FALSE);
+            strcat(str, number_string);
+            strcat(str, "  Idle ");
+            UTIL_int2str( number_string, Events.nbIdleCalls / (Events.nbCalls / 100 + 1), 3, FALSE);
+            strcat(str, number_string);
+            strcat(str, "%");
+            DRAW_DisplayStringWithMode( 0,152,str, ALL_SCREEN, NORMAL_TEXT, LEFT);
+            DRAW_DisplayStringWithMode( 0,136,GetTimerCalibrationString(), ALL_SCREEN, NORMAL_TEXT, LEFT);
+            DRAW_DisplayStringWithMode( 0,120,GetGovernorString(), ALL_SCREEN, NORMAL_TEXT, LEFT);
+            
+            // histogram of the STIMULATOR_Handler time
+            for(i=0; i<PROFILER_HISTOGRAM_BUCKETS; i++)
+            {
+                if(p->histogram[i] > maxCount) maxCount = p->histogram[i];
+            }
+            for(i=0; i<PROFILER_HISTOGRAM_BUCKETS; i++)
+            {
+                u16 barWidth = SCREEN_WIDTH/PROFILER_HISTOGRAM_BUCKETS;
+                u16 barHeight = p->histogram[i] / ((maxCount + STIM_HISTOGRAM_HEIGHT - 1) / STIM_HISTOGRAM_HEIGHT);
+                
+                LCD_FillRect(
+                    i*barWidth, STIM_LOWERPANEL_HEIGHT, 
+                    barWidth-1, STIM_HISTOGRAM_HEIGHT,                        
+                    STIM_BARBG_COLOR );                    
+                LCD_FillRect(
+                    i*barWidth, STIM_LOWERPANEL_HEIGHT, 
+                    barWidth-1, barHeight,                        
+                    STIM_BARFG_COLOR );                    
+            }
+            }
+            break;
         }
     }
 
 /*******************************************************************************
-* Function Name  : SetAutorun
-* Description    : Sets the bit 7 in SYS2 backup register to autorun this application 
-* Input          : None                     
-* Return         : None
+* Function Group : Retained GUI
+* Description    : Text fields of the normal screen. Each field remembers the text,
+                   position and size it has on the LCD; drawing the same text again
+                   writes nothing, a text of the same length and size writes the
+                   changed characters only. Nothing else paints over a field shown
+                   (see GUI compositor), so what is on the LCD stays as remembered.
+                   
+                   RIGHT and CENTER are resolved here like CircleOS does, so a part
+                   of the text can be drawn LEFT aligned at its own position.
 *******************************************************************************/
-static void SetAutorun(void)
+static void GUI_InitTextField(GUITextField_code id, coord_t x, coord_t y, enum ALIGNMENT align, u16 textColor, u16 bgndColor)
     {
-        //IH150125 the autorun is currently set in the CircleOS menu
+    GUI_Text_Field_struct *field = &GuiTextField[id];
+    
+    field->x = x;
+    field->y = y;
+    field->align = align;
+    field->textColor = textColor;
+    field->bgndColor = bgndColor;
+    field->isValid = FALSE;
+    field->drawnLength = 0;
     }
 
-static void BackUpParameters(void)
-{   
-    UTIL_WriteBackupRegister (BKP_FREQUENCY, PulseSeq.frequency);
-    UTIL_WriteBackupRegister (BKP_PULSESEQ, PulseSeq.pulseSeq);
-    UTIL_WriteBackupRegister (BKP_PULSEPEAKVOLTAGE, PulseSeq.peakVoltage);
+static void GUI_DrawTextField(GUITextField_code id, const char *text, u8 magnification)
+    {
+    GUI_Text_Field_struct *field = &GuiTextField[id];
+    u8 length = strlen(text);
+    coord_t charWidth = CHAR_WIDTH * magnification;
+    coord_t x = field->x;
+    u8 first = 0, last;
+    char part[GUI_TEXT_FIELD_LENGHT];
+    
+    if(length > GUI_TEXT_FIELD_LENGHT-1) length = GUI_TEXT_FIELD_LENGHT-1;
+    if(field->align == RIGHT)       x = SCREEN_WIDTH - length*charWidth - field->x;
+    else if(field->align == CENTER) x = (SCREEN_WIDTH - length*charWidth) / 2;
+    last = length - 1;
+    
+    if(field->isValid && x == field->drawnX && length == field->drawnLength && magnification == field->drawnMagnification)
+        {
+        // same place and size: only the characters that differ
+        while(first < length && text[first] == field->text[first]) first++;
+        if(first == length) return;
+        while(text[last] == field->text[last]) last--;
+        }
+    else if(field->isValid && field->drawnLength > 0)
+        {
+        // the old text is erased where the new one does not cover it
+        coord_t oldWidth = field->drawnLength * CHAR_WIDTH * field->drawnMagnification;
+        
+        if(x > field->drawnX || x + length*charWidth < field->drawnX + oldWidth || magnification < field->drawnMagnification)
+            {
+            field->drawnLength = 0;
+            GUI_RestoreLayers(field->drawnX, field->y, oldWidth, CHAR_HEIGHT * field->drawnMagnification);
+            }
+        }
+    
+    if(length > 0)
+        {
+        memcpy(part, text + first, last - first + 1);
+        part[last - first + 1] = 0;
+        
+        DRAW_SetCharMagniCoeff(magnification);
+        DRAW_SetTextColor(field->textColor);
+        DRAW_SetBGndColor(field->bgndColor);
+        DRAW_DisplayStringWithMode(x + first*charWidth, field->y, part, 0, NORMAL_TEXT, LEFT);
+        DRAW_SetCharMagniCoeff(1);
+        }
+    
+    memcpy(field->text, text, length);
+    field->text[length] = 0;
+    field->drawnX = x;
+    field->drawnLength = length;
+    field->drawnMagnification = magnification;
+    field->isValid = TRUE;
+    }
 
-return;
-}
+/*******************************************************************************
+* Function Name  : GUI_HideTextField
+* Description    : Takes a field off the screen; its text is not erased here, the
+                   next fill of the layers below covers it
+* Input          : id
+* Return         : None
+*******************************************************************************/
+static void GUI_HideTextField(GUITextField_code id)
+    {
+    GuiTextField[id].isValid = FALSE;
+    GuiTextField[id].drawnLength = 0;
+    }
 
-static void RestoreParameters(void)
-{
-    u32 p_Frequency             = UTIL_ReadBackupRegister (BKP_FREQUENCY);
-    u32 p_PulseSeq              = UTIL_ReadBackupRegister (BKP_PULSESEQ);
-    u32 p_PulsePeakVoltage      = UTIL_ReadBackupRegister (BKP_PULSEPEAKVOLTAGE);
+/*******************************************************************************
+* Function Name  : GUI_ClearStripChart
+* Description    : The middle panel has been cleared: the chart starts again at the
+                   left edge, every column is drawn whole the first time
+* Input          : None
+* Return         : None
+*******************************************************************************/
+static void GUI_ClearStripChart(void)
+    {
+    memset(GuiStripChart.height, GUI_STRIPCHART_CLEAN, sizeof(GuiStripChart.height));
+    GuiStripChart.nextColumn = 0;
+    }
 
-    // set defaults if backup not valid
-    if(p_Frequency>0)           { PulseSeq.frequency = p_Frequency;         }  else  { PulseSeq.frequency = FREQUENCY_1KHZ; }
-    if(p_PulseSeq>0)            { PulseSeq.pulseSeq = p_PulseSeq;           }  else  { PulseSeq.pulseSeq  = PULSESEQUENCE_1;  }
-    if(p_PulsePeakVoltage>0)    { PulseSeq.peakVoltage = p_PulsePeakVoltage;}  else  { PulseSeq.peakVoltage  = PULSEPEAKVOLTAGE_8V
-    ;  }
+/*******************************************************************************
+* Function Name  : GUI_AddStripChartColumn
+* Description    : Overwrites the oldest column of the strip chart with a new bar.
+                   The columns form a ring, so the panel is never cleared: a column
+                   drawn before changes only between its old and its new height,
+                   which costs at most one column of pixels per update. The parts
+                   under a text field are left out (GUI_ComposeFill) and drawn when
+                   the field uncovers them.
+* Input          : barHeight (pixels, <= STIM_MIDDLEPANEL_HEIGHT)
+* Return         : None
+*******************************************************************************/
+static void GUI_AddStripChartColumn(u16 barHeight)
+    {
+    coord_t x = GuiStripChart.nextColumn * GUI_STRIPCHART_COLUMN_WIDTH;
+    u8 oldHeight = GuiStripChart.height[GuiStripChart.nextColumn];
+    
+    if(oldHeight == GUI_STRIPCHART_CLEAN)
+        {
+        GUI_ComposeFill(
+            x, STIM_LOWERPANEL_HEIGHT + barHeight, 
+            GUI_STRIPCHART_COLUMN_WIDTH, STIM_MIDDLEPANEL_HEIGHT - barHeight,                        
+            STIM_BARBG_COLOR );
+        GUI_ComposeFill(
+            x, STIM_LOWERPANEL_HEIGHT, 
+            GUI_STRIPCHART_COLUMN_WIDTH, barHeight,                        
+            STIM_BARFG_COLOR );
+        }
+    else if(barHeight > oldHeight)
+        {
+        GUI_ComposeFill(
+            x, STIM_LOWERPANEL_HEIGHT + oldHeight, 
+            GUI_STRIPCHART_COLUMN_WIDTH, barHeight - oldHeight,                        
+            STIM_BARFG_COLOR );
+        }
+    else if(barHeight < oldHeight)
+        {
+        GUI_ComposeFill(
+            x, STIM_LOWERPANEL_HEIGHT + barHeight, 
+            GUI_STRIPCHART_COLUMN_WIDTH, oldHeight - barHeight,                        
+            STIM_BARBG_COLOR );
+        }
+    
+    GuiStripChart.height[GuiStripChart.nextColumn] = barHeight;
+    GuiStripChart.nextColumn = (GuiStripChart.nextColumn + 1) % GUI_STRIPCHART_NB_COLUMNS;
+    }
 
-                
-    return;
-}
+/*******************************************************************************
+* Function Group : GUI compositor
+* Description    : The normal screen is made of layers: the panel backgrounds, the
+                   strip chart on the middle panel and the text fields on top. A
+                   fill of the layers below is cut around the text fields shown,
+                   so every pixel is written once with its final colour: a bar no
+                   longer overpaints a figure that is then drawn again (the flicker
+                   of drawing the layers one after the other), and a text field
+                   that shrinks uncovers what the layers below have there.
+                   
+                   IH: composing off-screen would need a frame buffer (108kB for
+                   the middle panel alone) the application does not have, and the
+                   LCD is driven by CircleOS; the clipping gives the same result.
+*******************************************************************************/
+static void GUI_FillAroundTextFields(coord_t x, coord_t y, coord_t width, coord_t height, u16 color, u8 firstField)
+    {
+    u8 id;
+    
+    for(id=firstField; id<GUI_NB_TEXT_FIELDS; id++)
+        {
+        GUI_Text_Field_struct *field = &GuiTextField[id];
+        coord_t fieldWidth = field->drawnLength * CHAR_WIDTH * field->drawnMagnification;
+        coord_t fieldHeight = CHAR_HEIGHT * field->drawnMagnification;
+        
+        if(fieldWidth > 0
+           && x < field->drawnX + fieldWidth && field->drawnX < x + width
+           && y < field->y + fieldHeight && field->y < y + height)
+            {
+            // the (up to 4) parts of the rectangle around the field
+            coord_t bottom = (y > field->y) ? y : field->y;
+            coord_t top = (y + height < field->y + fieldHeight) ? y + height : field->y + fieldHeight;
+            
+            if(y < field->y)
+                {
+                GUI_FillAroundTextFields(x, y, width, field->y - y, color, id+1);
+                }
+            if(y + height > field->y + fieldHeight)
+                {
+                GUI_FillAroundTextFields(x, field->y + fieldHeight, width, y + height - field->y - fieldHeight, color, id+1);
+                }
+            if(x < field->drawnX)
+                {
+                GUI_FillAroundTextFields(x, bottom, field->drawnX - x, top - bottom, color, id+1);
+                }
+            if(x + width > field->drawnX + fieldWidth)
+                {
+                GUI_FillAroundTextFields(field->drawnX + fieldWidth, bottom, x + width - field->drawnX - fieldWidth, top - bottom, color, id+1);
+                }
+            return;
+            }
+        }
+    
+    if(width > 0 && height > 0)
+        {
+        LCD_FillRect(x, y, width, height, color);
+        }
+    }
 
-static char* GetSettingsString(void)
-{
-        char *frequency_string;
-        char *pulseSeq_string;
-        char *peakVoltage_string;
-        char time_string[6];
+static void GUI_ComposeFill(coord_t x, coord_t y, coord_t width, coord_t height, u16 color)
+    {
+    GUI_FillAroundTextFields(x, y, width, height, color, 0);
+    }
+
+/*******************************************************************************
+* Function Name  : GUI_RestoreLayers
+* Description    : Draws again what the panels and the strip chart have in a
+                   rectangle a text field no longer covers
+* Input          : the rectangle
+* Return         : None
+*******************************************************************************/
+static void GUI_RestoreLayers(coord_t x, coord_t y, coord_t width, coord_t height)
+    {
+    coord_t middleBottom = STIM_LOWERPANEL_HEIGHT;
+    coord_t middleTop = STIM_LOWERPANEL_HEIGHT + STIM_MIDDLEPANEL_HEIGHT;
+    coord_t bottom = (y > middleBottom) ? y : middleBottom;
+    coord_t top = (y + height < middleTop) ? y + height : middleTop;
+    coord_t columnX;
     
-        switch(PulseSeq.frequency)
+    // the lower and the upper panel
+    if(y < middleBottom)
         {
-            case FREQUENCY_1KHZ:
-                    frequency_string = "1kHz";                    
-                    break;
-            case FREQUENCY_2KHZ:
-                    frequency_string = "2kHz";                    
-                    break;
-            case FREQUENCY_3KHZ:
-                    frequency_string = "3kHz";                    
-                    break;
+        GUI_ComposeFill(x, y, width, ((y + height < middleBottom) ? y + height : middleBottom) - y, STIM_LOWERPANEL_COLOR);
+        }
+    if(y + height > middleTop)
+        {
+        GUI_ComposeFill(x, (y > middleTop) ? y : middleTop, width, y + height - ((y > middleTop) ? y : middleTop), STIM_UPPERPANEL_COLOR);
+        }
+    if(bottom >= top)
+        {
+        return;
         }
     
-        switch(PulseSeq.pulseSeq)
+    // the middle panel, column by column
+    for(columnX = x - x % GUI_STRIPCHART_COLUMN_WIDTH; columnX < x + width && columnX < SCREEN_WIDTH; columnX += GUI_STRIPCHART_COLUMN_WIDTH)
         {
-            case PULSESEQUENCE_1:
-                    pulseSeq_string = "Seq1";                    
-                    break;
-            case PULSESEQUENCE_2:
-                    pulseSeq_string = "Seq2";                    
-                    break;
-            case PULSESEQUENCE_3:
-                    pulseSeq_string = "Seq3";                    
-                    break;
-            case PULSESEQUENCE_4:
-                    pulseSeq_string = "Seq4";                    
-                    break;
+        coord_t left = (columnX > x) ? columnX : x;
+        coord_t right = (columnX + GUI_STRIPCHART_COLUMN_WIDTH < x + width) ? columnX + GUI_STRIPCHART_COLUMN_WIDTH : x + width;
+        u8 barHeight = GuiStripChart.height[columnX / GUI_STRIPCHART_COLUMN_WIDTH];
+        coord_t barTop = middleBottom + barHeight;
+        
+        if(barHeight == GUI_STRIPCHART_CLEAN)
+            {
+            GUI_ComposeFill(left, bottom, right - left, top - bottom, STIM_MIDDLEPANEL_COLOR);
+            continue;
+            }
+        if(bottom < barTop)
+            {
+            GUI_ComposeFill(left, bottom, right - left, ((top < barTop) ? top : barTop) - bottom, STIM_BARFG_COLOR);
+            }
+        if(top > barTop)
+            {
+            GUI_ComposeFill(left, (bottom > barTop) ? bottom : barTop, right - left, top - ((bottom > barTop) ? bottom : barTop), STIM_BARBG_COLOR);
+            }
         }
+    }
+
+/*******************************************************************************
+* Function Name  : SetAutorun
+* Description    : Sets the bit 7 in SYS2 backup register to autorun this application 
+* Input          : None                     
+* Return         : None
+*******************************************************************************/
+static void SetAutorun(void)
+    {
+        //IH150125 the autorun is currently set in the CircleOS menu
+    }
+
+static char* GetSettingsString(void)
+{
+        const char *pulseSeq_string;
+        char *peakVoltage_string;
+        char time_string[6];
     
+        pulseSeq_string = PulseSequenceTable[PulseSeq.pulseSeq-1].name;
+
         switch(PulseSeq.peakVoltage)
         {
             case PULSEPEAKVOLTAGE_8V:
@@ -1304,16 +6969,48 @@ static char* GetSettingsString(void)
         }       
         
         // max string lenght is SETTINGS_STRING_LENGHT
-        strcpy(SettingsStatusString, frequency_string); // lenght = 4
+        strcpy(SettingsStatusString, GetFrequencyString()); // lenght <= 8
         strcat(SettingsStatusString, "   ");            // lenght = 3
         strcat(SettingsStatusString, pulseSeq_string);  // length = 4
         strcat(SettingsStatusString, "   ");            // lenght = 3
         strcat(SettingsStatusString, peakVoltage_string);  // length = 2
+        if(CurrentControl.target)
+        {
+            char number_string[4];
+            
+            UTIL_int2str( number_string, CurrentControl.target, 3, FALSE);
+            strcat(SettingsStatusString, "  I");            // length = 3
+            strcat(SettingsStatusString, number_string);    // length = 3
+        }
             
         return SettingsStatusString;
 }
 
 
+/* sequence rate like "50Hz" or "2kHz" */
+static char* GetFrequencyString(void)
+{
+        char *str = FrequencyString;
+        u32 value = PulseSeq.frequency_Hz;
+        const char *unit = "Hz";
+        
+        if(PulseSeq.config && PulseSeq.config->phaseModulus < value)
+        {
+            value = PulseSeq.config->phaseModulus;        // limited by the sequence length
+        }
+        
+        if(value >= 1000 && value % 1000 == 0)
+        {
+            value /= 1000;
+            unit = "kHz";
+        }
+        UTIL_int2str( FrequencyString, value, 5, FALSE);
+        while(*str == ' ') str++;
+        strcat(str, unit);
+        
+        return str;
+}
+
 static char* GetTotalTimeString(void)
 {
         u8 THH, TMM, TSS;
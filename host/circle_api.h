@@ -0,0 +1,218 @@
+/******************************************************************************
+*
+* File Name          :  circle_api.h
+* Description        :  Stand-in for the CircleOS API, host (PC) simulation build
+*
+*                       Only the part of the API used by STiM32.c is declared.
+*                       The functions are implemented by circle_host.c.
+*
+*******************************************************************************/
+
+#ifndef __CIRCLE_API_H
+#define __CIRCLE_API_H
+
+#include <stdint.h>
+#include <string.h>
+
+/* Types ---------------------------------------------------------------------*/
+typedef uint8_t     u8;
+typedef uint16_t    u16;
+typedef uint32_t    u32;
+typedef int8_t      s8;
+typedef int16_t     s16;
+typedef int32_t     s32;
+
+typedef enum { FALSE = 0, TRUE = !FALSE } bool;
+
+typedef s16     coord_t;
+
+typedef void (*tHandler)(void);
+
+/* Menu ----------------------------------------------------------------------*/
+#define MENU_MAXITEM    8
+
+enum MENU_code
+    {
+    MENU_LEAVE              = 0,
+    MENU_CONTINUE           = 1,
+    MENU_REFRESH            = 2,
+    MENU_CHANGE             = 3,
+    MENU_CONTINUE_COMMAND   = 4,
+    MENU_LEAVE_AS_IT        = 5,
+    MENU_RESTORE_COMMAND    = 6,
+    };
+
+typedef struct
+    {
+    const char*     Text;
+    enum MENU_code  (*Fct_Init)(void);
+    enum MENU_code  (*Fct_Manage)(void);
+    int             fRemoveMenu;
+    }
+    tMenuItem;
+
+typedef struct
+    {
+    u8          fdispTitle;
+    const char* Title;
+    u8          NbItems;
+    u8          LgMax;
+    u8          XPos, YPos;
+    u8          XSize, YSize;
+    u8          SelectedItem;
+    tMenuItem   Items[MENU_MAXITEM];
+    }
+    tMenu;
+
+void            MENU_Set(tMenu* mptr);
+void            MENU_SetAppliDivider(u8 divider);
+void            MENU_ClearCurrentCommand(void);
+enum MENU_code  MENU_Quit(void);
+
+/* Scheduler, utilities ------------------------------------------------------*/
+#define MENU_SCHHDL_ID      1
+#define UNUSED5_SCHHDL_ID   9
+#define SCHHDL_MAX          10
+
+enum eSpeed
+    {
+    SPEED_VERY_LOW  = 1,
+    SPEED_LOW       = 2,
+    SPEED_MEDIUM    = 3,
+    SPEED_HIGH      = 4,
+    SPEED_VERY_HIGH = 5,
+    };
+
+enum BKPREG
+    {
+    BKP_SYS1 = 1, BKP_SYS2, BKP_SYS3, BKP_SYS4, BKP_SYS5, BKP_SYS6,
+    BKP_USER1, BKP_USER2, BKP_USER3, BKP_USER4,
+    BKP_MAX
+    };
+
+void    UTIL_SetSchHandler(u8 id, tHandler handler);
+void    UTIL_SetDividerHandler(u8 id, u16 divider);
+void    UTIL_SetIrqHandler(s32 offset, tHandler handler);
+void    UTIL_SetTimer(u32 millisec, tHandler handler);
+void    UTIL_SetPll(enum eSpeed speed);
+u16     UTIL_GetBat(void);
+void    UTIL_int2str(char* ptr, u32 X, u16 digit, bool fillwithzero);
+void    UTIL_WriteBackupRegister(u16 BKP_DR, u32 Data);
+u32     UTIL_ReadBackupRegister(u16 BKP_DR);
+void    SHUTDOWN_Action(void);
+
+/* RTC -----------------------------------------------------------------------*/
+void    RTC_SetTime(u32 THH, u32 TMM, u32 TSS);
+void    RTC_GetTime(u8* THH, u8* TMM, u8* TSS);
+
+/* LCD, drawing --------------------------------------------------------------*/
+#define SCREEN_WIDTH        240
+#define SCREEN_HEIGHT       320
+#define CHAR_WIDTH          7
+#define CHAR_HEIGHT         14
+
+#define RGB_MAKE(r,g,b)     ((u16)((((r) & 0xF8) << 8) | (((g) & 0xFC) << 3) | ((b) >> 3)))
+#define RGB_BLACK           0x0000
+#define RGB_WHITE           0xFFFF
+#define RGB_RED             0xF800
+#define RGB_GREEN           0x07E0
+#define RGB_BLUE            0x001F
+#define RGB_YELLOW          0xFFE0
+#define RGB_ORANGE          0xFD20
+
+#define ALL_SCREEN          255
+
+enum OFFSET_mode    { OFFSET_OFF, OFFSET_ON };
+enum DRAW_mode      { NORMAL_TEXT, INVERTED_TEXT };
+enum ALIGNMENT      { LEFT, CENTER, RIGHT };
+enum POINTER_mode   { POINTER_UNDEF, POINTER_ON, POINTER_OFF, POINTER_MENU, POINTER_APPLICATION, POINTER_RESTORE_LESS };
+
+void    LCD_SetOffset(enum OFFSET_mode mode);
+void    LCD_SetRotateScreen(u8 RotateScreen);
+void    LCD_SetBackLightOn(void);
+void    LCD_FillRect(coord_t x, coord_t y, coord_t width, coord_t height, u16 color);
+void    DRAW_SetDefaultColor(void);
+void    DRAW_SetCharMagniCoeff(u16 Coeff);
+void    DRAW_SetTextColor(u16 Color);
+void    DRAW_SetBGndColor(u16 Color);
+void    DRAW_Clear(void);
+void    DRAW_DisplayStringWithMode(coord_t x, coord_t y, const char* ptr, u8 len, u8 mode, enum ALIGNMENT align);
+void    POINTER_SetMode(enum POINTER_mode mode);
+
+/* Buttons, LEDs, buzzer -----------------------------------------------------*/
+enum BUTTON_state   { BUTTON_UNDEF, BUTTON_RELEASED, BUTTON_PUSHED, BUTTON_PUSHED_FORMAIN, BUTTON_CHANGED };
+enum BUTTON_mode    { BUTTON_DISABLED, BUTTON_ONOFF, BUTTON_ONOFF_FORMAIN, BUTTON_WITHCLICK };
+enum LED_id         { LED_GREEN, LED_RED };
+enum LED_mode       { LED_UNDEF, LED_OFF, LED_ON, LED_BLINKING_LF, LED_BLINKING_HF };
+enum BUZZER_mode    { BUZZER_UNDEF, BUZZER_OFF, BUZZER_ON, BUZZER_SHORTBEEP, BUZZER_LONGBEEP };
+
+enum BUTTON_state   BUTTON_GetState(void);
+void    BUTTON_SetMode(enum BUTTON_mode mode);
+void    BUTTON_WaitForRelease(void);
+void    LED_Set(enum LED_id id, enum LED_mode mode);
+void    BUZZER_SetMode(enum BUZZER_mode mode);
+
+/* CX extension connector ----------------------------------------------------*/
+typedef enum
+    {
+    CX_GPIO_PIN1 = 1, CX_GPIO_PIN2, CX_GPIO_PIN3, CX_GPIO_PIN4, CX_GPIO_PIN5,
+    CX_GPIO_PIN6, CX_GPIO_PIN7, CX_GPIO_PIN8,
+    CX_SPI,
+    CX_USART,
+    CX_ADC1,
+    CX_ADC2,
+    }
+    CX_ID_Type;
+
+#define CX_GPIO_LOW             ((void*)0)
+#define CX_GPIO_HIGH            ((void*)1)
+#define CX_GPIO_Mode_OUT_PP     ((void*)1)
+
+enum { CX_SPI_Mode_Low, CX_SPI_Mode_Medium, CX_SPI_Mode_High, CX_SPI_Mode_VeryHigh };
+enum { CX_SPI_8_Bits = 8, CX_SPI_16_Bits = 16 };
+enum { CX_SPI_MODE_SLAVE, CX_SPI_MODE_MASTER };
+enum { CX_SPI_POL_LOW, CX_SPI_POL_HIGH };
+enum { CX_SPI_PHA_FIRST, CX_SPI_PHA_SECOND };
+enum { CX_SPI_LSBFIRST, CX_SPI_MSBFIRST };
+enum { CX_SPI_Soft, CX_SPI_Hard };
+
+typedef struct
+    {
+    u32 Speed;
+    u32 WordLength;
+    u32 Mode;
+    u32 Polarity;
+    u32 Phase;
+    u32 MSB1LSB0;
+    u32 Nss;
+    u8* RxBuffer;
+    u32 RxBufferLen;
+    u8* TxBuffer;
+    u32 TxBufferLen;
+    }
+    tCX_SPI_Config;
+
+enum { CX_USART_WordLength_8b, CX_USART_WordLength_9b };
+enum { CX_USART_StopBits_1, CX_USART_StopBits_2 };
+enum { CX_USART_Parity_No, CX_USART_Parity_Even, CX_USART_Parity_Odd };
+enum { CX_USART_HardwareFlowControl_None, CX_USART_HardwareFlowControl_RTS_CTS };
+
+typedef struct
+    {
+    u32 Speed;                  // baud rate
+    u32 WordLength;
+    u32 StopBits;
+    u32 Parity;
+    u32 HardwareFlowControl;
+    u8* RxBuffer;
+    u32 RxBufferLen;
+    u8* TxBuffer;
+    u32 TxBufferLen;
+    }
+    tCX_USART_Config;
+
+u32     CX_Configure(CX_ID_Type id, const void* param1, const void* param2);
+u32     CX_Write(CX_ID_Type id, const void* param1, volatile void* param2);
+u32     CX_Read(CX_ID_Type id, void* param1, volatile void* param2);
+
+#endif /* __CIRCLE_API_H */
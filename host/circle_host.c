@@ -0,0 +1,391 @@
+/******************************************************************************
+*
+* File Name          :  circle_host.c
+* Description        :  Simulated CircleOS for the host (PC) build of STiM32
+*
+*                       The scheduler, the menu and the one-shot timer are driven
+*                       by HOST_SysTick(); the caller decides how fast virtual time
+*                       runs. The LCD is not rendered, only the written pixels
+*                       are counted.
+*
+*******************************************************************************/
+
+/* Includes ------------------------------------------------------------------*/
+#include <stdio.h>
+#include "stim32_host.h"
+
+/* Private defines -----------------------------------------------------------*/
+#define HOST_MENU_PATH_LENGTH   128
+
+/* Global variables ----------------------------------------------------------*/
+static struct
+    {
+        tHandler    handler[SCHHDL_MAX];
+        u16         divider[SCHHDL_MAX];
+        u32         tickCnt;
+
+        u8          appliDivider;
+        enum MENU_code (*application)(void);    // Application_Handler
+        enum MENU_code (*command)(void);        // current command, NULL when the menu is shown or the app left
+        bool        isRunning;
+
+        tMenu       *menu;
+        char        menuPath[HOST_MENU_PATH_LENGTH];
+        bool        isButtonPushed;
+
+        tHandler    timerHandler;
+        u32         timerTicksLeft;
+
+        u32         rtcOffsetSeconds;
+        u32         backupRegister[BKP_MAX];
+        u16         batteryVoltagemV;
+        u16         cxAdcValue;
+        enum LED_mode led[2];
+
+        u32         lcdPixelsWritten;
+        u16         charMagniCoeff;
+
+        enum eSpeed speed;
+    }
+    Host = { .batteryVoltagemV = 4100, .charMagniCoeff = 1, .appliDivider = 1, .speed = SPEED_MEDIUM };
+
+/* HCLK of the UTIL_SetPll speeds, as assumed for the STM32F429 (SPEED_VERY_HIGH = 120MHz) */
+static const u32 HostHclkHz[] = { 0, 24000000, 36000000, 48000000, 72000000, 120000000 };
+
+/*******************************************************************************
+* Function Group : Host controls
+*******************************************************************************/
+void HOST_StartApplication(enum MENU_code (*ini)(void), enum MENU_code (*handler)(void))
+    {
+    Host.divider[MENU_SCHHDL_ID] = 10;
+    Host.application = handler;
+    Host.isRunning = TRUE;
+    Host.command = (ini() == MENU_CONTINUE_COMMAND) ? handler : 0;
+    }
+
+bool HOST_IsApplicationRunning(void)
+    {
+    return Host.isRunning;
+    }
+
+u32 HOST_GetSysTickCount(void)
+    {
+    return Host.tickCnt;
+    }
+
+/* path like "Set Frequency| 2 kHz "; the button is pushed at the next application call */
+void HOST_SelectMenu(const char *path)
+    {
+    strncpy(Host.menuPath, path, HOST_MENU_PATH_LENGTH-1);
+    Host.isButtonPushed = TRUE;
+    }
+
+/* read by the application at its next call, like a push outside of a menu */
+void HOST_PushButton(void)
+    {
+    Host.isButtonPushed = TRUE;
+    }
+
+void HOST_SetBatteryVoltage(u16 mV)
+    {
+    Host.batteryVoltagemV = mV;
+    }
+
+void HOST_SetCxAdcValue(u16 ad_value_0_to_4095)
+    {
+    Host.cxAdcValue = ad_value_0_to_4095;
+    }
+
+enum LED_mode HOST_GetLedState(enum LED_id id)
+    {
+    return Host.led[id];
+    }
+
+u32 HOST_GetLcdPixelsWritten(void)
+    {
+    return Host.lcdPixelsWritten;
+    }
+
+u32 HOST_GetHclkHz(void)
+    {
+    return HostHclkHz[Host.speed];
+    }
+
+const char *HOST_GetMenuTitle(void)
+    {
+    return Host.command ? 0 : (Host.menu ? Host.menu->Title : 0);
+    }
+
+/*******************************************************************************
+* Function Name  : HOST_WalkMenu
+* Description    : Selects the items of the scripted menu path one by one, the way
+                   the CircleOS menu does it after a MENU_CHANGE
+* Input          : None
+* Return         : None
+*******************************************************************************/
+static void HOST_WalkMenu(void)
+    {
+    char *item = Host.menuPath;
+
+    Host.command = 0;
+    while(*item && Host.menu)
+        {
+        char *next = strchr(item, '|');
+        tMenuItem *selected = 0;
+        enum MENU_code code;
+        u8 i;
+
+        if(next) *next++ = 0;
+        for(i=0; i<Host.menu->NbItems; i++)
+            {
+            if(strcmp(Host.menu->Items[i].Text, item) == 0)
+                {
+                selected = &Host.menu->Items[i];
+                }
+            }
+        if(!selected)
+            {
+            fprintf(stderr, "circle_host: no item \"%s\" in menu \"%s\"\n", item, Host.menu->Title);
+            break;
+            }
+        Host.menu->SelectedItem = selected - Host.menu->Items;
+        code = selected->Fct_Init();
+        if(code != MENU_CHANGE)
+            {
+            Host.command = selected->Fct_Manage;
+            if(code == MENU_LEAVE)
+                {
+                Host.isRunning = FALSE;
+                }
+            break;
+            }
+        item = next ? next : "";
+        }
+    Host.menuPath[0] = 0;
+    }
+
+/*******************************************************************************
+* Function Name  : HOST_SysTick
+* Description    : One SysTick: scheduler handlers, one-shot timer, application
+* Input          : None
+* Return         : None
+*******************************************************************************/
+void HOST_SysTick(void)
+    {
+    u8 id;
+
+    Host.tickCnt++;
+
+    for(id=0; id<SCHHDL_MAX; id++)
+        {
+        if(Host.handler[id] && Host.divider[id] && (Host.tickCnt % Host.divider[id]) == 0)
+            {
+            Host.handler[id]();
+            }
+        }
+
+    if(Host.timerHandler && --Host.timerTicksLeft == 0)
+        {
+        tHandler handler = Host.timerHandler;
+
+        Host.timerHandler = 0;
+        handler();
+        }
+
+    if(Host.command && (Host.tickCnt % (Host.divider[MENU_SCHHDL_ID] * Host.appliDivider)) == 0)
+        {
+        switch(Host.command())
+            {
+            case MENU_CHANGE:
+                HOST_WalkMenu();
+                break;
+            case MENU_RESTORE_COMMAND:
+                Host.command = Host.application;
+                break;
+            case MENU_LEAVE:
+                Host.command = 0;
+                Host.isRunning = FALSE;
+                break;
+            default:
+                break;
+            }
+        }
+    }
+
+/*******************************************************************************
+* Function Group : Menu
+*******************************************************************************/
+void MENU_Set(tMenu* mptr)
+    {
+    Host.menu = mptr;
+    }
+
+void MENU_SetAppliDivider(u8 divider)
+    {
+    Host.appliDivider = divider ? divider : 1;
+    }
+
+void MENU_ClearCurrentCommand(void)
+    {
+    }
+
+enum MENU_code MENU_Quit(void)
+    {
+    return MENU_LEAVE;
+    }
+
+/*******************************************************************************
+* Function Group : Scheduler, utilities
+*******************************************************************************/
+void UTIL_SetSchHandler(u8 id, tHandler handler)
+    {
+    Host.handler[id] = handler;
+    }
+
+void UTIL_SetDividerHandler(u8 id, u16 divider)
+    {
+    Host.divider[id] = divider;
+    }
+
+void UTIL_SetIrqHandler(s32 offset, tHandler handler)
+    {
+    }
+
+void UTIL_SetTimer(u32 millisec, tHandler handler)
+    {
+    Host.timerTicksLeft = millisec * (HOST_SYSTICK_FREQUENCY_HZ / 1000);
+    Host.timerHandler = Host.timerTicksLeft ? handler : 0;
+    }
+
+void UTIL_SetPll(enum eSpeed speed)
+    {
+    if(speed >= SPEED_VERY_LOW && speed <= SPEED_VERY_HIGH) Host.speed = speed;
+    }
+
+u16 UTIL_GetBat(void)
+    {
+    return Host.batteryVoltagemV;
+    }
+
+void UTIL_int2str(char* ptr, u32 X, u16 digit, bool fillwithzero)
+    {
+    s16 i;
+
+    for(i=digit-1; i>=0; i--)
+        {
+        ptr[i] = (X || i == digit-1 || fillwithzero) ? '0' + X % 10 : ' ';
+        X /= 10;
+        }
+    ptr[digit] = 0;
+    }
+
+void UTIL_WriteBackupRegister(u16 BKP_DR, u32 Data)
+    {
+    if(BKP_DR < BKP_MAX) Host.backupRegister[BKP_DR] = Data;
+    }
+
+u32 UTIL_ReadBackupRegister(u16 BKP_DR)
+    {
+    return (BKP_DR < BKP_MAX) ? Host.backupRegister[BKP_DR] : 0;
+    }
+
+void SHUTDOWN_Action(void)
+    {
+    Host.command = 0;
+    Host.isRunning = FALSE;
+    }
+
+/*******************************************************************************
+* Function Group : RTC (runs on the virtual SysTick)
+*******************************************************************************/
+void RTC_SetTime(u32 THH, u32 TMM, u32 TSS)
+    {
+    Host.rtcOffsetSeconds = THH*3600 + TMM*60 + TSS - Host.tickCnt / HOST_SYSTICK_FREQUENCY_HZ;
+    }
+
+void RTC_GetTime(u8* THH, u8* TMM, u8* TSS)
+    {
+    u32 seconds = (Host.rtcOffsetSeconds + Host.tickCnt / HOST_SYSTICK_FREQUENCY_HZ) % 86400;
+
+    *THH = seconds / 3600;
+    *TMM = (seconds / 60) % 60;
+    *TSS = seconds % 60;
+    }
+
+/*******************************************************************************
+* Function Group : LCD, drawing (pixel count only)
+*******************************************************************************/
+void LCD_SetOffset(enum OFFSET_mode mode)       { }
+void LCD_SetRotateScreen(u8 RotateScreen)       { }
+void LCD_SetBackLightOn(void)                   { }
+void DRAW_SetDefaultColor(void)                 { }
+void DRAW_SetTextColor(u16 Color)               { }
+void DRAW_SetBGndColor(u16 Color)               { }
+void POINTER_SetMode(enum POINTER_mode mode)    { }
+
+void LCD_FillRect(coord_t x, coord_t y, coord_t width, coord_t height, u16 color)
+    {
+    Host.lcdPixelsWritten += (u32)width * height;
+    }
+
+void DRAW_SetCharMagniCoeff(u16 Coeff)
+    {
+    Host.charMagniCoeff = Coeff;
+    }
+
+void DRAW_Clear(void)
+    {
+    Host.lcdPixelsWritten += SCREEN_WIDTH * SCREEN_HEIGHT;
+    }
+
+void DRAW_DisplayStringWithMode(coord_t x, coord_t y, const char* ptr, u8 len, u8 mode, enum ALIGNMENT align)
+    {
+    u32 n = strlen(ptr);
+
+    if(len > n) n = len;
+    Host.lcdPixelsWritten += n * CHAR_WIDTH * CHAR_HEIGHT * Host.charMagniCoeff * Host.charMagniCoeff;
+    }
+
+/*******************************************************************************
+* Function Group : Buttons, LEDs, buzzer
+*******************************************************************************/
+enum BUTTON_state BUTTON_GetState(void)
+    {
+    if(Host.isButtonPushed)
+        {
+        Host.isButtonPushed = FALSE;
+        return BUTTON_PUSHED;
+        }
+    return BUTTON_RELEASED;
+    }
+
+void BUTTON_SetMode(enum BUTTON_mode mode)      { }
+void BUTTON_WaitForRelease(void)                { }
+void BUZZER_SetMode(enum BUZZER_mode mode)      { }
+
+void LED_Set(enum LED_id id, enum LED_mode mode)
+    {
+    Host.led[id] = mode;
+    }
+
+/*******************************************************************************
+* Function Group : CX extension connector
+*******************************************************************************/
+u32 CX_Configure(CX_ID_Type id, const void* param1, const void* param2)
+    {
+    return 0;
+    }
+
+u32 CX_Write(CX_ID_Type id, const void* param1, volatile void* param2)
+    {
+    return 0;
+    }
+
+u32 CX_Read(CX_ID_Type id, void* param1, volatile void* param2)
+    {
+    if(id == CX_ADC1 && param1)
+        {
+        *(u32*)param1 = Host.cxAdcValue;
+        }
+    return 0;
+    }
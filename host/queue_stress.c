@@ -0,0 +1,180 @@
+/******************************************************************************
+*
+* File Name          :  queue_stress.c
+* Description        :  Stress test of the readout queue of STiM32.c (Function
+*                       Group : Readout Queue) with a real producer and a real
+*                       consumer thread
+*
+*                       The producer pushes numbered records with a random pause
+*                       after each one, and now and then a burst without pauses,
+*                       so the queue runs both full and empty; the consumer pops
+*                       batches of random sizes. Outside of the bursts, the
+*                       producer gives way when the queue is full and the consumer
+*                       when it is empty, so the test also runs on a single CPU
+*                       (where the threads meet at preemptions). Every
+*                       field of a record is derived from its number, so a torn
+*                       record (a slot read while it is written) shows; the
+*                       numbers must come in order, and the records missing
+*                       between them must be the ones the producer had dropped
+*                       (Push returned FALSE), as counted in nbDropped.
+*
+*                       usage: queue_stress [millions_of_records]     (default: 10)
+*
+*                       The exit status is 1 if a record was torn, out of order
+*                       or lost without being counted.
+*
+*******************************************************************************/
+
+/* Includes ------------------------------------------------------------------*/
+#include <stdio.h>
+#include <stdlib.h>
+#include <pthread.h>
+#include <sched.h>
+#include "stim32_host.h"
+
+/* Private defines -----------------------------------------------------------*/
+#define STRESS_MAX_SPINS            64      // pause after a record, 0..this
+#define STRESS_BURST_PERIOD         65536   // records between the bursts
+#define STRESS_BURST_LENGTH         1024    // records pushed without a pause, more than the queue holds
+
+/* Global variables ----------------------------------------------------------*/
+static u32 NbRecords;
+static volatile bool IsProducerDone;
+
+static struct
+    {
+        u32     nbPushed;
+        u32     nbRefused;              // Push returned FALSE
+    }
+    Producer;
+
+static struct
+    {
+        u32     nbPopped;
+        u32     nbBatches;
+        u32     nbEmptyPolls;
+        u32     nbMissing;              // gaps in the record numbers
+        u32     nbTorn;
+        u32     nbOutOfOrder;
+        u32     maxBatch;
+        u32     last;                   // number of the last record popped
+    }
+    Consumer;
+
+/* the fields of record n */
+static u16 RecordCAE(u32 n)             { return (u16)((n * 2654435761u) >> 16); }
+static u8  RecordOverloaded(u32 n)      { return (u8)(n >> 3) & 1; }
+static u8  RecordState(u32 n)           { return (u8)(n ^ (n >> 11)) & 3; }
+
+/* STIMULATOR_Handler: one record per SysTick, numbered by its timestamp */
+static void *Produce(void *arg)
+    {
+    volatile u32 spin;
+    u32 n, random = 2, nbSpins;
+
+    for(n=1; n<=NbRecords; n++)
+        {
+        bool isBurst = (n % STRESS_BURST_PERIOD < STRESS_BURST_LENGTH);
+
+        if(HOST_ReadoutQueuePush(n, RecordCAE(n), RecordOverloaded(n), RecordState(n)))
+            {
+            Producer.nbPushed++;
+            }
+        else
+            {
+            Producer.nbRefused++;
+            if(!isBurst) sched_yield();
+            }
+        random = random * 1103515245 + 12345;
+        nbSpins = isBurst ? 0 : (random >> 16) % (STRESS_MAX_SPINS+1);
+        for(spin=0; spin<nbSpins; spin++);
+        }
+    IsProducerDone = TRUE;
+    return 0;
+    }
+
+/* Application_Handler: batches of 1..HOST_READOUT_BATCH_SIZE records */
+static void *Consume(void *arg)
+    {
+    u32 timestamp[HOST_READOUT_BATCH_SIZE];
+    u16 cae[HOST_READOUT_BATCH_SIZE];
+    u8 isOverloaded[HOST_READOUT_BATCH_SIZE], state[HOST_READOUT_BATCH_SIZE];
+    u32 random = 1, nbRecords, i;
+    bool isDone;
+
+    do
+        {
+        isDone = IsProducerDone;            // read before the last pops
+        random = random * 1103515245 + 12345;
+        nbRecords = HOST_ReadoutQueuePop(timestamp, cae, isOverloaded, state, 1 + (random >> 16) % HOST_READOUT_BATCH_SIZE);
+        if(nbRecords == 0)
+            {
+            Consumer.nbEmptyPolls++;
+            sched_yield();
+            continue;
+            }
+        Consumer.nbBatches++;
+        if(nbRecords > Consumer.maxBatch) Consumer.maxBatch = nbRecords;
+        for(i=0; i<nbRecords; i++)
+            {
+            u32 n = timestamp[i];
+
+            if(cae[i] != RecordCAE(n) || isOverloaded[i] != RecordOverloaded(n) || state[i] != RecordState(n))
+                {
+                Consumer.nbTorn++;
+                }
+            if(n <= Consumer.last)
+                {
+                Consumer.nbOutOfOrder++;
+                }
+            else
+                {
+                Consumer.nbMissing += n - Consumer.last - 1;
+                Consumer.last = n;
+                }
+            Consumer.nbPopped++;
+            }
+        }
+    while(!isDone || nbRecords > 0);
+    return 0;
+    }
+
+int main(int argc, char *argv[])
+    {
+    pthread_t producer, consumer;
+    u32 nbDropped;
+    bool isFailed;
+
+    NbRecords = (argc > 1) ? strtoul(argv[1], 0, 10) * 1000000 : 10000000;
+    if(argc > 2 || NbRecords == 0)
+        {
+        fprintf(stderr, "usage: queue_stress [millions_of_records]\n");
+        return 2;
+        }
+
+    HOST_ReadoutQueueReset();
+    if(pthread_create(&consumer, 0, Consume, 0) || pthread_create(&producer, 0, Produce, 0))
+        {
+        fprintf(stderr, "queue_stress: cannot start the threads\n");
+        return 2;
+        }
+    pthread_join(producer, 0);
+    pthread_join(consumer, 0);
+    nbDropped = HOST_GetReadoutQueueDropped();
+    Consumer.nbMissing += NbRecords - Consumer.last;        // dropped after the last one popped
+
+    isFailed = Consumer.nbTorn || Consumer.nbOutOfOrder
+            || nbDropped != Producer.nbRefused
+            || Consumer.nbMissing != nbDropped
+            || Consumer.nbPopped != Producer.nbPushed
+            || Producer.nbPushed + Producer.nbRefused != NbRecords;
+
+    printf("records             %u pushed, %u refused (queue full), %u dropped as counted by the queue\n",
+           Producer.nbPushed, Producer.nbRefused, nbDropped);
+    printf("consumer            %u popped in %u batches (max %u), %u polls found the queue empty\n",
+           Consumer.nbPopped, Consumer.nbBatches, Consumer.maxBatch, Consumer.nbEmptyPolls);
+    printf("checks              %u torn, %u out of order, %u missing from the numbers: %s\n",
+           Consumer.nbTorn, Consumer.nbOutOfOrder, Consumer.nbMissing, isFailed ? "FAILED" : "passed");
+
+    return isFailed ? 1 : 0;
+    }
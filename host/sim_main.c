@@ -0,0 +1,956 @@
+/******************************************************************************
+*
+* File Name          :  sim_main.c
+* Description        :  Host (PC) simulation of a STiM32 session
+*
+*                       Runs the firmware on a virtual 3kHz SysTick as fast as
+*                       the PC allows. The electrode contact is modelled as
+*                       periodically on and off; in contact, the current follows
+*                       the wiper voltage through a skin impedance that swings
+*                       slowly. The menu can be scripted.
+*
+*                       usage: stim32_sim [-t seconds] [-c contact_period_seconds]
+*                                         [-e clock_error_ppm] [-b discharge_seconds]
+*                                         [-l log_file] [-d log_dump_file] [-p backup_file]
+*                                         [-s telemetry_file|pty] [-r command_period_ms]
+*                                         [-i button_seconds] [-k trace_file] [-w] [-y]
+*                                         [-q min_peak_code:max_peak_code]
+*                                         [-m seconds:menu|item|path] ...
+*                                         [-x seconds:serial command line] ...
+*
+*                       The clock error makes the pulse timer run fast (or slow, if
+*                       negative) against the RTC and the SysTick; the run fails if
+*                       the timer calibration does not measure and apply it within
+*                       200 ppm. The battery follows
+*                       a Li-ion discharge curve from full to empty in discharge_seconds,
+*                       with a sag under stimulation and some noise; the run fails
+*                       if the 8V option changes more than once over the discharge.
+*                       The highest wiper code of each sequence must stay within
+*                       min_peak_code..max_peak_code, if given.
+*                       The session log flash is kept in log_file across runs (each
+*                       run is a session); the decoded log is written to log_dump_file.
+*                       The backup SRAM (settings store) is kept in backup_file, as if
+*                       on VBAT; without it, each run starts with a lost backup domain
+*                       and the settings come from the flash copy in the log, if any.
+*                       The settings store is checked against corrupt, torn, older and
+*                       newer records at the end.
+*                       The telemetry stream of the USART goes to telemetry_file, or
+*                       to a new pty (its name is printed) for telemetry_decode; the
+*                       lines written to the pty are the serial commands of the firmware.
+*                       Serial command lines can also be scripted (-x), or sent every
+*                       command_period_ms, alternating between two batches (-r); the
+*                       latency to the first edge with the new settings is reported.
+*                       Each pulse configuration taken by the pulse engine is checked
+*                       against its settings and each edge against the configuration
+*                       of its sequence; -r 1 hammers the reconfiguration. With -y,
+*                       the -r lines are sent so that one comes in between the publish
+*                       test of a SysTick and its publish, as the RX interrupt may; the
+*                       run fails if a publish is refused over a configuration not taken
+*                       yet (a caller that did not check), or if no line came in there.
+*                       The button can be pushed once at button_seconds, e.g. to
+*                       skip the intro screen. The boot figures are reported: the
+*                       virtual time does not see Application_Ini, so its host CPU
+*                       time and the LCD writes before the first pulse are added.
+*                       The pulse path is reported per sequence: the pulse interrupts
+*                       and their host time, scaled to cycles at 120 MHz;
+*                       -w scales each edge in an interrupt of its own, as before the
+*                       edge table held the wiper codes, for the benchmark.
+*                       The contact detectors are compared at the end on synthetic
+*                       CAE traces (noisy, with outliers, marginal) and on trace_file,
+*                       readouts recorded by "telemetry_decode -v": latency from
+*                       each step of the contact, false transitions, missed steps.
+*
+*                       e.g.   stim32_sim -t 3600 -m "600:Set Frequency| 2 kHz "
+*                              stim32_sim -t 60 -x "10.5:F2500 S3 V6" -x "30:?"
+*
+*******************************************************************************/
+
+/* Includes ------------------------------------------------------------------*/
+#define _GNU_SOURCE                         // posix_openpt (XSI), cfmakeraw (BSD)
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <termios.h>
+#include <unistd.h>
+#include <sys/ioctl.h>
+#include "stim32_host.h"
+
+/* Private defines -----------------------------------------------------------*/
+#define SIM_MAX_MENU_ACTIONS        16
+#define SIM_PULSE_TIMER_HZ          1000000
+#define SIM_CAE_PER_WIPER_CODE      4       // CAE readout per wiper code above 0V, at the lowest impedance
+#define SIM_CAE_NO_CONTACT          10
+#define SIM_IMPEDANCE_MIN_PERCENT   100     // skin impedance, triangle between these
+#define SIM_IMPEDANCE_MAX_PERCENT   160
+#define SIM_IMPEDANCE_PERIOD_TICKS  (7 * HOST_SYSTICK_FREQUENCY_HZ)
+#define SIM_ZERO_VOLTAGE_CODE       63
+#define SIM_CAE_AD_OFFSET           1500    // keep in line with SettingsDefaults
+#define SIM_CAE_AD_SCALE            3
+#define SIM_BATTERY_SAG_MV          60      // under stimulation (contact)
+#define SIM_BATTERY_NOISE_MV        8
+#define SIM_BATTERY_UPDATE_TICKS    300     // the battery voltage is set 10 times a second
+#define SIM_TELEMETRY_TIMEOUT_MS    100     // the pty reader may hold up the simulation this long
+#define SIM_PTY_READ_TICKS          10      // the commands written to the pty are read this often
+#define SIM_MAX_COMMAND_LENGTH      64
+#define SIM_LCD_NS_PER_PIXEL        50      // assumed LCD write time (16-bit FSMC), for the boot time
+#define SIM_TIMERCAL_TOLERANCE_PPM  200     // keep in line with TIMERCAL_APPLY_PPM
+#define SIM_HCLK_MHZ                120     // SPEED_VERY_HIGH: the host time of the pulse path in cycles
+#define SIM_TRACE_RATE_HZ           1000    // synthetic CAE traces: one readout per sequence at 1 kHz
+#define SIM_TRACE_LENGTH            (60 * SIM_TRACE_RATE_HZ)
+#define SIM_TRACE_MIN_SEGMENT       100     // readouts in or out of contact
+#define SIM_TRACE_MAX_SEGMENT       2000
+#define SIM_TRACE_OUTLIER_PERMILLE  20
+#define SIM_TRACE_MAX_RECORDED      (1 << 20)
+#define SIM_TRUTH_WINDOW            31      // recorded traces: the contact is the centered median of this many readouts
+
+/* Global variables ----------------------------------------------------------*/
+static struct
+    {
+        u32         tick;
+        const char  *path;
+    }
+    MenuActions[SIM_MAX_MENU_ACTIONS];
+static u32 NbMenuActions;
+
+static struct
+    {
+        u32         tick;
+        const char  *line;
+    }
+    SerialCommands[SIM_MAX_MENU_ACTIONS];
+static u32 NbSerialCommands;
+
+/* contact detection benchmark: the CAE readouts and the contact they come from */
+static u16 Trace[SIM_TRACE_MAX_RECORDED];
+static u8 TraceContact[SIM_TRACE_MAX_RECORDED];
+static u32 TraceState;
+static const char *RecordedTracePath = 0;
+
+typedef enum {
+    TRACE_NOISY,
+    TRACE_OUTLIERS,
+    TRACE_MARGINAL,
+    NB_SYNTHETIC_TRACES,
+    } Trace_code;
+
+static const char* const TraceName[NB_SYNTHETIC_TRACES+1] = { "noisy", "outliers", "marginal", "recorded" };
+
+/* the detectors compared; the one in use is added if it is none of them */
+static const struct
+    {
+        u32         statistic;
+        u32         window;
+        u32         hold;
+    }
+    ContactDetectors[] =
+    {
+        { HOST_CONTACT_LAST,    1,  1  },       // the raw readout
+        { HOST_CONTACT_LAST,    1,  10 },       // about the detection of older versions (10 SysTicks)
+        { HOST_CONTACT_MEAN,    9,  2  },
+        { HOST_CONTACT_MEDIAN,  9,  2  },
+    };
+#define SIM_NB_CONTACT_DETECTORS    (sizeof(ContactDetectors)/sizeof(ContactDetectors[0]))
+
+/* -r: the batches alternate, so each line changes the settings */
+static const char* const RepeatedCommands[2] = { "F2000 S3 V6\n", "F1000 S1 V8\n" };
+
+/* -y: instead of the -r batches, the second line waits for the first one to be taken and
+   the third comes in between the publish test of the SysTick that publishes the second and
+   its publish; at 4 kHz, the sequences fill most of the period, so the pulse engine often
+   cannot take the third line right away */
+static const char* const PreemptingCommands[3] = { "F4000 S3 V6\n", "F1300 S1 V8\n", "F1100 S3 V4\n" };
+static bool IsPublishPreempted = FALSE;
+static const char *PreemptingCommand = 0;
+static u32 NbPreemptions = 0;
+
+static u32 ContactPeriodTicks = 20 * HOST_SYSTICK_FREQUENCY_HZ;
+static s32 ClockErrorPpm = 0;
+static u32 NoiseState = 12345;
+static u32 DischargeTicks = 0;              // 0: constant battery voltage
+static s32 ButtonTick = -1;                 // -1: the button is not pushed
+static int TelemetryFd = -1;
+static int TelemetryPtySlaveFd = -1;        // kept open: raw mode, and no hangup between readers
+static u32 TelemetryBytesLost = 0;
+
+/* open-circuit voltage of a Li-ion cell, 100% to 0% charge in 10% steps */
+static const u16 DischargeCurve_mV[] = { 4180, 4080, 4000, 3930, 3870, 3820, 3790, 3760, 3730, 3680, 3500 };
+#define SIM_DISCHARGE_STEPS         (sizeof(DischargeCurve_mV)/sizeof(DischargeCurve_mV[0]) - 1)
+
+static bool IsInContact(void)
+    {
+    return (HOST_GetSysTickCount() % ContactPeriodTicks) < ContactPeriodTicks / 2;
+    }
+
+/*******************************************************************************
+* Function Name  : BatteryVoltage
+* Description    : Battery voltage of the discharge model at a SysTick
+* Input          : u32 tick
+* Return         : u16 mV
+*******************************************************************************/
+static u16 BatteryVoltage(u32 tick)
+    {
+    u32 position, step, fraction;
+    s32 mV;
+
+    if(tick >= DischargeTicks) tick = DischargeTicks;
+    position = (u32)((double)tick * SIM_DISCHARGE_STEPS * 1000 / DischargeTicks);
+    step = position / 1000;
+    fraction = position % 1000;
+    mV = DischargeCurve_mV[step];
+    if(step < SIM_DISCHARGE_STEPS)
+        {
+        mV -= (s32)(DischargeCurve_mV[step] - DischargeCurve_mV[step+1]) * fraction / 1000;
+        }
+    if(IsInContact()) mV -= SIM_BATTERY_SAG_MV;
+
+    NoiseState = NoiseState * 1103515245 + 12345;
+    return mV + (s32)((NoiseState >> 16) % (2*SIM_BATTERY_NOISE_MV+1)) - SIM_BATTERY_NOISE_MV;
+    }
+
+/*******************************************************************************
+* Function Name  : ContactAdcSource
+* Description    : ADC value of the CAE amplifier: electrode in contact during the
+                   first half of each contact period, where the current is the wiper
+                   voltage over the skin impedance; a little noise on top
+* Input          : u32 time (pulse timer ticks, unused)
+* Return         : u16 ADC value
+*******************************************************************************/
+static u16 ContactAdcSource(u32 time)
+    {
+    u32 cae = SIM_CAE_NO_CONTACT;
+
+    if(IsInContact())
+        {
+        u32 t = HOST_GetSysTickCount() % SIM_IMPEDANCE_PERIOD_TICKS;
+        u32 swing = (t < SIM_IMPEDANCE_PERIOD_TICKS/2) ? t : SIM_IMPEDANCE_PERIOD_TICKS - t;
+        u32 impedance = SIM_IMPEDANCE_MIN_PERCENT
+                      + (SIM_IMPEDANCE_MAX_PERCENT - SIM_IMPEDANCE_MIN_PERCENT) * swing / (SIM_IMPEDANCE_PERIOD_TICKS/2);
+        u8 code = HOST_GetWiperCode();
+
+        cae = (code > SIM_ZERO_VOLTAGE_CODE) ? (code - SIM_ZERO_VOLTAGE_CODE) * SIM_CAE_PER_WIPER_CODE * 100 / impedance : 0;
+        }
+
+    NoiseState = NoiseState * 1103515245 + 12345;
+    return SIM_CAE_AD_OFFSET + cae * SIM_CAE_AD_SCALE + ((NoiseState >> 16) % 7) - 3;
+    }
+
+/*******************************************************************************
+* Function Name  : TelemetrySink
+* Description    : The USART of the firmware: the bytes go to the file or the pty.
+                   A pty reader that does not keep up holds up the simulation (like
+                   the flow control of a USB CDC link) for a while, then bytes are lost.
+* Input          : data, length
+* Return         : None
+*******************************************************************************/
+static void TelemetrySink(const u8 *data, u32 length)
+    {
+    struct pollfd pfd = { TelemetryFd, POLLOUT, 0 };
+    ssize_t n;
+
+    while(length > 0)
+        {
+        if(TelemetryPtySlaveFd >= 0 && poll(&pfd, 1, SIM_TELEMETRY_TIMEOUT_MS) <= 0) break;
+        n = write(TelemetryFd, data, length);
+        if(n <= 0) break;
+        data += n;
+        length -= n;
+        }
+    TelemetryBytesLost += length;
+    }
+
+static bool OpenTelemetry(const char *path)
+    {
+    struct termios tio;
+
+    if(strcmp(path, "pty") != 0)
+        {
+        TelemetryFd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+        return TelemetryFd >= 0;
+        }
+    TelemetryFd = posix_openpt(O_RDWR | O_NOCTTY | O_NONBLOCK);
+    if(TelemetryFd < 0 || grantpt(TelemetryFd) || unlockpt(TelemetryFd)) return FALSE;
+    TelemetryPtySlaveFd = open(ptsname(TelemetryFd), O_RDWR | O_NOCTTY);
+    if(TelemetryPtySlaveFd < 0 || tcgetattr(TelemetryPtySlaveFd, &tio)) return FALSE;
+    cfmakeraw(&tio);
+    tcsetattr(TelemetryPtySlaveFd, TCSANOW, &tio);
+    fprintf(stderr, "stim32_sim: telemetry on %s\n", ptsname(TelemetryFd));
+    return TRUE;
+    }
+
+/* serial command lines written to the pty: to the RX line of the firmware */
+static void ReceiveTelemetryPty(void)
+    {
+    u8 buffer[SIM_MAX_COMMAND_LENGTH];
+    ssize_t n;
+
+    while(TelemetryPtySlaveFd >= 0 && (n = read(TelemetryFd, buffer, sizeof(buffer))) > 0)
+        {
+        HOST_SerialReceive(buffer, n);
+        }
+    }
+
+/* a scripted command line, with its line end */
+static void SendCommand(const char *line)
+    {
+    char buffer[SIM_MAX_COMMAND_LENGTH+1];
+
+    snprintf(buffer, sizeof(buffer), "%s\n", line);
+    HOST_SerialReceive((const u8 *)buffer, strlen(buffer));
+    }
+
+/* the RX interrupt preempts the publish of STIMULATOR_Handler */
+static void PreemptPublish(void)
+    {
+    if(!PreemptingCommand) return;
+    HOST_SerialReceive((const u8 *)PreemptingCommand, strlen(PreemptingCommand));
+    PreemptingCommand = 0;
+    NbPreemptions++;
+    }
+
+/* the pty reader gets a moment to take the rest */
+static void CloseTelemetry(void)
+    {
+    int pending, i;
+
+    for(i=0; TelemetryPtySlaveFd >= 0 && i<20; i++)
+        {
+        if(ioctl(TelemetryPtySlaveFd, FIONREAD, &pending) || pending == 0) break;
+        usleep(SIM_TELEMETRY_TIMEOUT_MS * 1000);
+        }
+    if(TelemetryFd >= 0) close(TelemetryFd);
+    if(TelemetryPtySlaveFd >= 0) close(TelemetryPtySlaveFd);
+    }
+
+static u32 TraceRandom(u32 range)
+    {
+    TraceState = TraceState * 1103515245 + 12345;
+    return (TraceState >> 16) % range;
+    }
+
+/* triangular, -amplitude..amplitude */
+static s32 TraceNoise(u32 amplitude)
+    {
+    return (s32)(TraceRandom(amplitude+1) + TraceRandom(amplitude+1)) - (s32)amplitude;
+    }
+
+/*******************************************************************************
+* Function Name  : MakeSyntheticTrace
+* Description    : Segments of 100..2000 readouts out of and in contact, in turn,
+                   the same at each run:
+                   noisy     in contact 125..200 (drawn for each segment), out of
+                             contact 10; +-15 of noise
+                   outliers  the same with 2% of the readouts lost (0) in contact
+                             and spikes (300..600) out of contact
+                   marginal  10 above the Run limit in contact and 10 below the Idle
+                             limit out of contact, with +-25 of noise across them
+* Input          : Trace_code kind, runLimit, idleLimit
+* Return         : the number of readouts
+*******************************************************************************/
+static u32 MakeSyntheticTrace(Trace_code kind, u16 runLimit, u16 idleLimit)
+    {
+    u32 n = 0, end, noise;
+    s32 level, value;
+    u8 isContact = 0;
+
+    TraceState = 1 + kind;
+    while(n < SIM_TRACE_LENGTH)
+        {
+        end = n + SIM_TRACE_MIN_SEGMENT + TraceRandom(SIM_TRACE_MAX_SEGMENT - SIM_TRACE_MIN_SEGMENT + 1);
+        if(end > SIM_TRACE_LENGTH) end = SIM_TRACE_LENGTH;
+        if(kind == TRACE_MARGINAL)
+            {
+            level = isContact ? runLimit + 10 : idleLimit - 10;
+            noise = 25;
+            }
+        else
+            {
+            level = isContact ? 125 + (s32)TraceRandom(76) : SIM_CAE_NO_CONTACT;
+            noise = 15;
+            }
+        for(; n < end; n++)
+            {
+            value = level + TraceNoise(noise);
+            if(kind == TRACE_OUTLIERS && TraceRandom(1000) < SIM_TRACE_OUTLIER_PERMILLE)
+                {
+                value = isContact ? 0 : 300 + (s32)TraceRandom(301);
+                }
+            Trace[n] = (value < 0) ? 0 : value;
+            TraceContact[n] = isContact;
+            }
+        isContact = !isContact;
+        }
+    return n;
+    }
+
+/*******************************************************************************
+* Function Name  : ReadRecordedTrace
+* Description    : The readouts of "telemetry_decode -v" (timestamp, state, CAE);
+                   the contact is taken from the readouts themselves: the median
+                   of the SIM_TRUTH_WINDOW readouts around each one (it sees the
+                   future, unlike the firmware) against the middle of the band
+* Input          : path, runLimit, idleLimit; *rate: readouts per second
+* Return         : the number of readouts, 0 if the file could not be read
+*******************************************************************************/
+static u32 ReadRecordedTrace(const char *path, u16 runLimit, u16 idleLimit, double *rate)
+    {
+    FILE *file = fopen(path, "r");
+    char line[128], state[32];
+    u32 n = 0, timestamp, firstTimestamp = 0, cae, i, k;
+
+    *rate = 0;
+    if(!file) return 0;
+    while(n < SIM_TRACE_MAX_RECORDED && fgets(line, sizeof(line), file))
+        {
+        if(sscanf(line, "%u %31s %u", &timestamp, state, &cae) != 3) continue;    // replies, the summary
+        if(n == 0) firstTimestamp = timestamp;
+        Trace[n++] = cae;
+        }
+    fclose(file);
+    if(n > 1 && timestamp != firstTimestamp)
+        {
+        *rate = (n - 1) * (double)HOST_SYSTICK_FREQUENCY_HZ / (timestamp - firstTimestamp);
+        }
+
+    for(i=0; i<n; i++)
+        {
+        u32 first = (i >= SIM_TRUTH_WINDOW/2) ? i - SIM_TRUTH_WINDOW/2 : 0;
+        u32 last = (i + SIM_TRUTH_WINDOW/2 < n) ? i + SIM_TRUTH_WINDOW/2 : n - 1;
+        u32 nbAbove = 0;
+
+        for(k=first; k<=last; k++)
+            {
+            if(2 * Trace[k] >= runLimit + idleLimit) nbAbove++;
+            }
+        TraceContact[i] = (2 * nbAbove > last - first + 1);
+        }
+    return n;
+    }
+
+/*******************************************************************************
+* Function Name  : RunContactDetector
+* Description    : Feeds the trace to the detector of HOST_ContactInit. A step is a
+                   change of the contact; its latency is the number of readouts up
+                   to the one the detector agrees at (1: at once). A step undone
+                   before the detector agrees is missed. A false transition is a
+                   change of the detector to the state the contact is not in.
+* Input          : n: readouts of the trace
+* Return         : steps, latency (sum and max), false transitions, missed steps
+*******************************************************************************/
+static void RunContactDetector(u32 n, u32 *nbSteps, u32 *sumLatency, u32 *maxLatency, u32 *nbFalse, u32 *nbMissed)
+    {
+    u32 i, step = 0;
+    u8 state, isRun = 0;
+    bool isPending = FALSE;
+
+    *nbSteps = *sumLatency = *maxLatency = *nbFalse = *nbMissed = 0;
+    for(i=0; i<n; i++)
+        {
+        if(TraceContact[i] != (i ? TraceContact[i-1] : 0))
+            {
+            if(isPending)
+                {
+                (*nbMissed)++;
+                isPending = FALSE;
+                }
+            else
+                {
+                (*nbSteps)++;
+                step = i;
+                isPending = TRUE;
+                }
+            }
+        state = HOST_ContactUpdate(Trace[i]);
+        if((state == HOST_STATE_IDLE || state == HOST_STATE_RUN) && (state == HOST_STATE_RUN) != isRun)
+            {
+            isRun = (state == HOST_STATE_RUN);
+            if(isRun != TraceContact[i]) (*nbFalse)++;
+            }
+        if(isPending && isRun == TraceContact[i])
+            {
+            *sumLatency += i - step + 1;
+            if(i - step + 1 > *maxLatency) *maxLatency = i - step + 1;
+            isPending = FALSE;
+            }
+        }
+    }
+
+/*******************************************************************************
+* Function Name  : BenchmarkContactDetection
+* Description    : The detectors against the synthetic traces and the recorded
+                   one, if any. The detector in use must not make a false transition
+                   or miss a step on the synthetic traces, and must stay within its
+                   latency bound on the noisy one.
+* Input          : None
+* Return         : the number of failures
+*******************************************************************************/
+static u32 BenchmarkContactDetection(void)
+    {
+    u32 statistic, window, hold, d, nbDetectors = SIM_NB_CONTACT_DETECTORS, nbFailures = 0;
+    u32 n, bound, nbSteps, sumLatency, maxLatency, nbFalse, nbMissed;
+    u16 runLimit, idleLimit;
+    double rate = SIM_TRACE_RATE_HZ;
+    const char *name;
+    char label[32];
+    Trace_code kind;
+
+    HOST_GetContactDetector(&statistic, &window, &hold, &runLimit, &idleLimit);
+    for(d=0; d<SIM_NB_CONTACT_DETECTORS; d++)
+        {
+        if(ContactDetectors[d].statistic == statistic && ContactDetectors[d].window == window && ContactDetectors[d].hold == hold) break;
+        }
+    if(d == SIM_NB_CONTACT_DETECTORS) nbDetectors++;
+
+    printf("contact detection   RUN at >= %u, IDLE at <= %u; latency in readouts from the step (mean/max, bound of a clean step)\n",
+           runLimit, idleLimit);
+    for(kind=0; kind<=NB_SYNTHETIC_TRACES; kind++)
+        {
+        if(kind < NB_SYNTHETIC_TRACES)
+            {
+            n = MakeSyntheticTrace(kind, runLimit, idleLimit);
+            }
+        else if(!RecordedTracePath)
+            {
+            break;
+            }
+        else if((n = ReadRecordedTrace(RecordedTracePath, runLimit, idleLimit, &rate)) == 0)
+            {
+            printf("  recorded trace    no readouts in %s\n", RecordedTracePath);
+            nbFailures++;
+            break;
+            }
+        for(d=0; d<nbDetectors; d++)
+            {
+            u32 s = (d < SIM_NB_CONTACT_DETECTORS) ? ContactDetectors[d].statistic : statistic;
+            u32 w = (d < SIM_NB_CONTACT_DETECTORS) ? ContactDetectors[d].window : window;
+            u32 h = (d < SIM_NB_CONTACT_DETECTORS) ? ContactDetectors[d].hold : hold;
+            bool isInUse = (s == statistic && w == window && h == hold);
+
+            bound = HOST_ContactInit(s, w, h, &name);
+            RunContactDetector(n, &nbSteps, &sumLatency, &maxLatency, &nbFalse, &nbMissed);
+            snprintf(label, sizeof(label), "%s %u/%u", name, w, h);
+            printf("  %-11s %-8s %6u readouts at %4.0f/s, %3u steps, latency %5.1f/%-4u (%2u), %4u false transitions, %2u missed%s\n",
+                   label, TraceName[kind], n, rate, nbSteps, (nbSteps > nbMissed) ? (double)sumLatency / (nbSteps - nbMissed) : 0.0,
+                   maxLatency, bound, nbFalse, nbMissed, isInUse ? "  (in use)" : "");
+            if(isInUse && kind < NB_SYNTHETIC_TRACES && (nbFalse || nbMissed || (kind == TRACE_NOISY && maxLatency > bound)))
+                {
+                nbFailures++;
+                }
+            }
+        }
+    return nbFailures;
+    }
+
+static double WallClockSeconds(void)
+    {
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec * 1e-9;
+    }
+
+static void Usage(void)
+    {
+    fprintf(stderr, "usage: stim32_sim [-t seconds] [-c contact_period_seconds] [-e clock_error_ppm] [-b discharge_seconds]"
+                    " [-l log_file] [-d log_dump_file] [-p backup_file] [-s telemetry_file|pty] [-r command_period_ms]"
+                    " [-i button_seconds] [-k trace_file] [-w] [-y] [-q min_peak_code:max_peak_code]"
+                    " [-m seconds:menu|item|path] ... [-x seconds:serial command line] ...\n");
+    exit(2);
+    }
+
+int main(int argc, char *argv[])
+    {
+    u32 simulatedSeconds = 600;
+    u32 nbTicks, tick, i;
+    u32 usRemainder = 0;
+    u32 nbEventsSeen = 0, nbEventsLost = 0;
+    u32 nbEdges = 0, nbBytes = 0, nbMistimedEdges = 0, maxEdgeError = 0;
+    u32 nbRunEntries = 0;
+    enum LED_mode greenLed = LED_UNDEF;
+    u32 nbReadouts, nbOverloads, nbDropped;
+    u32 nbOverruns, nbLateSequences;
+    u32 nbSequences, firstStart, lastStart, minPeriod, maxPeriod;
+    s32 measuredPpm, driftPpm, appliedPpm;
+    u32 nbMeasurements;
+    u32 nbCalls, nbIdleCalls;
+    u32 nbSwitches, nbGovernorSeconds, nbSecondsLow, savedEnergy_mJ;
+    u16 batterymV, voltageFactor;
+    u32 nbRefreshes, nb8VChanges;
+    u16 currentTarget;
+    u32 nbControlUpdates, nbControlLimited, sumAbsError;
+    u32 nbCases, nbFailures, maxWiperError, maxFactorError, maxBarError;
+    u32 nbPackets, nbTelemetryRecords, nbTelemetryBytes, nbTelemetryDropped;
+    u32 commandPeriodTicks = 0;
+    u32 nbCommandLines, nbCommandErrors, nbLatencies, minLatency, maxLatency, meanLatency;
+    u32 nbSwaps, nbDelayedSwaps, nbConfigsChecked, nbInconsistent, nbTornEdges, nbRefusedPublishes, playedFrequency;
+    u32 nbLogRecords, nbLogDropped, nbLogErases, nbLogBytes, nbSessions, nbActiveSeconds, nbIdleSeconds;
+    u32 settingsSequence, settingsFrequency, nbRejectedFields, nbSettingsWrites, nbFlashCopies, nbSettingsFailures;
+    u32 nbContactFailures;
+    bool isCalibrationFailed = FALSE, isBatteryFailed;
+    u32 nbPathSequences, nbPathIrqs_x100, pathNs;
+    u32 firstPulse_us, iniTime_us, bootPixels, readyTicks, mainScreenTicks;
+    bool isIntroSkipped;
+    const char *settingsSource;
+    const char *logDumpPath = 0;
+    FILE *logDump = 0;
+    u8 minPeakCode = 0xFF, maxPeakCode = 0, peakCode = 0;
+    u32 expectedMinPeakCode = 0, expectedMaxPeakCode = 0;   // 0: no expected range
+    u32 nbPeakCodesOutOfRange = 0;
+    double wallStart, wallSeconds;
+
+    for(i=1; i<(u32)argc; i++)
+        {
+        if(strcmp(argv[i], "-w") == 0)
+            {
+            HOST_SetPerEdgeScaling(TRUE);
+            continue;
+            }
+        if(strcmp(argv[i], "-y") == 0)
+            {
+            IsPublishPreempted = TRUE;
+            HOST_SetPublishPreemption(PreemptPublish);
+            continue;
+            }
+        if(i+1 >= (u32)argc) Usage();
+        if(strcmp(argv[i], "-t") == 0)
+            {
+            simulatedSeconds = strtoul(argv[++i], 0, 10);
+            }
+        else if(strcmp(argv[i], "-c") == 0)
+            {
+            ContactPeriodTicks = strtoul(argv[++i], 0, 10) * HOST_SYSTICK_FREQUENCY_HZ;
+            if(ContactPeriodTicks == 0) Usage();
+            }
+        else if(strcmp(argv[i], "-e") == 0)
+            {
+            ClockErrorPpm = strtol(argv[++i], 0, 10);
+            if(ClockErrorPpm <= -SIM_PULSE_TIMER_HZ) Usage();
+            }
+        else if(strcmp(argv[i], "-b") == 0)
+            {
+            DischargeTicks = strtoul(argv[++i], 0, 10) * HOST_SYSTICK_FREQUENCY_HZ;
+            if(DischargeTicks == 0) Usage();
+            }
+        else if(strcmp(argv[i], "-l") == 0)
+            {
+            if(!HOST_SetLogFile(argv[++i]))
+                {
+                fprintf(stderr, "stim32_sim: cannot open %s\n", argv[i]);
+                exit(2);
+                }
+            }
+        else if(strcmp(argv[i], "-p") == 0)
+            {
+            if(!HOST_SetBackupFile(argv[++i]))
+                {
+                fprintf(stderr, "stim32_sim: cannot open %s\n", argv[i]);
+                exit(2);
+                }
+            }
+        else if(strcmp(argv[i], "-s") == 0)
+            {
+            if(!OpenTelemetry(argv[++i]))
+                {
+                fprintf(stderr, "stim32_sim: cannot open the telemetry output %s\n", argv[i]);
+                exit(2);
+                }
+            HOST_SetSerialSink(TelemetrySink);
+            }
+        else if(strcmp(argv[i], "-d") == 0)
+            {
+            logDumpPath = argv[++i];
+            }
+        else if(strcmp(argv[i], "-r") == 0)
+            {
+            commandPeriodTicks = strtoul(argv[++i], 0, 10) * HOST_SYSTICK_FREQUENCY_HZ / 1000;
+            if(commandPeriodTicks == 0) Usage();
+            }
+        else if(strcmp(argv[i], "-i") == 0)
+            {
+            ButtonTick = (s32)(strtod(argv[++i], 0) * HOST_SYSTICK_FREQUENCY_HZ);
+            if(ButtonTick < 0) Usage();
+            }
+        else if(strcmp(argv[i], "-k") == 0)
+            {
+            RecordedTracePath = argv[++i];
+            }
+        else if(strcmp(argv[i], "-x") == 0 && NbSerialCommands < SIM_MAX_MENU_ACTIONS)
+            {
+            char *colon = strchr(argv[++i], ':');
+
+            if(!colon) Usage();
+            SerialCommands[NbSerialCommands].tick = (u32)(strtod(argv[i], 0) * HOST_SYSTICK_FREQUENCY_HZ);
+            SerialCommands[NbSerialCommands].line = colon + 1;
+            NbSerialCommands++;
+            }
+        else if(strcmp(argv[i], "-q") == 0)
+            {
+            char *colon = strchr(argv[++i], ':');
+
+            if(!colon) Usage();
+            expectedMinPeakCode = strtoul(argv[i], 0, 10);
+            expectedMaxPeakCode = strtoul(colon + 1, 0, 10);
+            if(expectedMaxPeakCode < expectedMinPeakCode || expectedMaxPeakCode > 0xFF) Usage();
+            }
+        else if(strcmp(argv[i], "-m") == 0 && NbMenuActions < SIM_MAX_MENU_ACTIONS)
+            {
+            char *colon = strchr(argv[++i], ':');
+
+            if(!colon) Usage();
+            MenuActions[NbMenuActions].tick = strtoul(argv[i], 0, 10) * HOST_SYSTICK_FREQUENCY_HZ;
+            MenuActions[NbMenuActions].path = colon + 1;
+            NbMenuActions++;
+            }
+        else
+            {
+            Usage();
+            }
+        }
+
+    HOST_SetAdcSource(ContactAdcSource);
+    if(DischargeTicks) HOST_SetBatteryVoltage(BatteryVoltage(0));
+    HOST_StartApplication(Application_Ini, Application_Handler);
+
+    nbTicks = simulatedSeconds * HOST_SYSTICK_FREQUENCY_HZ;
+    wallStart = WallClockSeconds();
+
+    for(tick=0; tick<nbTicks && HOST_IsApplicationRunning(); tick++)
+        {
+        u32 nbEvents, time, nominalTime, error;
+        u8 event, value;
+
+        // the pulse timer runs between the SysTicks
+        usRemainder += SIM_PULSE_TIMER_HZ + ClockErrorPpm;     // 1 ppm of 1MHz is 1Hz
+        HOST_PulseTimerAdvance(usRemainder / HOST_SYSTICK_FREQUENCY_HZ);
+        usRemainder %= HOST_SYSTICK_FREQUENCY_HZ;
+
+        if(DischargeTicks && tick % SIM_BATTERY_UPDATE_TICKS == 0)
+            {
+            HOST_SetBatteryVoltage(BatteryVoltage(tick));
+            }
+
+        HOST_SysTick();
+        if(PreemptingCommand)
+            {
+            // that SysTick did not publish: the line comes in between two SysTicks
+            HOST_SerialReceive((const u8 *)PreemptingCommand, strlen(PreemptingCommand));
+            PreemptingCommand = 0;
+            }
+
+        for(i=0; i<NbMenuActions; i++)
+            {
+            if(MenuActions[i].tick == tick)
+                {
+                HOST_SelectMenu(MenuActions[i].path);
+                }
+            }
+        if((s32)tick == ButtonTick)
+            {
+            HOST_PushButton();
+            }
+
+        // the serial commands come in between two SysTicks: the RX interrupt of the
+        // firmware parses them and publishes their settings right away
+        for(i=0; i<NbSerialCommands; i++)
+            {
+            if(SerialCommands[i].tick == tick)
+                {
+                SendCommand(SerialCommands[i].line);
+                }
+            }
+        if(commandPeriodTicks && tick % commandPeriodTicks == commandPeriodTicks - 1)
+            {
+            const char *line = RepeatedCommands[(tick / commandPeriodTicks) & 1];
+
+            if(IsPublishPreempted)
+                {
+                HOST_SerialReceive((const u8 *)PreemptingCommands[0], strlen(PreemptingCommands[0]));
+                HOST_SerialReceive((const u8 *)PreemptingCommands[1], strlen(PreemptingCommands[1]));
+                PreemptingCommand = PreemptingCommands[2];
+                }
+            else
+                {
+                HOST_SerialReceive((const u8 *)line, strlen(line));
+                }
+            }
+        if(tick % SIM_PTY_READ_TICKS == 0)
+            {
+            ReceiveTelemetryPty();
+            }
+
+        // wiper bus timeline: the NSS rising edges must land on the requested edge times
+        nbEvents = HOST_GetWiperBusEvent(0, &time, &event, &value, &nominalTime);
+        if(nbEvents - nbEventsSeen > 256)
+            {
+            nbEventsLost += nbEvents - nbEventsSeen - 256;
+            nbEventsSeen = nbEvents - 256;
+            }
+        for(; nbEventsSeen < nbEvents; nbEventsSeen++)
+            {
+            HOST_GetWiperBusEvent(nbEventsSeen - (nbEvents > 256 ? nbEvents - 256 : 0), &time, &event, &value, &nominalTime);
+            if(event == HOST_WIPERBUS_EVENT_BYTE)
+                {
+                nbBytes++;
+                // highest code of each sequence (the last edge is the 0V code)
+                if(value > peakCode) peakCode = value;
+                if(value == SIM_ZERO_VOLTAGE_CODE && peakCode > SIM_ZERO_VOLTAGE_CODE)
+                    {
+                    if(peakCode < minPeakCode) minPeakCode = peakCode;
+                    if(peakCode > maxPeakCode) maxPeakCode = peakCode;
+                    if(expectedMaxPeakCode && (peakCode < expectedMinPeakCode || peakCode > expectedMaxPeakCode))
+                        {
+                        nbPeakCodesOutOfRange++;
+                        }
+                    peakCode = 0;
+                    }
+                }
+            else if(event == HOST_WIPERBUS_EVENT_NSS_HIGH)
+                {
+                nbEdges++;
+                error = ((s32)(time - nominalTime) < 0) ? nominalTime - time : time - nominalTime;
+                if(error > 0) nbMistimedEdges++;
+                if(error > maxEdgeError) maxEdgeError = error;
+                }
+            }
+
+        if(HOST_GetLedState(LED_GREEN) != greenLed)
+            {
+            greenLed = HOST_GetLedState(LED_GREEN);
+            if(greenLed == LED_ON) nbRunEntries++;
+            }
+        }
+
+    wallSeconds = WallClockSeconds() - wallStart;
+    HOST_FlushLog();                                    // as at Quit or Shutdown
+    CloseTelemetry();
+    HOST_GetReadoutCounters(&nbReadouts, &nbOverloads, &nbDropped);
+
+    printf("simulated time      %.1f s (%u SysTicks)\n", (double)tick / HOST_SYSTICK_FREQUENCY_HZ, tick);
+    printf("wall time           %.3f s (x%.0f real time)\n", wallSeconds, wallSeconds > 0 ? tick / (double)HOST_SYSTICK_FREQUENCY_HZ / wallSeconds : 0.0);
+    printf("wiper edges         %u (%u bytes), %u trace events lost\n", nbEdges, nbBytes, nbEventsLost);
+    printf("mistimed edges      %u (max error %u us)\n", nbMistimedEdges, maxEdgeError);
+    nbSequences = HOST_GetSequenceTiming(&firstStart, &lastStart, &minPeriod, &maxPeriod);
+    if(nbSequences > 1)
+        {
+        // the sequence rate in real time: the pulse timer runs ClockErrorPpm fast
+        printf("sequences           %u since the last start, period %u..%u ticks, %.3f Hz\n", nbSequences, minPeriod, maxPeriod,
+               (nbSequences - 1) * (double)(SIM_PULSE_TIMER_HZ + ClockErrorPpm) / (lastStart - firstStart));
+        }
+    printf("readouts            %u (%u overloaded, %u dropped)\n", nbReadouts, nbOverloads, nbDropped);
+    printf("RUN state entries   %u\n", nbRunEntries);
+    printf("LCD pixels written  %u\n", HOST_GetLcdPixelsWritten());
+    HOST_GetEventCounters(&nbCalls, &nbIdleCalls);
+    printf("application calls   %u (%u idle, %.1f%%)\n", nbCalls, nbIdleCalls, nbCalls ? 100.0 * nbIdleCalls / nbCalls : 0.0);
+    HOST_GetBatteryModel(&batterymV, &voltageFactor, &nbRefreshes, &nb8VChanges);
+    // the discharge is monotonic: the hysteresis must keep the 8V option from toggling; fails the run
+    isBatteryFailed = DischargeTicks && nb8VChanges > 1;
+    printf("battery model       %u mV, voltage factor %u/4096, %u wiper refreshes, 8V option changed %u times%s\n",
+           batterymV, voltageFactor, nbRefreshes, nb8VChanges, isBatteryFailed ? " - more than once over the discharge" : "");
+    if(expectedMaxPeakCode)
+        {
+        // fails the run
+        if(!maxPeakCode) nbPeakCodesOutOfRange++;
+        printf("positive peak code  %u..%u, expected %u..%u: %u sequences out of range\n",
+               maxPeakCode ? minPeakCode : 0, maxPeakCode, expectedMinPeakCode, expectedMaxPeakCode, nbPeakCodesOutOfRange);
+        }
+    else if(maxPeakCode)
+        {
+        printf("positive peak code  %u..%u\n", minPeakCode, maxPeakCode);
+        }
+    HOST_GetCurrentControl(&currentTarget, &nbControlUpdates, &nbControlLimited, &sumAbsError);
+    if(currentTarget)
+        {
+        printf("constant current    target %u, %u updates (%u limited), mean error %.2f\n", currentTarget,
+               nbControlUpdates, nbControlLimited, nbControlUpdates ? (double)sumAbsError / nbControlUpdates : 0.0);
+        }
+    HOST_GetGovernor(&nbSwitches, &nbGovernorSeconds, &nbSecondsLow, &savedEnergy_mJ);
+    printf("clock governor      %u switches, low speed %u of %u s, %u mJ saved (estimate)\n",
+           nbSwitches, nbSecondsLow, nbGovernorSeconds, savedEnergy_mJ);
+    HOST_GetTelemetryCounters(&nbPackets, &nbTelemetryRecords, &nbTelemetryBytes, &nbTelemetryDropped);
+    printf("telemetry           %u records packed in %u packets, %u bytes sent (%.0f bytes/s, %.2f per record), %u records dropped, %u bytes lost by the pty\n",
+           nbTelemetryRecords, nbPackets, nbTelemetryBytes, tick ? nbTelemetryBytes * (double)HOST_SYSTICK_FREQUENCY_HZ / tick : 0.0,
+           nbTelemetryRecords ? (double)nbTelemetryBytes / nbTelemetryRecords : 0.0, nbTelemetryDropped, TelemetryBytesLost);
+    HOST_GetCommandCounters(&nbCommandLines, &nbCommandErrors, &nbLatencies, &minLatency, &maxLatency, &meanLatency);
+    if(nbCommandLines)
+        {
+        printf("serial commands     %u lines (%u errors); %u applied, latency to the first edge %u/%u/%u us (min/mean/max)\n",
+               nbCommandLines, nbCommandErrors, nbLatencies, minLatency, meanLatency, maxLatency);
+        }
+    playedFrequency = HOST_GetPulseConfigCounters(&nbSwaps, &nbDelayedSwaps, &nbConfigsChecked, &nbInconsistent, &nbTornEdges, &nbRefusedPublishes);
+    printf("pulse config        %u taken (%u after a lengthened wait), %u checked: %u inconsistent, %u torn edges; playing %u Hz\n",
+           nbSwaps, nbDelayedSwaps, nbConfigsChecked, nbInconsistent, nbTornEdges, playedFrequency);
+    printf("pulse publish       %u refused over a configuration not taken yet; %u serial lines in the publish of a SysTick%s\n",
+           nbRefusedPublishes, NbPreemptions, IsPublishPreempted ? "" : " (-y)");
+    nbPathSequences = HOST_GetPulsePathCost(&nbPathIrqs_x100, &pathNs);
+    printf("pulse path          %u sequences, %u.%02u pulse interrupts and %u ns of host time per sequence (%u cycles at %u MHz)\n",
+           nbPathSequences, nbPathIrqs_x100 / 100, nbPathIrqs_x100 % 100, pathNs,
+           pathNs * SIM_HCLK_MHZ / 1000, SIM_HCLK_MHZ);
+    HOST_GetLogCounters(&nbLogRecords, &nbLogDropped, &nbLogErases);
+    if(logDumpPath && !(logDump = fopen(logDumpPath, "w")))
+        {
+        fprintf(stderr, "stim32_sim: cannot write %s\n", logDumpPath);
+        }
+    nbLogBytes = HOST_ReadLog(logDump, &nbSessions, &nbActiveSeconds, &nbIdleSeconds);
+    if(logDump) fclose(logDump);
+    printf("session log         %u records this session (%u dropped, %u sector erases); in flash %u bytes,"
+           " %u sessions, %u s logged + %u s idle\n", nbLogRecords, nbLogDropped, nbLogErases, nbLogBytes,
+           nbSessions, nbActiveSeconds, nbIdleSeconds);
+    settingsSource = HOST_GetSettingsCounters(&settingsSequence, &settingsFrequency, &nbRejectedFields, &nbSettingsWrites, &nbFlashCopies);
+    printf("settings store      restored from %s (%u fields out of range); record #%u: %u Hz; %u writes, %u flash copies\n",
+           settingsSource, nbRejectedFields, settingsSequence, settingsFrequency, nbSettingsWrites, nbFlashCopies);
+    HOST_GetBootCounters(&firstPulse_us, &iniTime_us, &bootPixels, &readyTicks, &mainScreenTicks, &isIntroSkipped);
+    printf("boot                first pulse %u us after power-on (pulse timer %u us + Application_Ini %u us + %u LCD pixels at %u ns);"
+           " ready after %u ms, ", firstPulse_us + iniTime_us + bootPixels * SIM_LCD_NS_PER_PIXEL / 1000,
+           firstPulse_us, iniTime_us, bootPixels, SIM_LCD_NS_PER_PIXEL, readyTicks * 1000 / HOST_SYSTICK_FREQUENCY_HZ);
+    if(mainScreenTicks) printf("main screen after %u ms%s\n", mainScreenTicks * 1000 / HOST_SYSTICK_FREQUENCY_HZ, isIntroSkipped ? " (intro skipped)" : "");
+    else                printf("intro screen shown\n");
+    HOST_GetTimerCalibration(&measuredPpm, &driftPpm, &appliedPpm, &nbMeasurements);
+    // an injected clock error must be measured and applied within the recompile threshold; fails the run
+    if(ClockErrorPpm)
+        {
+        isCalibrationFailed = nbMeasurements == 0
+                           || abs(measuredPpm - ClockErrorPpm) > SIM_TIMERCAL_TOLERANCE_PPM
+                           || abs(appliedPpm - ClockErrorPpm) > SIM_TIMERCAL_TOLERANCE_PPM;
+        }
+    printf("timer calibration   %+d ppm (drift %+d ppm, applied %+d ppm, %u measurements; injected %+d ppm)%s\n",
+           measuredPpm, driftPpm, appliedPpm, nbMeasurements, ClockErrorPpm, isCalibrationFailed ? " - out of tolerance" : "");
+
+    // execution times measured with the host clock (ns resolution)
+    HOST_GetProfilerOverruns(&nbOverruns, &nbLateSequences);
+    printf("SysTick overruns    %u (%u sequences late)\n", nbOverruns, nbLateSequences);
+    printf("phase       count    min[us]  max[us]  histogram <1us <2us <4us ...\n");
+    for(i=0; i<HOST_PROFILER_NB_PHASES; i++)
+        {
+        const char *name;
+        u32 minUs, maxUs, histogram[HOST_PROFILER_HISTOGRAM_BUCKETS];
+        u32 count = HOST_GetProfilerPhase(i, &name, &minUs, &maxUs, histogram), b;
+
+        printf("%s %10u %8u %8u ", name, count, minUs, maxUs);
+        for(b=0; b<HOST_PROFILER_HISTOGRAM_BUCKETS; b++)
+            {
+            printf(" %u", histogram[b]);
+            }
+        printf("\n");
+        }
+    if(HOST_GetMenuTitle())
+        {
+        printf("menu left open      %s\n", HOST_GetMenuTitle());
+        }
+
+    // the fixed point scaling against the float reference; fails the run
+    nbFailures = HOST_CheckFixedPoint(&nbCases, &maxWiperError, &maxFactorError, &maxBarError);
+    printf("fixed point check   %u cases, %u out of tolerance (max error: wiper code %u, voltage factor %u/4096, chart %u px)\n",
+           nbCases, nbFailures, maxWiperError, maxFactorError, maxBarError);
+
+    // the restore paths of the settings store; fails the run
+    nbSettingsFailures = HOST_CheckSettings(&nbCases);
+    printf("settings check      %u cases, %u failed\n", nbCases, nbSettingsFailures);
+
+    // the detectors against the synthetic and recorded CAE traces; fails the run
+    nbContactFailures = BenchmarkContactDetection();
+
+    return (nbFailures || nbSettingsFailures || nbContactFailures || isCalibrationFailed || isBatteryFailed
+            || nbPeakCodesOutOfRange || nbInconsistent || nbTornEdges || nbRefusedPublishes
+            || (IsPublishPreempted && NbPreemptions == 0)) ? 1 : 0;
+    }
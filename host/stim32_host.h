@@ -0,0 +1,87 @@
+/******************************************************************************
+*
+* File Name          :  stim32_host.h
+* Description        :  Host (PC) simulation build: firmware entry points and
+*                       the controls of the simulated CircleOS (circle_host.c)
+*
+*******************************************************************************/
+
+#ifndef __STIM32_HOST_H
+#define __STIM32_HOST_H
+
+#include <stdio.h>
+#include "circle_api.h"
+
+#define HOST_SYSTICK_FREQUENCY_HZ   3000    // SysTick rate at SPEED_VERY_HIGH
+
+/* STiM32.c ------------------------------------------------------------------*/
+enum MENU_code  Application_Ini(void);
+enum MENU_code  Application_Handler(void);
+
+void    HOST_PulseTimerAdvance(u32 ticks);
+u32     HOST_GetWiperBusEvent(u32 n, u32 *time, u8 *event, u8 *value, u32 *nominalTime);
+u32     HOST_GetSequenceTiming(u32 *firstStart, u32 *lastStart, u32 *minPeriod, u32 *maxPeriod);
+void    HOST_SetAdcSource(u16 (*source)(u32 time));
+void    HOST_GetReadoutCounters(u32 *nbReadouts, u32 *nbOverloads, u32 *nbDropped);
+void    HOST_ReadoutQueueReset(void);
+bool    HOST_ReadoutQueuePush(u32 timestamp, u16 CAE1, u8 isOverloaded, u8 stimState);
+u32     HOST_ReadoutQueuePop(u32 timestamp[], u16 CAE1[], u8 isOverloaded[], u8 stimState[], u32 maxNbRecords);
+u32     HOST_GetReadoutQueueDropped(void);
+u32     HOST_GetProfilerPhase(u32 phase, const char **name, u32 *min_us, u32 *max_us, u32 histogram[]);
+void    HOST_GetProfilerOverruns(u32 *nbOverruns, u32 *nbLateSequences);
+void    HOST_GetTimerCalibration(s32 *measuredPpm, s32 *driftPpm, s32 *appliedPpm, u32 *nbMeasurements);
+void    HOST_GetEventCounters(u32 *nbCalls, u32 *nbIdleCalls);
+void    HOST_GetBatteryModel(u16 *mV, u16 *voltageFactor, u32 *nbRefreshes, u32 *nb8VChanges);
+void    HOST_GetCurrentControl(u16 *target, u32 *nbUpdates, u32 *nbLimited, u32 *sumAbsError);
+u8      HOST_GetWiperCode(void);
+u32     HOST_CheckFixedPoint(u32 *nbCases, u32 *maxWiperError, u32 *maxFactorError, u32 *maxBarError);
+void    HOST_GetGovernor(u32 *nbSwitches, u32 *nbSeconds, u32 *nbSecondsLow, u32 *savedEnergy_mJ);
+bool    HOST_SetLogFile(const char *path);
+void    HOST_FlushLog(void);
+void    HOST_GetLogCounters(u32 *nbRecords, u32 *nbDropped, u32 *nbErases);
+u32     HOST_ReadLog(FILE *out, u32 *nbSessions, u32 *nbActiveSeconds, u32 *nbIdleSeconds);
+bool    HOST_SetBackupFile(const char *path);
+const char *HOST_GetSettingsCounters(u32 *sequence, u32 *frequency_Hz, u32 *nbRejectedFields, u32 *nbWrites, u32 *nbFlashCopies);
+u32     HOST_CheckSettings(u32 *nbCases);
+void    HOST_SetSerialSink(void (*sink)(const u8 *data, u32 length));
+void    HOST_GetTelemetryCounters(u32 *nbPackets, u32 *nbRecords, u32 *nbBytes, u32 *nbDropped);
+void    HOST_SerialReceive(const u8 *data, u32 length);
+void    HOST_SetPublishPreemption(void (*preemption)(void));
+void    HOST_GetCommandCounters(u32 *nbLines, u32 *nbErrors, u32 *nbLatencies, u32 *minLatency_us, u32 *maxLatency_us, u32 *meanLatency_us);
+u32     HOST_GetPulseConfigCounters(u32 *nbSwaps, u32 *nbDelayedSwaps, u32 *nbChecked, u32 *nbInconsistent, u32 *nbTornEdges, u32 *nbRefusedPublishes);
+void    HOST_GetBootCounters(u32 *firstPulse_us, u32 *iniTime_us, u32 *lcdPixels, u32 *readySysTicks, u32 *mainScreenSysTicks, bool *isIntroSkipped);
+void    HOST_GetContactDetector(u32 *statistic, u32 *window, u32 *hold, u16 *runLimit, u16 *idleLimit);
+u32     HOST_ContactInit(u32 statistic, u32 window, u32 hold, const char **name);
+u8      HOST_ContactUpdate(u16 sample);
+void    HOST_SetPerEdgeScaling(bool isPerEdgeScaling);
+u32     HOST_GetPulsePathCost(u32 *nbIrqsPerSequence_x100, u32 *nsPerSequence);
+
+#define HOST_READOUT_BATCH_SIZE         32      // keep in line with READOUT_BATCH_SIZE
+#define HOST_PROFILER_NB_PHASES         7       // keep in line with ProfilerPhase_code
+#define HOST_PROFILER_HISTOGRAM_BUCKETS 12
+
+#define HOST_CONTACT_LAST               0       // keep in line with ContactStatistic_code
+#define HOST_CONTACT_MEAN               1
+#define HOST_CONTACT_MEDIAN             2
+#define HOST_STATE_IDLE                 0       // keep in line with StimState_code
+#define HOST_STATE_RUN                  1
+
+#define HOST_WIPERBUS_EVENT_NSS_LOW     0
+#define HOST_WIPERBUS_EVENT_BYTE        1
+#define HOST_WIPERBUS_EVENT_NSS_HIGH    2
+
+/* circle_host.c -------------------------------------------------------------*/
+void    HOST_StartApplication(enum MENU_code (*ini)(void), enum MENU_code (*handler)(void));
+bool    HOST_IsApplicationRunning(void);
+void    HOST_SysTick(void);
+u32     HOST_GetSysTickCount(void);
+void    HOST_SelectMenu(const char *path);
+void    HOST_PushButton(void);
+void    HOST_SetBatteryVoltage(u16 mV);
+void    HOST_SetCxAdcValue(u16 ad_value_0_to_4095);
+enum LED_mode HOST_GetLedState(enum LED_id id);
+u32     HOST_GetLcdPixelsWritten(void);
+u32     HOST_GetHclkHz(void);
+const char *HOST_GetMenuTitle(void);
+
+#endif /* __STIM32_HOST_H */
@@ -0,0 +1,269 @@
+/******************************************************************************
+*
+* File Name          :  telemetry_decode.c
+* Description        :  Decoder of the STiM32 telemetry stream
+*
+*                       Reads the COBS framed readout packets (see Function Group :
+*                       Telemetry in STiM32.c) from a file, a pty of stim32_sim or
+*                       the serial port of the device, checks them and reports the
+*                       sustained throughput and the records lost. The replies to the
+*                       serial commands in the stream are printed as they come.
+*
+*                       usage: telemetry_decode [-v] [file|tty]     (default: stdin)
+*
+*                       -v prints every record: timestamp, state, CAE, overload.
+*                       The exit status is 1 if a frame was corrupt or a packet lost.
+*
+*******************************************************************************/
+
+/* Includes ------------------------------------------------------------------*/
+#define _DEFAULT_SOURCE                     // cfmakeraw
+#include <stdio.h>
+#include <stdlib.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <termios.h>
+#include <time.h>
+#include <unistd.h>
+#include "stim32_host.h"
+
+/* Private defines -----------------------------------------------------------*/
+#define DECODE_MAX_FRAME            256     // COBS frame without its delimiter
+#define DECODE_HEADER_SIZE          9       // keep in line with TELEMETRY_HEADER_SIZE
+#define DECODE_RECORD_SIZE          3
+#define DECODE_PACKET_TYPE_READOUTS 1
+#define DECODE_PACKET_TYPE_REPLY    2
+#define DECODE_NB_STATES            4       // StimState_code
+
+/* Global variables ----------------------------------------------------------*/
+static struct
+    {
+        u32     nbFrames;
+        u32     nbCrcErrors;
+        u32     nbFramingErrors;
+        u32     nbPackets;
+        u32     nbPacketsLost;
+        u32     nbRecords;
+        u32     nbReplies;
+        u32     nbDropped;              // counted by the firmware
+        u32     nbOverloads;
+        u32     nbStates[DECODE_NB_STATES];
+        u32     nbBytes;
+        u32     firstTimestamp;
+        u32     lastTimestamp;
+        u16     lastDropped;
+        u8      lastSequence;
+        bool    isStarted;
+    }
+    Decode;
+
+static bool IsVerbose;
+
+static const char* const StateName[DECODE_NB_STATES] = { "IDLE", "RUN", "WAITING_FOR_RUN", "WAITING_FOR_IDLE" };
+
+/* same as CRC16_Compute of the firmware, bit by bit */
+static u16 Crc16(const u8 *data, u32 length)
+    {
+    u16 crc = 0xFFFF;
+    u8 bit;
+
+    while(length--)
+        {
+        crc ^= *data++ << 8;
+        for(bit=0; bit<8; bit++)
+            {
+            crc = (crc & 0x8000) ? (crc << 1) ^ 0x1021 : crc << 1;
+            }
+        }
+    return crc;
+    }
+
+/* returns the packet length, 0 if the frame is not valid COBS */
+static u32 CobsDecode(const u8 *frame, u32 length, u8 *packet)
+    {
+    u32 i = 0, n = 0;
+
+    while(i < length)
+        {
+        u8 code = frame[i++], k;
+
+        if(code == 0 || i + code - 1 > length) return 0;
+        for(k=1; k<code; k++)
+            {
+            packet[n++] = frame[i++];
+            }
+        if(code < 0xFF && i < length)
+            {
+            packet[n++] = 0;
+            }
+        }
+    return n;
+    }
+
+static void DecodeFrame(const u8 *frame, u32 length)
+    {
+    u8 packet[DECODE_MAX_FRAME];
+    u32 n, i, timestamp;
+    u16 dropped;
+    u8 nbRecords;
+
+    Decode.nbFrames++;
+    n = CobsDecode(frame, length, packet);
+    if(n < 4 || (packet[0] != DECODE_PACKET_TYPE_READOUTS && packet[0] != DECODE_PACKET_TYPE_REPLY))
+        {
+        Decode.nbFramingErrors++;
+        return;
+        }
+    if(Crc16(packet, n-2) != (packet[n-2] | (packet[n-1] << 8)))
+        {
+        Decode.nbCrcErrors++;
+        return;
+        }
+    if(Decode.isStarted)
+        {
+        Decode.nbPacketsLost += (u8)(packet[1] - Decode.lastSequence - 1);
+        }
+    Decode.lastSequence = packet[1];
+    Decode.nbPackets++;
+
+    if(packet[0] == DECODE_PACKET_TYPE_REPLY)
+        {
+        Decode.nbReplies++;
+        printf("reply               %.*s\n", (int)(n - 4), &packet[2]);
+        fflush(stdout);
+        return;
+        }
+    if(n < DECODE_HEADER_SIZE + 2)
+        {
+        Decode.nbFramingErrors++;
+        return;
+        }
+    nbRecords = packet[DECODE_HEADER_SIZE-1];
+    if(n != DECODE_HEADER_SIZE + nbRecords * DECODE_RECORD_SIZE + 2)
+        {
+        Decode.nbFramingErrors++;
+        return;
+        }
+
+    timestamp = packet[2] | (packet[3] << 8) | (packet[4] << 16) | ((u32)packet[5] << 24);
+    dropped = packet[6] | (packet[7] << 8);
+    if(Decode.isStarted)
+        {
+        Decode.nbDropped += (u16)(dropped - Decode.lastDropped);
+        }
+    else
+        {
+        Decode.firstTimestamp = timestamp;
+        Decode.nbDropped = dropped;
+        Decode.isStarted = TRUE;
+        }
+    Decode.lastDropped = dropped;
+
+    for(i=0; i<nbRecords; i++)
+        {
+        const u8 *record = &packet[DECODE_HEADER_SIZE + i * DECODE_RECORD_SIZE];
+        u16 value = record[1] | (record[2] << 8);
+        u8 state = (value >> 13) & 3;
+
+        timestamp += record[0];
+        Decode.nbRecords++;
+        Decode.nbStates[state]++;
+        if(value & 0x8000) Decode.nbOverloads++;
+        if(IsVerbose)
+            {
+            printf("%10u %-16s %5u%s\n", timestamp, StateName[state], value & 0x1FFF, (value & 0x8000) ? " overloaded" : "");
+            }
+        }
+    Decode.lastTimestamp = timestamp;
+    }
+
+static double WallClockSeconds(void)
+    {
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec * 1e-9;
+    }
+
+static void Usage(void)
+    {
+    fprintf(stderr, "usage: telemetry_decode [-v] [file|tty]\n");
+    exit(2);
+    }
+
+int main(int argc, char *argv[])
+    {
+    u8 buffer[4096], frame[DECODE_MAX_FRAME];
+    u32 frameLength = 0, i;
+    bool isFrameTooLong = FALSE, isSynchronised = TRUE;
+    double wallStart = 0, wallSeconds, seconds;
+    int fd = 0, argi;
+    ssize_t n;
+
+    for(argi=1; argi<argc && argv[argi][0] == '-'; argi++)
+        {
+        if(strcmp(argv[argi], "-v") == 0) IsVerbose = TRUE;
+        else Usage();
+        }
+    if(argi < argc - 1) Usage();
+    if(argi == argc - 1 && (fd = open(argv[argi], O_RDONLY | O_NOCTTY)) < 0)
+        {
+        fprintf(stderr, "telemetry_decode: cannot open %s\n", argv[argi]);
+        return 2;
+        }
+    if(isatty(fd))
+        {
+        struct termios tio;
+
+        // joined in the middle of the stream: the first frame starts after a 0
+        isSynchronised = FALSE;
+        if(tcgetattr(fd, &tio) == 0)
+            {
+            cfmakeraw(&tio);
+            tcsetattr(fd, TCSANOW, &tio);
+            }
+        }
+
+    // a pty reads EIO when stim32_sim has closed it
+    while((n = read(fd, buffer, sizeof(buffer))) > 0 || (n < 0 && errno == EINTR))
+        {
+        if(n <= 0) continue;
+        if(Decode.nbBytes == 0) wallStart = WallClockSeconds();
+        Decode.nbBytes += n;
+        for(i=0; i<(u32)n; i++)
+            {
+            if(buffer[i] == 0)
+                {
+                if(isFrameTooLong)              Decode.nbFramingErrors++;
+                else if(isSynchronised)         DecodeFrame(frame, frameLength);
+                isSynchronised = TRUE;
+                isFrameTooLong = FALSE;
+                frameLength = 0;
+                }
+            else if(frameLength < DECODE_MAX_FRAME)
+                {
+                frame[frameLength++] = buffer[i];
+                }
+            else
+                {
+                isFrameTooLong = TRUE;
+                }
+            }
+        }
+    wallSeconds = Decode.nbBytes ? WallClockSeconds() - wallStart : 0;
+    if(frameLength > 0) Decode.nbFramingErrors++;      // cut off at the end
+
+    seconds = (double)(Decode.lastTimestamp - Decode.firstTimestamp) / HOST_SYSTICK_FREQUENCY_HZ;
+    printf("frames              %u (%u CRC errors, %u framing errors)\n", Decode.nbFrames, Decode.nbCrcErrors, Decode.nbFramingErrors);
+    printf("packets             %u (%u lost, from the sequence numbers), %u replies\n", Decode.nbPackets, Decode.nbPacketsLost, Decode.nbReplies);
+    printf("records             %u in %.1f s of SysTick time: %.0f records/s sustained\n",
+           Decode.nbRecords, seconds, seconds > 0 ? Decode.nbRecords / seconds : 0.0);
+    printf("stream              %u bytes, %.0f bytes/s, %.2f bytes per record\n", Decode.nbBytes,
+           seconds > 0 ? Decode.nbBytes / seconds : 0.0, Decode.nbRecords ? (double)Decode.nbBytes / Decode.nbRecords : 0.0);
+    printf("dropped records     %u (counted by the firmware)\n", Decode.nbDropped);
+    printf("states              IDLE %u, RUN %u, WAITING_FOR_RUN %u, WAITING_FOR_IDLE %u; %u overloaded\n",
+           Decode.nbStates[0], Decode.nbStates[1], Decode.nbStates[2], Decode.nbStates[3], Decode.nbOverloads);
+    printf("wall time           %.3f s (%.0f bytes/s read)\n", wallSeconds, wallSeconds > 0 ? Decode.nbBytes / wallSeconds : 0.0);
+
+    return (Decode.nbCrcErrors || Decode.nbFramingErrors || Decode.nbPacketsLost) ? 1 : 0;
+    }